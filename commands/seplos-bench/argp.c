@@ -0,0 +1,87 @@
+#include "./bench.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+const char * argp_program_version = "seplos-bench 0.1";
+
+static const char args_doc[] = "";
+static const char doc[] = \
+  "Measure how fast the BMS can be polled, and what each sample costs." \
+  "\vBy default each iteration is one seplos_data() call for each pack. With --tick, each" \
+  " iteration is what seplosd does on a timer tick: TELEMETRY_GET and TELECOMMAND_GET for" \
+  " every pack through the non-blocking transaction engine, and the JSON payload for each.";
+
+static const struct argp_option options[] = {
+  {"device", 'd', "/dev/tty...", 0, "The serial device, tcp://host:port of a serial server, or the pseudo-terminal of seplos-sim."},
+  {"address", 'a', "0-255", 0, "The controller address of the battery (default 0)."},
+  {"pack", 'p', "0-255", 0, "A battery pack to read (default 1). Repeat for several packs."},
+  {"count", 'n', "number", 0, "How many iterations to measure (default 100)."},
+  {"warmup", 'w', "number", 0, "How many iterations to run first without measuring (default 5)."},
+  {"baud", 'b', "1200-115200", 0, "The serial speed (default 19200)."},
+  {"timeout", 't', "milliseconds", 0, "How long to wait for the battery to answer (default 1000)."},
+  {"tick", 'T', 0, 0, "Time whole seplosd ticks."},
+  {"capture", 'C', "file", 0, "Append every frame to a capture file, for seplos-replay."},
+  {}
+};
+
+const struct argp argp = {
+  options, parse_opt, args_doc, doc
+};
+
+static unsigned int
+number(struct argp_state * state, const char * arg, unsigned long low, unsigned long high)
+{
+  char * end;
+  const unsigned long value = strtoul(arg, &end, 0);
+
+  if ( *arg == '\0' || *end != '\0' || value < low || value > high )
+    argp_failure(state, 1, 0, "\"%s\" must be a number from %lu to %lu", arg, low, high);
+  return value;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+  struct arguments * arguments = state->input;
+
+  switch ( key ) {
+  case 'd':
+    arguments->device = arg;
+    break;
+  case 'a':
+    arguments->address = number(state, arg, 0, 0xff);
+    break;
+  case 'p':
+    if ( arguments->number_of_packs >= SEPLOS_MAX_PACKS )
+      argp_failure(state, 1, 0, "No more than %d packs can be read at once", SEPLOS_MAX_PACKS);
+    arguments->packs[arguments->number_of_packs++] = number(state, arg, 0, 0xff);
+    break;
+  case 'n':
+    arguments->count = number(state, arg, 1, 100000000);
+    break;
+  case 'w':
+    arguments->warmup = number(state, arg, 0, 100000000);
+    break;
+  case 'b':
+    arguments->baud = number(state, arg, 1, 115200);
+    break;
+  case 't':
+    arguments->timeout = number(state, arg, 1, 3600000);
+    break;
+  case 'T':
+    arguments->tick = true;
+    break;
+  case 'C':
+    arguments->capture = arg;
+    break;
+  case ARGP_KEY_ARG:
+    argp_usage(state);
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
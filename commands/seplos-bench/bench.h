@@ -0,0 +1,19 @@
+#include <stdbool.h>
+#include <argp.h>
+#include "seplos.h"
+
+extern const struct argp	argp;
+
+struct arguments
+{
+  const char *	device;		/* Serial device, or a seplos-sim pseudo-terminal */
+  unsigned int	address;	/* Controller address on the RS-485 bus */
+  unsigned int	packs[SEPLOS_MAX_PACKS]; /* Battery packs to read, in order */
+  unsigned int	number_of_packs;
+  unsigned int	count;		/* Measured iterations */
+  unsigned int	warmup;		/* Iterations run before measuring */
+  unsigned int	baud;
+  unsigned int	timeout;	/* Milliseconds to wait for the BMS to answer */
+  const char *	capture;	/* Append the frames to this capture file */
+  bool		tick;		/* Time whole seplosd ticks instead of seplos_data() */
+};
@@ -0,0 +1,238 @@
+#include "./bench.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Latencies in milliseconds, kept so that percentiles can be taken at the end. */
+typedef struct _Series {
+  double *	values;
+  unsigned int	length;
+} Series;
+
+/* Of the device under test, found out once when it is opened. */
+static int	transport;
+
+static double
+milliseconds(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec * 1e3) + (t.tv_nsec / 1e6);
+}
+
+static double
+cpu_milliseconds(void)
+{
+  struct rusage u;
+
+  getrusage(RUSAGE_SELF, &u);
+  return (u.ru_utime.tv_sec + u.ru_stime.tv_sec) * 1e3 \
+   + ((u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e3);
+}
+
+static int
+compare(const void * a, const void * b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(const Series * s, double p)
+{
+  if ( s->length == 0 )
+    return 0;
+
+  unsigned int i = (unsigned int)(p / 100.0 * s->length);
+  if ( i >= s->length )
+    i = s->length - 1;
+  return s->values[i];
+}
+
+static void
+report(const char * name, Series * s)
+{
+  qsort(s->values, s->length, sizeof(*s->values), compare);
+  fprintf(stdout, "  %-12s p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", name,
+   percentile(s, 50), percentile(s, 90), percentile(s, 99), s->length ? s->values[s->length - 1] : 0);
+}
+
+/*
+ * One request and reply through the transaction engine, waiting for the
+ * device with poll() the way seplosd waits for it with libuv.
+ */
+static int
+exchange(SeplosTransaction * t, int fd, unsigned int timeout)
+{
+  const double	deadline = milliseconds() + timeout;
+  int		ret = 0;
+
+  while ( t->state == SEPLOS_TRANSACTION_SENDING || t->state == SEPLOS_TRANSACTION_RECEIVING ) {
+    const bool		sending = t->state == SEPLOS_TRANSACTION_SENDING;
+    struct pollfd	p = { .fd = fd, .events = sending ? POLLOUT : POLLIN };
+    const double	remaining = deadline - milliseconds();
+
+    if ( remaining <= 0 || poll(&p, 1, remaining) == 0 ) {
+      seplos_transaction_fail(t, ETIMEDOUT);
+      break;
+    }
+
+    if ( sending )
+      ret = seplos_transaction_write(t, fd, transport);
+    else
+      ret = seplos_transaction_read(t, fd);
+    if ( ret < 0 )
+      break;
+  }
+  return t->status == NORMAL ? 0 : -1;
+}
+
+/* What seplosd does for one pack on a tick. Returns the number of samples. */
+static int
+tick_pack(const struct arguments * arguments, int fd, unsigned int pack, Series * transactions)
+{
+  static SeplosTransaction	t;
+  SeplosData			d[SEPLOS_MAX_PACKS] = {};
+  char				payload[SEPLOS_JSON_MAX];
+  int				n = 1;
+  double			start;
+
+  seplos_discard_input(fd, transport);
+
+  start = milliseconds();
+  seplos_telemetry_start(&t, arguments->address, pack, NULL, NULL);
+  if ( exchange(&t, fd, arguments->timeout) < 0 )
+    return -1;
+  transactions->values[transactions->length++] = milliseconds() - start;
+
+  if ( pack == SEPLOS_ALL_PACKS )
+    n = seplos_decode_telemetry_packs(&t, d, SEPLOS_MAX_PACKS);
+  else if ( seplos_decode_telemetry(&t, d) < 0 )
+    n = -1;
+  if ( n < 0 )
+    return -1;
+
+  start = milliseconds();
+  seplos_telecommand_start(&t, arguments->address, pack, NULL, NULL);
+  if ( exchange(&t, fd, arguments->timeout) < 0 )
+    return -1;
+  transactions->values[transactions->length++] = milliseconds() - start;
+
+  if ( pack == SEPLOS_ALL_PACKS ) {
+    if ( seplos_decode_telecommand_packs(&t, d, n) != n )
+      return -1;
+  }
+  else if ( seplos_decode_telecommand(&t, d) < 0 )
+    return -1;
+
+  for ( int i = 0; i < n; i++ )
+    seplos_json_format(payload, sizeof(payload), &d[i], SEPLOS_JSON_ALL);
+
+  return n;
+}
+
+/* One seplos_data() call. Returns the number of samples. */
+static int
+data_pack(const struct arguments * arguments, int fd, unsigned int pack, Series * transactions)
+{
+  SeplosData	d[SEPLOS_MAX_PACKS];
+  const double	start = milliseconds();
+  int		n = 1;
+
+  if ( pack == SEPLOS_ALL_PACKS )
+    n = seplos_data_all(fd, arguments->address, d, SEPLOS_MAX_PACKS);
+  else if ( seplos_data(fd, arguments->address, pack, d) < 0 )
+    n = -1;
+
+  if ( n >= 0 )
+    transactions->values[transactions->length++] = milliseconds() - start;
+  return n;
+}
+
+int
+main(int argc, char * * argv)
+{
+  struct arguments	arguments = {};
+  Series		transactions = {}, iterations = {};
+  unsigned long		samples = 0, failures = 0;
+
+  arguments.device = "/dev/ttyUSB0";
+  arguments.count = 100;
+  arguments.warmup = 5;
+  arguments.baud = SEPLOS_DEFAULT_BAUD;
+  arguments.timeout = SEPLOS_DEFAULT_REPLY_TIMEOUT;
+
+  argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+  if ( arguments.number_of_packs == 0 )
+    arguments.packs[arguments.number_of_packs++] = 0x01;
+
+  if ( arguments.capture && seplos_capture_open(arguments.capture) < 0 )
+    return 1;
+
+  seplos_set_reply_timeout(arguments.timeout);
+  int fd = seplos_open_serial(arguments.device, arguments.baud, SEPLOS_DEFAULT_BYTE_TIMEOUT);
+  if ( fd < 0 )
+    return 1;
+  transport = seplos_transport(fd);
+
+  if ( arguments.tick )
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  transactions.values = calloc((size_t)arguments.count * arguments.number_of_packs * 2, sizeof(double));
+  iterations.values = calloc(arguments.count, sizeof(double));
+  if ( !transactions.values || !iterations.values ) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+
+  int (*poll_pack)(const struct arguments *, int, unsigned int, Series *) = \
+   arguments.tick ? tick_pack : data_pack;
+
+  for ( unsigned int i = 0; i < arguments.warmup; i++ ) {
+    for ( unsigned int j = 0; j < arguments.number_of_packs; j++ ) {
+      poll_pack(&arguments, fd, arguments.packs[j], &transactions);
+      transactions.length = 0;
+    }
+  }
+
+  const double cpu = cpu_milliseconds();
+  const double start = milliseconds();
+
+  for ( unsigned int i = 0; i < arguments.count; i++ ) {
+    const double iteration = milliseconds();
+
+    for ( unsigned int j = 0; j < arguments.number_of_packs; j++ ) {
+      const int n = poll_pack(&arguments, fd, arguments.packs[j], &transactions);
+      if ( n < 0 )
+        failures++;
+      else
+        samples += n;
+    }
+    iterations.values[iterations.length++] = milliseconds() - iteration;
+  }
+
+  const double elapsed = milliseconds() - start;
+  const double used = cpu_milliseconds() - cpu;
+
+  fprintf(stdout, "%s: %u iterations, %lu samples, %lu failures in %.3f s\n",
+   arguments.tick ? "seplosd tick" : "seplos_data()", arguments.count, samples, failures, elapsed / 1e3);
+  fprintf(stdout, "  %.1f iterations/s, %.1f samples/s, %.1f us CPU per sample\n",
+   arguments.count / (elapsed / 1e3), samples / (elapsed / 1e3), samples ? used * 1e3 / samples : 0);
+  report(arguments.tick ? "transaction" : "seplos_data", &transactions);
+  report(arguments.tick ? "tick" : "iteration", &iterations);
+
+  close(fd);
+  seplos_capture_close();
+  free(transactions.values);
+  free(iterations.values);
+
+  return failures ? 1 : 0;
+}
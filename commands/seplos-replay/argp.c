@@ -0,0 +1,50 @@
+#include "./replay.h"
+#include <stdlib.h>
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+const char * argp_program_version = "seplos-replay 0.1";
+
+static const char args_doc[] = "capture-file...";
+static const char doc[] = \
+  "Replay frames captured by seplosd through the decoder and the JSON encoder." \
+  "\vEach sample is printed as a line of JSON with the time it was read, for backfilling" \
+  " a time-series database. The frame and sample rates are reported on the standard error.";
+
+static const struct argp_option options[] = {
+  {"repeat", 'r', "number", 0, "Replay each file this many times (default 1)."},
+  {"quiet", 'q', 0, 0, "Don't print the samples, only time the replay."},
+  {}
+};
+
+const struct argp argp = {
+  options, parse_opt, args_doc, doc
+};
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+  struct arguments * arguments = state->input;
+  char * end;
+
+  switch ( key ) {
+  case 'r':
+    arguments->repeat = strtoul(arg, &end, 0);
+    if ( *arg == '\0' || *end != '\0' || arguments->repeat < 1 )
+      argp_failure(state, 1, 0, "\"%s\" must be a number of at least 1", arg);
+    break;
+  case 'q':
+    arguments->quiet = true;
+    break;
+  case ARGP_KEY_ARGS:
+    arguments->files = &(state->argv[state->next]);
+    arguments->number_of_files = state->argc - state->next;
+    break;
+  case ARGP_KEY_NO_ARGS:
+    argp_usage(state);
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
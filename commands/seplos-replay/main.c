@@ -0,0 +1,167 @@
+#include "./replay.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The samples being put together for one address and pack number, the way
+ * seplosd keeps them for each pack. A telemetry reply starts a sample, and
+ * the telecommand reply that follows completes it. seplosd doesn't always ask
+ * for the telecommand information, so a sample is also complete when the next
+ * telemetry reply arrives, keeping the telecommand information it had.
+ */
+typedef struct _Stream {
+  unsigned int	address;
+  unsigned int	pack;
+  unsigned int	number_of_packs;
+  uint64_t	time;
+  bool		pending;
+  SeplosData	data[SEPLOS_MAX_PACKS];
+} Stream;
+
+#define MAX_STREAMS 64
+
+static Stream		streams[MAX_STREAMS];
+static unsigned int	number_of_streams = 0;
+
+static unsigned long	frames = 0, replies = 0, samples = 0, bad = 0;
+
+static Stream *
+stream(unsigned int address, unsigned int pack)
+{
+  for ( unsigned int i = 0; i < number_of_streams; i++ ) {
+    if ( streams[i].address == address && streams[i].pack == pack )
+      return &streams[i];
+  }
+
+  if ( number_of_streams == MAX_STREAMS )
+    return NULL;
+
+  Stream * const s = &streams[number_of_streams++];
+  memset(s, 0, sizeof(*s));
+  s->address = address;
+  s->pack = pack;
+  return s;
+}
+
+static void
+emit(const struct arguments * arguments, Stream * s)
+{
+  char	payload[SEPLOS_JSON_MAX];
+
+  for ( unsigned int i = 0; i < s->number_of_packs; i++ ) {
+    const SeplosData * const d = &(s->data[i]);
+    const size_t length = seplos_json_format(payload, sizeof(payload), d, SEPLOS_JSON_ALL);
+
+    if ( !arguments->quiet ) {
+      fprintf(stdout, "{\"time\":%llu,\"address\":%u,\"pack\":%u,\"data\":",
+       (unsigned long long)(s->time / 1000), d->controller_address, d->battery_pack_number);
+      fwrite(payload, 1, length, stdout);
+      fputs("}\n", stdout);
+    }
+    samples++;
+  }
+  s->pending = false;
+}
+
+static void
+replay(const struct arguments * arguments, const SeplosCaptureRecord * r)
+{
+  frames++;
+  if ( r->kind != SEPLOS_CAPTURE_REPLY )
+    return;
+  replies++;
+
+  if ( r->command != TELEMETRY_GET && r->command != TELECOMMAND_GET )
+    return;
+
+  Stream * const s = stream(r->address, r->pack);
+  if ( s == NULL ) {
+    bad++;
+    return;
+  }
+
+  if ( r->command == TELEMETRY_GET ) {
+    if ( s->pending )
+      emit(arguments, s);
+
+    const int n = seplos_capture_decode(r, s->data, SEPLOS_MAX_PACKS);
+    if ( n < 0 ) {
+      bad++;
+      return;
+    }
+    s->number_of_packs = n;
+    s->time = r->time;
+    s->pending = true;
+  }
+  else if ( s->pending ) {
+    /* The telecommand reply about the packs of the telemetry reply before it. */
+    if ( seplos_capture_decode(r, s->data, s->number_of_packs) < 0 )
+      bad++;
+    emit(arguments, s);
+  }
+}
+
+static double
+seconds(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+int
+main(int argc, char * * argv)
+{
+  static char		output[256 * 1024];
+  struct arguments	arguments = {};
+  SeplosCaptureRecord	r;
+  int			status = 0;
+
+  arguments.repeat = 1;
+
+  argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+  setvbuf(stdout, output, _IOFBF, sizeof(output));
+
+  const double start = seconds();
+
+  for ( unsigned int i = 0; i < arguments.number_of_files; i++ ) {
+    SeplosCapture	c;
+
+    if ( seplos_capture_map(&c, arguments.files[i]) < 0 ) {
+      status = 1;
+      continue;
+    }
+
+    for ( unsigned int j = 0; j < arguments.repeat; j++ ) {
+      int ret;
+
+      seplos_capture_rewind(&c);
+      while ( (ret = seplos_capture_next(&c, &r)) > 0 )
+        replay(&arguments, &r);
+
+      if ( ret < 0 ) {
+        fprintf(stderr, "%s: ends in the middle of a record.\n", arguments.files[i]);
+        status = 1;
+      }
+    }
+    seplos_capture_unmap(&c);
+
+    for ( unsigned int j = 0; j < number_of_streams; j++ ) {
+      if ( streams[j].pending )
+        emit(&arguments, &streams[j]);
+    }
+    number_of_streams = 0;
+  }
+  fflush(stdout);
+
+  const double elapsed = seconds() - start;
+
+  fprintf(stderr, "%lu frames, %lu replies, %lu samples, %lu bad in %.3f s: %.0f frames/s, %.0f samples/s\n",
+   frames, replies, samples, bad, elapsed, frames / elapsed, samples / elapsed);
+
+  return status;
+}
@@ -0,0 +1,13 @@
+#include <stdbool.h>
+#include <argp.h>
+#include "seplos.h"
+
+extern const struct argp	argp;
+
+struct arguments
+{
+  char * *	files;		/* Capture files, in the order to replay them */
+  unsigned int	number_of_files;
+  unsigned int	repeat;		/* Times to replay each file */
+  bool		quiet;		/* Decode and encode, but don't print the samples */
+};
@@ -0,0 +1,108 @@
+#include "./sim.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+const char * argp_program_version = "seplos-sim 0.1";
+
+static const char args_doc[] = "";
+static const char doc[] = \
+  "Simulate a SEPLOS BMS on a pseudo-terminal or a TCP port, for testing and benchmarks without a battery." \
+  "\vThe path of the pseudo-terminal, or the tcp:// device name, is printed on standard output. Point seplos, seplosd or" \
+  " seplos-bench at it.";
+
+static const struct argp_option options[] = {
+  {"link", 'L', "path", 0, "Also make a symbolic link to the pseudo-terminal here."},
+  {"tcp", 'T', "port", 0, "Listen on this TCP port of every interface instead, like an Ethernet serial server, for one client at a time."},
+  {"address", 'a', "0-255", 0, "The controller address to answer for (default 0)."},
+  {"packs", 'n', "1-16", 0, "The number of packs behind the controller (default 1)."},
+  {"cells", 'c', "1-16", 0, "The number of cells in each pack (default 16)."},
+  {"latency", 'l', "milliseconds", 0, "How long to wait before each reply (default 0)."},
+  {"jitter", 'j', "milliseconds", 0, "Wait up to this much longer, at random (default 0)."},
+  {"drop", 'D', "percent", 0, "How many requests to leave unanswered."},
+  {"corrupt", 'C', "percent", 0, "How many replies to send with a bad checksum."},
+  {"garbage", 'G', "percent", 0, "How many replies to precede with line noise."},
+  {"error", 'E', "percent", 0, "How many replies to send with an error code instead of data."},
+  {"history", 'H', "records", 0, "The number of history records each pack keeps, one every 5 minutes up to now (default 288, a day)."},
+  {"seed", 's', "number", 0, "Seed for the random numbers (default 1)."},
+  {"still", 'S', 0, 0, "The battery is idle, and its readings never change."},
+  {"verbose", 'v', 0, 0, "Log every request on standard error."},
+  {}
+};
+
+const struct argp argp = {
+  options, parse_opt, args_doc, doc
+};
+
+static unsigned int
+number(struct argp_state * state, const char * arg, unsigned long low, unsigned long high)
+{
+  char * end;
+  const unsigned long value = strtoul(arg, &end, 0);
+
+  if ( *arg == '\0' || *end != '\0' || value < low || value > high )
+    argp_failure(state, 1, 0, "\"%s\" must be a number from %lu to %lu", arg, low, high);
+  return value;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+  struct arguments * arguments = state->input;
+
+  switch ( key ) {
+  case 'L':
+    arguments->link = arg;
+    break;
+  case 'a':
+    arguments->address = number(state, arg, 0, 0xff);
+    break;
+  case 'n':
+    arguments->packs = number(state, arg, 1, SEPLOS_MAX_PACKS);
+    break;
+  case 'c':
+    arguments->cells = number(state, arg, 1, SEPLOS_N_CELLS);
+    break;
+  case 'l':
+    arguments->latency = number(state, arg, 0, 60000);
+    break;
+  case 'j':
+    arguments->jitter = number(state, arg, 0, 60000);
+    break;
+  case 'D':
+    arguments->drop = number(state, arg, 0, 100);
+    break;
+  case 'C':
+    arguments->corrupt = number(state, arg, 0, 100);
+    break;
+  case 'G':
+    arguments->garbage = number(state, arg, 0, 100);
+    break;
+  case 'E':
+    arguments->error = number(state, arg, 0, 100);
+    break;
+  case 'T':
+    arguments->tcp = number(state, arg, 1, 0xffff);
+    break;
+  case 'H':
+    arguments->history = number(state, arg, 0, 0xffff);
+    break;
+  case 's':
+    arguments->seed = number(state, arg, 0, 0xffffffff);
+    break;
+  case 'S':
+    arguments->still = true;
+    break;
+  case 'v':
+    arguments->verbose = true;
+    break;
+  case ARGP_KEY_ARG:
+    argp_usage(state);
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
@@ -0,0 +1,277 @@
+#include <math.h>
+#include <time.h>
+#include "./sim.h"
+#include "internal.h"
+
+#define RATED_CAPACITY 280.0	/* amp hours */
+
+void
+sim_battery_init(SimulatedPack * p, unsigned int number, unsigned int cells)
+{
+  p->number = number;
+  p->cells = cells;
+  p->state_of_charge = 70.0 + number;
+  p->cycles = 10 * number + 4;
+}
+
+/* A repeatable bit of noise, from -1 to 1, for a reading at a point in time. */
+static double
+noise(unsigned int pack, unsigned int index, double now)
+{
+  uint32_t x = (uint32_t)(now * 10) * 2654435761u ^ (pack << 16) ^ index;
+
+  x ^= x >> 15;
+  x *= 0x2c1b3c6d;
+  x ^= x >> 12;
+  return ((x & 0xffff) / 32767.5) - 1.0;
+}
+
+/* Charging and discharging in a 15 minute cycle. */
+static double
+current(const SimulatedPack * p, double now)
+{
+  return 12.0 * sin((2 * M_PI * now / 900.0) + p->number);
+}
+
+static double
+state_of_charge(const SimulatedPack * p, double now)
+{
+  return p->state_of_charge - 5.0 * cos((2 * M_PI * now / 900.0) + p->number);
+}
+
+static double
+cell_voltage(const SimulatedPack * p, unsigned int cell, double now)
+{
+  return 3.25 + (state_of_charge(p, now) * 0.001) + (current(p, now) * 0.002) \
+   + (cell * 0.0005) + (0.001 * noise(p->number, cell, now));
+}
+
+static double
+temperature(const SimulatedPack * p, unsigned int sensor, double now)
+{
+  return 24.0 + (sensor * 0.4) + (fabs(current(p, now)) * 0.1) + (0.2 * noise(p->number, 100 + sensor, now));
+}
+
+static char *
+hex2(char * p, unsigned int value)
+{
+  _sp_hex2(value, p);
+  return p + 2;
+}
+
+static char *
+hex4(char * p, unsigned int value)
+{
+  _sp_hex4(value, p);
+  return p + 4;
+}
+
+static char *
+telemetry_record(char * i, const SimulatedPack * p, double now)
+{
+  double total = 0;
+
+  i = hex2(i, p->number);
+  i = hex2(i, p->cells);
+  for ( unsigned int c = 0; c < p->cells; c++ ) {
+    const double v = cell_voltage(p, c, now);
+    total += v;
+    i = hex4(i, lround(v * 1000));
+  }
+
+  i = hex2(i, SEPLOS_N_TEMPERATURES);
+  for ( unsigned int t = 0; t < SEPLOS_N_TEMPERATURES; t++ )
+    i = hex4(i, lround(temperature(p, t, now) * 10) + 2731);
+
+  const double soc = state_of_charge(p, now);
+  i = hex4(i, (uint16_t)(int16_t)lround(current(p, now) * 100));
+  i = hex4(i, lround(total * 100));
+  i = hex4(i, lround(RATED_CAPACITY * soc));	/* residual capacity, in 10 mAh */
+
+  /* Capacity, SoC, rated capacity, cycles, SoH, port voltage, and 4 reserved. */
+  i = hex2(i, 10);
+  i = hex4(i, lround(RATED_CAPACITY * 100));
+  i = hex4(i, lround(soc * 10));
+  i = hex4(i, lround(RATED_CAPACITY * 100));
+  i = hex4(i, p->cycles);
+  i = hex4(i, 1000);
+  i = hex4(i, lround(total * 100));
+  for ( int r = 0; r < 4; r++ )
+    i = hex4(i, 0);
+
+  return i;
+}
+
+static char *
+telecommand_record(char * i, const SimulatedPack * p, double now)
+{
+  const double amps = current(p, now);
+  double highest = 0;
+  unsigned int equilibrium = 0;
+
+  i = hex2(i, p->number);
+  i = hex2(i, p->cells);
+  for ( unsigned int c = 0; c < p->cells; c++ )
+    i = hex2(i, cell_voltage(p, c, now) < 3.0 ? LOW_LIMIT_HIT : NORMAL);
+
+  i = hex2(i, SEPLOS_N_TEMPERATURES);
+  for ( unsigned int t = 0; t < SEPLOS_N_TEMPERATURES; t++ )
+    i = hex2(i, NORMAL);
+
+  i = hex2(i, NORMAL);	/* Current */
+  i = hex2(i, NORMAL);	/* Voltage */
+
+  /* While charging, balance the cells that are ahead. */
+  for ( unsigned int c = 0; c < p->cells; c++ ) {
+    if ( cell_voltage(p, c, now) > highest )
+      highest = cell_voltage(p, c, now);
+  }
+  for ( unsigned int c = 0; amps > 0.1 && c < p->cells; c++ ) {
+    if ( cell_voltage(p, c, now) > highest - 0.002 )
+      equilibrium |= 1 << c;
+  }
+
+  i = hex2(i, 20);
+  for ( int a = 0; a < 6; a++ )
+    i = hex2(i, 0);				/* Alarm events 1 to 6 */
+  i = hex2(i, 0x03);				/* Both switches on */
+  i = hex2(i, equilibrium & 0xff);
+  i = hex2(i, (equilibrium >> 8) & 0xff);
+  i = hex2(i, amps > 0.1 ? 0x02 : (amps < -0.1 ? 0x01 : 0x10));
+  i = hex2(i, 0);				/* Disconnection state */
+  i = hex2(i, 0);
+  i = hex2(i, 0);				/* Alarm events 7 and 8 */
+  i = hex2(i, 0);
+  for ( int r = 0; r < 6; r++ )
+    i = hex2(i, 0);
+
+  return i;
+}
+
+/*
+ * Write the info field of a reply about pack, or about all of the packs for
+ * SEPLOS_ALL_PACKS. Returns its length, or 0 if there is no such pack.
+ */
+static unsigned int
+reply(const SimulatedPack * packs, unsigned int n, unsigned int pack, double now, char * info,
+ char * (*record)(char *, const SimulatedPack *, double))
+{
+  char * i = hex2(info, 0);	/* Data flag */
+  bool found = false;
+
+  for ( unsigned int j = 0; j < n; j++ ) {
+    if ( pack == SEPLOS_ALL_PACKS || packs[j].number == pack ) {
+      i = record(i, &packs[j], now);
+      found = true;
+    }
+  }
+  return found ? i - info : 0;
+}
+
+unsigned int
+sim_telemetry(const SimulatedPack * packs, unsigned int n, unsigned int pack, double now, char * info)
+{
+  return reply(packs, n, pack, now, info, telemetry_record);
+}
+
+unsigned int
+sim_telecommand(const SimulatedPack * packs, unsigned int n, unsigned int pack, double now, char * info)
+{
+  return reply(packs, n, pack, now, info, telecommand_record);
+}
+
+#define HISTORY_INTERVAL 300	/* seconds between history records */
+
+/*
+ * Write the info field of the reply to HISTORY_GET for record index of
+ * records, the last of which was taken at last. Returns its length, or 0 if
+ * there is no such pack.
+ */
+unsigned int
+sim_history(const SimulatedPack * packs, unsigned int n, unsigned int pack, unsigned int index, unsigned int records,
+ time_t last, char * info)
+{
+  const double	age = (double)(records - 1 - index) * HISTORY_INTERVAL;
+  const time_t	when = last - (time_t)age;
+  struct tm	t;
+  char *	i = info;
+
+  localtime_r(&when, &t);
+
+  for ( unsigned int j = 0; j < n; j++ ) {
+    if ( packs[j].number != pack )
+      continue;
+
+    i = hex2(i, 0);	/* Data flag */
+    i = hex4(i, index);
+    i = hex4(i, records);
+    i = hex2(i, t.tm_year - 100);
+    i = hex2(i, t.tm_mon + 1);
+    i = hex2(i, t.tm_mday);
+    i = hex2(i, t.tm_hour);
+    i = hex2(i, t.tm_min);
+    i = hex2(i, t.tm_sec);
+    i = telemetry_record(i, &packs[j], -age);
+    return i - info;
+  }
+  return 0;
+}
+
+/* The vendor information: device name, software version and manufacturer. */
+unsigned int
+sim_vendor(char * info)
+{
+  static const char	name[10] = "SIM-16S";
+  static const char	manufacturer[20] = "seplos-sim";
+  char *		i = info;
+
+  for ( unsigned int c = 0; c < sizeof(name); c++ )
+    i = hex2(i, name[c] ? name[c] : ' ');
+  i = hex2(i, 1);
+  i = hex2(i, 0);
+  for ( unsigned int c = 0; c < sizeof(manufacturer); c++ )
+    i = hex2(i, manufacturer[c] ? manufacturer[c] : ' ');
+  return i - info;
+}
+
+/* The time on the BMS clock, which is this machine's. */
+unsigned int
+sim_time(char * info)
+{
+  const time_t	now = time(NULL);
+  struct tm	t;
+  char *	i = info;
+
+  localtime_r(&now, &t);
+  i = hex4(i, t.tm_year + 1900);
+  i = hex2(i, t.tm_mon + 1);
+  i = hex2(i, t.tm_mday);
+  i = hex2(i, t.tm_hour);
+  i = hex2(i, t.tm_min);
+  i = hex2(i, t.tm_sec);
+  return i - info;
+}
+
+/*
+ * Some plausible protection settings, cell and pack voltages in mV and 10 mV:
+ * the alarm, protection and recovery levels, high then low.
+ */
+unsigned int
+sim_teleregulation(const SimulatedPack * packs, unsigned int n, unsigned int pack, char * info)
+{
+  static const uint16_t	cell[] = { 3550, 3650, 3400, 2800, 2700, 2900 };
+  char *		i = info;
+
+  for ( unsigned int j = 0; j < n; j++ ) {
+    if ( packs[j].number != pack )
+      continue;
+
+    i = hex2(i, 0);	/* Data flag */
+    for ( unsigned int c = 0; c < sizeof(cell) / sizeof(*cell); c++ )
+      i = hex4(i, cell[c]);
+    for ( unsigned int c = 0; c < sizeof(cell) / sizeof(*cell); c++ )
+      i = hex4(i, cell[c] * packs[j].cells / 10);
+    return i - info;
+  }
+  return 0;
+}
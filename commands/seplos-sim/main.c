@@ -0,0 +1,338 @@
+#include "./sim.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+#include "communication.h"
+
+static volatile sig_atomic_t	stop = 0;
+
+/* When the last history record was taken. The history doesn't change while the simulator runs. */
+static time_t			history_end;
+
+static struct {
+  unsigned long	requests;
+  unsigned long	replies;
+  unsigned long	dropped;
+  unsigned long	corrupted;
+  unsigned long	garbled;
+  unsigned long	errors;
+  unsigned long	bad_requests;
+} counts;
+
+static void
+on_signal(int signal)
+{
+  stop = 1;
+}
+
+static double
+seconds(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+static bool
+chance(unsigned int * seed, unsigned int percent)
+{
+  return percent > 0 && (unsigned int)(rand_r(seed) % 100) < percent;
+}
+
+static void
+write_all(int fd, const void * data, size_t size)
+{
+  const char *	p = data;
+
+  while ( size > 0 ) {
+    const ssize_t ret = write(fd, p, size);
+    if ( ret < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      _sp_error("Write: %s\n", strerror(errno));
+      return;
+    }
+    p += ret;
+    size -= ret;
+  }
+}
+
+/* Works out and sends the answer to one complete request. */
+static void
+answer(int fd, const struct arguments * arguments, const SimulatedPack * packs, const Seplos_2_0 * request,
+ unsigned int * seed, double started)
+{
+  const double	now = arguments->still ? 0 : seconds() - started;
+  Seplos_2_0	frame;
+  char		info[4096];
+  unsigned int	length = 0;
+  unsigned int	code = NORMAL;
+  bool		invalid = false;
+
+  const unsigned int address = _sp_hex2b(request->address, &invalid);
+  const unsigned int command = _sp_hex2b(request->function, &invalid);
+  const unsigned int pack = _sp_hex2b(request->info, &invalid);
+
+  counts.requests++;
+
+  if ( arguments->verbose )
+    fprintf(stderr, "request: address %u command %02X pack %u\n", address, command, pack);
+
+  /* Another controller on the same bus would answer this. */
+  if ( address != arguments->address )
+    return;
+
+  if ( chance(seed, arguments->drop) ) {
+    counts.dropped++;
+    return;
+  }
+
+  switch ( command ) {
+  case TELEMETRY_GET:
+    length = sim_telemetry(packs, arguments->packs, pack, now, info);
+    if ( length == 0 )
+      return; /* No such pack. */
+    break;
+  case TELECOMMAND_GET:
+    length = sim_telecommand(packs, arguments->packs, pack, now, info);
+    if ( length == 0 )
+      return;
+    break;
+  case HISTORY_GET: {
+    const unsigned int index = _sp_hex4b(&(request->info[2]), &invalid);
+
+    if ( index >= arguments->history ) {
+      code = NO_HISTORY;
+      break;
+    }
+    length = sim_history(packs, arguments->packs, pack, index, arguments->history, history_end, info);
+    if ( length == 0 )
+      return;
+    break;
+  }
+  case TELEREGULATION_GET:
+    length = sim_teleregulation(packs, arguments->packs, pack, info);
+    if ( length == 0 )
+      return;
+    break;
+  case VENDOR_GET:
+    length = sim_vendor(info);
+    break;
+  case TIME_GET:
+    length = sim_time(info);
+    break;
+  case PROTOCOL_VER_GET:
+    break;
+  default:
+    code = CID2_ERROR;
+    break;
+  }
+
+  if ( chance(seed, arguments->error) ) {
+    counts.errors++;
+    code = EXECUTION_FAILURE;
+    length = 0;
+  }
+
+  unsigned int latency = arguments->latency;
+  if ( arguments->jitter > 0 )
+    latency += rand_r(seed) % (arguments->jitter + 1);
+  if ( latency > 0 )
+    usleep(latency * 1000);
+
+  const unsigned int size = _sp_encode_command(address, code, info, length, &frame);
+
+  if ( chance(seed, arguments->corrupt) ) {
+    counts.corrupted++;
+    frame.info[length] = frame.info[length] == '0' ? '1' : '0';
+  }
+
+  if ( chance(seed, arguments->garbage) ) {
+    static const char noise[] = "\xff\x00~2F\r\x7f";
+    counts.garbled++;
+    write_all(fd, noise, 1 + (rand_r(seed) % (sizeof(noise) - 1)));
+  }
+
+  write_all(fd, &frame, size);
+  counts.replies++;
+}
+
+/* A request's function field is the command, so _sp_decode_info() can't be used. */
+static bool
+valid_request(const Seplos_2_0 * request, unsigned int size)
+{
+  unsigned int	length;
+  bool		invalid = false;
+
+  if ( size < 18 || _sp_check_header(request, &length) < 0 || size != length + 18 )
+    return false;
+
+  const unsigned int checksum = _sp_hex4b(&(request->info[length]), &invalid);
+  return !invalid && checksum == _sp_overall_checksum(request->version, length + 12);
+}
+
+/*
+ * Pulls complete requests, from '~' to the carriage return, out of what has
+ * been read so far. Returns how many bytes are left over for next time.
+ */
+static size_t
+requests(int fd, const struct arguments * arguments, const SimulatedPack * packs, char * buffer, size_t size,
+ unsigned int * seed, double started)
+{
+  size_t	start = 0;
+
+  for ( size_t i = 0; i < size; i++ ) {
+    if ( buffer[i] == '~' )
+      start = i;
+    else if ( buffer[i] == '\r' ) {
+      const Seplos_2_0 *	request = (const Seplos_2_0 *)&buffer[start];
+
+      if ( buffer[start] == '~' && valid_request(request, i - start + 1) )
+        answer(fd, arguments, packs, request, seed, started);
+      else
+        counts.bad_requests++;
+
+      start = i + 1;
+    }
+  }
+
+  if ( start >= size )
+    return 0;
+
+  memmove(buffer, &buffer[start], size - start);
+  return size - start;
+}
+
+static int
+listen_tcp(unsigned int port)
+{
+  struct sockaddr_in	a = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+  const int		on = 1;
+  const int		fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if ( fd < 0 )
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if ( bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(fd, 1) < 0 ) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int
+main(int argc, char * * argv)
+{
+  struct arguments	arguments = {};
+  SimulatedPack		packs[SEPLOS_MAX_PACKS];
+  struct termios	t;
+  char			name[256];
+  char			buffer[SEPLOS_MAX_FRAME];
+  size_t		buffered = 0;
+  int			master = -1, slave, listener = -1;
+
+  arguments.packs = 1;
+  arguments.cells = SEPLOS_N_CELLS;
+  arguments.history = 288;
+  arguments.seed = 1;
+
+  argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+  for ( unsigned int i = 0; i < arguments.packs; i++ )
+    sim_battery_init(&packs[i], i + 1, arguments.cells);
+
+  if ( arguments.tcp ) {
+    if ( (listener = listen_tcp(arguments.tcp)) < 0 ) {
+      _sp_error("TCP port %u: %s\n", arguments.tcp, strerror(errno));
+      return 1;
+    }
+    snprintf(name, sizeof(name), "%slocalhost:%u", SEPLOS_TCP_PREFIX, arguments.tcp);
+  }
+  else {
+    if ( openpty(&master, &slave, name, NULL, NULL) < 0 ) {
+      _sp_error("openpty: %s\n", strerror(errno));
+      return 1;
+    }
+
+    /*
+     * Keep the other end open, so that reads don't fail while no client has
+     * it open, and make it raw so that nothing is echoed before one does.
+     */
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+
+    if ( arguments.link ) {
+      unlink(arguments.link);
+      if ( symlink(name, arguments.link) < 0 ) {
+        _sp_error("%s: %s\n", arguments.link, strerror(errno));
+        return 1;
+      }
+    }
+  }
+
+  /* Without SA_RESTART, so that the signal interrupts the read below. */
+  struct sigaction action = { .sa_handler = on_signal };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  /* A client that hangs up must only end its own connection. */
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stdout, "%s\n", name);
+  fflush(stdout);
+
+  const double started = seconds();
+  history_end = time(NULL);
+  unsigned int seed = arguments.seed;
+
+  while ( !stop ) {
+    if ( master < 0 ) {
+      if ( (master = accept(listener, NULL, NULL)) < 0 ) {
+        if ( errno == EINTR )
+          continue;
+        _sp_error("Accept: %s\n", strerror(errno));
+        break;
+      }
+      /* The noise and the reply are written separately, and mustn't wait for each other. */
+      setsockopt(master, IPPROTO_TCP, TCP_NODELAY, &(const int){ 1 }, sizeof(int));
+      buffered = 0;
+    }
+
+    const ssize_t ret = read(master, &buffer[buffered], sizeof(buffer) - buffered);
+    if ( ret < 0 && errno == EINTR )
+      continue;
+    else if ( ret < 0 && listener < 0 ) {
+      _sp_error("Read: %s\n", strerror(errno));
+      break;
+    }
+    else if ( ret <= 0 && listener >= 0 ) {
+      /* The client hung up. Wait for the next. */
+      close(master);
+      master = -1;
+      continue;
+    }
+
+    buffered = requests(master, &arguments, packs, buffer, buffered + ret, &seed, started);
+    if ( buffered == sizeof(buffer) )
+      buffered = 0; /* Line noise without an end. */
+  }
+
+  if ( arguments.link && !arguments.tcp )
+    unlink(arguments.link);
+
+  fprintf(stderr, "%lu requests, %lu replies, %lu dropped, %lu corrupted, %lu garbled, %lu errors, %lu bad requests\n",
+   counts.requests, counts.replies, counts.dropped, counts.corrupted, counts.garbled, counts.errors, counts.bad_requests);
+
+  return 0;
+}
@@ -0,0 +1,44 @@
+#include <stdbool.h>
+#include <time.h>
+#include <argp.h>
+#include "seplos.h"
+
+extern const struct argp	argp;
+
+struct arguments
+{
+  const char *	link;		/* Symbolic link to create to the pseudo-terminal */
+  unsigned int	tcp;		/* Serve on this TCP port instead, like a serial server */
+  unsigned int	address;	/* Controller address to answer for */
+  unsigned int	packs;		/* Number of packs behind the controller */
+  unsigned int	cells;		/* Cells per pack */
+  unsigned int	latency;	/* Milliseconds before each reply */
+  unsigned int	jitter;		/* Up to this many more milliseconds */
+  unsigned int	drop;		/* Percent of requests not answered */
+  unsigned int	corrupt;	/* Percent of replies with a bad checksum */
+  unsigned int	garbage;	/* Percent of replies preceded by line noise */
+  unsigned int	error;		/* Percent of replies with an error code */
+  unsigned int	history;	/* History records each pack keeps */
+  unsigned int	seed;		/* For the random numbers, so runs can be repeated */
+  bool		still;		/* The battery is idle and its readings never change */
+  bool		verbose;	/* Log every request */
+};
+
+/*
+ * The state of one simulated pack. The readings are worked out from the time,
+ * so they drift the way a real battery's do.
+ */
+typedef struct _SimulatedPack {
+  unsigned int	number;
+  unsigned int	cells;
+  float		state_of_charge;
+  unsigned int	cycles;
+} SimulatedPack;
+
+extern void		sim_battery_init(SimulatedPack * p, unsigned int number, unsigned int cells);
+extern unsigned int	sim_telemetry(const SimulatedPack * packs, unsigned int n, unsigned int pack, double now, char * info);
+extern unsigned int	sim_telecommand(const SimulatedPack * packs, unsigned int n, unsigned int pack, double now, char * info);
+extern unsigned int	sim_vendor(char * info);
+extern unsigned int	sim_time(char * info);
+extern unsigned int	sim_teleregulation(const SimulatedPack * packs, unsigned int n, unsigned int pack, char * info);
+extern unsigned int	sim_history(const SimulatedPack * packs, unsigned int n, unsigned int pack, unsigned int index, unsigned int records, time_t last, char * info);
@@ -1,5 +1,6 @@
 #include "./seplos_cmd.h"
 #include "internal.h"
+#include <stdlib.h>
 #include <string.h>
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
@@ -7,15 +8,34 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state);
 const char * argp_program_version = "seplos 0.1";
 const char * argp_program_bug_address = "Bruce Perens K6BP <bruce@perens.com>";
 
-static const char args_doc[] = "";
+static const char args_doc[] = "\ndump RING-FILE\nhistory [RING-FILE]\nlive SHM-NAME";
 static const char doc[] = \
   "Monitor the battery-management system." \
-  "";
+  "\vWith \"dump\", print the samples seplosd kept in a history ring, in the chosen format," \
+  " instead of reading the battery." \
+  " With \"history\", download the history the first pack keeps itself, and append it to RING-FILE," \
+  " or print it if there is none. With --checkpoint, a download that was interrupted goes on from" \
+  " where it stopped. An existing RING-FILE is never started over, and must not be a ring seplosd" \
+  " is writing." \
+  " With \"live\", print the latest sample of each pack from the shared memory seplosd publishes to" \
+  " under shm_name, or only of the packs given with --pack at --address.";
 
 static const struct argp_option options[] = {
-  {"device", 'd', "/dev/tty...", 0, "The serial device used to communicate with the battery."},
+  {"device", 'd', "/dev/tty...", 0, "The serial device used to communicate with the battery, or tcp://host:port of a serial server."},
+  {"address", 'a', "0-255", 0, "The controller address of the battery (default 0)."},
+  {"pack", 'p', "0-255", 0, "A battery pack to read (default 1). Repeat to read several packs on the same bus. 255 reads every pack behind the controller in one request."},
+  {"baud", 'b', "1200-115200", 0, "The serial speed (default 19200)."},
+  {"timeout", 't', "milliseconds", 0, "How long to wait for the battery to answer (default 1000). A pack that isn't there fails after this long."},
   {"longer", 'l', 0, 0, "More information: individual cell states, etc."},
   {"format", 'f', "text|HTML|JSON", 0, "Format of the output: text: text file, HTML: web page, JSON: easy format for communication between programs."},
+  {"from", 'F', "seconds", 0, "With dump, start at this time, in seconds since the epoch."},
+  {"to", 'T', "seconds", 0, "With dump, end at this time, in seconds since the epoch."},
+  {"every", 'e', "number", 0, "With dump, print only every n'th sample."},
+  {"checkpoint", 'k', "file", 0, "With history, keep the position of the download in this file, and go on from it."},
+  {"samples", 's', "number", 0, "With history, the number of samples a new RING-FILE holds (default 100000). An existing one keeps its own."},
+  {"capture", 'C', "file", 0, "Append every request and reply frame to this file, for seplos-replay."},
+  {"watch", 'w', "milliseconds", 0, "Keep reading the packs at this interval until interrupted. With JSON, each pack is one line with the time and how long the battery took to answer."},
+  {"count", 'n', "number", 0, "Read the packs this many times, at the --watch interval or one after another, and stop."},
   {}
 };
 
@@ -32,6 +52,43 @@ parse_opt(int key, char *arg, struct argp_state *state)
   case 'd':
     arguments->device = arg;
     break;
+  case 'a':
+  case 'p': {
+    char * end;
+    const unsigned long value = strtoul(arg, &end, 0);
+
+    if ( *arg == '\0' || *end != '\0' || value > 0xff )
+      argp_failure(state, 1, 0, "Parameter to --%s must be a number from 0 to 255", key == 'a' ? "address" : "pack");
+
+    if ( key == 'a' )
+      arguments->address = value;
+    else if ( arguments->number_of_packs >= MAX_PACKS )
+      argp_failure(state, 1, 0, "No more than %d packs can be read at once", MAX_PACKS);
+    else
+      arguments->packs[arguments->number_of_packs++] = value;
+    break;
+  }
+  case 'b':
+  case 't':
+  case 'w':
+  case 'n': {
+    char * end;
+    const unsigned long value = strtoul(arg, &end, 0);
+    const char * const name = key == 'b' ? "baud" : key == 't' ? "timeout" : key == 'w' ? "watch" : "count";
+
+    if ( *arg == '\0' || *end != '\0' || value == 0 || value > (key == 'n' ? 0xffffffff : 3600000) )
+      argp_failure(state, 1, 0, "Parameter to --%s must be a positive number", name);
+
+    if ( key == 'b' )
+      arguments->baud = value;
+    else if ( key == 't' )
+      arguments->timeout = value;
+    else if ( key == 'w' )
+      arguments->watch = value;
+    else
+      arguments->count = value;
+    break;
+  }
   case 'f':
     if ( ( strcmp(arg, "text") == 0 ) || ( strcmp(arg, "TEXT") == 0 ) )
       arguments->format = TEXT;
@@ -45,8 +102,50 @@ parse_opt(int key, char *arg, struct argp_state *state)
   case 'l':
     arguments->longer = true;
     break;
+  case 'k':
+    arguments->checkpoint = arg;
+    break;
+  case 'C':
+    arguments->capture = arg;
+    break;
+  case 'F':
+  case 'T':
+  case 's':
+  case 'e': {
+    char * end;
+    const unsigned long long value = strtoull(arg, &end, 0);
+
+    if ( *arg == '\0' || *end != '\0' || ((key == 'e' || key == 's') && (value == 0 || value > 0xffffffff)) )
+      argp_failure(state, 1, 0, "Parameter to --%s must be a positive number", key == 'F' ? "from" : key == 'T' ? "to" : key == 's' ? "samples" : "every");
+
+    if ( key == 'F' )
+      arguments->from = value;
+    else if ( key == 'T' )
+      arguments->to = value;
+    else if ( key == 's' )
+      arguments->samples = value;
+    else
+      arguments->every = value;
+    break;
+  }
   case ARGP_KEY_ARG:
+    if ( state->arg_num == 0 && strcmp(arg, "dump") == 0 )
+      arguments->dump = true;
+    else if ( state->arg_num == 0 && strcmp(arg, "history") == 0 )
+      arguments->history = true;
+    else if ( state->arg_num == 0 && strcmp(arg, "live") == 0 )
+      arguments->live = true;
+    else if ( state->arg_num == 1 && arguments->live )
+      arguments->segment = arg;
+    else if ( state->arg_num == 1 )
+      arguments->ring = arg;
+    else
+      argp_usage(state);
+    break;
   case ARGP_KEY_END:
+    if ( (arguments->dump || arguments->live) && state->arg_num == 1 )
+      argp_usage(state);
+    break;
   case ARGP_KEY_FINI:
   case ARGP_KEY_INIT:
   case ARGP_KEY_NO_ARGS:
@@ -1,8 +1,331 @@
 #include "./seplos_cmd.h"
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "seplos.h"
 
+/* Reused from one reading to the next while watching. */
+static char			frame[SEPLOS_MAX_FRAME];
+static char			line[SEPLOS_JSON_MAX + 128];
+static volatile sig_atomic_t	stopping = 0;
+
+static void
+dump_sample(const SeplosData * m, uint64_t time, void * data)
+{
+  const struct arguments * const	arguments = data;
+  const time_t			seconds = time / 1000;
+  char				when[32];
+
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+
+  switch ( arguments->format ) {
+  case TEXT:
+    fprintf(stdout, "Time: %s\n", when);
+    seplos_text(stdout, m, arguments->longer);
+    fprintf(stdout, "\n");
+    break;
+  case HTML:
+    fprintf(stdout, "<h2>%s</h2>\n", when);
+    seplos_html(stdout, m, arguments->longer);
+    break;
+  case JSON: {
+    char	buffer[SEPLOS_JSON_MAX];
+    uint32_t	fields = SEPLOS_JSON_ALL;
+
+    if ( !arguments->longer )
+      fields &= ~(SEPLOS_JSON_CELLS | SEPLOS_JSON_TEMPERATURES);
+
+    seplos_json_format(buffer, sizeof(buffer), m, fields);
+    fprintf(stdout, "{\"time\":%llu,\"data\":%s}\n", (unsigned long long)time, buffer);
+    break;
+  }
+  }
+}
+
+/* Print what seplosd kept in a pack's history ring. */
+static int
+dump(const struct arguments * arguments)
+{
+  SeplosRing	r;
+
+  if ( seplos_ring_map(&r, arguments->ring) < 0 )
+    return 1;
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery History</title></head><body>\n");
+
+  seplos_ring_query(&r, arguments->from * 1000, arguments->to ? (arguments->to * 1000) + 999 : UINT64_MAX,
+   arguments->every, dump_sample, (void *)arguments);
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "</body></html>\n");
+
+  seplos_ring_close(&r);
+  return 0;
+}
+
+/* Print the latest sample of each pack that seplosd published to shared memory. */
+static int
+live(const struct arguments * arguments)
+{
+  SeplosLive		l;
+  SeplosLiveSample	s;
+  int			status = 0;
+
+  if ( seplos_live_map(&l, arguments->segment) < 0 )
+    return 1;
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Monitor</title></head><body>\n");
+
+  if ( arguments->number_of_packs == 0 ) {
+    for ( unsigned int i = 0; i < seplos_live_capacity(&l) && seplos_live_read(&l, i, &s) == 0; i++ )
+      dump_sample(&s.data, s.time, (void *)arguments);
+  }
+  else {
+    for ( unsigned int i = 0; i < arguments->number_of_packs; i++ ) {
+      const int index = seplos_live_find(&l, NULL, arguments->address, arguments->packs[i]);
+
+      if ( index < 0 || seplos_live_read(&l, index, &s) < 0 ) {
+        fprintf(stderr, "%s: address %u pack %u: %s\n", arguments->segment, arguments->address,
+         arguments->packs[i], strerror(errno));
+        status = 1;
+        continue;
+      }
+      dump_sample(&s.data, s.time, (void *)arguments);
+    }
+  }
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "</body></html>\n");
+
+  seplos_live_close(&l);
+  return status;
+}
+
+/* Where the history records go: the ring, or if there is none, standard output. */
+typedef struct _HistorySink {
+  const struct arguments *	arguments;
+  SeplosRing *			ring;
+} HistorySink;
+
+static void
+history_record(const SeplosHistoryRecord * r, void * data)
+{
+  const HistorySink * const	sink = data;
+
+  if ( sink->ring )
+    seplos_ring_append(sink->ring, &(r->data), r->time);
+  else
+    dump_sample(&(r->data), r->time, (void *)sink->arguments);
+}
+
+/*
+ * Download the history the pack keeps into a ring, or print it. With a
+ * checkpoint, an interrupted download goes on from where it stopped.
+ */
+static int
+history(const struct arguments * arguments, seplos_device fd)
+{
+  const unsigned int	pack = arguments->packs[0];
+  SeplosRing		ring;
+  HistorySink		sink = { arguments, NULL };
+  SeplosHistory		h;
+  int			status = 0;
+
+  if ( arguments->ring ) {
+    if ( seplos_ring_attach(&ring, arguments->ring, arguments->samples, arguments->address, pack) < 0 )
+      return 1;
+    sink.ring = &ring;
+  }
+
+  if ( seplos_history_open(&h, arguments->checkpoint, arguments->address, pack, history_record, &sink) < 0 ) {
+    if ( arguments->ring )
+      seplos_ring_close(&ring);
+    return 1;
+  }
+
+  /*
+   * Only records newer than what the ring has are delivered, so that running
+   * this again without a checkpoint adds nothing twice, and the ring stays in
+   * time order for seplos_ring_query().
+   */
+  if ( arguments->ring && seplos_ring_last(&ring) > h.last )
+    h.last = seplos_ring_last(&ring);
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery History</title></head><body>\n");
+
+  const int records = seplos_history_download(fd, &h, 0);
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "</body></html>\n");
+
+  if ( records < 0 ) {
+    fprintf(stderr, "History download stopped at record %u of %u.\n", h.next, h.records);
+    status = 1;
+  }
+  else
+    fprintf(stderr, "%d history records, %u kept by the pack.\n", records, h.records);
+
+  seplos_history_close(&h);
+  if ( arguments->ring )
+    seplos_ring_close(&ring);
+  return status;
+}
+
+static uint64_t
+nanoseconds(clockid_t clock)
+{
+  struct timespec t;
+
+  clock_gettime(clock, &t);
+  return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+static void
+interrupted(int signal)
+{
+  stopping = 1;
+}
+
+/*
+ * One line of JSON for a pack: the wall-clock time in milliseconds, the pack,
+ * the milliseconds the request took, and the data or what went wrong.
+ */
+static void
+stream_sample(const struct arguments * arguments, const SeplosData * m, unsigned int pack, uint64_t time, uint64_t latency)
+{
+  uint32_t	fields = SEPLOS_JSON_ALL;
+  size_t	n;
+
+  if ( !arguments->longer )
+    fields &= ~(SEPLOS_JSON_CELLS | SEPLOS_JSON_TEMPERATURES);
+
+  n = snprintf(line, sizeof(line), "{\"time\":%llu,\"address\":%u,\"pack\":%u,\"latency\":%.3f,",
+   (unsigned long long)time, arguments->address, pack, latency / 1e6);
+
+  if ( m ) {
+    n += snprintf(line + n, sizeof(line) - n, "\"data\":");
+    n += seplos_json_format(line + n, sizeof(line) - n, m, fields);
+  }
+  else
+    n += snprintf(line + n, sizeof(line) - n, "\"error\":\"%s\"", strerror(errno));
+
+  if ( n + 2 < sizeof(line) ) {
+    memcpy(line + n, "}\n", 2);
+    fwrite(line, 1, n + 2, stdout);
+  }
+}
+
+/*
+ * Read each of the packs once and print them. While watching, each sample is
+ * printed with its time, and a pack that fails is reported like one that
+ * answered. Returns 1 if any pack failed.
+ */
+static int
+read_packs(const struct arguments * arguments, seplos_device fd, bool * first)
+{
+  const bool	watching = arguments->watch || arguments->count;
+  int		status = 0;
+
+  for ( unsigned int i = 0; i < arguments->number_of_packs && !stopping; i++ ) {
+    SeplosData		d[SEPLOS_MAX_PACKS] = {};
+    const uint64_t	time = nanoseconds(CLOCK_REALTIME) / 1000000;
+    const uint64_t	then = nanoseconds(CLOCK_MONOTONIC);
+    int			packs = 1;
+
+    if ( arguments->packs[i] == SEPLOS_ALL_PACKS )
+      packs = seplos_data_all_buffer(fd, arguments->address, d, SEPLOS_MAX_PACKS, frame, sizeof(frame));
+    else if ( seplos_data_buffer(fd, arguments->address, arguments->packs[i], d, frame, sizeof(frame)) < 0 )
+      packs = -1;
+
+    const uint64_t	latency = nanoseconds(CLOCK_MONOTONIC) - then;
+
+    if ( packs < 0 ) {
+      if ( watching && arguments->format == JSON && !stopping )
+        stream_sample(arguments, NULL, arguments->packs[i], time, latency);
+      status = 1;
+      continue;
+    }
+
+    for ( int j = 0; j < packs; j++ ) {
+      if ( watching ) {
+        if ( arguments->format == JSON )
+          stream_sample(arguments, &d[j], d[j].battery_pack_number, time, latency);
+        else
+          dump_sample(&d[j], time, (void *)arguments);
+        continue;
+      }
+
+      switch ( arguments->format ) {
+      case TEXT:
+        if ( !*first )
+          fprintf(stdout, "\n");
+        seplos_text(stdout, &d[j], arguments->longer);
+        break;
+      case HTML:
+        seplos_html(stdout, &d[j], arguments->longer);
+        break;
+      case JSON:
+        seplos_json(stdout, &d[j], arguments->longer);
+        break;
+      }
+      *first = false;
+    }
+  }
+
+  fflush(stdout);
+  return status;
+}
+
+/*
+ * Read the packs count times, or until interrupted, starting a reading every
+ * watch milliseconds. A reading that runs late moves the ones after it,
+ * rather than their being hurried to catch up.
+ */
+static int
+watch(const struct arguments * arguments, seplos_device fd)
+{
+  const struct sigaction	action = { .sa_handler = interrupted };
+  struct timespec		next;
+  bool				first = true;
+  int				status = 0;
+
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  for ( unsigned int round = 0; !stopping && (arguments->count == 0 || round < arguments->count); round++ ) {
+    if ( round > 0 && arguments->watch ) {
+      struct timespec	now;
+
+      next.tv_sec += arguments->watch / 1000;
+      next.tv_nsec += (arguments->watch % 1000) * 1000000L;
+      if ( next.tv_nsec >= 1000000000L ) {
+        next.tv_sec++;
+        next.tv_nsec -= 1000000000L;
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ( now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec) )
+        next = now;
+
+      while ( !stopping && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR )
+        ;
+      if ( stopping )
+        break;
+    }
+
+    status |= read_packs(arguments, fd, &first);
+  }
+
+  return status;
+}
+
 int
 main(int argc, char * * argv)
 {
@@ -11,33 +334,48 @@ main(int argc, char * * argv)
 
   arguments.device = "/dev/ttyUSB0";
   arguments.format = TEXT;
+  arguments.baud = SEPLOS_DEFAULT_BAUD;
+  arguments.timeout = SEPLOS_DEFAULT_REPLY_TIMEOUT;
+  arguments.samples = 100000;
 
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-  int fd = seplos_open(arguments.device);
+  if ( arguments.dump )
+    return dump(&arguments);
+  if ( arguments.live )
+    return live(&arguments);
 
-  SeplosData d;
+  if ( arguments.number_of_packs == 0 )
+    arguments.packs[arguments.number_of_packs++] = 0x01;
+
+  seplos_set_reply_timeout(arguments.timeout);
+  int fd = seplos_open_serial(arguments.device, arguments.baud, SEPLOS_DEFAULT_BYTE_TIMEOUT);
 
   if ( fd < 0 )
     return 1;
 
-  seplos_data(fd, 0, 0x01, &d);
+  if ( arguments.capture && seplos_capture_open(arguments.capture) < 0 )
+    return 1;
 
-  switch ( arguments.format ) {
-  case TEXT:
-    seplos_text(stdout, &d, arguments.longer);
-    break;
-  case HTML:
+  if ( arguments.history ) {
+    const int status = history(&arguments, fd);
+
+    seplos_capture_close();
+    close(fd);
+    return status;
+  }
+
+  if ( arguments.format == HTML )
     fprintf(stdout, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Monitor</title></head><body>\n");
-    seplos_html(stdout, &d, arguments.longer);
+
+  bool first = true;
+  const int status = arguments.watch || arguments.count ? watch(&arguments, fd) : read_packs(&arguments, fd, &first);
+
+  if ( arguments.format == HTML )
     fprintf(stdout, "</body></html>\n");
-    break;
-  case JSON:
-    seplos_json(stdout, &d, arguments.longer);
-    break;
-  }
 
+  seplos_capture_close();
   close(fd);
 
-  return 0;
+  return status;
 }
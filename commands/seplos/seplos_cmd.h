@@ -1,6 +1,9 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <argp.h>
 
+#define MAX_PACKS 16
+
 extern const struct argp	argp;
 
 enum Format {
@@ -14,5 +17,23 @@ struct arguments
   char *	device;	/* Serial device connected to the battery */
   enum Format	format; /* text, HTML, or JSON. */
   bool		longer; /* More information but not necessarily verbose */
+  unsigned int	address; /* Controller address on the RS-485 bus */
+  unsigned int	packs[MAX_PACKS]; /* Battery packs to read, in order */
+  unsigned int	number_of_packs;
+  unsigned int	baud; /* Serial speed */
+  unsigned int	timeout; /* Milliseconds to wait for the BMS to answer */
+  const char *	ring; /* With "dump", the seplosd history ring to print. With "history", the ring to fill */
+  bool		dump; /* The "dump" command */
+  bool		live; /* The "live" command: print the latest samples seplosd published to shared memory */
+  const char *	segment; /* With "live", the shm_name of seplosd */
+  bool		history; /* The "history" command: download the pack's own history */
+  const char *	checkpoint; /* With history, where to keep the position of the download */
+  const char *	capture; /* Append every frame to this capture file */
+  unsigned int	samples; /* With history, the capacity of a new ring */
+  uint64_t	from; /* Dump samples from this time, in seconds since the epoch */
+  uint64_t	to; /* ... up to this one */
+  unsigned int	every; /* Dump only every n'th sample */
+  unsigned int	watch; /* Milliseconds from one reading of the packs to the next, 0 to read them once */
+  unsigned int	count; /* Stop after this many readings, 0 for no limit */
 };
 
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "./internal.h"
+
+/*
+ * Packs stored by column, for scanning hundreds of them for the worst cell.
+ * Each pass over a column is a loop with no branches and no dependency
+ * from one pack to the next, so the compiler turns it into vector minimum
+ * and maximum instructions. The comparisons are written so that a NaN,
+ * which is a cell the pack doesn't have, never wins: x < y is false when
+ * either is NaN, which is also what the vector instructions do.
+ *
+ * The scans work on blocks of packs, with the per-pack results for the
+ * block on the stack, so they need no memory of their own.
+ */
+#define BLOCK 64
+
+static inline void
+set_bit(uint32_t * bitmap, unsigned int index, bool value)
+{
+  const uint32_t mask = (uint32_t)1 << (index % 32);
+
+  if ( value )
+    bitmap[index / 32] |= mask;
+  else
+    bitmap[index / 32] &= ~mask;
+}
+
+/*
+ * Lay the arrays of a batch of capacity packs out in memory, which must be
+ * at least SEPLOS_BATCH_BYTES(capacity) bytes and suitably aligned for a
+ * float, as malloc() returns. The batch starts empty.
+ */
+int
+seplos_batch_init(SeplosBatch * b, void * memory, size_t size, unsigned int capacity)
+{
+  const size_t	stride = SEPLOS_BATCH_STRIDE(capacity);
+  char *	p = memory;
+
+  if ( capacity == 0 || memory == NULL || size < SEPLOS_BATCH_BYTES(capacity) \
+   || ((uintptr_t)memory % sizeof(float)) != 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(b, 0, sizeof(*b));
+  b->capacity = capacity;
+  b->stride = stride;
+
+  b->current = (float *)p;
+  p += stride * sizeof(float);
+  b->voltage = (float *)p;
+  p += stride * sizeof(float);
+  b->state_of_charge = (float *)p;
+  p += stride * sizeof(float);
+  b->cell_voltage = (float *)p;
+  p += stride * SEPLOS_N_CELLS * sizeof(float);
+  b->temperature = (float *)p;
+  p += stride * SEPLOS_N_TEMPERATURES * sizeof(float);
+
+  b->alarm = (uint32_t *)p;
+  p += (stride / 32) * sizeof(uint32_t);
+  b->cell_alarm = (uint32_t *)p;
+  p += (stride / 32) * sizeof(uint32_t);
+  b->temperature_alarm = (uint32_t *)p;
+  p += (stride / 32) * sizeof(uint32_t);
+
+  b->address = (uint8_t *)p;
+  p += stride;
+  b->pack = (uint8_t *)p;
+  p += stride;
+  b->number_of_cells = (uint8_t *)p;
+
+  return 0;
+}
+
+/* Empty the batch, to fill it again with the next scan. */
+void
+seplos_batch_clear(SeplosBatch * b)
+{
+  b->length = 0;
+}
+
+/*
+ * Append n decoded packs. Returns the index of the first, or -1 with errno
+ * ENOSPC if there isn't room for all of them, and then none are added.
+ */
+int
+seplos_batch_add(SeplosBatch * b, const SeplosData * m, unsigned int n)
+{
+  const unsigned int	first = b->length;
+  const size_t		stride = b->stride;
+
+  if ( n > b->capacity - b->length ) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  for ( unsigned int i = 0; i < n; i++ ) {
+    const SeplosData * const	d = &m[i];
+    const unsigned int		p = b->length++;
+    const unsigned int		cells = d->number_of_cells < SEPLOS_N_CELLS ? d->number_of_cells : SEPLOS_N_CELLS;
+
+    b->current[p] = d->charge_discharge_current;
+    b->voltage[p] = d->total_battery_voltage;
+    b->state_of_charge[p] = d->state_of_charge;
+
+    for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ )
+      b->cell_voltage[(c * stride) + p] = c < cells ? d->cell_voltage[c] : NAN;
+    for ( unsigned int t = 0; t < SEPLOS_N_TEMPERATURES; t++ )
+      b->temperature[(t * stride) + p] = d->temperature[t];
+
+    set_bit(b->alarm, p, d->has_alarm);
+    set_bit(b->cell_alarm, p, d->has_cell_alarm);
+    set_bit(b->temperature_alarm, p, d->has_temperature_alarm);
+
+    b->address[p] = d->controller_address;
+    b->pack[p] = d->battery_pack_number;
+    b->number_of_cells[p] = cells;
+  }
+
+  return first;
+}
+
+/*
+ * Decode a finished TELEMETRY_GET and TELECOMMAND_GET pair, for one pack or
+ * for SEPLOS_ALL_PACKS, and append the packs. Returns the number of packs
+ * added, or -1 if a reply is malformed or there isn't room.
+ */
+int
+seplos_batch_decode(SeplosBatch * b, const SeplosTransaction * telemetry, const SeplosTransaction * telecommand)
+{
+  SeplosData	d[SEPLOS_MAX_PACKS] = {};
+  int		packs = 1;
+
+  if ( telemetry->pack == SEPLOS_ALL_PACKS ) {
+    packs = seplos_decode_telemetry_packs(telemetry, d, SEPLOS_MAX_PACKS);
+    if ( packs < 0 || seplos_decode_telecommand_packs(telecommand, d, packs) != packs ) {
+      errno = EBADMSG;
+      return -1;
+    }
+  }
+  else if ( seplos_decode_telemetry(telemetry, d) < 0 || seplos_decode_telecommand(telecommand, d) < 0 )
+    return -1;
+
+  if ( seplos_batch_add(b, d, packs) < 0 )
+    return -1;
+  return packs;
+}
+
+/* The lowest and highest of columns columns, for n packs from start. */
+static void
+column_range(const float * column, size_t stride, unsigned int columns, unsigned int start, unsigned int n,
+ float * restrict lowest, float * restrict highest)
+{
+  for ( unsigned int p = 0; p < n; p++ ) {
+    lowest[p] = INFINITY;
+    highest[p] = -INFINITY;
+  }
+
+  for ( unsigned int c = 0; c < columns; c++ ) {
+    const float * restrict v = &column[(c * stride) + start];
+
+    for ( unsigned int p = 0; p < n; p++ ) {
+      lowest[p] = v[p] < lowest[p] ? v[p] : lowest[p];
+      highest[p] = v[p] > highest[p] ? v[p] : highest[p];
+    }
+  }
+}
+
+/*
+ * The lowest and highest cell voltage of each pack, into arrays of
+ * b->length. Both are NaN for a pack with no cells.
+ */
+void
+seplos_batch_cell_range(const SeplosBatch * b, float * lowest, float * highest)
+{
+  for ( unsigned int start = 0; start < b->length; start += BLOCK ) {
+    const unsigned int n = b->length - start < BLOCK ? b->length - start : BLOCK;
+
+    column_range(b->cell_voltage, b->stride, SEPLOS_N_CELLS, start, n, &lowest[start], &highest[start]);
+    for ( unsigned int p = start; p < start + n; p++ ) {
+      if ( lowest[p] > highest[p] )
+        lowest[p] = highest[p] = NAN;
+    }
+  }
+}
+
+static void
+extreme_init(SeplosBatchExtreme * e, float value)
+{
+  e->value = value;
+  e->index = UINT_MAX;
+  e->position = 0;
+}
+
+/* Take value for pack index if it beats e: lower if sign is -1, higher if 1. */
+static inline void
+extreme_consider(SeplosBatchExtreme * e, float value, unsigned int index, int sign)
+{
+  if ( sign < 0 ? value < e->value : value > e->value ) {
+    e->value = value;
+    e->index = index;
+  }
+}
+
+/* Find which column of the winning pack holds the value, once the scan is done. */
+static void
+extreme_finish(SeplosBatchExtreme * e, const float * column, size_t stride, unsigned int columns)
+{
+  if ( e->index == UINT_MAX ) {
+    e->value = NAN;
+    e->index = 0;
+    return;
+  }
+
+  for ( unsigned int c = 0; column && c < columns; c++ ) {
+    if ( column[(c * stride) + e->index] == e->value ) {
+      e->position = c;
+      break;
+    }
+  }
+}
+
+/*
+ * Scan the whole batch for the lowest and highest cell, the pack with the
+ * largest difference between its cells, the hottest and coldest sensor, and
+ * the number of packs in alarm.
+ */
+void
+seplos_batch_scan(const SeplosBatch * b, SeplosBatchScan * s)
+{
+  float	lowest[BLOCK], highest[BLOCK];
+
+  extreme_init(&s->lowest_cell, INFINITY);
+  extreme_init(&s->highest_cell, -INFINITY);
+  extreme_init(&s->largest_imbalance, -INFINITY);
+  extreme_init(&s->hottest, -INFINITY);
+  extreme_init(&s->coldest, INFINITY);
+  s->alarms = 0;
+
+  for ( unsigned int start = 0; start < b->length; start += BLOCK ) {
+    const unsigned int n = b->length - start < BLOCK ? b->length - start : BLOCK;
+
+    column_range(b->cell_voltage, b->stride, SEPLOS_N_CELLS, start, n, lowest, highest);
+    for ( unsigned int p = 0; p < n; p++ ) {
+      extreme_consider(&s->lowest_cell, lowest[p], start + p, -1);
+      extreme_consider(&s->highest_cell, highest[p], start + p, 1);
+      extreme_consider(&s->largest_imbalance, highest[p] - lowest[p], start + p, 1);
+    }
+
+    column_range(b->temperature, b->stride, SEPLOS_N_TEMPERATURES, start, n, lowest, highest);
+    for ( unsigned int p = 0; p < n; p++ ) {
+      extreme_consider(&s->coldest, lowest[p], start + p, -1);
+      extreme_consider(&s->hottest, highest[p], start + p, 1);
+    }
+  }
+
+  for ( unsigned int w = 0; w < (b->length + 31) / 32; w++ ) {
+    uint32_t bits = b->alarm[w];
+
+    if ( w == b->length / 32 )
+      bits &= ((uint32_t)1 << (b->length % 32)) - 1;
+    s->alarms += __builtin_popcount(bits);
+  }
+
+  extreme_finish(&s->lowest_cell, b->cell_voltage, b->stride, SEPLOS_N_CELLS);
+  extreme_finish(&s->highest_cell, b->cell_voltage, b->stride, SEPLOS_N_CELLS);
+  extreme_finish(&s->largest_imbalance, NULL, b->stride, 0);
+  extreme_finish(&s->hottest, b->temperature, b->stride, SEPLOS_N_TEMPERATURES);
+  extreme_finish(&s->coldest, b->temperature, b->stride, SEPLOS_N_TEMPERATURES);
+}
@@ -4,18 +4,15 @@
 #include "./internal.h"
 #include "./communication.h"
 
-int
-_sp_bms_command(
- seplos_device	       fd,
+unsigned int
+_sp_encode_command(
  const unsigned int    address,
  const unsigned int    command,
  const void * restrict info,
  const unsigned int    info_length,
- Seplos_2_0 *	       result)
+ Seplos_2_0 *	       encoded)
 {
-  Seplos_2_0        encoded = {};
   Seplos_2_0_Binary s = {};
-  Seplos_2_0_Binary r = {};
 
   s.version = 0x20; /* Protocol version 2.0 */
   s.address = address;
@@ -23,48 +20,36 @@ _sp_bms_command(
   s.function = command;
   s.length = _sp_length_checksum(info_length) | (info_length & 0x0fff);
 
-  _sp_hex2(s.version, encoded.version);
-  _sp_hex2(s.address, encoded.address);
-  _sp_hex2(s.device, encoded.device);
-  _sp_hex2(s.function, encoded.function);
-  _sp_hex4(s.length, encoded.length);
+  _sp_hex2(s.version, encoded->version);
+  _sp_hex2(s.address, encoded->address);
+  _sp_hex2(s.device, encoded->device);
+  _sp_hex2(s.function, encoded->function);
+  _sp_hex4(s.length, encoded->length);
 
-  encoded.start = '~';
+  encoded->start = '~';
   assert(info_length < 4096);
 
-  uint8_t * i = encoded.info;
+  uint8_t * i = encoded->info;
   memcpy(i, info, info_length);
   i += info_length;
 
-  uint16_t checksum = _sp_overall_checksum(encoded.version, info_length + 12);
+  uint16_t checksum = _sp_overall_checksum(encoded->version, info_length + 12);
   _sp_hex4(checksum, i);
   i += 4;
 
   *i++ = '\r';
 
-  _sp_discard_serial_input(fd); /* Throw away any pending I/O */
-
-  int ret = _sp_write_serial(fd, &encoded, info_length + 18);
-  if ( ret != info_length + 18 ) {
-    _sp_error("Write: %s\n", strerror(errno)); /* FIX: Abstract away POSIX */
-    return -1;
-  }
-  _sp_wait_until_serial_data_is_transmitted(fd);
-
-  /*
-   * Becuase of the the wait for data to be transmitted, above, the BMC should have
-   * the command.
-   * There should always be at least 18 bytes in a properly-formed packet.
-   * Timeout of the read here is an unusual event, and likely means that the BMC got
-   * unplugged or went into hibernation.
-   */
-  ret = _sp_read_serial(fd, result, 18);
-
-  if ( ret != 18 ) {
-    _sp_error("Read: %s\n", strerror(errno)); /* FIX: Abstract away POSIX */
-    return -1;
-  }
+  return info_length + 18;
+}
 
+/*
+ * Validate the first 18 bytes of a response, and return the length of the
+ * info field that follows the header.
+ */
+int
+_sp_check_header(const Seplos_2_0 * result, unsigned int * length)
+{
+  Seplos_2_0_Binary r = {};
   bool invalid = false;
 
   if ( result->start != '~' )
@@ -78,46 +63,224 @@ _sp_bms_command(
 
   /* Abort if the major protocol version isn't 2. Accept any minor version */
   if ( r.version > 0x2f || r.version < 0x20 ) {
-    _sp_error("SEPLOS protocol %x not implemented.\n");
+    _sp_error("SEPLOS protocol %x not implemented.\n", r.version);
+    _sp_failure = SEPLOS_FAILURE_VERSION;
+    errno = EBADMSG;
     return -1;
   }
 
   if ( invalid ) {
-    _sp_error("Non-hexidecimal character where only hexidecimal was expected: %18s.\n", (const char *)&result);
+    _sp_error("Non-hexidecimal character where only hexidecimal was expected: %.18s.\n", (const char *)result);
+    _sp_failure = SEPLOS_FAILURE_NOT_HEX;
+    errno = EBADMSG;
     return -1;
   }
 
   if ( _sp_length_checksum(r.length & 0x0fff) != (r.length & 0xf000) ) {
     _sp_error("Length code incorrect.");
+    _sp_failure = SEPLOS_FAILURE_LENGTH_CHECKSUM;
+    errno = EBADMSG;
     return -1; 
   }
  
-  r.length &= 0x0fff;
-  
-  if ( r.length > 0 ) {
-    ret = _sp_read_serial(fd, &(result->info[5]), r.length);
-    if ( ret != r.length ) {
-      _sp_error("Info read: %s\n", strerror(errno));
-      return -1;
-    }
-  }
-  
-  for ( unsigned int j = 0; j < r.length + 4; j++ ) {
-    uint8_t c = result->info[j];
-    if ( !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) ) {
-      _sp_error("Non-hexidecimal character where only hexidecimal was expected: %s.\n", (const char *)&result);
-      return -1;
-    }
+  *length = r.length & 0x0fff;
+  return 0;
+}
+
+/*
+ * Validate the info field and checksum of a complete response in one pass
+ * over the frame, converting the info field to binary into info as it goes,
+ * so that the fields are decoded from the bytes rather than from the hex
+ * again. info has room for length / 2 bytes, or is NULL if only the checks
+ * are wanted. Returns the response code from the function field.
+ */
+int
+_sp_decode_info(const Seplos_2_0 * result, unsigned int length, uint8_t * info)
+{
+  unsigned int	sum = 0;
+  uint8_t	checksum[2];
+  bool		invalid = false;
+
+  /* The checksum covers everything between the start and the checksum. */
+  if ( !_sp_hex_decode(result->version, 12, NULL, &sum) \
+   || !_sp_hex_decode(result->info, length, info, &sum) ) {
+    _sp_error("Non-hexidecimal character where only hexidecimal was expected.\n");
+    _sp_failure = SEPLOS_FAILURE_NOT_HEX;
+    errno = EBADMSG;
+    return -1;
   }
 
-  checksum = _sp_hex4b(&(result->info[r.length]), &invalid);
-  if ( invalid || checksum != _sp_overall_checksum(result->version, r.length + 12) ) {
+  unsigned int ignored = 0;
+  if ( !_sp_hex_decode(&(result->info[length]), 4, checksum, &ignored) \
+   || ((checksum[0] << 8) | checksum[1]) != (((~sum) & 0xffff) + 1) ) {
     _sp_error("Checksum mismatch.\n");
+    _sp_failure = SEPLOS_FAILURE_CHECKSUM;
+    errno = EBADMSG;
     return -1;
   }
 
-  if ( r.function != NORMAL ) {
-    _sp_error("Return code %x.\n", r.function);
+  const uint8_t function = _sp_hex2b(result->function, &invalid);
+  /* NO_HISTORY is how the end of the history is reported, so it isn't worth a message. */
+  if ( function != NORMAL && function != NO_HISTORY )
+    _sp_error("Return code %x.\n", function);
+  if ( function != NORMAL )
+    _sp_failure = SEPLOS_FAILURE_RESPONSE;
+  return function;
+}
+
+/* True if there is a '~' after the start of the frame, for _sp_resync() to move to. */
+bool
+_sp_resyncable(const char * frame, unsigned int have)
+{
+  return have > 1 && memchr(&frame[1], '~', have - 1) != NULL;
+}
+
+/*
+ * Move the frame up to the first '~' at or after from, dropping the bytes
+ * before it: line noise, or the rest of a frame that failed its checks. Since
+ * '~' is never part of the hexadecimal body of a frame, it starts the next
+ * one. If there is none, everything is dropped. Returns the bytes dropped.
+ */
+unsigned int
+_sp_resync(char * frame, unsigned int from, unsigned int * have)
+{
+  const char * const	start = from < *have ? memchr(&frame[from], '~', *have - from) : NULL;
+  const unsigned int	dropped = start ? start - frame : *have;
+
+  *have -= dropped;
+  if ( *have > 0 )
+    memmove(frame, start, *have);
+  return dropped;
+}
+
+/*
+ * Send a command and read the reply into result, which has room for size
+ * bytes. The request is encoded into the same buffer, because the bus is half
+ * duplex and the request is finished before the reply starts. Only as much
+ * of the buffer as the reply's length field says is touched. The reply's info
+ * field is converted into decoded, which has room for (size - 18) / 2 bytes,
+ * unless it is NULL.
+ */
+int
+_sp_bms_command(
+ seplos_device	       fd,
+ const unsigned int    address,
+ const unsigned int    command,
+ const void * restrict info,
+ const unsigned int    info_length,
+ Seplos_2_0 *	       result,
+ const unsigned int    size,
+ uint8_t *	       decoded)
+{
+  unsigned int      length;
+  bool              invalid = false;
+  /* A blocking call isn't handed the device's transport, so it asks once per command. */
+  const int         transport = seplos_transport(fd);
+
+  assert(size >= info_length + 18);
+
+  const unsigned int encoded_length = _sp_encode_command(address, command, info, info_length, result);
+
+  /* TELEMETRY_GET and TELECOMMAND_GET take the pack number as their info, HISTORY_GET takes it first. */
+  const unsigned int pack = info_length >= 2 ? _sp_hex2b(info, &invalid) : 0;
+  _sp_capture(SEPLOS_CAPTURE_REQUEST, address, command, pack, result, encoded_length);
+
+  _sp_discard_serial_input(fd, transport); /* Throw away any pending I/O */
+  _sp_failure = SEPLOS_FAILURE_NONE;
+  memset(&_sp_timing, 0, sizeof(_sp_timing));
+
+  uint64_t then = _sp_now(), now;
+
+  int ret = _sp_write_serial(fd, transport, result, encoded_length);
+  if ( ret != encoded_length ) {
+    _sp_error("Write: %s\n", strerror(errno)); /* FIX: Abstract away POSIX */
+    _sp_failure = SEPLOS_FAILURE_IO;
+    return -1;
+  }
+  now = _sp_now();
+  _sp_timing.write = now - then;
+  then = now;
+
+  _sp_wait_until_serial_data_is_transmitted(fd, transport);
+  now = _sp_now();
+  _sp_timing.drain = now - then;
+  then = now;
+
+  /*
+   * Becuase of the the wait for data to be transmitted, above, the BMC should have
+   * the command.
+   * There should always be at least 18 bytes in a properly-formed packet.
+   * Timeout of the read here is an unusual event, and likely means that the BMC got
+   * unplugged or went into hibernation.
+   * The first byte is read on its own, to time how long the BMS takes to start.
+   * Anything before the '~' that starts the reply is skipped, and a frame that
+   * fails its checks is given up for a later '~' in what was already read,
+   * up to a frame's worth of bytes.
+   */
+  Seplos_2_0 * const	frame = result;
+  char * const		bytes = (char *)result;
+  unsigned int		have = 0;
+  unsigned int		dropped = 0;
+  bool			header = false;
+  int			status;
+
+  for ( ;; ) {
+    const unsigned int want = header ? length + 18 : 18;
+
+    if ( have > 0 && frame->start != '~' ) {
+      if ( (dropped += _sp_resync(bytes, 0, &have)) > SEPLOS_MAX_FRAME ) {
+        _sp_error("No frame in %u bytes of reply.\n", dropped);
+        _sp_failure = SEPLOS_FAILURE_MALFORMED;
+        errno = EBADMSG;
+        return -1;
+      }
+      continue;
+    }
+
+    if ( have < want ) {
+      ret = _sp_read_serial(fd, &bytes[have], have == 0 && dropped == 0 ? 1 : want - have);
+      if ( ret < 0 ) {
+        _sp_error("%s: %s\n", header ? "Info read" : "Read", strerror(errno)); /* FIX: Abstract away POSIX */
+        _sp_failure = errno == ETIMEDOUT ? SEPLOS_FAILURE_TIMEOUT : SEPLOS_FAILURE_IO;
+        return -1;
+      }
+      if ( have == 0 && dropped == 0 )
+        _sp_timing.first_byte = _sp_now() - then;
+      have += ret;
+      continue;
+    }
+
+    _sp_quiet = _sp_resyncable(bytes, have);
+
+    if ( !header ) {
+      status = _sp_check_header(result, &length);
+      _sp_quiet = false;
+      if ( status < 0 ) {
+        _sp_capture(SEPLOS_CAPTURE_REPLY, address, command, pack, result, 18);
+        if ( (dropped += _sp_resync(bytes, 1, &have)) <= SEPLOS_MAX_FRAME && have > 0 )
+          continue;
+        return -1;
+      }
+
+      if ( length + 18 > size ) {
+        _sp_error("Reply of %u bytes doesn't fit in a %u byte buffer.\n", length + 18, size);
+        _sp_failure = SEPLOS_FAILURE_MALFORMED;
+        errno = EMSGSIZE;
+        return -1;
+      }
+      header = true;
+      continue;
+    }
+
+    _sp_timing.frame = _sp_now() - then;
+    _sp_capture(SEPLOS_CAPTURE_REPLY, address, command, pack, result, length + 18);
+
+    status = _sp_decode_info(result, length, decoded);
+    _sp_quiet = false;
+    if ( status >= 0 )
+      return status;
+    if ( (dropped += _sp_resync(bytes, 1, &have)) > SEPLOS_MAX_FRAME || have == 0 )
+      return -1;
+    header = false;
   }
-  return r.function;
 }
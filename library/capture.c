@@ -0,0 +1,259 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./internal.h"
+#include "./communication.h"
+
+/*
+ * The capture file is the 8-byte magic below, then one record per frame:
+ *
+ *   8 bytes	time in microseconds since the epoch
+ *   1 byte	SEPLOS_CAPTURE_REQUEST or SEPLOS_CAPTURE_REPLY
+ *   1 byte	controller address
+ *   1 byte	command
+ *   1 byte	pack number, 0 if the command has none
+ *   2 bytes	frame length
+ *   the frame, exactly as it went over the wire
+ *
+ * Numbers are little-endian. The command and pack are in the record because
+ * the reply doesn't carry them: its function field is the response code.
+ */
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'C', 'A', 'P', 1 };
+#define RECORD_HEADER	14
+
+static FILE *		capture = NULL;
+
+/* Appends go through a large stdio buffer, flushed by seplos_capture_flush(). */
+static char		capture_buffer[64 * 1024];
+
+int
+seplos_capture_open(const char * path)
+{
+  seplos_capture_close();
+
+  if ( (capture = fopen(path, "ab")) == NULL ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  setvbuf(capture, capture_buffer, _IOFBF, sizeof(capture_buffer));
+
+  /* A new file gets the magic, an existing one is appended to. */
+  if ( ftell(capture) == 0 && fwrite(magic, sizeof(magic), 1, capture) != 1 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    fclose(capture);
+    capture = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void
+seplos_capture_flush(void)
+{
+  if ( capture )
+    fflush(capture);
+}
+
+void
+seplos_capture_close(void)
+{
+  if ( capture ) {
+    fclose(capture);
+    capture = NULL;
+  }
+}
+
+void
+_sp_capture(
+ unsigned int	kind,
+ unsigned int	address,
+ unsigned int	command,
+ unsigned int	pack,
+ const void *	frame,
+ unsigned int	length)
+{
+  struct timespec	now;
+  uint8_t		header[RECORD_HEADER];
+
+  if ( capture == NULL )
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  const uint64_t time = ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+
+  for ( int i = 0; i < 8; i++ )
+    header[i] = time >> (i * 8);
+  header[8] = kind;
+  header[9] = address;
+  header[10] = command;
+  header[11] = pack;
+  header[12] = length;
+  header[13] = length >> 8;
+
+  /* A full disk shouldn't stop the polling, so write errors are ignored. */
+  fwrite(header, sizeof(header), 1, capture);
+  fwrite(frame, length, 1, capture);
+}
+
+/*
+ * Map a capture file for replay. Records are read in place, so replaying
+ * costs no more than the decoding.
+ */
+int
+seplos_capture_map(SeplosCapture * c, const char * path)
+{
+  struct stat	s;
+  const int	fd = open(path, O_RDONLY);
+
+  memset(c, 0, sizeof(*c));
+
+  if ( fd < 0 || fstat(fd, &s) < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    return -1;
+  }
+
+  if ( s.st_size < sizeof(magic) ) {
+    _sp_error("%s: not a capture file.\n", path);
+    close(fd);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  void * const base = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( base == MAP_FAILED ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  madvise(base, s.st_size, MADV_SEQUENTIAL);
+
+  if ( memcmp(base, magic, sizeof(magic)) != 0 ) {
+    _sp_error("%s: not a capture file.\n", path);
+    munmap(base, s.st_size);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  c->base = base;
+  c->size = s.st_size;
+  c->offset = sizeof(magic);
+  return 0;
+}
+
+void
+seplos_capture_unmap(SeplosCapture * c)
+{
+  if ( c->base )
+    munmap((void *)c->base, c->size);
+  memset(c, 0, sizeof(*c));
+}
+
+void
+seplos_capture_rewind(SeplosCapture * c)
+{
+  c->offset = sizeof(magic);
+}
+
+/*
+ * Returns 1 with the next record, 0 at the end of the file, or -1 if the
+ * file ends in the middle of a record, as it can if seplosd was killed.
+ * r->frame points into the mapping.
+ */
+int
+seplos_capture_next(SeplosCapture * c, SeplosCaptureRecord * r)
+{
+  const uint8_t * const	p = &(c->base[c->offset]);
+  uint64_t		time = 0;
+
+  if ( c->offset == c->size )
+    return 0;
+
+  if ( c->size - c->offset < RECORD_HEADER ) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  for ( int i = 7; i >= 0; i-- )
+    time = (time << 8) | p[i];
+  r->time = time;
+  r->kind = p[8];
+  r->address = p[9];
+  r->command = p[10];
+  r->pack = p[11];
+  r->length = p[12] | (p[13] << 8);
+  r->frame = (const char *)&(p[RECORD_HEADER]);
+
+  if ( c->size - c->offset - RECORD_HEADER < r->length ) {
+    errno = EBADMSG;
+    return -1;
+  }
+  c->offset += RECORD_HEADER + r->length;
+  return 1;
+}
+
+/*
+ * Validate and decode a captured TELEMETRY_GET or TELECOMMAND_GET reply the
+ * way a live one is, into m, which has room for size packs. As with the
+ * transaction decoders, decode the telemetry reply first and then the
+ * telecommand reply into the same array. Returns the number of packs decoded,
+ * or -1 if the reply is bad.
+ */
+int
+seplos_capture_decode(const SeplosCaptureRecord * r, SeplosData * m, unsigned int size)
+{
+  const Seplos_2_0 * const	frame = (const Seplos_2_0 *)r->frame;
+  uint8_t			info[SEPLOS_MAX_INFO];
+  unsigned int			length;
+
+  if ( r->kind != SEPLOS_CAPTURE_REPLY || r->length < 18 || size == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( _sp_check_header(frame, &length) < 0 )
+    return -1;
+
+  if ( length + 18 != r->length ) {
+    _sp_error("Captured reply is %u bytes, its length field says %u.\n", r->length, length + 18);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  if ( _sp_decode_info(frame, length, info) != NORMAL ) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  if ( r->pack == SEPLOS_ALL_PACKS ) {
+    int packs;
+
+    if ( r->command == TELEMETRY_GET ) {
+      packs = _sp_decode_telemetry_packs(frame, info, m, size);
+      for ( int i = 0; i < packs; i++ )
+        m[i].controller_address = r->address;
+    }
+    else if ( r->command == TELECOMMAND_GET )
+      packs = _sp_decode_telecommand_packs(frame, info, m, size);
+    else {
+      errno = EINVAL;
+      return -1;
+    }
+    return packs;
+  }
+
+  m->controller_address = r->address;
+  m->battery_pack_number = r->pack;
+  if ( r->command == TELEMETRY_GET )
+    return _sp_decode_telemetry(frame, info, m) < 0 ? -1 : 1;
+  else if ( r->command == TELECOMMAND_GET )
+    return _sp_decode_telecommand(frame, info, m) < 0 ? -1 : 1;
+
+  errno = EINVAL;
+  return -1;
+}
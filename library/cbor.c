@@ -0,0 +1,275 @@
+#include <string.h>
+#include "./internal.h"
+
+/*
+ * A CBOR writer into a caller's buffer. Like the JSON writer, it never
+ * allocates and keeps counting past the end of the buffer, so that the caller
+ * learns the length that would have been needed.
+ */
+typedef struct _Writer {
+  char *	buffer;
+  size_t	size;
+  size_t	length;
+} Writer;
+
+enum {
+  UNSIGNED = 0,
+  NEGATIVE = 1,
+  ARRAY = 4,
+  MAP = 5,
+  SIMPLE = 7
+};
+
+static void
+put(Writer * w, const uint8_t * bytes, size_t length)
+{
+  if ( w->length < w->size ) {
+    size_t room = w->size - w->length;
+    memcpy(&w->buffer[w->length], bytes, length < room ? length : room);
+  }
+  w->length += length;
+}
+
+/* The initial byte and argument of an item, in the shortest form. */
+static void
+head(Writer * w, unsigned int major, uint64_t value)
+{
+  uint8_t	bytes[9];
+  int		n;
+
+  if ( value < 24 ) {
+    bytes[0] = (major << 5) | value;
+    put(w, bytes, 1);
+    return;
+  }
+  else if ( value <= 0xff ) {
+    bytes[0] = (major << 5) | 24;
+    n = 1;
+  }
+  else if ( value <= 0xffff ) {
+    bytes[0] = (major << 5) | 25;
+    n = 2;
+  }
+  else if ( value <= 0xffffffff ) {
+    bytes[0] = (major << 5) | 26;
+    n = 4;
+  }
+  else {
+    bytes[0] = (major << 5) | 27;
+    n = 8;
+  }
+
+  for ( int i = 0; i < n; i++ )
+    bytes[n - i] = value >> (i * 8);
+
+  put(w, bytes, n + 1);
+}
+
+static void
+put_integer(Writer * w, int64_t value)
+{
+  if ( value < 0 )
+    head(w, NEGATIVE, -1 - value);
+  else
+    head(w, UNSIGNED, value);
+}
+
+/* value in units of 1/scale, rounded as the JSON writer does. */
+static bool
+scale_value(double value, double scale, int64_t * scaled)
+{
+  const double	v = value * scale;
+
+  /* This also catches NaN, which fails every comparison. */
+  if ( !(v < 1e15 && v > -1e15) )
+    return false;
+
+  *scaled = (int64_t)(v < 0 ? v - 0.5 : v + 0.5);
+  return true;
+}
+
+static void
+put_scaled(Writer * w, double value, double scale)
+{
+  int64_t	scaled;
+
+  if ( scale_value(value, scale, &scaled) )
+    put_integer(w, scaled);
+  else
+    head(w, SIMPLE, 22);	/* null */
+}
+
+static void
+member_scaled(Writer * w, unsigned int key, double value, double scale)
+{
+  head(w, UNSIGNED, key);
+  put_scaled(w, value, scale);
+}
+
+static void
+member_unsigned(Writer * w, unsigned int key, uint64_t value)
+{
+  head(w, UNSIGNED, key);
+  head(w, UNSIGNED, value);
+}
+
+static void
+member_bool(Writer * w, unsigned int key, bool value)
+{
+  head(w, UNSIGNED, key);
+  head(w, SIMPLE, value ? 21 : 20);
+}
+
+/*
+ * The first value, then each value's difference from the one before, which
+ * for cells that are close together takes one byte each instead of three.
+ */
+static void
+member_deltas(Writer * w, unsigned int key, const float * values, unsigned int n, double scale)
+{
+  int64_t	previous = 0;
+
+  head(w, UNSIGNED, key);
+  head(w, ARRAY, n);
+  for ( unsigned int i = 0; i < n; i++ ) {
+    int64_t scaled;
+
+    if ( scale_value(values[i], scale, &scaled) ) {
+      put_integer(w, scaled - previous);
+      previous = scaled;
+    }
+    else
+      head(w, SIMPLE, 22);	/* null, and the next is relative to the one before it */
+  }
+}
+
+static void
+member_bytes(Writer * w, unsigned int key, const uint8_t * values, unsigned int n)
+{
+  head(w, UNSIGNED, key);
+  head(w, ARRAY, n);
+  for ( unsigned int i = 0; i < n; i++ )
+    head(w, UNSIGNED, values[i]);
+}
+
+static unsigned int
+flags(const SeplosData * m)
+{
+  return (m->has_alarm ? SEPLOS_CBOR_FLAG_ALARM : 0)
+   | (m->other_or_undocumented_alarm_state ? SEPLOS_CBOR_FLAG_OTHER_ALARM : 0)
+   | (m->has_cell_alarm ? SEPLOS_CBOR_FLAG_CELL_ALARM : 0)
+   | (m->has_temperature_alarm ? SEPLOS_CBOR_FLAG_TEMPERATURE_ALARM : 0)
+   | (m->has_voltage_or_current_alarm ? SEPLOS_CBOR_FLAG_VOLTAGE_OR_CURRENT_ALARM : 0)
+   | (m->has_bit_alarm ? SEPLOS_CBOR_FLAG_BIT_ALARM : 0)
+   | (m->depleted ? SEPLOS_CBOR_FLAG_DEPLETED : 0)
+   | (m->overcharge ? SEPLOS_CBOR_FLAG_OVERCHARGE : 0);
+}
+
+/*
+ * Write the members in fields, as seplos_json_format() does, into the map
+ * described by SEPLOS_CBOR_SCHEMA in seplos.h. time is the wall-clock time of
+ * the sample in ms, or 0 to leave it out. Returns the length of the document,
+ * which is more than size if it didn't fit. Unlike the JSON, it isn't
+ * terminated, since it may contain zeros.
+ */
+size_t
+seplos_cbor_format(char * buffer, size_t size, const SeplosData const * m, uint32_t fields, uint64_t time)
+{
+  Writer	w = { buffer, size, 0 };
+  unsigned int	cells = m->number_of_cells;
+  const bool	all = (fields & SEPLOS_JSON_ALL) == SEPLOS_JSON_ALL;
+  unsigned int	members = 1 + (time != 0);
+
+  if ( cells > SEPLOS_N_CELLS )
+    cells = SEPLOS_N_CELLS;
+
+  fields &= SEPLOS_JSON_ALL;
+  for ( uint32_t f = fields; f; f &= f - 1 )
+    members++;
+  if ( all )
+    members += SEPLOS_CBOR_KEYS - SEPLOS_CBOR_PORT_VOLTAGE + 2;
+
+  head(&w, MAP, members);
+  member_unsigned(&w, SEPLOS_CBOR_VERSION, SEPLOS_CBOR_SCHEMA);
+  if ( time )
+    member_unsigned(&w, SEPLOS_CBOR_TIME, time);
+  if ( all ) {
+    member_unsigned(&w, SEPLOS_CBOR_ADDRESS, m->controller_address);
+    member_unsigned(&w, SEPLOS_CBOR_PACK, m->battery_pack_number);
+  }
+
+  if ( fields & SEPLOS_JSON_CURRENT )
+    member_scaled(&w, SEPLOS_CBOR_CURRENT, m->charge_discharge_current, 100);
+  if ( fields & SEPLOS_JSON_VOLTAGE )
+    member_scaled(&w, SEPLOS_CBOR_VOLTAGE, m->total_battery_voltage, 100);
+  if ( fields & SEPLOS_JSON_DELTA_VOLTAGE )
+    member_scaled(&w, SEPLOS_CBOR_DELTA_VOLTAGE, m->highest_cell_voltage - m->lowest_cell_voltage, 1000);
+  if ( fields & SEPLOS_JSON_POWER )
+    member_scaled(&w, SEPLOS_CBOR_POWER, m->charge_discharge_current * m->total_battery_voltage, 100);
+  if ( fields & SEPLOS_JSON_SOC )
+    member_scaled(&w, SEPLOS_CBOR_SOC, m->state_of_charge, 10);
+  if ( fields & SEPLOS_JSON_SOH )
+    member_scaled(&w, SEPLOS_CBOR_SOH, m->state_of_health, 10);
+  if ( fields & SEPLOS_JSON_CAPACITY )
+    member_scaled(&w, SEPLOS_CBOR_CAPACITY, m->battery_capacity, 100);
+  if ( fields & SEPLOS_JSON_CYCLES )
+    member_unsigned(&w, SEPLOS_CBOR_CYCLES, m->number_of_cycles);
+  if ( fields & SEPLOS_JSON_RESIDUAL_CAPACITY )
+    member_scaled(&w, SEPLOS_CBOR_RESIDUAL_CAPACITY, m->residual_capacity, 100);
+  if ( fields & SEPLOS_JSON_RATED_CAPACITY )
+    member_scaled(&w, SEPLOS_CBOR_RATED_CAPACITY, m->rated_capacity, 100);
+  if ( fields & SEPLOS_JSON_BALANCING )
+    member_unsigned(&w, SEPLOS_CBOR_BALANCING, m->equilibrium_state);
+  if ( fields & SEPLOS_JSON_HOT )
+    member_bool(&w, SEPLOS_CBOR_HOT, m->hot);
+  if ( fields & SEPLOS_JSON_COLD )
+    member_bool(&w, SEPLOS_CBOR_COLD, m->cold);
+  if ( fields & SEPLOS_JSON_SHUTDOWN )
+    member_bool(&w, SEPLOS_CBOR_SHUTDOWN, m->shutdown);
+  if ( fields & SEPLOS_JSON_STANDBY )
+    member_bool(&w, SEPLOS_CBOR_STANDBY, m->standby);
+  if ( fields & SEPLOS_JSON_CHARGE )
+    member_bool(&w, SEPLOS_CBOR_CHARGE, m->charge);
+  if ( fields & SEPLOS_JSON_DISCHARGE )
+    member_bool(&w, SEPLOS_CBOR_DISCHARGE, m->discharge);
+  if ( fields & SEPLOS_JSON_CHARGE_SWITCH )
+    member_bool(&w, SEPLOS_CBOR_CHARGE_SWITCH, m->charge_switch);
+  if ( fields & SEPLOS_JSON_DISCHARGE_SWITCH )
+    member_bool(&w, SEPLOS_CBOR_DISCHARGE_SWITCH, m->discharge_switch);
+  if ( fields & SEPLOS_JSON_MAX_TEMPERATURE )
+    member_scaled(&w, SEPLOS_CBOR_MAX_TEMPERATURE, m->highest_temperature, 10);
+  if ( fields & SEPLOS_JSON_MIN_TEMPERATURE )
+    member_scaled(&w, SEPLOS_CBOR_MIN_TEMPERATURE, m->lowest_temperature, 10);
+  if ( fields & SEPLOS_JSON_ENVIRONMENT_TEMPERATURE )
+    member_scaled(&w, SEPLOS_CBOR_ENVIRONMENT_TEMPERATURE, m->temperature[4], 10);
+  if ( fields & SEPLOS_JSON_BMS_TEMPERATURE )
+    member_scaled(&w, SEPLOS_CBOR_BMS_TEMPERATURE, m->temperature[5], 10);
+  if ( fields & SEPLOS_JSON_CELLS )
+    member_deltas(&w, SEPLOS_CBOR_CELLS, m->cell_voltage, cells, 1000);
+  if ( fields & SEPLOS_JSON_TEMPERATURES )
+    member_deltas(&w, SEPLOS_CBOR_TEMPERATURES, m->temperature, SEPLOS_N_TEMPERATURES, 10);
+
+  if ( all ) {
+    member_scaled(&w, SEPLOS_CBOR_PORT_VOLTAGE, m->port_voltage, 100);
+    member_bool(&w, SEPLOS_CBOR_FLOATING_CHARGE, m->floating_charge);
+    member_bool(&w, SEPLOS_CBOR_CURRENT_LIMIT_SWITCH, m->current_limit_switch);
+    member_bool(&w, SEPLOS_CBOR_HEATING_SWITCH, m->heating_switch);
+    member_unsigned(&w, SEPLOS_CBOR_DISCONNECTION, m->disconnection_state);
+    member_scaled(&w, SEPLOS_CBOR_LOWEST_CELL, m->lowest_cell_voltage, 1000);
+    member_scaled(&w, SEPLOS_CBOR_HIGHEST_CELL, m->highest_cell_voltage, 1000);
+    member_unsigned(&w, SEPLOS_CBOR_NUMBER_OF_CELLS, m->number_of_cells);
+    member_bytes(&w, SEPLOS_CBOR_CELL_ALARMS, m->cell_alarm, cells);
+    member_bytes(&w, SEPLOS_CBOR_TEMPERATURE_ALARMS, m->temperature_alarm, SEPLOS_N_TEMPERATURES);
+    member_unsigned(&w, SEPLOS_CBOR_CURRENT_ALARM, m->charge_discharge_current_alarm);
+    member_unsigned(&w, SEPLOS_CBOR_VOLTAGE_ALARM, m->total_battery_voltage_alarm);
+
+    head(&w, UNSIGNED, SEPLOS_CBOR_BIT_ALARMS);
+    head(&w, ARRAY, sizeof(m->bit_alarm) / sizeof(*m->bit_alarm));
+    for ( unsigned int i = 0; i < sizeof(m->bit_alarm) / sizeof(*m->bit_alarm); i++ )
+      head(&w, UNSIGNED, m->bit_alarm[i]);
+
+    member_unsigned(&w, SEPLOS_CBOR_FLAGS, flags(m));
+  }
+
+  return w.length;
+}
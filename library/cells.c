@@ -0,0 +1,184 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "./internal.h"
+
+/*
+ * Long-run statistics of every cell of a pack, to find the weak ones without
+ * keeping the samples: how each cell's voltage varies, how far it sits from
+ * the mean of the pack's cells, how often the BMS balances it, and its
+ * internal resistance. Each sample updates them in constant time with
+ * Welford's running mean and variance, so a SeplosCells is the same size
+ * after a day as after a year.
+ *
+ * The resistance of a cell is estimated from each pair of consecutive samples
+ * between which the current stepped by at least STEP amps, as the change of
+ * the cell's voltage over the change of the current. A step that small is a few
+ * millivolts on a typical cell, near the resolution of the BMS, but the
+ * noise averages out over many steps. Pairs more than GAP ms apart are not
+ * used, since the cell's state of charge has moved on in the meantime.
+ *
+ * The state is saved to a file in host byte order, like the ring, since it's
+ * only read on the machine that writes it.
+ */
+#define STEP	5.0
+#define GAP	60000
+
+typedef struct _CellsHeader {
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	size;		/* sizeof(SeplosCells) of the writer */
+} CellsHeader;
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'C', 'E', 'L', 'L' };
+#define VERSION		1
+
+void
+seplos_running_add(SeplosRunning * r, double x)
+{
+  const double delta = x - r->mean;
+
+  r->count++;
+  r->mean += delta / r->count;
+  r->m2 += delta * (x - r->mean);
+}
+
+/* The sample standard deviation, 0 until there are two values. */
+double
+seplos_running_deviation(const SeplosRunning * r)
+{
+  return r->count > 1 ? sqrt(r->m2 / (r->count - 1)) : 0.0;
+}
+
+void
+seplos_cells_init(SeplosCells * c, unsigned int address, unsigned int pack)
+{
+  memset(c, 0, sizeof(*c));
+  c->address = address;
+  c->pack = pack;
+}
+
+/*
+ * Add a sample, taken at time ms since the epoch. A pack that now reports a
+ * different number of cells has been replaced or rewired, so its statistics
+ * start over. The first sample sets the address and pack.
+ */
+void
+seplos_cells_add(SeplosCells * c, const SeplosData * m, uint64_t time)
+{
+  const unsigned int	cells = m->number_of_cells < SEPLOS_N_CELLS ? m->number_of_cells : SEPLOS_N_CELLS;
+  const double		step = m->charge_discharge_current - c->last_current;
+  bool			resistance;
+  double		mean = 0;
+
+  if ( cells == 0 )
+    return;
+
+  if ( c->samples == 0 || c->number_of_cells != cells )
+    seplos_cells_init(c, m->controller_address, m->battery_pack_number);
+
+  resistance = c->samples > 0 && time > c->last_time && time - c->last_time <= GAP && fabs(step) >= STEP;
+
+  for ( unsigned int i = 0; i < cells; i++ )
+    mean += m->cell_voltage[i];
+  mean /= cells;
+
+  for ( unsigned int i = 0; i < cells; i++ ) {
+    SeplosCell * const	cell = &c->cell[i];
+    const float		v = m->cell_voltage[i];
+
+    seplos_running_add(&cell->voltage, v);
+    seplos_running_add(&cell->drift, v - mean);
+    if ( m->equilibrium_state & (1 << i) )
+      cell->balancing++;
+    if ( resistance )
+      seplos_running_add(&cell->resistance, (v - c->last_voltage[i]) / step);
+    c->last_voltage[i] = v;
+  }
+
+  c->number_of_cells = cells;
+  c->samples++;
+  c->last_current = m->charge_discharge_current;
+  c->last_time = time;
+}
+
+/*
+ * Read the statistics of the pack at address and pack saved in path. If the
+ * file is missing, or holds another pack or an older format, they start
+ * empty. Returns -1 only if the file is there but can't be read.
+ */
+int
+seplos_cells_load(SeplosCells * c, const char * path, unsigned int address, unsigned int pack)
+{
+  CellsHeader	h;
+  SeplosCells	saved;
+  int		fd;
+
+  seplos_cells_init(c, address, pack);
+
+  if ( (fd = open(path, O_RDONLY)) < 0 ) {
+    if ( errno == ENOENT )
+      return 0;
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if ( pread(fd, &h, sizeof(h), 0) == sizeof(h) \
+   && memcmp(h.magic, magic, sizeof(magic)) == 0 \
+   && h.version == VERSION && h.size == sizeof(SeplosCells) \
+   && pread(fd, &saved, sizeof(saved), sizeof(h)) == sizeof(saved) \
+   && saved.address == address && saved.pack == pack )
+    *c = saved;
+
+  close(fd);
+  return 0;
+}
+
+/*
+ * Save the statistics to path. They are written to path.new and renamed over
+ * path, so a crash part way through leaves the previous save in place.
+ */
+int
+seplos_cells_save(const SeplosCells * c, const char * path)
+{
+  CellsHeader	h = { .version = VERSION, .size = sizeof(SeplosCells) };
+  char		temporary[4096];
+  int		fd;
+  bool		written;
+
+  memcpy(h.magic, magic, sizeof(magic));
+
+  if ( snprintf(temporary, sizeof(temporary), "%s.new", path) >= sizeof(temporary) ) {
+    _sp_error("%s: file name too long.\n", path);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if ( (fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ) {
+    _sp_error("%s: %s\n", temporary, strerror(errno));
+    return -1;
+  }
+
+  written = write(fd, &h, sizeof(h)) == sizeof(h) && write(fd, c, sizeof(*c)) == sizeof(*c);
+  if ( close(fd) < 0 || !written ) {
+    const int error = errno;
+
+    _sp_error("%s: %s\n", temporary, strerror(error));
+    unlink(temporary);
+    errno = error;
+    return -1;
+  }
+
+  if ( rename(temporary, path) < 0 ) {
+    const int error = errno;
+
+    _sp_error("%s: %s\n", path, strerror(error));
+    unlink(temporary);
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
@@ -58,4 +58,22 @@ _sp_bms_command(
  const unsigned int    command,
  const void * restrict info,
  const unsigned int    info_length,
- Seplos_2_0 *	       result);
+ Seplos_2_0 *	       result,
+ const unsigned int    size,
+ uint8_t *	       decoded);
+
+extern unsigned int
+_sp_encode_command(
+ const unsigned int    address,
+ const unsigned int    command,
+ const void * restrict info,
+ const unsigned int    info_length,
+ Seplos_2_0 *	       encoded);
+
+extern int		_sp_check_header(const Seplos_2_0 * result, unsigned int * length);
+extern int		_sp_decode_info(const Seplos_2_0 * result, unsigned int length, uint8_t * info);
+extern int		_sp_decode_telemetry(const Seplos_2_0 * telemetry, const uint8_t * info, SeplosData * m);
+extern int		_sp_decode_telecommand(const Seplos_2_0 * telecommand, const uint8_t * info, SeplosData * m);
+extern int		_sp_decode_telemetry_packs(const Seplos_2_0 * telemetry, const uint8_t * info, SeplosData * m, unsigned int size);
+extern int		_sp_decode_telecommand_packs(const Seplos_2_0 * telecommand, const uint8_t * info, SeplosData * m, unsigned int size);
+extern int		_sp_decode_history(const Seplos_2_0 * history, const uint8_t * info, unsigned int * index, unsigned int * records, uint8_t * when, SeplosData * m);
@@ -1,54 +1,78 @@
+#include <errno.h>
+#include <string.h>
 #include "./internal.h"
 #include "./communication.h"
 
-int
-seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m)
+/*
+ * Replies are decoded field by field with a cursor, using the counts that the
+ * BMS sends ahead of each variable part: the number of cells, the number of
+ * temperatures and the number of custom fields. That way a pack with fewer
+ * than 16 cells decodes correctly, and so does the reply to a query of all
+ * packs, which is one record like this for every pack on the bus.
+ *
+ * The hex of the info field was converted to bytes, once, by _sp_decode_info()
+ * as it checked the frame, so the cursor reads those bytes. Only the length
+ * is taken from the frame.
+ */
+typedef struct _Cursor {
+  const uint8_t *	data;
+  unsigned int		length;	/* Bytes */
+  unsigned int		offset;
+  bool			invalid;
+} Cursor;
+
+static void
+cursor_init(Cursor * c, const Seplos_2_0 * frame, const uint8_t * info)
 {
-  Seplos_2_0	telemetry = {};
-  Seplos_2_0	telecommand = {};
-  uint8_t	pack_info[2];
-  bool		invalid;
+  bool invalid = false;
 
-  _sp_hex2(pack, pack_info);
+  c->data = info;
+  c->length = (_sp_hex4b(frame->length, &invalid) & 0x0fff) / 2;
+  c->offset = 0;
+  c->invalid = invalid;
+}
 
-  int status = _sp_bms_command(
-   fd,
-   address,		/* Address */
-   TELEMETRY_GET,	/* command */
-   &pack_info,		/* pack number */
-   sizeof(pack_info),	/* length of the above */
-   &telemetry);
+static bool
+cursor_has(const Cursor * c, unsigned int bytes)
+{
+  return c->offset + bytes <= c->length;
+}
 
-  if ( status != NORMAL ) {
-    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
-    return -1;
+static uint8_t
+next8(Cursor * c)
+{
+  if ( !cursor_has(c, 1) ) {
+    c->invalid = true;
+    return 0;
   }
+  return c->data[c->offset++];
+}
 
-  status = _sp_bms_command(
-   fd,
-   address,		/* Address */
-   TELECOMMAND_GET,	/* command */
-   &pack_info,		/* pack number */
-   sizeof(pack_info),	/* length of the above */
-   &telecommand);
-
-  if ( status != 0 ) {
-    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
-    return -1;
+static uint16_t
+next16(Cursor * c)
+{
+  if ( !cursor_has(c, 2) ) {
+    c->invalid = true;
+    return 0;
   }
+  const uint16_t value = (c->data[c->offset] << 8) | c->data[c->offset + 1];
+  c->offset += 2;
+  return value;
+}
 
-  const Seplos_2_0_Telemetry const * t = &(telemetry.telemetry);
-  const Seplos_2_0_Telecommand const * c = &(telecommand.telecommand);
-
-  m->controller_address = address;
-  m->battery_pack_number = pack;
+static void
+decode_telemetry_record(Cursor * c, SeplosData * m)
+{
+  m->battery_pack_number = next8(c);
 
-  m->number_of_cells = _sp_hex2b(t->number_of_cells, &invalid);
+  m->number_of_cells = next8(c);
 
   m->lowest_cell_voltage = 1000.0;
   m->highest_cell_voltage = -1000.0;
-  for ( int i = 0; i < 16; i++ ) {
-    const float value = _sp_hex4b(t->cell_voltage[i], &invalid) / 1000.0;
+  for ( unsigned int i = 0; i < m->number_of_cells; i++ ) {
+    const float value = next16(c) / 1000.0;
+    if ( i >= SEPLOS_N_CELLS )
+      continue;
     m->cell_voltage[i] = value;
     if ( value > m->highest_cell_voltage )
       m->highest_cell_voltage = value;
@@ -56,10 +80,14 @@ seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosDat
       m->lowest_cell_voltage = value;
   }
 
+  const unsigned int number_of_temperatures = next8(c);
+
   m->lowest_temperature = 1000.0;
   m->highest_temperature = -1000.0;
-  for ( int i = 0; i < 6; i++ ) {
-    const float value = (_sp_hex4b(t->temperature[i], &invalid) - 2731) / 10.0;
+  for ( unsigned int i = 0; i < number_of_temperatures; i++ ) {
+    const float value = (next16(c) - 2731) / 10.0;
+    if ( i >= SEPLOS_N_TEMPERATURES )
+      continue;
     m->temperature[i] = value;
     if ( value > m->highest_temperature )
       m->highest_temperature = value;
@@ -67,55 +95,44 @@ seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosDat
       m->lowest_temperature = value;
   }
 
-  int16_t current = (int16_t)_sp_hex4b(t->charge_discharge_current, &invalid);
+  int16_t current = (int16_t)next16(c);
   m->charge_discharge_current = current *.01f;
 
-  m->total_battery_voltage = _sp_hex4b(t->total_battery_voltage, &invalid) / 100.0;
-  m->residual_capacity = _sp_hex4b(t->residual_capacity, &invalid) / 100.0;
-  m->battery_capacity = _sp_hex4b(t->battery_capacity, &invalid) / 100.0;
-  m->state_of_charge = _sp_hex4b(t->state_of_charge, &invalid) / 10.0;
-  m->rated_capacity = _sp_hex4b(t->rated_capacity, &invalid) / 100.0;
-  m->number_of_cycles = _sp_hex4b(t->number_of_cycles, &invalid);
-  m->state_of_health = _sp_hex4b(t->state_of_health, &invalid) / 10.0;
-  m->port_voltage = _sp_hex4b(t->port_voltage, &invalid) / 100.0;
-
-  for (int i = 0; i < SEPLOS_N_CELLS; i++ ) {
-    m->cell_alarm[i] = _sp_hex2b(c->cell_alarm[i], &invalid);
-  }
-  for (int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
-    m->temperature_alarm[i] = _sp_hex2b(c->temperature_alarm[i], &invalid);
-  }
-  m->charge_discharge_current_alarm = _sp_hex2b(c->charge_discharge_current_alarm, &invalid);
-  m->total_battery_voltage_alarm = _sp_hex2b(c->total_battery_voltage_alarm, &invalid);
-
-  m->bit_alarm[0] = _sp_hex2b(c->alarm_1_through_6[0], &invalid) \
-   | (_sp_hex2b(c->alarm_1_through_6[1], &invalid) << 8) \
-   | (_sp_hex2b(c->alarm_1_through_6[2], &invalid) << 16) \
-   | (_sp_hex2b(c->alarm_1_through_6[3], &invalid) << 24);
-
-  m->bit_alarm[1] = _sp_hex2b(c->alarm_1_through_6[4], &invalid) \
-   | (_sp_hex2b(c->alarm_1_through_6[5], &invalid) << 8) \
-   | (_sp_hex2b(c->alarm_7_and_8[0], &invalid) << 16) \
-   | (_sp_hex2b(c->alarm_7_and_8[1], &invalid) << 24);
+  m->total_battery_voltage = next16(c) / 100.0;
+  m->residual_capacity = next16(c) / 100.0;
 
-  m->equilibrium_state = _sp_hex2b(c->equilibrium_state[0], &invalid) \
-   | (_sp_hex2b(c->equilibrium_state[1], &invalid) << 8);
+  /* The custom fields are in this order. Any past port voltage are reserved. */
+  const unsigned int number_of_custom_fields = next8(c);
+  uint16_t custom[6] = {};
 
-  m->disconnection_state = _sp_hex2b(c->disconnection_state[0], &invalid) \
-   | (_sp_hex2b(c->disconnection_state[1], &invalid) << 8);
+  for ( unsigned int i = 0; i < number_of_custom_fields; i++ ) {
+    const uint16_t value = next16(c);
+    if ( i < (sizeof(custom) / sizeof(*custom)) )
+      custom[i] = value;
+  }
 
-  uint8_t state = _sp_hex2b(c->on_off_state, &invalid);
-  m->discharge_switch = !!(state & 0x01);
-  m->charge_switch = !!(state & 0x02);
-  m->current_limit_switch = !!(state & 0x04);
-  m->heating_switch = !!(state & 0x08);
+  m->battery_capacity = custom[0] / 100.0;
+  m->state_of_charge = custom[1] / 10.0;
+  m->rated_capacity = custom[2] / 100.0;
+  m->number_of_cycles = custom[3];
+  m->state_of_health = custom[4] / 10.0;
+  m->port_voltage = custom[5] / 100.0;
+}
 
-  state = _sp_hex2b(c->system_state, &invalid);
-  m->discharge = (state & 0x01);
-  m->charge = (state & 0x02);
-  m->floating_charge = (state & 0x04);
-  m->standby = (state & 0x10);
-  m->shutdown = (state & 0x20);
+static void
+summarize_alarms(SeplosData * m)
+{
+  /* The summary flags are only ever set below, so start them from a clean slate. */
+  m->has_alarm = false;
+  m->other_or_undocumented_alarm_state = false;
+  m->has_cell_alarm = false;
+  m->has_temperature_alarm = false;
+  m->has_voltage_or_current_alarm = false;
+  m->has_bit_alarm = false;
+  m->depleted = false;
+  m->overcharge = false;
+  m->cold = false;
+  m->hot = false;
 
   if ( m->total_battery_voltage_alarm != NORMAL ) {
     m->has_alarm = m->has_voltage_or_current_alarm = true;
@@ -189,3 +206,305 @@ seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosDat
     }
   }
 }
+
+static void
+decode_telecommand_record(Cursor * c, SeplosData * m)
+{
+  m->battery_pack_number = next8(c);
+
+  const unsigned int number_of_cells = next8(c);
+  for ( unsigned int i = 0; i < number_of_cells; i++ ) {
+    const uint8_t value = next8(c);
+    if ( i < SEPLOS_N_CELLS )
+      m->cell_alarm[i] = value;
+  }
+
+  const unsigned int number_of_temperatures = next8(c);
+  for ( unsigned int i = 0; i < number_of_temperatures; i++ ) {
+    const uint8_t value = next8(c);
+    if ( i < SEPLOS_N_TEMPERATURES )
+      m->temperature_alarm[i] = value;
+  }
+
+  m->charge_discharge_current_alarm = next8(c);
+  m->total_battery_voltage_alarm = next8(c);
+
+  /*
+   * The custom alarms are, in order: alarm events 1 through 6, the on/off
+   * state, two bytes of equilibrium state, the system state, two bytes of
+   * disconnection state, alarm events 7 and 8, and reserved bytes.
+   */
+  const unsigned int number_of_custom_alarms = next8(c);
+  uint8_t custom[14] = {};
+
+  for ( unsigned int i = 0; i < number_of_custom_alarms; i++ ) {
+    const uint8_t value = next8(c);
+    if ( i < sizeof(custom) )
+      custom[i] = value;
+  }
+
+  m->bit_alarm[0] = custom[0] | (custom[1] << 8) | (custom[2] << 16) | (custom[3] << 24);
+  m->bit_alarm[1] = custom[4] | (custom[5] << 8) | (custom[12] << 16) | (custom[13] << 24);
+
+  m->equilibrium_state = custom[7] | (custom[8] << 8);
+  m->disconnection_state = custom[10] | (custom[11] << 8);
+
+  uint8_t state = custom[6];
+  m->discharge_switch = !!(state & 0x01);
+  m->charge_switch = !!(state & 0x02);
+  m->current_limit_switch = !!(state & 0x04);
+  m->heating_switch = !!(state & 0x08);
+
+  state = custom[9];
+  m->discharge = (state & 0x01);
+  m->charge = (state & 0x02);
+  m->floating_charge = (state & 0x04);
+  m->standby = (state & 0x10);
+  m->shutdown = (state & 0x20);
+
+  summarize_alarms(m);
+}
+
+/*
+ * Decode up to size pack records from a TELEMETRY_GET reply. Returns the
+ * number of packs decoded, or -1 if the reply is malformed.
+ */
+int
+_sp_decode_telemetry_packs(const Seplos_2_0 * telemetry, const uint8_t * info, SeplosData * m, unsigned int size)
+{
+  Cursor	c;
+  unsigned int	n = 0;
+
+  cursor_init(&c, telemetry, info);
+  (void)next8(&c); /* Data flag */
+
+  while ( n < size && cursor_has(&c, 1) && !c.invalid ) {
+    decode_telemetry_record(&c, &m[n]);
+    if ( !c.invalid )
+      n++;
+  }
+
+  if ( c.invalid ) {
+    _sp_error("Telemetry reply is malformed.\n");
+    _sp_failure = SEPLOS_FAILURE_MALFORMED;
+    errno = EBADMSG;
+    return -1;
+  }
+  return n;
+}
+
+/*
+ * Decode up to size pack records from a TELECOMMAND_GET reply into the same
+ * packs, in the same order, as the telemetry reply. Returns the number of
+ * packs decoded, or -1 if the reply is malformed.
+ */
+int
+_sp_decode_telecommand_packs(const Seplos_2_0 * telecommand, const uint8_t * info, SeplosData * m, unsigned int size)
+{
+  Cursor	c;
+  unsigned int	n = 0;
+
+  cursor_init(&c, telecommand, info);
+  (void)next8(&c); /* Data flag */
+
+  while ( n < size && cursor_has(&c, 1) && !c.invalid ) {
+    decode_telecommand_record(&c, &m[n]);
+    if ( !c.invalid )
+      n++;
+  }
+
+  if ( c.invalid ) {
+    _sp_error("Telecommand reply is malformed.\n");
+    _sp_failure = SEPLOS_FAILURE_MALFORMED;
+    errno = EBADMSG;
+    return -1;
+  }
+  return n;
+}
+
+int
+_sp_decode_telemetry(const Seplos_2_0 * telemetry, const uint8_t * info, SeplosData * m)
+{
+  const unsigned int pack = m->battery_pack_number;
+
+  if ( _sp_decode_telemetry_packs(telemetry, info, m, 1) != 1 ) {
+    _sp_failure = SEPLOS_FAILURE_MALFORMED;
+    errno = EBADMSG;
+    return -1;
+  }
+  /* Keep the pack number that was asked for. */
+  m->battery_pack_number = pack;
+  return 0;
+}
+
+int
+_sp_decode_telecommand(const Seplos_2_0 * telecommand, const uint8_t * info, SeplosData * m)
+{
+  const unsigned int pack = m->battery_pack_number;
+
+  if ( _sp_decode_telecommand_packs(telecommand, info, m, 1) != 1 ) {
+    _sp_failure = SEPLOS_FAILURE_MALFORMED;
+    errno = EBADMSG;
+    return -1;
+  }
+  /* Keep the pack number that was asked for. */
+  m->battery_pack_number = pack;
+  return 0;
+}
+
+/*
+ * Decode a HISTORY_GET reply: the data flag, the number of the record and of
+ * the records the pack keeps, the time the BMS took it as year - 2000, month,
+ * day, hour, minute and second, then a telemetry record. when must have room
+ * for 6 bytes.
+ */
+int
+_sp_decode_history(const Seplos_2_0 * history, const uint8_t * info, unsigned int * index, unsigned int * records, uint8_t * when, SeplosData * m)
+{
+  const unsigned int	pack = m->battery_pack_number;
+  Cursor		c;
+
+  cursor_init(&c, history, info);
+  (void)next8(&c); /* Data flag */
+  *index = next16(&c);
+  *records = next16(&c);
+  for ( int i = 0; i < 6; i++ )
+    when[i] = next8(&c);
+  decode_telemetry_record(&c, m);
+
+  if ( c.invalid ) {
+    _sp_error("History reply is malformed.\n");
+    _sp_failure = SEPLOS_FAILURE_MALFORMED;
+    errno = EBADMSG;
+    return -1;
+  }
+  m->battery_pack_number = pack;
+  return 0;
+}
+
+static int
+command(seplos_device fd, unsigned int address, unsigned int command, unsigned int pack, void * buffer, unsigned int size, uint8_t * info)
+{
+  uint8_t	pack_info[2];
+
+  if ( size < SEPLOS_PACK_FRAME ) {
+    _sp_error("A frame buffer needs at least %d bytes.\n", SEPLOS_PACK_FRAME);
+    errno = EINVAL;
+    return -1;
+  }
+
+  _sp_hex2(pack, pack_info);
+
+  const int status = _sp_bms_command(
+   fd,
+   address,		/* Address */
+   command,		/* command */
+   &pack_info,		/* pack number */
+   sizeof(pack_info),	/* length of the above */
+   (Seplos_2_0 *)buffer,
+   size,
+   info);
+
+  if ( status != NORMAL ) {
+    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
+    if ( status > 0 )
+      errno = EBADMSG;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Like seplos_data(), but the replies are read into the caller's buffer, of
+ * at least SEPLOS_PACK_FRAME bytes, which can be reused from one call to the
+ * next. Each reply is decoded before the next command overwrites it.
+ */
+int
+seplos_data_buffer(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m, void * buffer, unsigned int buffer_size)
+{
+  const Seplos_2_0 * const	frame = (const Seplos_2_0 *)buffer;
+  uint8_t			info[SEPLOS_MAX_INFO];
+  uint64_t			decode;
+  int				ret;
+
+  m->controller_address = address;
+  m->battery_pack_number = pack;
+
+  if ( command(fd, address, TELEMETRY_GET, pack, buffer, buffer_size, info) < 0 )
+    return -1;
+
+  decode = _sp_now();
+  ret = _sp_decode_telemetry(frame, info, m);
+  decode = _sp_now() - decode;
+  if ( ret < 0 || command(fd, address, TELECOMMAND_GET, pack, buffer, buffer_size, info) < 0 )
+    return -1;
+
+  _sp_timing.decode = _sp_now();
+  ret = _sp_decode_telecommand(frame, info, m);
+  _sp_timing.decode = _sp_now() - _sp_timing.decode + decode;
+
+  return ret < 0 ? -1 : 0;
+}
+
+int
+seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m)
+{
+  char	buffer[SEPLOS_PACK_FRAME];
+
+  return seplos_data_buffer(fd, address, pack, m, buffer, sizeof(buffer));
+}
+
+/*
+ * Like seplos_data_all(), with the caller's buffer. The reply grows with the
+ * number of packs, so it needs up to SEPLOS_MAX_FRAME bytes.
+ */
+int
+seplos_data_all_buffer(seplos_device fd, unsigned int address, SeplosData * m, unsigned int size, void * buffer, unsigned int buffer_size)
+{
+  const Seplos_2_0 * const	frame = (const Seplos_2_0 *)buffer;
+  uint8_t			info[SEPLOS_MAX_INFO];
+
+  if ( command(fd, address, TELEMETRY_GET, SEPLOS_ALL_PACKS, buffer, buffer_size, info) < 0 )
+    return -1;
+
+  memset(m, 0, size * sizeof(*m));
+
+  uint64_t decode = _sp_now();
+  const int packs = _sp_decode_telemetry_packs(frame, info, m, size);
+  decode = _sp_now() - decode;
+  if ( packs < 0 )
+    return -1;
+
+  if ( command(fd, address, TELECOMMAND_GET, SEPLOS_ALL_PACKS, buffer, buffer_size, info) < 0 )
+    return -1;
+
+  _sp_timing.decode = _sp_now();
+  const int alarms = _sp_decode_telecommand_packs(frame, info, m, packs);
+  _sp_timing.decode = _sp_now() - _sp_timing.decode + decode;
+  if ( alarms < 0 )
+    return -1;
+  if ( alarms != packs ) {
+    _sp_error("Telemetry has %d packs but telecommand has %d.\n", packs, alarms);
+    _sp_failure = SEPLOS_FAILURE_MALFORMED;
+    errno = EBADMSG;
+    return -1;
+  }
+
+  for ( int i = 0; i < packs; i++ )
+    m[i].controller_address = address;
+
+  return packs;
+}
+
+/*
+ * Read every pack behind the controller at address with a single
+ * TELEMETRY_GET and a single TELECOMMAND_GET for pack SEPLOS_ALL_PACKS.
+ * Returns the number of packs stored in m, which has room for size of them.
+ */
+int
+seplos_data_all(seplos_device fd, unsigned int address, SeplosData * m, unsigned int size)
+{
+  char	buffer[SEPLOS_MAX_FRAME];
+
+  return seplos_data_all_buffer(fd, address, m, size, buffer, sizeof(buffer));
+}
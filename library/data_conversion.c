@@ -2,6 +2,17 @@
 
 static const char hex[] = "0123456789ABCDEF";
 
+/*
+ * The value of each ASCII hex digit with 0x10 added, so that everything
+ * that isn't a hex digit is 0. Decoding a nibble is a single lookup.
+ */
+static const uint8_t hex_value[256] = {
+  ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+  ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+  ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+  ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f
+};
+
 float
 _sp_farenheit(float c)
 {
@@ -33,16 +44,11 @@ _sp_hex4(uint16_t value, char ascii[4])
 uint8_t
 _sp_hex1b(uint8_t c, bool * invalid)
 {
-  if ( c >= '0' && c <= '9' )
-    return c - '0';
-  else if ( c >= 'a' && c <= 'f' )
-    return c - 'a' + 10;
-  else if ( c >= 'A' && c <= 'F' )
-    return c - 'A' + 10;
-  else {
+  const uint8_t value = hex_value[c];
+
+  if ( !value )
     *invalid = true;
-    return 0;
-  }
+  return value & 0xf;
 }
 
 uint8_t
@@ -58,6 +64,37 @@ _sp_hex4b(const char ascii[4], bool * invalid)
    (_sp_hex1b(ascii[2], invalid) << 4) | _sp_hex1b(ascii[3], invalid);
 }
 
+/*
+ * Convert length ASCII hex digits to length / 2 bytes in one pass, adding the
+ * digits to *sum for the frame checksum as it goes. binary may be NULL to only
+ * validate and sum. Returns false if any character isn't a hex digit.
+ */
+bool
+_sp_hex_decode(const char * restrict ascii, unsigned int length, uint8_t * restrict binary, unsigned int * sum)
+{
+  const uint8_t *	a = (const uint8_t *)ascii;
+  unsigned int		s = *sum;
+  uint8_t		valid = 0x10;
+
+  for ( unsigned int i = 0; i + 1 < length; i += 2 ) {
+    const uint8_t high = hex_value[a[i]];
+    const uint8_t low = hex_value[a[i + 1]];
+
+    valid &= high & low;
+    s += a[i] + a[i + 1];
+    if ( binary )
+      *binary++ = (high << 4) | (low & 0xf);
+  }
+
+  if ( length & 1 ) {
+    valid &= hex_value[a[length - 1]];
+    s += a[length - 1];
+  }
+
+  *sum = s;
+  return valid != 0;
+}
+
 unsigned int
 _sp_length_checksum(unsigned int length)
 {
@@ -1,11 +1,31 @@
 #include "./internal.h"
 #include <stdarg.h>
 
+int		_sp_failure = SEPLOS_FAILURE_NONE;
+SeplosTiming	_sp_timing = {};
+bool		_sp_quiet = false;
+
+int
+seplos_last_failure(void)
+{
+  return _sp_failure;
+}
+
+const SeplosTiming *
+seplos_last_timing(void)
+{
+  return &_sp_timing;
+}
+
 void
 _sp_error(const char * restrict pattern, ...)
 {
   va_list args;
 
+  /* Set around checks whose failure will be recovered from, so as not to report it. */
+  if ( _sp_quiet )
+    return;
+
   va_start(args, pattern);
   fflush(stdout);
   vfprintf(stderr, pattern, args);
@@ -0,0 +1,232 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./internal.h"
+#include "./communication.h"
+
+/*
+ * Bulk download of the history that a pack keeps, with HISTORY_GET. The
+ * request is the pack number and the number of the record wanted, and the
+ * reply is that record, which _sp_decode_history() describes, or NO_HISTORY
+ * past the last one. The bus is half duplex, so only one request can be out;
+ * the next is sent as soon as a reply has been taken, without waiting for
+ * anything else.
+ *
+ * The checkpoint file holds where the download is, in host byte order like
+ * the ring, since it's only read on the machine that writes it. It is written
+ * in place after every record, which only dirties the page cache.
+ */
+typedef struct _Checkpoint {
+  char		magic[8];
+  uint32_t	address;
+  uint32_t	pack;
+  uint32_t	next;
+  uint32_t	records;
+  uint64_t	last;
+} Checkpoint;
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'H', 'I', 'S', 'T' };
+
+static void
+checkpoint(const SeplosHistory * h)
+{
+  Checkpoint	c = {};
+
+  if ( h->checkpoint < 0 )
+    return;
+
+  memcpy(c.magic, magic, sizeof(magic));
+  c.address = h->address;
+  c.pack = h->pack;
+  c.next = h->next;
+  c.records = h->records;
+  c.last = h->last;
+  if ( pwrite(h->checkpoint, &c, sizeof(c), 0) != sizeof(c) )
+    _sp_error("History checkpoint: %s\n", strerror(errno));
+}
+
+/*
+ * Open a download of a pack's history. If path names a checkpoint file holding
+ * the position of an earlier download of the same pack, this one goes on
+ * from there. Otherwise it starts at the first record. path may be NULL.
+ */
+int
+seplos_history_open(
+ SeplosHistory *	h,
+ const char *		path,
+ unsigned int		address,
+ unsigned int		pack,
+ seplos_history_cb	callback,
+ void *			data)
+{
+  Checkpoint	c;
+
+  memset(h, 0, sizeof(*h));
+  h->address = address;
+  h->pack = pack;
+  h->callback = callback;
+  h->data = data;
+  h->checkpoint = -1;
+
+  if ( path == NULL || *path == '\0' )
+    return 0;
+
+  if ( (h->checkpoint = open(path, O_RDWR | O_CREAT, 0644)) < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if ( pread(h->checkpoint, &c, sizeof(c), 0) == sizeof(c) \
+   && memcmp(c.magic, magic, sizeof(magic)) == 0 \
+   && c.address == address && c.pack == pack ) {
+    /* Ask for the last record again, to find out whether the pack still has it. */
+    h->next = c.next > 0 ? c.next - 1 : 0;
+    h->records = c.records;
+    h->last = c.last;
+  }
+  return 0;
+}
+
+void
+seplos_history_close(SeplosHistory * h)
+{
+  if ( h->checkpoint >= 0 )
+    close(h->checkpoint);
+  h->checkpoint = -1;
+}
+
+static unsigned int
+request(const SeplosHistory * h, char info[6])
+{
+  _sp_hex2(h->pack, info);
+  _sp_hex4(h->next, &info[2]);
+  return 6;
+}
+
+static uint64_t
+milliseconds(const uint8_t when[6])
+{
+  struct tm	t = {};
+
+  t.tm_year = when[0] + 100;
+  t.tm_mon = when[1] - 1;
+  t.tm_mday = when[2];
+  t.tm_hour = when[3];
+  t.tm_min = when[4];
+  t.tm_sec = when[5];
+  t.tm_isdst = -1;
+
+  const time_t seconds = mktime(&t);
+  return seconds < 0 ? 0 : (uint64_t)seconds * 1000;
+}
+
+/*
+ * Take a reply. Returns 1 if there are more records to ask for, 0 once the
+ * last has been taken, or -1 if the reply is bad.
+ */
+static int
+accept(SeplosHistory * h, const Seplos_2_0 * frame, const uint8_t * info, int status)
+{
+  SeplosHistoryRecord	r = {};
+  uint8_t		when[6];
+
+  if ( status == NO_HISTORY ) {
+    /* Past the end. If the last record delivered before is gone, the pack's history was cleared. */
+    _sp_failure = SEPLOS_FAILURE_NONE;
+    if ( h->next > 0 && h->delivered == 0 && !h->restarted ) {
+      h->restarted = true;
+      h->next = 0;
+      return 1;
+    }
+    h->done = true;
+    checkpoint(h);
+    return 0;
+  }
+  else if ( status != NORMAL ) {
+    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
+    if ( status > 0 )
+      errno = EBADMSG;
+    return -1;
+  }
+
+  r.data.controller_address = h->address;
+  r.data.battery_pack_number = h->pack;
+  if ( _sp_decode_history(frame, info, &r.index, &r.records, when, &r.data) < 0 )
+    return -1;
+
+  r.time = milliseconds(when);
+  h->records = r.records;
+  h->next = r.index + 1;
+
+  if ( r.time > h->last ) {
+    h->last = r.time;
+    h->delivered++;
+    if ( h->callback )
+      (h->callback)(&r, h->data);
+  }
+
+  h->done = h->next >= h->records;
+  checkpoint(h);
+  return h->done ? 0 : 1;
+}
+
+/*
+ * Download records until the pack has no more, or limit of them have been
+ * delivered if limit isn't 0. Returns the number delivered, or -1 on error,
+ * in which case the checkpoint is left at the record that failed.
+ */
+int
+seplos_history_download(seplos_device fd, SeplosHistory * h, unsigned int limit)
+{
+  char			buffer[SEPLOS_PACK_FRAME];
+  uint8_t		decoded[(SEPLOS_PACK_FRAME - 18) / 2];
+  const uint64_t	delivered = h->delivered;
+  int			more = 1;
+
+  h->done = false;
+  while ( more > 0 && (limit == 0 || h->delivered - delivered < limit) ) {
+    char		info[6];
+    const unsigned int	length = request(h, info);
+
+    const int status = _sp_bms_command(fd, h->address, HISTORY_GET, info, length, (Seplos_2_0 *)buffer, sizeof(buffer), decoded);
+    if ( status < 0 )
+      return -1;
+
+    if ( (more = accept(h, (const Seplos_2_0 *)buffer, decoded, status)) < 0 )
+      return -1;
+  }
+  return h->delivered - delivered;
+}
+
+/* The next request goes out from the callback of the reply before it. */
+static void
+reply(SeplosTransaction * t, int status)
+{
+  SeplosHistory * const	h = t->data;
+  const int		more = status < 0 ? -1 : accept(h, (const Seplos_2_0 *)t->frame, t->info, status);
+
+  if ( more > 0 )
+    seplos_history_start(h);
+  else
+    h->status = more < 0 ? -1 : NORMAL;
+}
+
+/*
+ * Start a non-blocking download with h->transaction, and drive that the way
+ * any transaction is driven. Each reply starts the request for the record
+ * after it, so the transaction only reaches SEPLOS_TRANSACTION_DONE when the
+ * download has ended, and h->status says how: NORMAL, or -1 with the
+ * transaction's error and failure saying why.
+ */
+void
+seplos_history_start(SeplosHistory * h)
+{
+  char			info[6];
+  const unsigned int	length = request(h, info);
+
+  h->done = false;
+  h->status = 0;
+  seplos_transaction_start(&(h->transaction), h->address, HISTORY_GET, info, length, reply, h);
+}
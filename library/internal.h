@@ -8,7 +8,13 @@ typedef struct _Seplos_2_O_Binary {
   uint16_t	length;
 } Seplos_2_0_Binary;
 
-extern void		_sp_discard_serial_input(seplos_device fd);
+extern void		_sp_capture(unsigned int kind, unsigned int address, unsigned int command, unsigned int pack, const void * frame, unsigned int length);
+extern void		_sp_discard_serial_input(seplos_device fd, int transport);
+extern void		_sp_discard_socket_input(seplos_device fd);
+extern int		_sp_failure;
+extern uint64_t		_sp_now(void);
+extern bool		_sp_quiet;
+extern SeplosTiming	_sp_timing;
 extern void		_sp_error(const char * restrict pattern, ...);
 extern float		_sp_farenheit(float c);
 extern void		_sp_hex1(uint8_t value, char ascii[1]);
@@ -17,8 +23,13 @@ extern void		_sp_hex4(uint16_t value, char ascii[4]);
 extern uint8_t		_sp_hex1b(uint8_t c, bool * invalid);
 extern uint8_t		_sp_hex2b(const char ascii[2], bool * invalid);
 extern uint16_t		_sp_hex4b(const char ascii[4], bool * invalid);
+extern bool		_sp_hex_decode(const char * restrict ascii, unsigned int length, uint8_t * restrict binary, unsigned int * sum);
 extern unsigned int	_sp_length_checksum(unsigned int length);
 extern unsigned int	_sp_overall_checksum(const char * restrict data, unsigned int length);
+extern int		_sp_read_available(seplos_device fd, void * data, size_t size);
+extern bool		_sp_resyncable(const char * frame, unsigned int have);
+extern unsigned int	_sp_resync(char * frame, unsigned int from, unsigned int * have);
 extern int		_sp_read_serial(seplos_device fd, void * data, size_t size);
-extern void		_sp_wait_until_serial_data_is_transmitted(seplos_device fd);
-extern int		_sp_write_serial(seplos_device fd, void * data, size_t size);
+extern void		_sp_wait_until_serial_data_is_transmitted(seplos_device fd, int transport);
+extern int		_sp_write_serial(seplos_device fd, int transport, void * data, size_t size);
+extern int		_sp_write_socket(seplos_device fd, void * data, size_t size);
@@ -1,6 +1,252 @@
+#include <math.h>
+#include <string.h>
 #include "./internal.h"
 
+/*
+ * A JSON writer into a caller's buffer. It never allocates, and like
+ * snprintf() it keeps counting past the end of the buffer so that the caller
+ * learns the length that would have been needed.
+ */
+typedef struct _Writer {
+  char *	buffer;
+  size_t	size;
+  size_t	length;
+  bool		first;
+} Writer;
+
+static void
+put(Writer * w, const char * s, size_t length)
+{
+  if ( w->length < w->size ) {
+    size_t room = w->size - w->length;
+    memcpy(&w->buffer[w->length], s, length < room ? length : room);
+  }
+  w->length += length;
+}
+
+static void
+put_unsigned(Writer * w, uint64_t value)
+{
+  char	digits[20];
+  int	i = sizeof(digits);
+
+  do {
+    digits[--i] = '0' + (value % 10);
+    value /= 10;
+  } while ( value );
+
+  put(w, &digits[i], sizeof(digits) - i);
+}
+
+/*
+ * Writes value with a fixed number of decimals. The BMS reports fixed-point
+ * numbers, so this prints what it sent rather than the float's binary noise.
+ */
+static void
+put_fixed(Writer * w, double value, int decimals)
+{
+  static const uint64_t	scale[] = { 1, 10, 100, 1000 };
+  const double		magnitude = value < 0 ? -value : value;
+  uint64_t		scaled;
+  uint64_t		fraction;
+  char			digits[3];
+
+  /* This also catches NaN, which fails every comparison. */
+  if ( !(magnitude < 1e15) ) {
+    put(w, "null", 4);
+    return;
+  }
+
+  scaled = (uint64_t)(magnitude * scale[decimals] + 0.5);
+  if ( value < 0 && scaled != 0 )
+    put(w, "-", 1);
+
+  put_unsigned(w, scaled / scale[decimals]);
+
+  if ( decimals > 0 ) {
+    fraction = scaled % scale[decimals];
+    for ( int i = decimals - 1; i >= 0; i-- ) {
+      digits[i] = '0' + (fraction % 10);
+      fraction /= 10;
+    }
+    put(w, ".", 1);
+    put(w, digits, decimals);
+  }
+}
+
+static void
+key(Writer * w, const char * name)
+{
+  if ( !w->first )
+    put(w, ",", 1);
+  w->first = false;
+
+  put(w, "\"", 1);
+  put(w, name, strlen(name));
+  put(w, "\":", 2);
+}
+
+static void
+member_fixed(Writer * w, const char * name, double value, int decimals)
+{
+  key(w, name);
+  put_fixed(w, value, decimals);
+}
+
+static void
+member_bool(Writer * w, const char * name, bool value)
+{
+  key(w, name);
+  if ( value )
+    put(w, "true", 4);
+  else
+    put(w, "false", 5);
+}
+
+static void
+member_array(Writer * w, const char * name, const float * values, unsigned int n, int decimals)
+{
+  key(w, name);
+  put(w, "[", 1);
+  for ( unsigned int i = 0; i < n; i++ ) {
+    if ( i > 0 )
+      put(w, ",", 1);
+    put_fixed(w, values[i], decimals);
+  }
+  put(w, "]", 1);
+}
+
+size_t
+seplos_json_format(char * buffer, size_t size, const SeplosData const * m, uint32_t fields)
+{
+  Writer	w = { buffer, size, 0, true };
+  unsigned int	cells = m->number_of_cells;
+
+  if ( cells > SEPLOS_N_CELLS )
+    cells = SEPLOS_N_CELLS;
+
+  put(&w, "{", 1);
+
+  if ( fields & SEPLOS_JSON_CURRENT )
+    member_fixed(&w, "i", m->charge_discharge_current, 2);
+  if ( fields & SEPLOS_JSON_VOLTAGE )
+    member_fixed(&w, "v", m->total_battery_voltage, 2);
+  if ( fields & SEPLOS_JSON_DELTA_VOLTAGE )
+    member_fixed(&w, "dv", m->highest_cell_voltage - m->lowest_cell_voltage, 3);
+  if ( fields & SEPLOS_JSON_POWER )
+    member_fixed(&w, "p", m->charge_discharge_current * m->total_battery_voltage, 2);
+  if ( fields & SEPLOS_JSON_SOC )
+    member_fixed(&w, "soc", m->state_of_charge, 0);
+  if ( fields & SEPLOS_JSON_SOH )
+    member_fixed(&w, "soh", m->state_of_health, 0);
+  if ( fields & SEPLOS_JSON_CAPACITY )
+    member_fixed(&w, "cap", m->battery_capacity, 0);
+  if ( fields & SEPLOS_JSON_CYCLES )
+    member_fixed(&w, "ncycles", m->number_of_cycles, 0);
+  if ( fields & SEPLOS_JSON_RESIDUAL_CAPACITY )
+    member_fixed(&w, "cap_residual", m->residual_capacity, 0);
+  if ( fields & SEPLOS_JSON_RATED_CAPACITY )
+    member_fixed(&w, "cap_rated", m->rated_capacity, 0);
+  if ( fields & SEPLOS_JSON_BALANCING )
+    member_bool(&w, "bal", m->equilibrium_state);
+  if ( fields & SEPLOS_JSON_HOT )
+    member_bool(&w, "hot", m->hot);
+  if ( fields & SEPLOS_JSON_COLD )
+    member_bool(&w, "cold", m->cold);
+  if ( fields & SEPLOS_JSON_SHUTDOWN )
+    member_bool(&w, "shutdown", m->shutdown);
+  if ( fields & SEPLOS_JSON_STANDBY )
+    member_bool(&w, "standby", m->standby);
+  if ( fields & SEPLOS_JSON_CHARGE )
+    member_bool(&w, "charge", m->charge);
+  if ( fields & SEPLOS_JSON_DISCHARGE )
+    member_bool(&w, "discharge", m->discharge);
+  if ( fields & SEPLOS_JSON_CHARGE_SWITCH )
+    member_bool(&w, "charge_sw", m->charge_switch);
+  if ( fields & SEPLOS_JSON_DISCHARGE_SWITCH )
+    member_bool(&w, "discharge_sw", m->discharge_switch);
+  if ( fields & SEPLOS_JSON_MAX_TEMPERATURE )
+    member_fixed(&w, "max_temp", m->highest_temperature, 0);
+  if ( fields & SEPLOS_JSON_MIN_TEMPERATURE )
+    member_fixed(&w, "min_temp", m->lowest_temperature, 0);
+  if ( fields & SEPLOS_JSON_ENVIRONMENT_TEMPERATURE )
+    member_fixed(&w, "environment_temp", m->temperature[4], 0);
+  if ( fields & SEPLOS_JSON_BMS_TEMPERATURE )
+    member_fixed(&w, "bms_temp", m->temperature[5], 0);
+  if ( fields & SEPLOS_JSON_CELLS )
+    member_array(&w, "cells", m->cell_voltage, cells, 3);
+  if ( fields & SEPLOS_JSON_TEMPERATURES )
+    member_array(&w, "temps", m->temperature, SEPLOS_N_TEMPERATURES, 1);
+
+  put(&w, "}", 1);
+
+  if ( size > 0 )
+    buffer[w.length < size ? w.length : size - 1] = '\0';
+
+  return w.length;
+}
+
 void
 seplos_json(FILE * f, const SeplosData const * m, bool longer)
 {
+  char		buffer[SEPLOS_JSON_MAX];
+  uint32_t	fields = SEPLOS_JSON_ALL;
+
+  if ( !longer )
+    fields &= ~(SEPLOS_JSON_CELLS | SEPLOS_JSON_TEMPERATURES);
+
+  seplos_json_format(buffer, sizeof(buffer), m, fields);
+  fprintf(f, "%s\n", buffer);
+}
+
+static void
+member_unsigned(Writer * w, const char * name, uint64_t value)
+{
+  key(w, name);
+  put_unsigned(w, value);
+}
+
+/*
+ * Writes the statistics of each cell, as an array in cell order: the mean
+ * voltage "v" in V; its standard deviation "v_sd", the mean "drift" from the
+ * pack's mean cell and the deviation "drift_sd" in mV; the share of samples
+ * "bal" with the cell balancing; and the internal resistance "r" with its
+ * deviation "r_sd" in milliohms, from "r_n" steps of current, null with none.
+ * Returns the length it needed, like snprintf().
+ */
+size_t
+seplos_cells_json(char * buffer, size_t size, const SeplosCells * c)
+{
+  Writer	w = { buffer, size, 0, true };
+
+  put(&w, "{", 1);
+  member_unsigned(&w, "samples", c->samples);
+  key(&w, "cells");
+  put(&w, "[", 1);
+
+  for ( unsigned int i = 0; i < c->number_of_cells && i < SEPLOS_N_CELLS; i++ ) {
+    const SeplosCell * const	cell = &c->cell[i];
+    const bool			measured = cell->resistance.count > 0;
+
+    if ( i > 0 )
+      put(&w, ",", 1);
+    put(&w, "{", 1);
+    w.first = true;
+    member_fixed(&w, "v", cell->voltage.mean, 3);
+    member_fixed(&w, "v_sd", seplos_running_deviation(&cell->voltage) * 1000, 1);
+    member_fixed(&w, "drift", cell->drift.mean * 1000, 1);
+    member_fixed(&w, "drift_sd", seplos_running_deviation(&cell->drift) * 1000, 1);
+    member_fixed(&w, "bal", c->samples ? (double)cell->balancing / c->samples : 0, 3);
+    member_fixed(&w, "r", measured ? cell->resistance.mean * 1000 : NAN, 2);
+    member_fixed(&w, "r_sd", measured ? seplos_running_deviation(&cell->resistance) * 1000 : NAN, 2);
+    member_unsigned(&w, "r_n", cell->resistance.count);
+    put(&w, "}", 1);
+  }
+
+  put(&w, "]}", 2);
+
+  if ( size > 0 )
+    buffer[w.length < size ? w.length : size - 1] = '\0';
+
+  return w.length;
 }
@@ -0,0 +1,321 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./internal.h"
+
+/*
+ * The latest sample of every pack, in a POSIX shared-memory segment, for
+ * programs on the same machine that want the current state without MQTT or a
+ * round trip to the BMS. seplosd writes a slot each time it has decoded a
+ * pack. The readers never block it, and it never waits for them: each slot
+ * has a sequence number that is odd while the slot is being written, and a
+ * reader copies the slot out and tries again if the number was odd or has
+ * moved on in the meantime.
+ *
+ * Slots are taken by packs in the order they are first published, and a pack
+ * keeps its slot. The segment holds the SeplosData of the library that wrote
+ * it, so the header records its size and a reader built against a different
+ * one refuses the segment.
+ */
+typedef struct _LiveHeader {
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	slot_size;
+  uint32_t	data_size;	/* sizeof(SeplosData) of the writer */
+  uint32_t	capacity;
+  uint8_t	reserved[40];
+} LiveHeader;
+
+typedef struct _LiveSlot {
+  _Atomic uint32_t	sequence;	/* Odd while the slot is written. 0 if it never has been */
+  uint32_t		address;
+  uint32_t		pack;
+  uint32_t		reserved;
+  uint64_t		time;		/* Milliseconds since the epoch */
+  char			device[SEPLOS_LIVE_DEVICE];
+  SeplosData		data;
+} __attribute__((aligned(64))) LiveSlot;
+
+_Static_assert(sizeof(LiveHeader) == 64, "The live header must stay 64 bytes");
+_Static_assert(sizeof(LiveSlot) % 64 == 0, "A live slot must fill whole cache lines");
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'L', 'I', 'V', 'E' };
+#define VERSION		1
+
+/* A reader that keeps finding the slot half-written gives up after this many tries. */
+#define TRIES		1000
+
+static LiveHeader *
+header(const SeplosLive * l)
+{
+  return (LiveHeader *)l->base;
+}
+
+static LiveSlot *
+slot(const SeplosLive * l, unsigned int index)
+{
+  return &(((LiveSlot *)((uint8_t *)l->base + sizeof(LiveHeader)))[index]);
+}
+
+static size_t
+size_of(unsigned int capacity)
+{
+  return sizeof(LiveHeader) + ((size_t)capacity * sizeof(LiveSlot));
+}
+
+static int
+map(SeplosLive * l, int fd, size_t size, bool writable)
+{
+  void * const base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+  if ( base == MAP_FAILED )
+    return -1;
+  l->base = base;
+  l->size = size;
+  return 0;
+}
+
+static bool
+valid(const LiveHeader * h, size_t size)
+{
+  return memcmp(h->magic, magic, sizeof(magic)) == 0 \
+   && h->version == VERSION \
+   && h->slot_size == sizeof(LiveSlot) \
+   && h->data_size == sizeof(SeplosData) \
+   && h->capacity > 0 \
+   && size == size_of(h->capacity);
+}
+
+/*
+ * Open the segment called name, which is "/something", for publishing,
+ * creating it if needed. A segment of the same capacity is taken over with its
+ * samples, so that the readers go on seeing the packs across a restart. Any
+ * other is unlinked and made anew, rather than resized under the readers that
+ * have it mapped: they keep the old one until they map the name again.
+ */
+int
+seplos_live_open(SeplosLive * l, const char * name, unsigned int capacity)
+{
+  const size_t	size = size_of(capacity);
+  struct stat	s;
+  int		fd;
+
+  memset(l, 0, sizeof(*l));
+
+  if ( capacity == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( (fd = shm_open(name, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &s) < 0 ) {
+    _sp_error("%s: %s\n", name, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    return -1;
+  }
+
+  if ( s.st_size == size && map(l, fd, size, true) == 0 ) {
+    if ( valid(header(l), size) ) {
+      close(fd);
+      return 0;
+    }
+    munmap(l->base, l->size);
+    l->base = NULL;
+  }
+
+  if ( s.st_size != 0 ) {
+    close(fd);
+    shm_unlink(name);
+    if ( (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 ) {
+      _sp_error("%s: %s\n", name, strerror(errno));
+      return -1;
+    }
+  }
+
+  if ( ftruncate(fd, size) < 0 || map(l, fd, size, true) < 0 ) {
+    _sp_error("%s: %s\n", name, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  /* ftruncate() filled it with zeroes, so every slot is empty. */
+  LiveHeader * const h = header(l);
+  h->version = VERSION;
+  h->slot_size = sizeof(LiveSlot);
+  h->data_size = sizeof(SeplosData);
+  h->capacity = capacity;
+  memcpy(h->magic, magic, sizeof(magic));
+  return 0;
+}
+
+/*
+ * Map the segment called name for reading. seplosd may go on publishing to it
+ * at the same time.
+ */
+int
+seplos_live_map(SeplosLive * l, const char * name)
+{
+  struct stat	s;
+  const int	fd = shm_open(name, O_RDONLY, 0);
+
+  memset(l, 0, sizeof(*l));
+
+  if ( fd < 0 || fstat(fd, &s) < 0 || map(l, fd, s.st_size, false) < 0 ) {
+    _sp_error("%s: %s\n", name, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if ( s.st_size < sizeof(LiveHeader) || !valid(header(l), s.st_size) ) {
+    _sp_error("%s: not a live sample segment, or from a different version of the library.\n", name);
+    seplos_live_close(l);
+    errno = EBADMSG;
+    return -1;
+  }
+  return 0;
+}
+
+void
+seplos_live_close(SeplosLive * l)
+{
+  if ( l->base )
+    munmap(l->base, l->size);
+  memset(l, 0, sizeof(*l));
+}
+
+unsigned int
+seplos_live_capacity(const SeplosLive * l)
+{
+  return header(l)->capacity;
+}
+
+/*
+ * Publish the latest sample of the pack m is from, on device, with its time
+ * in milliseconds since the epoch. Returns the slot, or -1 with errno ENOSPC
+ * if the pack is new and every slot is taken. There is one writer, so the
+ * slots can be searched without synchronization.
+ */
+int
+seplos_live_publish(SeplosLive * l, const char * device, const SeplosData * m, uint64_t time)
+{
+  const unsigned int	capacity = header(l)->capacity;
+  char			name[SEPLOS_LIVE_DEVICE] = {};
+  LiveSlot *		s = NULL;
+
+  strncpy(name, device, sizeof(name) - 1);
+
+  for ( unsigned int i = 0; i < capacity; i++ ) {
+    LiveSlot * const	candidate = slot(l, i);
+
+    if ( atomic_load_explicit(&candidate->sequence, memory_order_relaxed) == 0 ) {
+      s = candidate;
+      break;
+    }
+    if ( candidate->address == m->controller_address && candidate->pack == m->battery_pack_number \
+     && strcmp(candidate->device, name) == 0 ) {
+      s = candidate;
+      break;
+    }
+  }
+
+  if ( s == NULL ) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  const uint32_t sequence = atomic_load_explicit(&s->sequence, memory_order_relaxed);
+  atomic_store_explicit(&s->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  s->address = m->controller_address;
+  s->pack = m->battery_pack_number;
+  s->time = time;
+  memcpy(s->device, name, sizeof(name));
+  s->data = *m;
+
+  atomic_store_explicit(&s->sequence, sequence + 2, memory_order_release);
+  return s - slot(l, 0);
+}
+
+/*
+ * Copy out the sample in a slot, and its time in milliseconds since the epoch.
+ * Returns -1 with errno ENOENT if nothing has been published in the slot, or
+ * EAGAIN if it was being written every time it was tried.
+ */
+int
+seplos_live_read(const SeplosLive * l, unsigned int index, SeplosLiveSample * sample)
+{
+  const LiveSlot *	s;
+
+  if ( index >= header(l)->capacity ) {
+    errno = EINVAL;
+    return -1;
+  }
+  s = slot(l, index);
+
+  for ( unsigned int i = 0; i < TRIES; i++ ) {
+    const uint32_t before = atomic_load_explicit(&s->sequence, memory_order_acquire);
+
+    if ( before == 0 ) {
+      errno = ENOENT;
+      return -1;
+    }
+    if ( before & 1 )
+      continue;
+
+    sample->time = s->time;
+    memcpy(sample->device, s->device, sizeof(sample->device));
+    sample->data = s->data;
+
+    atomic_thread_fence(memory_order_acquire);
+    if ( atomic_load_explicit(&s->sequence, memory_order_relaxed) == before ) {
+      sample->device[sizeof(sample->device) - 1] = '\0';
+      return 0;
+    }
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/*
+ * The slot of the pack at address and pack, on device, or on any device if
+ * that is NULL. Returns -1 with errno ENOENT if it hasn't been published.
+ */
+int
+seplos_live_find(const SeplosLive * l, const char * device, unsigned int address, unsigned int pack)
+{
+  const unsigned int capacity = header(l)->capacity;
+
+  for ( unsigned int i = 0; i < capacity; i++ ) {
+    const LiveSlot * const	s = slot(l, i);
+    uint32_t			sequence = atomic_load_explicit(&s->sequence, memory_order_acquire);
+    char			name[SEPLOS_LIVE_DEVICE];
+
+    /*
+     * A slot keeps its pack once taken, so only the first write changes
+     * these. Wait for it to finish.
+     */
+    for ( unsigned int t = 0; sequence == 1 && t < TRIES; t++ )
+      sequence = atomic_load_explicit(&s->sequence, memory_order_acquire);
+
+    /* The slots are taken in order, so there are none after an empty one. */
+    if ( sequence <= 1 )
+      break;
+
+    memcpy(name, s->device, sizeof(name));
+    name[sizeof(name) - 1] = '\0';
+    if ( s->address == address && s->pack == pack && (device == NULL || strncmp(name, device, sizeof(name) - 1) == 0) )
+      return i;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
@@ -0,0 +1,260 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <string.h>
+#include <time.h>
+#include "./internal.h"
+#include "./communication.h"
+
+/*
+ * A cache of what a pack says about itself: the protocol version, the vendor
+ * information, the offset of its clock and its teleregulation parameters.
+ * These almost never change, so each is read on first use and then again
+ * once ttl has passed, or sooner when seplos_metadata_observe() sees the
+ * pack's switches change, which is what changing its settings looks like
+ * from outside.
+ *
+ * The layouts of the replies follow YD/T 1363.3, which the SEPLOS protocol
+ * is derived from: VENDOR_GET is the device name in 10 characters, the
+ * software version in 2 bytes and the manufacturer in 20 characters.
+ * TIME_GET is the year in 2 bytes, then month, day, hour, minute and second.
+ * TELEREGULATION_GET is the data flag and then 2-byte parameters, which are
+ * kept as they are, since their meaning isn't documented.
+ */
+static const unsigned int	commands[SEPLOS_METADATA_ITEMS] = {
+  PROTOCOL_VER_GET,
+  VENDOR_GET,
+  TIME_GET,
+  TELEREGULATION_GET
+};
+
+/* The BMS clock is read to the second, so it is only a change when it moves further than this. */
+#define CLOCK_SLACK 2000
+
+void
+seplos_metadata_init(SeplosMetadata * m, unsigned int address, unsigned int pack, uint64_t ttl)
+{
+  memset(m, 0, sizeof(*m));
+  m->address = address;
+  m->pack = pack;
+  m->ttl = ttl * 1000000;
+}
+
+/* Returns the items that are due to be read: never read, stale, or read longer than ttl ago. */
+unsigned int
+seplos_metadata_due(const SeplosMetadata * m)
+{
+  const uint64_t	now = _sp_now();
+  unsigned int		due = m->stale;
+
+  for ( unsigned int i = 0; i < SEPLOS_METADATA_ITEMS; i++ ) {
+    if ( m->asked_at[i] == 0 || now - m->asked_at[i] >= m->ttl )
+      due |= 1 << i;
+  }
+  return due;
+}
+
+/* Look at a decoded telecommand reply, and read the settings again if the switches changed. */
+void
+seplos_metadata_observe(SeplosMetadata * m, const SeplosData * d)
+{
+  const uint32_t state = 1 | (d->discharge_switch << 1) | (d->charge_switch << 2) \
+   | (d->current_limit_switch << 3) | (d->heating_switch << 4) | (d->shutdown << 5);
+
+  if ( m->state != 0 && m->state != state )
+    m->stale |= SEPLOS_METADATA_ALL & ~SEPLOS_METADATA_PROTOCOL;
+  m->state = state;
+}
+
+static unsigned int
+item_index(unsigned int item)
+{
+  unsigned int i = 0;
+
+  while ( i < SEPLOS_METADATA_ITEMS - 1 && !(item & (1 << i)) )
+    i++;
+  return i;
+}
+
+static int
+item_of(unsigned int command)
+{
+  for ( unsigned int i = 0; i < SEPLOS_METADATA_ITEMS; i++ ) {
+    if ( commands[i] == command )
+      return i;
+  }
+  return -1;
+}
+
+/* Start the command that reads the lowest of the items given. */
+void
+seplos_metadata_start(SeplosTransaction * t, const SeplosMetadata * m, unsigned int item, seplos_transaction_cb callback, void * data)
+{
+  char	pack_info[2];
+
+  /* PROTOCOL_VER_GET and VENDOR_GET are about the controller, and it ignores the pack number. */
+  _sp_hex2(m->pack, pack_info);
+  seplos_transaction_start(t, m->address, commands[item_index(item)], pack_info, sizeof(pack_info), callback, data);
+}
+
+static void
+text(char * into, const uint8_t * from, unsigned int length)
+{
+  unsigned int n = 0;
+
+  for ( unsigned int i = 0; i < length && from[i] != '\0'; i++ )
+    into[n++] = (from[i] >= ' ' && from[i] < 0x7f) ? from[i] : '?';
+  while ( n > 0 && into[n - 1] == ' ' )
+    n--;
+  into[n] = '\0';
+}
+
+static uint64_t
+wall_clock(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_REALTIME, &t);
+  return ((uint64_t)t.tv_sec * 1000) + (t.tv_nsec / 1000000);
+}
+
+/*
+ * Decode a reply into the cache, from its info field as it was converted when
+ * the reply was checked. Returns 1 if a value changed, 0 if not, or -1 if the
+ * reply is bad.
+ */
+static int
+decode(SeplosMetadata * m, unsigned int command, const Seplos_2_0 * frame, const uint8_t * info, int status)
+{
+  SeplosMetadata	before;
+  unsigned int		length;
+  const int		i = item_of(command);
+
+  if ( i < 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(&before, m, sizeof(before));
+
+  /* Whether it answered or not, it isn't asked again until ttl has passed. */
+  m->asked_at[i] = _sp_now();
+  m->stale &= ~(1 << i);
+
+  if ( status != NORMAL ) {
+    if ( status > 0 )
+      errno = EBADMSG;
+    return -1;
+  }
+
+  if ( _sp_check_header(frame, &length) < 0 )
+    return -1;
+  length /= 2;
+
+  switch ( command ) {
+  case PROTOCOL_VER_GET: {
+    bool		invalid = false;
+    const uint8_t	version = _sp_hex2b(frame->version, &invalid);
+
+    m->protocol_version = ((version >> 4) & 0xf) + ((version & 0xf) * 0.1);
+    break;
+  }
+  case VENDOR_GET:
+    if ( length < 32 )
+      goto malformed;
+    text(m->device_name, info, 10);
+    m->software_version[0] = info[10];
+    m->software_version[1] = info[11];
+    text(m->manufacturer, &info[12], 20);
+    break;
+  case TIME_GET: {
+    struct tm	t = {};
+
+    if ( length < 7 )
+      goto malformed;
+    t.tm_year = ((info[0] << 8) | info[1]) - 1900;
+    t.tm_mon = info[2] - 1;
+    t.tm_mday = info[3];
+    t.tm_hour = info[4];
+    t.tm_min = info[5];
+    t.tm_sec = info[6];
+    t.tm_isdst = -1;
+
+    const time_t		seconds = mktime(&t);
+    const int64_t		offset = seconds < 0 ? 0 : ((int64_t)seconds * 1000) - (int64_t)wall_clock();
+
+    /* The clock drifts, so only a jump counts as a change. */
+    if ( !(m->valid & SEPLOS_METADATA_TIME) || offset - m->clock_offset > CLOCK_SLACK \
+     || m->clock_offset - offset > CLOCK_SLACK )
+      m->clock_offset = offset;
+    break;
+  }
+  case TELEREGULATION_GET:
+    if ( length < 1 )
+      goto malformed;
+    m->number_of_parameters = 0;
+    memset(m->parameters, 0, sizeof(m->parameters));
+    for ( unsigned int j = 1; j + 1 < length && m->number_of_parameters < SEPLOS_MAX_PARAMETERS; j += 2 )
+      m->parameters[m->number_of_parameters++] = (info[j] << 8) | info[j + 1];
+    break;
+  }
+
+  m->valid |= 1 << i;
+
+  /* Everything but the bookkeeping, compared with how it was. */
+  before.valid = m->valid;
+  before.stale = m->stale;
+  memcpy(before.asked_at, m->asked_at, sizeof(before.asked_at));
+  if ( memcmp(&before, m, sizeof(before)) == 0 )
+    return 0;
+
+  m->generation++;
+  return 1;
+
+malformed:
+  _sp_error("Reply to command %x is too short.\n", command);
+  _sp_failure = SEPLOS_FAILURE_MALFORMED;
+  errno = EBADMSG;
+  return -1;
+}
+
+/*
+ * Take the reply to a transaction started with seplos_metadata_start(),
+ * whether it succeeded or not. Returns 1 if a value changed, 0 if not, or -1
+ * if there was no good reply, in which case the item is not asked for again
+ * until ttl has passed.
+ */
+int
+seplos_metadata_decode(const SeplosTransaction * t, SeplosMetadata * m)
+{
+  if ( t->status < 0 )
+    errno = t->error;
+  return decode(m, t->command, (const Seplos_2_0 *)t->frame, t->info, t->status);
+}
+
+/*
+ * Read whatever is due, waiting for each reply. Returns 1 if a value
+ * changed, 0 if not, or -1 if any of the commands failed.
+ */
+int
+seplos_metadata(seplos_device fd, SeplosMetadata * m)
+{
+  char		buffer[SEPLOS_MAX_FRAME];
+  uint8_t	info[SEPLOS_MAX_INFO];
+  unsigned int	due = seplos_metadata_due(m);
+  int		result = 0;
+
+  for ( unsigned int i = 0; i < SEPLOS_METADATA_ITEMS; i++ ) {
+    char	pack_info[2];
+
+    if ( !(due & (1 << i)) )
+      continue;
+
+    _sp_hex2(m->pack, pack_info);
+    const int status = _sp_bms_command(fd, m->address, commands[i], pack_info, sizeof(pack_info), (Seplos_2_0 *)buffer, sizeof(buffer), info);
+    const int changed = decode(m, commands[i], (const Seplos_2_0 *)buffer, info, status);
+
+    if ( changed < 0 )
+      result = -1;
+    else if ( changed > 0 && result == 0 )
+      result = 1;
+  }
+  return result;
+}
@@ -83,3 +83,15 @@ const char const * seplos_temperature_names[SEPLOS_N_TEMPERATURES] = {
   "Environment temperature",
   "Power temperature"
 };
+
+const char const * seplos_failure_names[SEPLOS_FAILURE_COUNT] = {
+  "none",
+  "timeout",
+  "checksum",
+  "length_checksum",
+  "not_hex",
+  "version",
+  "malformed",
+  "response",
+  "io"
+};
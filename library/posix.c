@@ -1,19 +1,45 @@
 #include "./internal.h"
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 void
-_sp_discard_serial_input(seplos_device fd) {
-  tcflush(fd, TCIOFLUSH); /* Throw away any pending I/O */
+_sp_discard_serial_input(seplos_device fd, int transport) {
+  if ( transport == SEPLOS_TRANSPORT_TCP )
+    _sp_discard_socket_input(fd);
+  else
+    tcflush(fd, TCIOFLUSH); /* Throw away any pending I/O */
 }
 
 void
-_sp_wait_until_serial_data_is_transmitted(seplos_device fd) {
-  tcdrain(fd);
+seplos_discard_input(seplos_device fd, int transport) {
+  _sp_discard_serial_input(fd, transport);
+}
+
+/*
+ * A socket has nothing to wait for: the request was written whole, and
+ * without Nagle's algorithm it is sent at once.
+ */
+void
+_sp_wait_until_serial_data_is_transmitted(seplos_device fd, int transport) {
+  if ( transport == SEPLOS_TRANSPORT_SERIAL )
+    tcdrain(fd);
 }
 
 int
-_sp_write_serial(seplos_device fd, void * data, size_t size)
+_sp_write_serial(seplos_device fd, int transport, void * data, size_t size)
 {
+  if ( transport == SEPLOS_TRANSPORT_TCP )
+    return _sp_write_socket(fd, data, size);
   return write(fd, data, size);
 }
+
+/* Nanoseconds on a clock that only goes forward, for timing. */
+uint64_t
+_sp_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
@@ -5,10 +5,40 @@
 #include <unistd.h>
 #include <string.h>
 
+static const struct {
+  unsigned int	baud;
+  speed_t	speed;
+} speeds[] = {
+  { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+  { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }
+};
+
+/*
+ * Open the serial device at baud, or with a name that starts with
+ * SEPLOS_TCP_PREFIX, connect to a serial server with seplos_open_tcp(). A read returns once it has everything that
+ * was asked for, or when the line has been quiet for byte_timeout milliseconds
+ * after the first character, so a whole reply usually takes a single read().
+ * How long to wait for that first character is up to _sp_read_serial().
+ */
 seplos_device
-seplos_open(const char * serial_device)
+seplos_open_serial(const char * serial_device, unsigned int baud, unsigned int byte_timeout)
 {
   struct termios t = {};
+  speed_t speed = 0;
+
+  /* A serial server's port has its speed set on the server. */
+  if ( strncmp(serial_device, SEPLOS_TCP_PREFIX, strlen(SEPLOS_TCP_PREFIX)) == 0 )
+    return seplos_open_tcp(serial_device + strlen(SEPLOS_TCP_PREFIX), SEPLOS_DEFAULT_CONNECT_TIMEOUT);
+
+  for ( unsigned int i = 0; i < sizeof(speeds) / sizeof(*speeds); i++ ) {
+    if ( speeds[i].baud == baud )
+      speed = speeds[i].speed;
+  }
+  if ( !speed ) {
+    _sp_error("%u baud is not supported.\n", baud);
+    errno = EINVAL;
+    return -1;
+  }
 
   const int fd = open(serial_device, O_RDWR|O_NOCTTY, 0);
   if ( fd < 0 ) {
@@ -16,14 +46,27 @@ seplos_open(const char * serial_device)
     return -1;
   }
 
+  /* VTIME counts tenths of a second, and 0 would mean no inter-byte timer. */
+  unsigned int tenths = (byte_timeout + 99) / 100;
+  if ( tenths < 1 )
+    tenths = 1;
+  if ( tenths > 255 )
+    tenths = 255;
+
   tcgetattr(fd, &t);
-  cfsetspeed(&t, 19200);
+  cfsetspeed(&t, speed);
   cfmakeraw(&t);
   tcflush(fd, TCIOFLUSH); /* Throw away any pending I/O */
   t.c_lflag &= ~ICANON;
-  t.c_cc[VTIME] = 1; // 1 second timeout
-  t.c_cc[VMIN] = 0;
+  t.c_cc[VTIME] = tenths;
+  t.c_cc[VMIN] = 255;
   tcsetattr(fd, TCSANOW, &t);
 
   return fd;
 }
+
+seplos_device
+seplos_open(const char * serial_device)
+{
+  return seplos_open_serial(serial_device, SEPLOS_DEFAULT_BAUD, SEPLOS_DEFAULT_BYTE_TIMEOUT);
+}
@@ -1,24 +1,75 @@
 #include "./internal.h"
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 
+static unsigned int reply_timeout = SEPLOS_DEFAULT_REPLY_TIMEOUT;
+
+/*
+ * Set how long, in milliseconds, the blocking calls wait for the BMS to start
+ * sending each part of a reply. A pack that isn't there fails after this long.
+ */
+void
+seplos_set_reply_timeout(unsigned int milliseconds)
+{
+  reply_timeout = milliseconds;
+}
+
+static int64_t
+now_ms(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/*
+ * Read size bytes. Each read() is preceded by a poll() bounded by the reply
+ * deadline, because with VMIN set the read itself would wait forever for a
+ * first character. Once characters flow, the read returns the whole rest of
+ * the reply at once, or stops when the line goes quiet for VTIME.
+ */
 int
 _sp_read_serial(seplos_device fd, void * data, size_t size)
 {
-  /* FIX: Fill in the timeout here. */
-
-  size_t received_amount = 0;
+  const int64_t	deadline = now_ms() + reply_timeout;
+  size_t	received_amount = 0;
 
   while ( received_amount < size ) {
-    int ret = read(fd, data, size - received_amount);
+    struct pollfd	p = { .fd = fd, .events = POLLIN };
+    const int64_t	remaining = deadline - now_ms();
+
+    int ret = remaining > 0 ? poll(&p, 1, remaining) : 0;
     if ( ret < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      _sp_error("Poll failed: %s\n", strerror(errno));
+      return ret;
+    }
+    else if ( ret == 0 ) {
+      /*
+       * Report this as a timeout, so that the caller can tell a silent BMS
+       * from a failed device.
+       */
+      _sp_error("The BMS did not answer within %u ms.\n", reply_timeout);
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    ret = read(fd, data, size - received_amount);
+    if ( ret < 0 ) {
+      if ( errno == EINTR || errno == EAGAIN )
+        continue;
       _sp_error("Read failed: %s\n", strerror(errno));
       return ret;
     }
     else if ( ret == 0 ) {
-      /* Read should always block until it receives at least one character */
+      /* The device was readable but had nothing: the other end hung up. */
       _sp_error("Serial end-of-file.\n");
+      errno = EIO;
       return -1;
     }
     else {
@@ -29,3 +80,26 @@ _sp_read_serial(seplos_device fd, void * data, size_t size)
   return received_amount;
 }
 
+/*
+ * Read whatever is waiting on a non-blocking device, without waiting for more.
+ * Returns 0 if nothing is available.
+ */
+int
+_sp_read_available(seplos_device fd, void * data, size_t size)
+{
+  int ret = read(fd, data, size);
+
+  if ( ret < 0 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      return 0;
+    _sp_error("Read failed: %s\n", strerror(errno));
+    return -1;
+  }
+  else if ( ret == 0 ) {
+    /* A non-blocking tty only returns 0 if the other end hung up. */
+    _sp_error("Serial end-of-file.\n");
+    errno = EIO;
+    return -1;
+  }
+  return ret;
+}
@@ -0,0 +1,180 @@
+#include "./internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The TCP transport, for buses reached through an Ethernet serial server that
+ * passes the bytes of a TCP connection to its RS-485 port and back unchanged,
+ * often called "raw TCP". The baud rate is set on the server. The rest of the
+ * library treats the socket like the tty: it is polled, read and written the
+ * same way, and only the few calls that are tty-specific look at its transport.
+ */
+
+/*
+ * Split address, "host:port" or "[v6 address]:port", into the host, copied to
+ * host, which has room for size bytes, and the port, which points into
+ * address. For a program that resolves the name itself.
+ */
+int
+seplos_parse_tcp(const char * address, char * host, size_t size, const char * * port)
+{
+  const char *	colon = strrchr(address, ':');
+  const char *	start = address;
+  size_t	length;
+
+  if ( colon == NULL || colon[1] == '\0' ) {
+    _sp_error("%s: a TCP device is tcp://host:port.\n", address);
+    errno = EINVAL;
+    return -1;
+  }
+  length = colon - address;
+
+  if ( *address == '[' && length >= 2 && address[length - 1] == ']' ) {
+    start++;
+    length -= 2;
+  }
+
+  if ( length == 0 || length >= size ) {
+    _sp_error("%s: bad host name.\n", address);
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(host, start, length);
+  host[length] = '\0';
+  *port = colon + 1;
+  return 0;
+}
+
+/* Waits up to timeout ms for a connection in progress. */
+static int
+connected(int fd, unsigned int timeout)
+{
+  struct pollfd	p = { .fd = fd, .events = POLLOUT };
+  int		error = 0;
+  socklen_t	length = sizeof(error);
+  int		ret;
+
+  while ( (ret = poll(&p, 1, timeout)) < 0 && errno == EINTR )
+    ;
+
+  if ( ret == 0 ) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if ( ret < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 )
+    return -1;
+  if ( error != 0 ) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Connect to a serial server at a resolved address of length bytes. With a
+ * timeout, this waits up to that many milliseconds for the connection and
+ * returns a blocking socket, for the blocking calls. With 0 it returns at
+ * once with a non-blocking socket that is still connecting, for an event
+ * loop: it becomes writable when the connection is made, and the first
+ * write fails if it couldn't be. On failure it returns -1 with errno set,
+ * without a message, since the caller may have other addresses to try.
+ *
+ * Nagle's algorithm is turned off, since each request is written whole and
+ * has to leave at once, and keepalives find a server that went away while
+ * the connection was idle.
+ */
+seplos_device
+seplos_connect_tcp(const struct sockaddr * address, unsigned int length, unsigned int timeout)
+{
+  const int	on = 1;
+  int		fd;
+  int		error;
+
+  if ( (fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 )
+    return -1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+  if ( connect(fd, address, length) == 0 || (errno == EINPROGRESS && timeout == 0) )
+    return fd;
+  if ( errno == EINPROGRESS && connected(fd, timeout) == 0 ) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+  }
+
+  error = errno;
+  close(fd);
+  errno = error;
+  return -1;
+}
+
+/*
+ * Connect to a serial server at address, which is "host:port", trying each
+ * address the name resolves to, as seplos_connect_tcp() does. The name is
+ * looked up with getaddrinfo(), which blocks, so an event loop should resolve
+ * it on its own and call seplos_connect_tcp().
+ */
+seplos_device
+seplos_open_tcp(const char * address, unsigned int timeout)
+{
+  struct addrinfo	hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo *	addresses;
+  char			host[256];
+  const char *		port;
+  int			fd = -1;
+  int			ret;
+
+  if ( seplos_parse_tcp(address, host, sizeof(host), &port) < 0 )
+    return -1;
+
+  if ( (ret = getaddrinfo(host, port, &hints, &addresses)) != 0 ) {
+    _sp_error("%s: %s\n", address, gai_strerror(ret));
+    errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    return -1;
+  }
+
+  for ( struct addrinfo * a = addresses; a != NULL && fd < 0; a = a->ai_next )
+    fd = seplos_connect_tcp(a->ai_addr, a->ai_addrlen, timeout);
+  ret = errno;
+  freeaddrinfo(addresses);
+  errno = ret;
+
+  if ( fd < 0 )
+    _sp_error("%s: %s\n", address, strerror(errno));
+  return fd;
+}
+
+int
+seplos_transport(seplos_device fd)
+{
+  struct stat	s;
+
+  return fstat(fd, &s) == 0 && S_ISSOCK(s.st_mode) ? SEPLOS_TRANSPORT_TCP : SEPLOS_TRANSPORT_SERIAL;
+}
+
+/* Read and drop whatever has arrived, since a socket has no tcflush(). */
+void
+_sp_discard_socket_input(seplos_device fd)
+{
+  char	buffer[SEPLOS_MAX_FRAME];
+
+  while ( recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0 )
+    ;
+}
+
+/* Without SIGPIPE, so that a server that hung up fails the write rather than the program. */
+int
+_sp_write_socket(seplos_device fd, void * data, size_t size)
+{
+  return send(fd, data, size, MSG_NOSIGNAL);
+}
@@ -4,7 +4,8 @@
 float
 seplos_protocol_version(seplos_device fd, unsigned int address)
 {
-  Seplos_2_0	response = {};
+  char		buffer[SEPLOS_PACK_FRAME];
+  Seplos_2_0 *	response = (Seplos_2_0 *)buffer;
   /*
    * For this command: BMS parses the address, but not the pack number.
    */
@@ -16,7 +17,9 @@ seplos_protocol_version(seplos_device fd, unsigned int address)
    PROTOCOL_VER_GET,	/* command */
    &pack_info,		/* pack number */
    sizeof(pack_info),	/* length of the above */
-   &response);
+   response,
+   sizeof(buffer),
+   NULL);		/* Only the header is wanted */
 
   if ( status != NORMAL ) {
     _sp_error("Bad response %x from SEPLOS BMS.\n", status);
@@ -24,7 +27,7 @@ seplos_protocol_version(seplos_device fd, unsigned int address)
   }
 
   bool invalid = false;
-  uint16_t version = _sp_hex2b(response.version, &invalid);
+  uint16_t version = _sp_hex2b(response->version, &invalid);
 
   return ((version >> 4) & 0xf) + ((version & 0xf) * 0.1);
 }
@@ -0,0 +1,478 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./internal.h"
+
+/*
+ * A fixed-size history of one pack's samples in a memory-mapped file, so that
+ * a broker or network outage doesn't leave a gap. Appending a sample only
+ * dirties the page cache, and the file never grows, however long the link is
+ * down: the oldest samples are overwritten.
+ *
+ * Samples are stored at the resolution the BMS sends them: millivolts for
+ * cells, 10 mV, 10 mA and 10 mAh for the pack, tenths of a percent and of a
+ * degree. Cell voltages are stored as millivolts above the lowest cell, at most
+ * 255. The byte alarms are kept as the summary flags. The file is in host
+ * byte order, since it's only read on the machine that writes it.
+ */
+typedef struct _RingHeader {
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	sample_size;
+  uint64_t	capacity;
+  uint64_t	head;		/* Samples ever written. The next goes at head % capacity */
+  uint32_t	address;
+  uint32_t	pack;
+  uint8_t	reserved[24];
+} RingHeader;
+
+typedef struct _RingSample {
+  int64_t	time;			/* Milliseconds since the epoch */
+  int16_t	current;		/* 10 mA */
+  uint16_t	voltage;		/* 10 mV */
+  uint16_t	port_voltage;		/* 10 mV */
+  uint16_t	residual_capacity;	/* 10 mAh */
+  uint16_t	battery_capacity;	/* 10 mAh */
+  uint16_t	rated_capacity;		/* 10 mAh */
+  uint16_t	state_of_charge;	/* 0.1% */
+  uint16_t	state_of_health;	/* 0.1% */
+  uint16_t	number_of_cycles;
+  uint16_t	lowest_cell;		/* mV */
+  uint8_t	cell_delta[SEPLOS_N_CELLS];	/* mV above lowest_cell */
+  int16_t	temperature[SEPLOS_N_TEMPERATURES];	/* 0.1 degree C */
+  uint16_t	equilibrium_state;
+  uint16_t	disconnection_state;
+  uint8_t	number_of_cells;
+  uint8_t	reserved;
+  uint32_t	flags;
+  uint32_t	bit_alarm[2];
+  uint32_t	reserved2;
+} RingSample;
+
+_Static_assert(sizeof(RingHeader) == 64, "The ring header must stay 64 bytes");
+_Static_assert(sizeof(RingSample) == 80, "The ring sample must stay 80 bytes");
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'R', 'I', 'N', 'G' };
+#define VERSION		1
+
+enum _ring_flags {
+  DISCHARGE =			1 << 0,
+  CHARGE =			1 << 1,
+  FLOATING_CHARGE =		1 << 2,
+  STANDBY =			1 << 3,
+  SHUTDOWN =			1 << 4,
+  DISCHARGE_SWITCH =		1 << 5,
+  CHARGE_SWITCH =		1 << 6,
+  CURRENT_LIMIT_SWITCH =	1 << 7,
+  HEATING_SWITCH =		1 << 8,
+  HAS_ALARM =			1 << 9,
+  OTHER_ALARM_STATE =		1 << 10,
+  CELL_ALARM =			1 << 11,
+  TEMPERATURE_ALARM =		1 << 12,
+  VOLTAGE_OR_CURRENT_ALARM =	1 << 13,
+  BIT_ALARM =			1 << 14,
+  DEPLETED =			1 << 15,
+  OVERCHARGE =			1 << 16,
+  COLD =			1 << 17,
+  HOT =				1 << 18
+};
+
+static const struct {
+  size_t	offset;
+  uint32_t	flag;
+} flags[] = {
+  { offsetof(SeplosData, discharge), DISCHARGE },
+  { offsetof(SeplosData, charge), CHARGE },
+  { offsetof(SeplosData, floating_charge), FLOATING_CHARGE },
+  { offsetof(SeplosData, standby), STANDBY },
+  { offsetof(SeplosData, shutdown), SHUTDOWN },
+  { offsetof(SeplosData, discharge_switch), DISCHARGE_SWITCH },
+  { offsetof(SeplosData, charge_switch), CHARGE_SWITCH },
+  { offsetof(SeplosData, current_limit_switch), CURRENT_LIMIT_SWITCH },
+  { offsetof(SeplosData, heating_switch), HEATING_SWITCH },
+  { offsetof(SeplosData, has_alarm), HAS_ALARM },
+  { offsetof(SeplosData, other_or_undocumented_alarm_state), OTHER_ALARM_STATE },
+  { offsetof(SeplosData, has_cell_alarm), CELL_ALARM },
+  { offsetof(SeplosData, has_temperature_alarm), TEMPERATURE_ALARM },
+  { offsetof(SeplosData, has_voltage_or_current_alarm), VOLTAGE_OR_CURRENT_ALARM },
+  { offsetof(SeplosData, has_bit_alarm), BIT_ALARM },
+  { offsetof(SeplosData, depleted), DEPLETED },
+  { offsetof(SeplosData, overcharge), OVERCHARGE },
+  { offsetof(SeplosData, cold), COLD },
+  { offsetof(SeplosData, hot), HOT }
+};
+
+static RingHeader *
+header(const SeplosRing * r)
+{
+  return (RingHeader *)r->base;
+}
+
+static RingSample *
+sample(const SeplosRing * r, uint64_t index)
+{
+  return &(((RingSample *)((uint8_t *)r->base + sizeof(RingHeader)))[index % header(r)->capacity]);
+}
+
+/* Round to the nearest step and clamp to the range of the stored type. */
+static long
+fixed(float value, float scale, long low, long high)
+{
+  const float scaled = value * scale;
+
+  if ( scaled != scaled )
+    return 0;
+  else if ( scaled <= low )
+    return low;
+  else if ( scaled >= high )
+    return high;
+  return (long)(scaled + (scaled < 0 ? -0.5f : 0.5f));
+}
+
+static void
+encode(RingSample * s, const SeplosData * m, uint64_t time)
+{
+  const long lowest_cell = fixed(m->lowest_cell_voltage, 1000, 0, 0xffff);
+
+  s->time = time;
+  s->current = fixed(m->charge_discharge_current, 100, -0x8000, 0x7fff);
+  s->voltage = fixed(m->total_battery_voltage, 100, 0, 0xffff);
+  s->port_voltage = fixed(m->port_voltage, 100, 0, 0xffff);
+  s->residual_capacity = fixed(m->residual_capacity, 100, 0, 0xffff);
+  s->battery_capacity = fixed(m->battery_capacity, 100, 0, 0xffff);
+  s->rated_capacity = fixed(m->rated_capacity, 100, 0, 0xffff);
+  s->state_of_charge = fixed(m->state_of_charge, 10, 0, 0xffff);
+  s->state_of_health = fixed(m->state_of_health, 10, 0, 0xffff);
+  s->number_of_cycles = m->number_of_cycles > 0xffff ? 0xffff : m->number_of_cycles;
+  s->lowest_cell = lowest_cell;
+  s->number_of_cells = m->number_of_cells > SEPLOS_N_CELLS ? SEPLOS_N_CELLS : m->number_of_cells;
+
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    long delta = 0;
+
+    if ( i < s->number_of_cells )
+      delta = fixed(m->cell_voltage[i], 1000, 0, 0xffff) - lowest_cell;
+    s->cell_delta[i] = delta < 0 ? 0 : delta > 0xff ? 0xff : delta;
+  }
+
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ )
+    s->temperature[i] = fixed(m->temperature[i], 10, -0x8000, 0x7fff);
+
+  s->equilibrium_state = m->equilibrium_state;
+  s->disconnection_state = m->disconnection_state;
+  s->bit_alarm[0] = m->bit_alarm[0];
+  s->bit_alarm[1] = m->bit_alarm[1];
+
+  s->flags = 0;
+  for ( unsigned int i = 0; i < sizeof(flags) / sizeof(*flags); i++ ) {
+    if ( *(const bool *)((const uint8_t *)m + flags[i].offset) )
+      s->flags |= flags[i].flag;
+  }
+}
+
+static void
+decode(const RingHeader * h, const RingSample * s, SeplosData * m)
+{
+  memset(m, 0, sizeof(*m));
+
+  m->controller_address = h->address;
+  m->battery_pack_number = h->pack;
+  m->charge_discharge_current = s->current / 100.0;
+  m->total_battery_voltage = s->voltage / 100.0;
+  m->port_voltage = s->port_voltage / 100.0;
+  m->residual_capacity = s->residual_capacity / 100.0;
+  m->battery_capacity = s->battery_capacity / 100.0;
+  m->rated_capacity = s->rated_capacity / 100.0;
+  m->state_of_charge = s->state_of_charge / 10.0;
+  m->state_of_health = s->state_of_health / 10.0;
+  m->number_of_cycles = s->number_of_cycles;
+  m->number_of_cells = s->number_of_cells;
+
+  m->lowest_cell_voltage = s->lowest_cell / 1000.0;
+  m->highest_cell_voltage = m->lowest_cell_voltage;
+  for ( unsigned int i = 0; i < s->number_of_cells; i++ ) {
+    m->cell_voltage[i] = (s->lowest_cell + s->cell_delta[i]) / 1000.0;
+    if ( m->cell_voltage[i] > m->highest_cell_voltage )
+      m->highest_cell_voltage = m->cell_voltage[i];
+  }
+
+  m->lowest_temperature = 1000.0;
+  m->highest_temperature = -1000.0;
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    const float value = s->temperature[i] / 10.0;
+    m->temperature[i] = value;
+    if ( value > m->highest_temperature )
+      m->highest_temperature = value;
+    if ( value < m->lowest_temperature )
+      m->lowest_temperature = value;
+  }
+
+  m->equilibrium_state = s->equilibrium_state;
+  m->disconnection_state = s->disconnection_state;
+  m->bit_alarm[0] = s->bit_alarm[0];
+  m->bit_alarm[1] = s->bit_alarm[1];
+
+  for ( unsigned int i = 0; i < sizeof(flags) / sizeof(*flags); i++ )
+    *(bool *)((uint8_t *)m + flags[i].offset) = !!(s->flags & flags[i].flag);
+}
+
+static int
+map(SeplosRing * r, int fd, size_t size, bool writable)
+{
+  void * const base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+  if ( base == MAP_FAILED )
+    return -1;
+  r->base = base;
+  r->size = size;
+  return 0;
+}
+
+static bool
+valid(const RingHeader * h, size_t size)
+{
+  return memcmp(h->magic, magic, sizeof(magic)) == 0 \
+   && h->version == VERSION \
+   && h->sample_size == sizeof(RingSample) \
+   && h->capacity > 0 \
+   && size == sizeof(RingHeader) + (h->capacity * sizeof(RingSample));
+}
+
+/*
+ * Start the file over as an empty ring. The whole file is allocated up front,
+ * so that a full disk can't fault in the middle of an append. Closes fd.
+ */
+static int
+create(SeplosRing * r, int fd, const char * path, unsigned int capacity, unsigned int address, unsigned int pack)
+{
+  const size_t	size = sizeof(RingHeader) + ((size_t)capacity * sizeof(RingSample));
+  int		error = 0;
+
+  if ( ftruncate(fd, 0) < 0 || (error = posix_fallocate(fd, 0, size)) != 0 \
+   || map(r, fd, size, true) < 0 ) {
+    if ( error )
+      errno = error;
+    _sp_error("%s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  RingHeader * const h = header(r);
+  h->version = VERSION;
+  h->sample_size = sizeof(RingSample);
+  h->capacity = capacity;
+  h->head = 0;
+  h->address = address;
+  h->pack = pack;
+  memcpy(h->magic, magic, sizeof(magic));
+  return 0;
+}
+
+/*
+ * Open the ring for a pack, for appending, creating it if needed. A file
+ * with a different capacity is started over.
+ */
+int
+seplos_ring_open(SeplosRing * r, const char * path, unsigned int capacity, unsigned int address, unsigned int pack)
+{
+  const size_t	size = sizeof(RingHeader) + ((size_t)capacity * sizeof(RingSample));
+  struct stat	s;
+  int		fd;
+
+  memset(r, 0, sizeof(*r));
+
+  if ( capacity == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( (fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &s) < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    return -1;
+  }
+
+  if ( s.st_size == size && map(r, fd, size, true) == 0 ) {
+    const RingHeader * const h = header(r);
+    if ( valid(h, size) && h->address == address && h->pack == pack ) {
+      close(fd);
+      return 0;
+    }
+    munmap(r->base, r->size);
+    r->base = NULL;
+  }
+
+  return create(r, fd, path, capacity, address, pack);
+}
+
+/*
+ * Open a ring for appending without ever starting it over: an existing ring
+ * is kept at the capacity it was made with, and anything else that isn't
+ * empty is refused. Only a missing or empty file is made into a new ring of
+ * capacity samples. Nothing stops two writers appending at once, so this
+ * must not be a ring seplosd is writing.
+ */
+int
+seplos_ring_attach(SeplosRing * r, const char * path, unsigned int capacity, unsigned int address, unsigned int pack)
+{
+  struct stat	s;
+  int		fd;
+
+  memset(r, 0, sizeof(*r));
+
+  if ( capacity == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( (fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &s) < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    return -1;
+  }
+
+  if ( s.st_size == 0 )
+    return create(r, fd, path, capacity, address, pack);
+
+  if ( map(r, fd, s.st_size, true) < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  const RingHeader * const h = header(r);
+  if ( s.st_size < sizeof(RingHeader) || !valid(h, s.st_size) ) {
+    _sp_error("%s: not a sample ring.\n", path);
+    seplos_ring_close(r);
+    errno = EBADMSG;
+    return -1;
+  }
+  if ( h->address != address || h->pack != pack ) {
+    _sp_error("%s: holds controller %u pack %u, not controller %u pack %u.\n", path, h->address, h->pack, address, pack);
+    seplos_ring_close(r);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Map a ring for reading. seplosd may go on appending to it at the same time. */
+int
+seplos_ring_map(SeplosRing * r, const char * path)
+{
+  struct stat	s;
+  const int	fd = open(path, O_RDONLY);
+
+  memset(r, 0, sizeof(*r));
+
+  if ( fd < 0 || fstat(fd, &s) < 0 || map(r, fd, s.st_size, false) < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if ( s.st_size < sizeof(RingHeader) || !valid(header(r), s.st_size) ) {
+    _sp_error("%s: not a sample ring.\n", path);
+    seplos_ring_close(r);
+    errno = EBADMSG;
+    return -1;
+  }
+  return 0;
+}
+
+void
+seplos_ring_close(SeplosRing * r)
+{
+  if ( r->base )
+    munmap(r->base, r->size);
+  memset(r, 0, sizeof(*r));
+}
+
+/*
+ * time is in milliseconds since the epoch. A time before the newest sample's,
+ * as after the clock has been stepped back, is taken as that sample's, so
+ * that the ring stays in the time order seplos_ring_query() searches by.
+ */
+void
+seplos_ring_append(SeplosRing * r, const SeplosData * m, uint64_t time)
+{
+  RingHeader * const	h = header(r);
+  const uint64_t	head = h->head;
+
+  if ( head > 0 && time < (uint64_t)sample(r, head - 1)->time )
+    time = sample(r, head - 1)->time;
+
+  encode(sample(r, head), m, time);
+
+  /* Readers only look at samples below head, so publish it last. */
+  __atomic_store_n(&(h->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/* The time of the newest sample, in milliseconds since the epoch, or 0 if there is none. */
+uint64_t
+seplos_ring_last(const SeplosRing * r)
+{
+  const uint64_t head = __atomic_load_n(&(header(r)->head), __ATOMIC_ACQUIRE);
+
+  return head > 0 ? (uint64_t)sample(r, head - 1)->time : 0;
+}
+
+/*
+ * Call callback with every every'th sample from time from up to and including
+ * time to, oldest first, and return how many there were. A sample that
+ * seplosd overwrites while it is being read is skipped.
+ */
+int
+seplos_ring_query(
+ const SeplosRing *	r,
+ uint64_t		from,
+ uint64_t		to,
+ unsigned int		every,
+ seplos_ring_cb		callback,
+ void *			data)
+{
+  const RingHeader * const	h = header(r);
+  const uint64_t		head = __atomic_load_n(&(h->head), __ATOMIC_ACQUIRE);
+  uint64_t			low = head > h->capacity ? head - h->capacity : 0;
+  uint64_t			high = head;
+  int				count = 0;
+
+  if ( every == 0 )
+    every = 1;
+
+  /* The samples are in time order, so find the first one at from. */
+  while ( low < high ) {
+    const uint64_t middle = low + ((high - low) / 2);
+    if ( (uint64_t)sample(r, middle)->time < from )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for ( uint64_t i = low; i < head; i += every ) {
+    const RingSample	copy = *sample(r, i);
+    SeplosData		m;
+
+    /* Once the writer has come all the way around, this one may be torn. */
+    if ( i + h->capacity <= __atomic_load_n(&(h->head), __ATOMIC_ACQUIRE) )
+      continue;
+
+    if ( (uint64_t)copy.time > to )
+      break;
+
+    decode(h, &copy, &m);
+    (callback)(&m, copy.time, data);
+    count++;
+  }
+  return count;
+}
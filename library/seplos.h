@@ -8,8 +8,43 @@
 #define SEPLOS_N_TEMPERATURES 6
 #define SEPLOS_N_BIT_ALARMS 64
 
+/*
+ * Asking for this pack number makes the master BMS answer for every pack
+ * daisy-chained behind it, in one reply. There can be at most SEPLOS_MAX_PACKS.
+ */
+#define SEPLOS_ALL_PACKS 0xFF
+#define SEPLOS_MAX_PACKS 16
+
 typedef int	seplos_device; /* File descriptor on POSIX */
 
+struct sockaddr;
+
+/* The serial settings used by seplos_open(). Times are in milliseconds. */
+#define SEPLOS_DEFAULT_BAUD 19200
+#define SEPLOS_DEFAULT_BYTE_TIMEOUT 100
+#define SEPLOS_DEFAULT_REPLY_TIMEOUT 1000
+
+/*
+ * A device named tcp://host:port is a serial server on the network, which
+ * seplos_open_serial() connects to with seplos_open_tcp(), waiting up to
+ * SEPLOS_DEFAULT_CONNECT_TIMEOUT ms. A program with an event loop splits the
+ * name with seplos_parse_tcp(), resolves it without blocking, and connects
+ * with seplos_connect_tcp().
+ */
+#define SEPLOS_TCP_PREFIX "tcp://"
+#define SEPLOS_DEFAULT_CONNECT_TIMEOUT 3000
+
+/*
+ * How a device is reached, which decides how its pending input is thrown
+ * away and how a request is written. seplos_transport() asks the system with
+ * fstat(). A program that keeps the device open finds out once, from how it
+ * opened it or by asking, and hands it to the calls that take one.
+ */
+enum _seplos_transport {
+  SEPLOS_TRANSPORT_SERIAL = 0,
+  SEPLOS_TRANSPORT_TCP
+};
+
 /*
  * This is the structure that all other software will use to montior the battery.
  * All of the communications, validation, and data conversion to the native data
@@ -181,12 +216,515 @@ enum _seplos_response {
   PERMISSION_ERROR = 0xe4        /* Permission error */
 };
 
+/*
+ * The largest frame the protocol can carry: 13 bytes of header, up to 4095
+ * bytes of info, 4 bytes of checksum, and the carriage return.
+ */
+#define SEPLOS_MAX_FRAME (13 + 4095 + 4 + 1)
+
+/*
+ * Enough for the reply about a single pack, which is about 170 bytes with 16
+ * cells. Replies for SEPLOS_ALL_PACKS need up to SEPLOS_MAX_FRAME.
+ */
+#define SEPLOS_PACK_FRAME 256
+
+/* The info field of the largest frame, converted from hex to bytes. */
+#define SEPLOS_MAX_INFO (4095 / 2)
+
+/*
+ * Why the last command failed, as seplos_last_failure() and the failure
+ * member of SeplosTransaction report it. The names are in seplos_failure_names[].
+ */
+enum _seplos_failure {
+  SEPLOS_FAILURE_NONE = 0,
+  SEPLOS_FAILURE_TIMEOUT,		/* The BMS didn't answer, or stopped */
+  SEPLOS_FAILURE_CHECKSUM,		/* The frame checksum didn't match */
+  SEPLOS_FAILURE_LENGTH_CHECKSUM,	/* The checksum in the length field didn't match */
+  SEPLOS_FAILURE_NOT_HEX,		/* A character that doesn't belong in the frame */
+  SEPLOS_FAILURE_VERSION,		/* Not protocol version 2 */
+  SEPLOS_FAILURE_MALFORMED,		/* The info field didn't decode, or didn't fit */
+  SEPLOS_FAILURE_RESPONSE,		/* The BMS answered with an error code */
+  SEPLOS_FAILURE_IO,			/* The device failed */
+  SEPLOS_FAILURE_COUNT
+};
+
+/*
+ * Where the time went in the last command sent by seplos_data() and the other
+ * blocking calls, in CLOCK_MONOTONIC nanoseconds.
+ */
+typedef struct _SeplosTiming {
+  uint64_t	write;		/* In write() */
+  uint64_t	drain;		/* Waiting for the request to leave the UART */
+  uint64_t	first_byte;	/* From then until the first byte of the reply */
+  uint64_t	frame;		/* From then until the whole reply */
+  uint64_t	decode;		/* Decoding the replies, in seplos_data() */
+} SeplosTiming;
+
+enum _seplos_transaction_state {
+  SEPLOS_TRANSACTION_IDLE = 0,
+  SEPLOS_TRANSACTION_SENDING,
+  SEPLOS_TRANSACTION_RECEIVING,
+  SEPLOS_TRANSACTION_DONE
+};
+
+typedef struct _SeplosTransaction SeplosTransaction;
+
+/*
+ * Called once per transaction. status is the BMS response code (NORMAL is
+ * success), or -1 if the frame couldn't be sent or received, in which case
+ * error holds the errno value.
+ */
+typedef void (*seplos_transaction_cb)(SeplosTransaction * t, int status);
+
+/*
+ * A non-blocking request/response exchange with the BMS, for programs that
+ * run their own event loop. Start it, call seplos_transaction_write() until
+ * it returns 0 when the device is writable, then call seplos_transaction_read()
+ * whenever the device is readable, or seplos_transaction_feed() with bytes
+ * that arrived some other way. The callback runs when the reply is complete
+ * and validated, or on the first error. Noise ahead of the reply, and a
+ * frame that fails its checks with another '~' behind it, are skipped over
+ * rather than failing the exchange. The device must be non-blocking.
+ * Unlike seplos_data(), pending input is not discarded before each request;
+ * call seplos_discard_input() where that's wanted. Both take the device's
+ * transport, so that it isn't asked for on every call.
+ *
+ * The request and the reply share one frame buffer, because the bus is half
+ * duplex and the request is finished before the reply starts.
+ */
+struct _SeplosTransaction {
+  int			state;
+  unsigned int		address;
+  unsigned int		command;
+  unsigned int		pack;	/* For TELEMETRY_GET, TELECOMMAND_GET and HISTORY_GET */
+  unsigned int		length;
+  unsigned int		offset;
+  int			status;
+  int			error;
+  int			failure;	/* One of _seplos_failure */
+  unsigned int		skipped;	/* Bytes of the reply dropped to find the start of a frame */
+  /* CLOCK_MONOTONIC nanoseconds, for timing each stage of the exchange. */
+  uint64_t		started_at;
+  uint64_t		sent_at;
+  uint64_t		first_byte_at;
+  uint64_t		finished_at;
+  seplos_transaction_cb	callback;
+  void *		data;
+  char			frame[SEPLOS_MAX_FRAME];
+  uint8_t		info[SEPLOS_MAX_INFO];	/* The reply's info field, converted as it was checked */
+};
+
+/*
+ * The members of the JSON document, for choosing which of them
+ * seplos_json_format() writes.
+ */
+enum _seplos_json_field {
+  SEPLOS_JSON_CURRENT = 1 << 0,			/* "i" */
+  SEPLOS_JSON_VOLTAGE = 1 << 1,			/* "v" */
+  SEPLOS_JSON_DELTA_VOLTAGE = 1 << 2,		/* "dv" */
+  SEPLOS_JSON_POWER = 1 << 3,			/* "p" */
+  SEPLOS_JSON_SOC = 1 << 4,			/* "soc" */
+  SEPLOS_JSON_SOH = 1 << 5,			/* "soh" */
+  SEPLOS_JSON_CAPACITY = 1 << 6,		/* "cap" */
+  SEPLOS_JSON_CYCLES = 1 << 7,			/* "ncycles" */
+  SEPLOS_JSON_RESIDUAL_CAPACITY = 1 << 8,	/* "cap_residual" */
+  SEPLOS_JSON_RATED_CAPACITY = 1 << 9,		/* "cap_rated" */
+  SEPLOS_JSON_BALANCING = 1 << 10,		/* "bal" */
+  SEPLOS_JSON_HOT = 1 << 11,			/* "hot" */
+  SEPLOS_JSON_COLD = 1 << 12,			/* "cold" */
+  SEPLOS_JSON_SHUTDOWN = 1 << 13,		/* "shutdown" */
+  SEPLOS_JSON_STANDBY = 1 << 14,		/* "standby" */
+  SEPLOS_JSON_CHARGE = 1 << 15,			/* "charge" */
+  SEPLOS_JSON_DISCHARGE = 1 << 16,		/* "discharge" */
+  SEPLOS_JSON_CHARGE_SWITCH = 1 << 17,		/* "charge_sw" */
+  SEPLOS_JSON_DISCHARGE_SWITCH = 1 << 18,	/* "discharge_sw" */
+  SEPLOS_JSON_MAX_TEMPERATURE = 1 << 19,	/* "max_temp" */
+  SEPLOS_JSON_MIN_TEMPERATURE = 1 << 20,	/* "min_temp" */
+  SEPLOS_JSON_ENVIRONMENT_TEMPERATURE = 1 << 21,	/* "environment_temp" */
+  SEPLOS_JSON_BMS_TEMPERATURE = 1 << 22,	/* "bms_temp" */
+  SEPLOS_JSON_CELLS = 1 << 23,			/* "cells", the cell voltages */
+  SEPLOS_JSON_TEMPERATURES = 1 << 24,		/* "temps", all temperature sensors */
+  SEPLOS_JSON_ALL = (1 << 25) - 1
+};
+
+/* The single-valued members come first, one bit each. */
+#define SEPLOS_JSON_SCALARS 23
+
+/* A buffer of this size holds any document seplos_json_format() writes. */
+#define SEPLOS_JSON_MAX 2048
+
+/*
+ * The compact binary document that seplos_cbor_format() writes: a CBOR
+ * (RFC 8949) map with these unsigned integer keys. Numbers are integers at
+ * the resolution the BMS reports, in the units given, so decoding needs no
+ * text parsing and no floats. A value that isn't a number is null. The
+ * delta coded arrays hold the first value and then the difference of each
+ * value from the one before it.
+ * SEPLOS_CBOR_VERSION is always present, and is raised whenever a
+ * key changes meaning; new keys may be added without raising it.
+ *
+ * The keys from SEPLOS_CBOR_CURRENT to SEPLOS_CBOR_TEMPERATURES follow the
+ * seplos_json_field bits, in the same order, and are written for the bits
+ * given. The rest are only written for SEPLOS_JSON_ALL.
+ */
+#define SEPLOS_CBOR_SCHEMA 1
+
+enum _seplos_cbor_key {
+  SEPLOS_CBOR_VERSION = 0,		/* SEPLOS_CBOR_SCHEMA */
+  SEPLOS_CBOR_TIME = 1,			/* ms since the epoch, if given */
+  SEPLOS_CBOR_ADDRESS = 2,
+  SEPLOS_CBOR_PACK = 3,
+  SEPLOS_CBOR_CURRENT = 4,		/* 10 mA, negative when discharging */
+  SEPLOS_CBOR_VOLTAGE = 5,		/* 10 mV */
+  SEPLOS_CBOR_DELTA_VOLTAGE = 6,	/* mV between the highest and lowest cell */
+  SEPLOS_CBOR_POWER = 7,		/* 10 mW, negative when discharging */
+  SEPLOS_CBOR_SOC = 8,			/* 0.1 % */
+  SEPLOS_CBOR_SOH = 9,			/* 0.1 % */
+  SEPLOS_CBOR_CAPACITY = 10,		/* 10 mAh */
+  SEPLOS_CBOR_CYCLES = 11,
+  SEPLOS_CBOR_RESIDUAL_CAPACITY = 12,	/* 10 mAh */
+  SEPLOS_CBOR_RATED_CAPACITY = 13,	/* 10 mAh */
+  SEPLOS_CBOR_BALANCING = 14,		/* equilibrium_state, a bit per cell */
+  SEPLOS_CBOR_HOT = 15,			/* true or false, as are the next 7 */
+  SEPLOS_CBOR_COLD = 16,
+  SEPLOS_CBOR_SHUTDOWN = 17,
+  SEPLOS_CBOR_STANDBY = 18,
+  SEPLOS_CBOR_CHARGE = 19,
+  SEPLOS_CBOR_DISCHARGE = 20,
+  SEPLOS_CBOR_CHARGE_SWITCH = 21,
+  SEPLOS_CBOR_DISCHARGE_SWITCH = 22,
+  SEPLOS_CBOR_MAX_TEMPERATURE = 23,	/* 0.1 degrees C */
+  SEPLOS_CBOR_MIN_TEMPERATURE = 24,	/* 0.1 degrees C */
+  SEPLOS_CBOR_ENVIRONMENT_TEMPERATURE = 25,	/* 0.1 degrees C */
+  SEPLOS_CBOR_BMS_TEMPERATURE = 26,	/* 0.1 degrees C */
+  SEPLOS_CBOR_CELLS = 27,		/* array of mV, one per cell, delta coded */
+  SEPLOS_CBOR_TEMPERATURES = 28,	/* array of 0.1 degrees C, cells 1-4, environment, power, delta coded */
+  SEPLOS_CBOR_PORT_VOLTAGE = 29,	/* 10 mV */
+  SEPLOS_CBOR_FLOATING_CHARGE = 30,	/* true or false, as are the next 2 */
+  SEPLOS_CBOR_CURRENT_LIMIT_SWITCH = 31,
+  SEPLOS_CBOR_HEATING_SWITCH = 32,
+  SEPLOS_CBOR_DISCONNECTION = 33,	/* disconnection_state, a bit per cell */
+  SEPLOS_CBOR_LOWEST_CELL = 34,		/* mV */
+  SEPLOS_CBOR_HIGHEST_CELL = 35,	/* mV */
+  SEPLOS_CBOR_NUMBER_OF_CELLS = 36,
+  SEPLOS_CBOR_CELL_ALARMS = 37,		/* array, one per cell: 0 normal, 1 low, 2 high, 0xf0 other */
+  SEPLOS_CBOR_TEMPERATURE_ALARMS = 38,	/* array, as SEPLOS_CBOR_TEMPERATURES */
+  SEPLOS_CBOR_CURRENT_ALARM = 39,
+  SEPLOS_CBOR_VOLTAGE_ALARM = 40,
+  SEPLOS_CBOR_BIT_ALARMS = 41,		/* array of bit_alarm words, names in seplos_bit_alarm_names */
+  SEPLOS_CBOR_FLAGS = 42,		/* the summary of the alarms, SEPLOS_CBOR_FLAG_* */
+  SEPLOS_CBOR_KEYS
+};
+
+enum _seplos_cbor_flag {
+  SEPLOS_CBOR_FLAG_ALARM = 1 << 0,		/* has_alarm */
+  SEPLOS_CBOR_FLAG_OTHER_ALARM = 1 << 1,	/* other_or_undocumented_alarm_state */
+  SEPLOS_CBOR_FLAG_CELL_ALARM = 1 << 2,		/* has_cell_alarm */
+  SEPLOS_CBOR_FLAG_TEMPERATURE_ALARM = 1 << 3,	/* has_temperature_alarm */
+  SEPLOS_CBOR_FLAG_VOLTAGE_OR_CURRENT_ALARM = 1 << 4, /* has_voltage_or_current_alarm */
+  SEPLOS_CBOR_FLAG_BIT_ALARM = 1 << 5,		/* has_bit_alarm */
+  SEPLOS_CBOR_FLAG_DEPLETED = 1 << 6,
+  SEPLOS_CBOR_FLAG_OVERCHARGE = 1 << 7
+};
+
+/* A buffer of this size holds any document seplos_cbor_format() writes. */
+#define SEPLOS_CBOR_MAX 512
+
+/*
+ * Raw frame capture. Once seplos_capture_open() has been called, every
+ * request and reply that passes through seplos_data() or a transaction is
+ * appended to the file with a timestamp, for replay with seplos_capture_map().
+ */
+enum _seplos_capture_kind {
+  SEPLOS_CAPTURE_REQUEST = 0,
+  SEPLOS_CAPTURE_REPLY = 1
+};
+
+typedef struct _SeplosCaptureRecord {
+  uint64_t	time;		/* Microseconds since the epoch */
+  unsigned int	kind;
+  unsigned int	address;
+  unsigned int	command;	/* For a reply, the command it answers */
+  unsigned int	pack;
+  unsigned int	length;
+  const char *	frame;		/* Points into the mapped file */
+} SeplosCaptureRecord;
+
+typedef struct _SeplosCapture {
+  const uint8_t *	base;
+  size_t		size;
+  size_t		offset;
+} SeplosCapture;
+
+/*
+ * A fixed-size history of a pack's samples in a memory-mapped file. See
+ * ring.c for the format.
+ */
+typedef struct _SeplosRing {
+  void *	base;
+  size_t	size;
+} SeplosRing;
+
+/* Called by seplos_ring_query() with each sample and its time in milliseconds since the epoch. */
+typedef void (*seplos_ring_cb)(const SeplosData * m, uint64_t time, void * data);
+
+/* The length of the device name kept with a live sample, with its NUL. Longer names are cut short. */
+#define SEPLOS_LIVE_DEVICE 48
+
+/*
+ * The latest sample of every pack, in a shared-memory segment that seplosd
+ * publishes to. See live.c for the format.
+ */
+typedef struct _SeplosLive {
+  void *	base;
+  size_t	size;
+} SeplosLive;
+
+/* A sample copied out of the live segment by seplos_live_read(). */
+typedef struct _SeplosLiveSample {
+  uint64_t	time;		/* Milliseconds since the epoch */
+  char		device[SEPLOS_LIVE_DEVICE];
+  SeplosData	data;
+} SeplosLiveSample;
+
+/*
+ * A record of the history the pack keeps, from HISTORY_GET. The BMS doesn't
+ * say what time zone its clock is in, so the time is taken as local time.
+ * The records carry the telemetry, so the alarms in data are left clear.
+ */
+typedef struct _SeplosHistoryRecord {
+  unsigned int	index;		/* The record number, from 0 for the oldest */
+  unsigned int	records;	/* How many records the pack keeps */
+  uint64_t	time;		/* Milliseconds since the epoch */
+  SeplosData	data;
+} SeplosHistoryRecord;
+
+/* Called with each record of a history download, oldest first. */
+typedef void (*seplos_history_cb)(const SeplosHistoryRecord * r, void * data);
+
+/*
+ * A download of a pack's history, one record per exchange, sent back to back.
+ * Each record goes to the callback as soon as it has arrived, and if a
+ * checkpoint file was given, the position is written to it after each, so an
+ * interrupted download starts again at the record after the last one
+ * delivered. Records no newer than the last one delivered are skipped, in
+ * case the BMS has renumbered them since.
+ */
+typedef struct _SeplosHistory {
+  unsigned int		address;
+  unsigned int		pack;
+  unsigned int		next;		/* The record to ask for next */
+  unsigned int		records;	/* As the last reply said */
+  uint64_t		last;		/* The time of the last record delivered */
+  uint64_t		delivered;	/* Records delivered by this download */
+  int			checkpoint;	/* File descriptor, or -1 */
+  bool			done;		/* The BMS has no more records */
+  bool			restarted;	/* Started over from the first record once */
+  int			status;		/* How a non-blocking download ended */
+  seplos_history_cb	callback;
+  void *		data;
+  SeplosTransaction	transaction;
+} SeplosHistory;
+
+/*
+ * What a pack says about itself, which seldom changes: see metadata.c.
+ * Each item is read with its own command.
+ */
+enum _seplos_metadata_item {
+  SEPLOS_METADATA_PROTOCOL = 1 << 0,		/* PROTOCOL_VER_GET */
+  SEPLOS_METADATA_VENDOR = 1 << 1,		/* VENDOR_GET */
+  SEPLOS_METADATA_TIME = 1 << 2,		/* TIME_GET */
+  SEPLOS_METADATA_TELEREGULATION = 1 << 3,	/* TELEREGULATION_GET */
+  SEPLOS_METADATA_ALL = (1 << 4) - 1
+};
+
+#define SEPLOS_METADATA_ITEMS 4
+#define SEPLOS_MAX_PARAMETERS 64
+
+typedef struct _SeplosMetadata {
+  unsigned int	address;
+  unsigned int	pack;
+  unsigned int	valid;		/* The items that have been read */
+  unsigned int	stale;		/* The items to read again before their time is up */
+  uint64_t	ttl;		/* Nanoseconds before an item is read again */
+  uint64_t	asked_at[SEPLOS_METADATA_ITEMS];	/* CLOCK_MONOTONIC ns, 0 if never */
+  uint32_t	state;		/* The switches, when last observed */
+  unsigned int	generation;	/* Raised whenever a value changes */
+  float		protocol_version;
+  char		device_name[11];
+  uint8_t	software_version[2];	/* Major and minor */
+  char		manufacturer[21];
+  int64_t	clock_offset;	/* Milliseconds the BMS clock is ahead of this machine's */
+  unsigned int	number_of_parameters;
+  uint16_t	parameters[SEPLOS_MAX_PARAMETERS];	/* From TELEREGULATION_GET, in the order sent */
+} SeplosMetadata;
+
+/*
+ * Many packs decoded side by side, for scanning a fleet: each member is an
+ * array with one entry per pack, and the cells and temperatures are stored
+ * by column, so that cell c of every pack is contiguous. The memory is the
+ * caller's, carved up by seplos_batch_init(). A cell a pack doesn't have is
+ * NaN. The alarm members are bitmaps, with bit p % 32 of word p / 32 for
+ * the pack at index p.
+ */
+typedef struct _SeplosBatch {
+  unsigned int	capacity;	/* Packs there is room for */
+  unsigned int	stride;		/* Entries in each column: capacity rounded up to 32 */
+  unsigned int	length;		/* Packs in the batch */
+  float *	current;
+  float *	voltage;
+  float *	state_of_charge;
+  float *	cell_voltage;	/* Cell c of pack p at [(c * stride) + p] */
+  float *	temperature;	/* Sensor t of pack p at [(t * stride) + p] */
+  uint32_t *	alarm;		/* has_alarm */
+  uint32_t *	cell_alarm;	/* has_cell_alarm */
+  uint32_t *	temperature_alarm;	/* has_temperature_alarm */
+  uint8_t *	address;
+  uint8_t *	pack;
+  uint8_t *	number_of_cells;
+} SeplosBatch;
+
+#define SEPLOS_BATCH_STRIDE(capacity) ((((size_t)(capacity)) + 31) & ~(size_t)31)
+
+/* The bytes of memory seplos_batch_init() needs for capacity packs. */
+#define SEPLOS_BATCH_BYTES(capacity) \
+ ((SEPLOS_BATCH_STRIDE(capacity) * (((3 + SEPLOS_N_CELLS + SEPLOS_N_TEMPERATURES) * sizeof(float)) + 3)) \
+ + ((SEPLOS_BATCH_STRIDE(capacity) / 32) * 3 * sizeof(uint32_t)))
+
+/* Where a reduction found its value: the index of the pack in the batch, and the cell or sensor. */
+typedef struct _SeplosBatchExtreme {
+  float		value;
+  unsigned int	index;
+  unsigned int	position;
+} SeplosBatchExtreme;
+
+/* What seplos_batch_scan() finds over the whole batch. Values are NaN for an empty batch. */
+typedef struct _SeplosBatchScan {
+  SeplosBatchExtreme	lowest_cell;
+  SeplosBatchExtreme	highest_cell;
+  SeplosBatchExtreme	largest_imbalance;	/* Highest minus lowest cell of one pack; position is 0 */
+  SeplosBatchExtreme	hottest;
+  SeplosBatchExtreme	coldest;
+  unsigned int		alarms;			/* Packs with has_alarm */
+} SeplosBatchScan;
+
+/* A running mean and variance, by Welford's method. */
+typedef struct _SeplosRunning {
+  uint64_t	count;
+  double	mean;
+  double	m2;		/* Sum of squared differences from the mean */
+} SeplosRunning;
+
+typedef struct _SeplosCell {
+  SeplosRunning	voltage;	/* V */
+  SeplosRunning	drift;		/* V above the mean of the pack's cells */
+  SeplosRunning	resistance;	/* Ohms, from the change of voltage over a step of current */
+  uint64_t	balancing;	/* Samples with the cell being balanced */
+} SeplosCell;
+
+/*
+ * The long-run statistics of every cell of one pack, updated in constant
+ * time by seplos_cells_add(). See cells.c.
+ */
+typedef struct _SeplosCells {
+  uint32_t	address;
+  uint32_t	pack;
+  uint32_t	number_of_cells;
+  float		last_current;
+  uint64_t	samples;
+  uint64_t	last_time;	/* Milliseconds since the epoch */
+  float		last_voltage[SEPLOS_N_CELLS];
+  SeplosCell	cell[SEPLOS_N_CELLS];
+} SeplosCells;
+
+/* A buffer of this size holds any document seplos_cells_json() writes. */
+#define SEPLOS_CELLS_JSON_MAX 4096
+
 extern const char const * seplos_bit_alarm_names[SEPLOS_N_BIT_ALARMS];
 extern const char const * seplos_temperature_names[SEPLOS_N_TEMPERATURES];
+extern const char const * seplos_failure_names[SEPLOS_FAILURE_COUNT];
 
 extern int		seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m);
+extern int		seplos_data_all(seplos_device fd, unsigned int address, SeplosData * m, unsigned int size);
+extern int		seplos_data_buffer(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m, void * buffer, unsigned int buffer_size);
+extern int		seplos_data_all_buffer(seplos_device fd, unsigned int address, SeplosData * m, unsigned int size, void * buffer, unsigned int buffer_size);
 extern seplos_device	seplos_open(const char * serial_device);
+extern seplos_device	seplos_open_serial(const char * serial_device, unsigned int baud, unsigned int byte_timeout);
+extern seplos_device	seplos_open_tcp(const char * address, unsigned int timeout);
+extern seplos_device	seplos_connect_tcp(const struct sockaddr * address, unsigned int length, unsigned int timeout);
+extern int		seplos_parse_tcp(const char * address, char * host, size_t size, const char * * port);
+extern void		seplos_set_reply_timeout(unsigned int milliseconds);
+extern void		seplos_discard_input(seplos_device fd, int transport);
+extern int		seplos_transport(seplos_device fd);
+extern int		seplos_last_failure(void);
+extern const SeplosTiming *	seplos_last_timing(void);
 extern float		seplos_protocol_version(seplos_device fd, unsigned int address);
 extern void		seplos_html(FILE * f, const SeplosData const * m, bool longer);
 extern void		seplos_json(FILE * f, const SeplosData const * m, bool longer);
+extern size_t		seplos_json_format(char * buffer, size_t size, const SeplosData const * m, uint32_t fields);
+extern size_t		seplos_cbor_format(char * buffer, size_t size, const SeplosData const * m, uint32_t fields, uint64_t time);
 extern void		seplos_text(FILE * f, const SeplosData const * m, bool longer);
+
+extern int		seplos_batch_init(SeplosBatch * b, void * memory, size_t size, unsigned int capacity);
+extern void		seplos_batch_clear(SeplosBatch * b);
+extern int		seplos_batch_add(SeplosBatch * b, const SeplosData * m, unsigned int n);
+extern int		seplos_batch_decode(SeplosBatch * b, const SeplosTransaction * telemetry, const SeplosTransaction * telecommand);
+extern void		seplos_batch_cell_range(const SeplosBatch * b, float * lowest, float * highest);
+extern void		seplos_batch_scan(const SeplosBatch * b, SeplosBatchScan * s);
+
+extern void		seplos_cells_init(SeplosCells * c, unsigned int address, unsigned int pack);
+extern void		seplos_cells_add(SeplosCells * c, const SeplosData * m, uint64_t time);
+extern int		seplos_cells_load(SeplosCells * c, const char * path, unsigned int address, unsigned int pack);
+extern int		seplos_cells_save(const SeplosCells * c, const char * path);
+extern size_t		seplos_cells_json(char * buffer, size_t size, const SeplosCells * c);
+extern void		seplos_running_add(SeplosRunning * r, double x);
+extern double		seplos_running_deviation(const SeplosRunning * r);
+
+extern int		seplos_capture_open(const char * path);
+extern void		seplos_capture_flush(void);
+extern void		seplos_capture_close(void);
+extern int		seplos_capture_map(SeplosCapture * c, const char * path);
+extern int		seplos_capture_next(SeplosCapture * c, SeplosCaptureRecord * r);
+extern void		seplos_capture_rewind(SeplosCapture * c);
+extern void		seplos_capture_unmap(SeplosCapture * c);
+extern int		seplos_capture_decode(const SeplosCaptureRecord * r, SeplosData * m, unsigned int size);
+
+extern int		seplos_history_open(SeplosHistory * h, const char * path, unsigned int address, unsigned int pack, seplos_history_cb callback, void * data);
+extern int		seplos_history_download(seplos_device fd, SeplosHistory * h, unsigned int limit);
+extern void		seplos_history_start(SeplosHistory * h);
+extern void		seplos_history_close(SeplosHistory * h);
+
+extern int		seplos_live_open(SeplosLive * l, const char * name, unsigned int capacity);
+extern int		seplos_live_map(SeplosLive * l, const char * name);
+extern void		seplos_live_close(SeplosLive * l);
+extern unsigned int	seplos_live_capacity(const SeplosLive * l);
+extern int		seplos_live_publish(SeplosLive * l, const char * device, const SeplosData * m, uint64_t time);
+extern int		seplos_live_read(const SeplosLive * l, unsigned int index, SeplosLiveSample * sample);
+extern int		seplos_live_find(const SeplosLive * l, const char * device, unsigned int address, unsigned int pack);
+
+extern void		seplos_metadata_init(SeplosMetadata * m, unsigned int address, unsigned int pack, uint64_t ttl);
+extern unsigned int	seplos_metadata_due(const SeplosMetadata * m);
+extern void		seplos_metadata_observe(SeplosMetadata * m, const SeplosData * d);
+extern void		seplos_metadata_start(SeplosTransaction * t, const SeplosMetadata * m, unsigned int item, seplos_transaction_cb callback, void * data);
+extern int		seplos_metadata_decode(const SeplosTransaction * t, SeplosMetadata * m);
+extern int		seplos_metadata(seplos_device fd, SeplosMetadata * m);
+
+extern int		seplos_ring_open(SeplosRing * r, const char * path, unsigned int capacity, unsigned int address, unsigned int pack);
+extern int		seplos_ring_attach(SeplosRing * r, const char * path, unsigned int capacity, unsigned int address, unsigned int pack);
+extern int		seplos_ring_map(SeplosRing * r, const char * path);
+extern void		seplos_ring_close(SeplosRing * r);
+extern void		seplos_ring_append(SeplosRing * r, const SeplosData * m, uint64_t time);
+extern uint64_t		seplos_ring_last(const SeplosRing * r);
+extern int		seplos_ring_query(const SeplosRing * r, uint64_t from, uint64_t to, unsigned int every, seplos_ring_cb callback, void * data);
+
+extern void		seplos_transaction_start(SeplosTransaction * t, unsigned int address, unsigned int command, const void * info, unsigned int info_length, seplos_transaction_cb callback, void * data);
+extern void		seplos_telemetry_start(SeplosTransaction * t, unsigned int address, unsigned int pack, seplos_transaction_cb callback, void * data);
+extern void		seplos_telecommand_start(SeplosTransaction * t, unsigned int address, unsigned int pack, seplos_transaction_cb callback, void * data);
+extern int		seplos_transaction_write(SeplosTransaction * t, seplos_device fd, int transport);
+extern int		seplos_transaction_read(SeplosTransaction * t, seplos_device fd);
+extern int		seplos_transaction_feed(SeplosTransaction * t, const void * data, size_t size);
+extern void		seplos_transaction_fail(SeplosTransaction * t, int error);
+extern int		seplos_decode_telemetry(const SeplosTransaction * t, SeplosData * m);
+extern int		seplos_decode_telecommand(const SeplosTransaction * t, SeplosData * m);
+extern int		seplos_decode_telemetry_packs(const SeplosTransaction * t, SeplosData * m, unsigned int size);
+extern int		seplos_decode_telecommand_packs(const SeplosTransaction * t, SeplosData * m, unsigned int size);
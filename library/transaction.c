@@ -0,0 +1,266 @@
+#include <errno.h>	/* FIX: Abstract away POSIX */
+#include <string.h>
+#include "./internal.h"
+#include "./communication.h"
+
+_Static_assert(sizeof(Seplos_2_0) <= SEPLOS_MAX_FRAME, "SEPLOS_MAX_FRAME is too small for a frame");
+
+static void
+finish(SeplosTransaction * t, int status, int error)
+{
+  /* Whatever arrived is captured, good or bad, so that replay sees it too. */
+  if ( t->state == SEPLOS_TRANSACTION_RECEIVING && t->offset > 0 )
+    _sp_capture(SEPLOS_CAPTURE_REPLY, t->address, t->command, t->pack, t->frame, t->offset);
+
+  /* The checks that failed recorded why in _sp_failure. */
+  if ( status == NORMAL )
+    t->failure = SEPLOS_FAILURE_NONE;
+  else if ( error == ETIMEDOUT )
+    t->failure = SEPLOS_FAILURE_TIMEOUT;
+  else if ( status > 0 || error == EBADMSG )
+    t->failure = _sp_failure != SEPLOS_FAILURE_NONE ? _sp_failure : SEPLOS_FAILURE_MALFORMED;
+  else
+    t->failure = SEPLOS_FAILURE_IO;
+  _sp_failure = t->failure;
+
+  t->finished_at = _sp_now();
+  t->state = SEPLOS_TRANSACTION_DONE;
+  t->status = status;
+  t->error = error;
+  if ( t->callback )
+    (t->callback)(t, status);
+}
+
+void
+seplos_transaction_start(
+ SeplosTransaction *	t,
+ unsigned int		address,
+ unsigned int		command,
+ const void *		info,
+ unsigned int		info_length,
+ seplos_transaction_cb	callback,
+ void *			data)
+{
+  bool	invalid = false;
+
+  t->address = address;
+  t->command = command;
+  t->length = _sp_encode_command(address, command, info, info_length, (Seplos_2_0 *)t->frame);
+  t->offset = 0;
+  t->status = 0;
+  t->error = 0;
+  t->failure = _sp_failure = SEPLOS_FAILURE_NONE;
+  t->skipped = 0;
+  t->started_at = _sp_now();
+  t->sent_at = t->first_byte_at = t->finished_at = 0;
+  t->pack = info_length >= 2 ? _sp_hex2b(info, &invalid) : 0;
+  t->callback = callback;
+  t->data = data;
+  t->state = SEPLOS_TRANSACTION_SENDING;
+  _sp_capture(SEPLOS_CAPTURE_REQUEST, address, command, t->pack, t->frame, t->length);
+}
+
+void
+seplos_telemetry_start(SeplosTransaction * t, unsigned int address, unsigned int pack, seplos_transaction_cb callback, void * data)
+{
+  uint8_t	pack_info[2];
+
+  _sp_hex2(pack, pack_info);
+  seplos_transaction_start(t, address, TELEMETRY_GET, pack_info, sizeof(pack_info), callback, data);
+}
+
+void
+seplos_telecommand_start(SeplosTransaction * t, unsigned int address, unsigned int pack, seplos_transaction_cb callback, void * data)
+{
+  uint8_t	pack_info[2];
+
+  _sp_hex2(pack, pack_info);
+  seplos_transaction_start(t, address, TELECOMMAND_GET, pack_info, sizeof(pack_info), callback, data);
+}
+
+/*
+ * Returns 0 once the whole request has been written, 1 if the device would
+ * block and this should be called again when it is writable, or -1 on error.
+ */
+int
+seplos_transaction_write(SeplosTransaction * t, seplos_device fd, int transport)
+{
+  if ( t->state != SEPLOS_TRANSACTION_SENDING )
+    return 0;
+
+  while ( t->offset < t->length ) {
+    const int ret = _sp_write_serial(fd, transport, &(t->frame[t->offset]), t->length - t->offset);
+    if ( ret < 0 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+        return 1;
+      _sp_error("Write: %s\n", strerror(errno)); /* FIX: Abstract away POSIX */
+      finish(t, -1, errno);
+      return -1;
+    }
+    t->offset += ret;
+  }
+
+  /* The reply reuses the frame. Read the fixed 18-byte part first. */
+  t->sent_at = _sp_now();
+  t->state = SEPLOS_TRANSACTION_RECEIVING;
+  t->length = 18;
+  t->offset = 0;
+  return 0;
+}
+
+/*
+ * Give up on a frame that failed its checks for a later '~' among the bytes
+ * already in, if there is one. The frame is captured first, as it was.
+ */
+static bool
+resync(SeplosTransaction * t)
+{
+  if ( !_sp_resyncable(t->frame, t->offset) )
+    return false;
+
+  _sp_capture(SEPLOS_CAPTURE_REPLY, t->address, t->command, t->pack, t->frame, t->offset);
+  t->skipped += _sp_resync(t->frame, 1, &(t->offset));
+  t->length = 18;
+  return true;
+}
+
+/*
+ * Account for bytes that have been placed at the end of the frame, and
+ * validate the header or the whole frame once enough has arrived. Bytes
+ * before the '~' that starts a frame are dropped, so line noise ahead of the
+ * reply costs only the bytes it hit. The header is checked again each time,
+ * since a resync can move a different frame into place.
+ */
+static int
+received(SeplosTransaction * t, unsigned int size)
+{
+  Seplos_2_0 * const	result = (Seplos_2_0 *)t->frame;
+  unsigned int		length;
+  int			status;
+
+  if ( t->first_byte_at == 0 && size > 0 )
+    t->first_byte_at = _sp_now();
+  t->offset += size;
+
+  for ( ;; ) {
+    if ( t->offset > 0 && result->start != '~' ) {
+      t->skipped += _sp_resync(t->frame, 0, &(t->offset));
+      t->length = 18;
+      continue;
+    }
+
+    if ( t->offset < 18 )
+      return 0;
+
+    _sp_quiet = _sp_resyncable(t->frame, t->offset);
+    status = _sp_check_header(result, &length);
+    _sp_quiet = false;
+    if ( status < 0 ) {
+      if ( resync(t) )
+        continue;
+      finish(t, -1, errno);
+      return -1;
+    }
+
+    t->length = 18 + length;
+    if ( t->offset < t->length )
+      return 0;
+
+    _sp_quiet = _sp_resyncable(t->frame, t->offset);
+    status = _sp_decode_info(result, length, t->info);
+    _sp_quiet = false;
+    if ( status < 0 && resync(t) )
+      continue;
+    finish(t, status, status < 0 ? errno : 0);
+    return status < 0 ? -1 : 0;
+  }
+}
+
+/*
+ * Returns the number of bytes consumed, or -1 if the reply was bad. Bytes past
+ * the end of the reply are not consumed.
+ */
+int
+seplos_transaction_feed(SeplosTransaction * t, const void * data, size_t size)
+{
+  unsigned int	consumed = 0;
+
+  while ( t->state == SEPLOS_TRANSACTION_RECEIVING && consumed < size ) {
+    unsigned int amount = t->length - t->offset;
+    if ( amount > size - consumed )
+      amount = size - consumed;
+
+    memcpy(&(t->frame[t->offset]), (const char *)data + consumed, amount);
+    consumed += amount;
+    if ( received(t, amount) < 0 )
+      return -1;
+  }
+  return consumed;
+}
+
+/*
+ * Read whatever the device has for us. Returns 1 if more is expected, 0 when
+ * the transaction has completed, or -1 on error.
+ */
+int
+seplos_transaction_read(SeplosTransaction * t, seplos_device fd)
+{
+  while ( t->state == SEPLOS_TRANSACTION_RECEIVING ) {
+    const int ret = _sp_read_available(fd, &(t->frame[t->offset]), t->length - t->offset);
+    if ( ret < 0 ) {
+      finish(t, -1, errno);
+      return -1;
+    }
+    else if ( ret == 0 )
+      return 1;
+
+    if ( received(t, ret) < 0 )
+      return -1;
+  }
+  return 0;
+}
+
+/* Abandon a transaction, for instance because the caller's deadline passed. */
+void
+seplos_transaction_fail(SeplosTransaction * t, int error)
+{
+  if ( t->state == SEPLOS_TRANSACTION_SENDING || t->state == SEPLOS_TRANSACTION_RECEIVING )
+    finish(t, -1, error);
+}
+
+int
+seplos_decode_telemetry(const SeplosTransaction * t, SeplosData * m)
+{
+  m->controller_address = t->address;
+  m->battery_pack_number = t->pack;
+  return _sp_decode_telemetry((const Seplos_2_0 *)t->frame, t->info, m);
+}
+
+int
+seplos_decode_telecommand(const SeplosTransaction * t, SeplosData * m)
+{
+  m->controller_address = t->address;
+  m->battery_pack_number = t->pack;
+  return _sp_decode_telecommand((const Seplos_2_0 *)t->frame, t->info, m);
+}
+
+/*
+ * For replies to SEPLOS_ALL_PACKS. Decode the telemetry reply first, then
+ * the telecommand reply into the same array. Both return the number of packs
+ * decoded, or -1 if the reply is malformed.
+ */
+int
+seplos_decode_telemetry_packs(const SeplosTransaction * t, SeplosData * m, unsigned int size)
+{
+  const int packs = _sp_decode_telemetry_packs((const Seplos_2_0 *)t->frame, t->info, m, size);
+
+  for ( int i = 0; i < packs; i++ )
+    m[i].controller_address = t->address;
+  return packs;
+}
+
+int
+seplos_decode_telecommand_packs(const SeplosTransaction * t, SeplosData * m, unsigned int size)
+{
+  return _sp_decode_telecommand_packs((const Seplos_2_0 *)t->frame, t->info, m, size);
+}
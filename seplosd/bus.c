@@ -0,0 +1,868 @@
+#include "bus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+static void __bus_on_poll(uv_poll_t *poll, int status, int events);
+static void __bus_on_deadline(uv_timer_t *timer);
+
+static void __bus_on_poll_closed(uv_handle_t *handle)
+{
+    free(handle);
+}
+
+static void __bus_release_poll(seplosd_bus_t *bus)
+{
+    if (bus->poll)
+    {
+        uv_close((uv_handle_t *)bus->poll, __bus_on_poll_closed);
+        bus->poll = NULL;
+    }
+}
+
+static void __bus_publish_pending(seplosd_bus_t *bus);
+static void __bus_apply(seplosd_bus_t *bus, seplosd_bus_t *from);
+
+static void __bus_finish(seplosd_bus_t *bus, int r, int error)
+{
+    __bus_publish_pending(bus);
+    seplos_capture_flush();
+    bus->busy = false;
+    uv_timer_stop(&bus->deadline);
+
+    if (bus->poll)
+    {
+        uv_poll_stop(bus->poll);
+    }
+
+    seplosd_session_result(&bus->session, r, error, uv_now(bus->loop));
+
+    /* The session closed the device, so its poll handle has to go too. */
+    if (bus->session.fd < 0)
+    {
+        __bus_release_poll(bus);
+    }
+
+    if (bus->reload)
+    {
+        __bus_apply(bus, bus->reload);
+        bus->reload = NULL;
+    }
+}
+
+static void __bus_send(seplosd_bus_t *bus)
+{
+    int r;
+
+    if ((r = seplos_transaction_write(&bus->transaction, bus->session.fd, bus->session.transport)) < 0)
+    {
+        /* the transaction callback has already handled the failure. */
+        return;
+    }
+
+    uv_poll_start(bus->poll, r > 0 ? UV_WRITABLE : UV_READABLE, __bus_on_poll);
+    uv_timer_start(&bus->deadline, __bus_on_deadline, bus->reply_timeout, 0);
+}
+
+static void __bus_on_telemetry(SeplosTransaction *t, int status);
+static void __bus_on_telecommand(SeplosTransaction *t, int status);
+static void __bus_on_metadata(SeplosTransaction *t, int status);
+
+/*
+ * With all_packs, only the first pack at each address is asked, for all of
+ * them. Metadata is asked of every pack.
+ */
+static bool __bus_asks(const seplosd_bus_t *bus, size_t index)
+{
+    if (!bus->all_packs || bus->phase == SEPLOSD_BUS_METADATA)
+    {
+        return true;
+    }
+
+    for (size_t i = 0; i < index; i++)
+    {
+        if (bus->packs[i].address == bus->packs[index].address)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool __bus_due(const seplosd_bus_t *bus, const seplosd_pack_t *pack)
+{
+    if (bus->phase == SEPLOSD_BUS_TELEMETRY)
+    {
+        return bus->sweep_at >= pack->next_telemetry;
+    }
+
+    /* A pack that isn't answering would only fail, and not be asked again for a long time. */
+    if (bus->phase == SEPLOSD_BUS_METADATA)
+    {
+        return pack->answered && seplos_metadata_due(&pack->metadata) != 0;
+    }
+
+    return pack->telecommand_due;
+}
+
+/*
+ * Sends the next command in the sweep, or ends the sweep. The telemetry of
+ * every pack that is due goes first, then the telecommands, then whatever
+ * metadata is due, so the measurements never wait behind the slower-changing
+ * alarm state, and neither waits behind the metadata.
+ */
+static void __bus_next(seplosd_bus_t *bus)
+{
+    const seplosd_pack_t *pack;
+
+    while (bus->current < bus->n_packs &&
+           (!__bus_asks(bus, bus->current) || !__bus_due(bus, &bus->packs[bus->current])))
+    {
+        bus->current++;
+    }
+
+    if (bus->current >= bus->n_packs)
+    {
+        if (bus->phase != SEPLOSD_BUS_METADATA)
+        {
+            bus->phase = bus->phase == SEPLOSD_BUS_TELEMETRY ? SEPLOSD_BUS_TELECOMMAND : SEPLOSD_BUS_METADATA;
+            bus->current = 0;
+            __bus_next(bus);
+            return;
+        }
+
+        __bus_finish(bus, 0, 0);
+        return;
+    }
+
+    pack = &bus->packs[bus->current];
+    memset(bus->samples, 0, sizeof(bus->samples));
+    bus->n_samples = 0;
+
+    if (bus->phase == SEPLOSD_BUS_TELEMETRY)
+    {
+        seplos_telemetry_start(&bus->transaction, pack->address,
+                               bus->all_packs ? SEPLOS_ALL_PACKS : pack->pack,
+                               __bus_on_telemetry, bus);
+    }
+    else if (bus->phase == SEPLOSD_BUS_TELECOMMAND)
+    {
+        seplos_telecommand_start(&bus->transaction, pack->address,
+                                 bus->all_packs ? SEPLOS_ALL_PACKS : pack->pack,
+                                 __bus_on_telecommand, bus);
+    }
+    else
+    {
+        seplos_metadata_start(&bus->transaction, &pack->metadata, seplos_metadata_due(&pack->metadata),
+                              __bus_on_metadata, bus);
+    }
+
+    __bus_send(bus);
+}
+
+/* Sends the command that failed again, for the same pack. */
+static void __bus_on_retry(uv_timer_t *timer)
+{
+    __bus_next((seplosd_bus_t *)timer->data);
+}
+
+/*
+ * A damaged reply is worth asking for again at once, and so is a timeout
+ * from a pack that has been answering, which on a noisy bus is usually a
+ * request that the pack never made out. A pack that hasn't been answering
+ * would only time out again, and one that answered with an error code would
+ * only send it again.
+ */
+static bool __bus_retries(const seplosd_bus_t *bus, const seplosd_pack_t *pack, int failure)
+{
+    if (bus->attempt >= bus->retries)
+    {
+        return false;
+    }
+
+    switch (failure)
+    {
+    case SEPLOS_FAILURE_TIMEOUT:
+        return pack->reachable;
+    case SEPLOS_FAILURE_RESPONSE:
+    case SEPLOS_FAILURE_IO:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static void __bus_pack_failed(seplosd_bus_t *bus, const char *what, int status, int error, int failure)
+{
+    seplosd_pack_t *pack = &bus->packs[bus->current];
+
+    pack->stats.failures[failure]++;
+
+    if (seplosd_session_is_io_error(error))
+    {
+        log_error("%s: %s failed for address %u pack %u. status=%d %s", bus->session.device, what,
+                  pack->address, bus->all_packs ? SEPLOS_ALL_PACKS : pack->pack,
+                  status, status < 0 ? strerror(error) : "");
+        pack->telecommand_due = false;
+        __bus_finish(bus, -1, error);
+        return;
+    }
+
+    /* A late answer from this pack must not be mistaken for the next one's, or for the retry's. */
+    seplos_discard_input(bus->session.fd, bus->session.transport);
+
+    if (__bus_retries(bus, pack, failure))
+    {
+        const uint64_t delay = bus->retry_jitter ? rand_r(&bus->seed) % (bus->retry_jitter + 1) : 0;
+
+        bus->attempt++;
+        pack->stats.retries++;
+        log_warn("%s: %s failed for address %u pack %u, asking again in %llu ms (%u of %u). status=%d %s",
+                 bus->session.device, what, pack->address, bus->all_packs ? SEPLOS_ALL_PACKS : pack->pack,
+                 (unsigned long long)delay, bus->attempt, bus->retries, status, status < 0 ? strerror(error) : "");
+
+        /*
+         * The transaction is done, so a byte that arrives during the pause
+         * would only wake the poll again and again. __bus_send() re-arms it.
+         */
+        uv_poll_stop(bus->poll);
+        uv_timer_start(&bus->deadline, __bus_on_retry, delay, 0);
+        return;
+    }
+
+    log_error("%s: %s failed for address %u pack %u. status=%d %s", bus->session.device, what,
+              pack->address, bus->all_packs ? SEPLOS_ALL_PACKS : pack->pack,
+              status, status < 0 ? strerror(error) : "");
+
+    /* Its telemetry is still published, with the alarm state from before. */
+    pack->telecommand_due = false;
+    pack->reachable = false;
+
+    /* Only this pack is affected, so carry on with the rest of the sweep. */
+    bus->attempt = 0;
+    bus->current++;
+    __bus_next(bus);
+}
+
+static void __bus_publish(seplosd_bus_t *bus, seplosd_pack_t *pack)
+{
+    pack->pending = false;
+
+    if (bus->on_sample)
+    {
+        bus->on_sample(bus, pack);
+    }
+}
+
+/* Publishes the packs whose telemetry was waiting for a telecommand that didn't come. */
+static void __bus_publish_pending(seplosd_bus_t *bus)
+{
+    for (size_t i = 0; i < bus->n_packs; i++)
+    {
+        if (bus->packs[i].pending)
+        {
+            __bus_publish(bus, &bus->packs[i]);
+        }
+    }
+}
+
+/* Copies what TELEMETRY_GET reports, leaving what TELECOMMAND_GET reports alone. */
+static void __bus_merge_telemetry(SeplosData *into, const SeplosData *telemetry)
+{
+    into->lowest_temperature = telemetry->lowest_temperature;
+    into->highest_temperature = telemetry->highest_temperature;
+    into->lowest_cell_voltage = telemetry->lowest_cell_voltage;
+    into->highest_cell_voltage = telemetry->highest_cell_voltage;
+    into->number_of_cells = telemetry->number_of_cells;
+    into->charge_discharge_current = telemetry->charge_discharge_current;
+    into->total_battery_voltage = telemetry->total_battery_voltage;
+    into->residual_capacity = telemetry->residual_capacity;
+    into->battery_capacity = telemetry->battery_capacity;
+    into->state_of_charge = telemetry->state_of_charge;
+    into->rated_capacity = telemetry->rated_capacity;
+    into->number_of_cycles = telemetry->number_of_cycles;
+    into->state_of_health = telemetry->state_of_health;
+    into->port_voltage = telemetry->port_voltage;
+    memcpy(into->cell_voltage, telemetry->cell_voltage, sizeof(into->cell_voltage));
+    memcpy(into->temperature, telemetry->temperature, sizeof(into->temperature));
+}
+
+/* Finds the sample for a pack in the reply, which may be for all packs at its address. */
+static const SeplosData *__bus_sample(const seplosd_bus_t *bus, const seplosd_pack_t *pack)
+{
+    if (!bus->all_packs)
+    {
+        return bus->n_samples > 0 ? &bus->samples[0] : NULL;
+    }
+
+    for (int j = 0; j < bus->n_samples; j++)
+    {
+        if (bus->samples[j].battery_pack_number == pack->pack)
+        {
+            return &bus->samples[j];
+        }
+    }
+
+    log_warn("%s: address %u has no data for pack %u", bus->session.device, pack->address, pack->pack);
+    return NULL;
+}
+
+/*
+ * Merges a reply into every configured pack it answers for: the current
+ * pack, or with all_packs every pack at the same address.
+ */
+static void __bus_merge(seplosd_bus_t *bus, bool telemetry)
+{
+    const seplosd_pack_t *asked = &bus->packs[bus->current];
+
+    for (size_t i = bus->current; i < bus->n_packs; i++)
+    {
+        seplosd_pack_t *pack = &bus->packs[i];
+        const SeplosData *sample;
+
+        if ((i != bus->current && !bus->all_packs) || pack->address != asked->address)
+        {
+            continue;
+        }
+
+        if (!(sample = __bus_sample(bus, pack)))
+        {
+            continue;
+        }
+
+        if (telemetry)
+        {
+            __bus_merge_telemetry(&pack->data, sample);
+            pack->answered = true;
+        }
+        else
+        {
+            SeplosData merged = *sample;
+
+            __bus_merge_telemetry(&merged, &pack->data);
+            pack->data = merged;
+            seplos_metadata_observe(&pack->metadata, &pack->data);
+        }
+
+        pack->data.controller_address = pack->address;
+        pack->data.battery_pack_number = pack->pack;
+
+        /* Telemetry that is followed by a telecommand is published with it. */
+        if (telemetry && asked->telecommand_due)
+        {
+            pack->pending = true;
+        }
+        else
+        {
+            __bus_publish(bus, pack);
+        }
+    }
+}
+
+/* Times the stages of the exchange that just ended, as far as it got. */
+static void __bus_observe(seplosd_pack_t *pack, const SeplosTransaction *t, int status)
+{
+    pack->stats.skipped += t->skipped;
+
+    if (t->sent_at)
+    {
+        seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_WRITE], t->sent_at - t->started_at);
+    }
+
+    if (t->first_byte_at)
+    {
+        seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_FIRST_BYTE], t->first_byte_at - t->sent_at);
+
+        if (status == NORMAL)
+        {
+            seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_FRAME], t->finished_at - t->first_byte_at);
+        }
+    }
+}
+
+/* FNV-1a, to tell whether a reply is the same as an earlier one. */
+static uint32_t __bus_digest(const SeplosTransaction *t)
+{
+    uint32_t hash = 2166136261u;
+
+    for (unsigned int i = 0; i < t->length; i++)
+    {
+        hash = (hash ^ (uint8_t)t->frame[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Alarm and switch state follow the measurements, so once the pack's
+ * telecommand_interval has passed it is only asked again if the telemetry
+ * has changed since the last time. That skips half of the bus traffic for a
+ * pack that is sitting idle.
+ */
+static bool __bus_telecommand_due(const seplosd_bus_t *bus, const seplosd_pack_t *pack)
+{
+    if (bus->sweep_at < pack->next_telecommand)
+    {
+        return false;
+    }
+
+    if (pack->telemetry_digest == pack->telecommand_digest)
+    {
+        log_trace("%s: telemetry for address %u pack %u unchanged, not asking for alarms",
+                  bus->session.device, pack->address, pack->pack);
+        return false;
+    }
+
+    return true;
+}
+
+static void __bus_on_telecommand(SeplosTransaction *t, int status)
+{
+    seplosd_bus_t *bus = (seplosd_bus_t *)t->data;
+    seplosd_pack_t *pack = &bus->packs[bus->current];
+    uint64_t started;
+
+    __bus_observe(pack, t, status);
+
+    if (status != NORMAL)
+    {
+        __bus_pack_failed(bus, "telecommand", status, status < 0 ? t->error : EBADMSG, t->failure);
+        return;
+    }
+
+    started = uv_hrtime();
+    if (bus->all_packs)
+    {
+        bus->n_samples = seplos_decode_telecommand_packs(t, bus->samples, SEPLOS_MAX_PACKS);
+    }
+    else
+    {
+        bus->n_samples = seplos_decode_telecommand(t, &bus->samples[0]) < 0 ? -1 : 1;
+    }
+    seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_DECODE], uv_hrtime() - started);
+
+    if (bus->n_samples < 0)
+    {
+        __bus_pack_failed(bus, "telecommand decode", -1, EBADMSG, SEPLOS_FAILURE_MALFORMED);
+        return;
+    }
+
+    pack->stats.failures[SEPLOS_FAILURE_NONE]++;
+    pack->reachable = true;
+    bus->attempt = 0;
+
+    pack->telecommand_due = false;
+    pack->telecommand_digest = pack->telemetry_digest;
+    pack->next_telecommand = bus->sweep_at + pack->telecommand_interval;
+
+    __bus_merge(bus, false);
+
+    bus->current++;
+    __bus_next(bus);
+}
+
+static void __bus_on_telemetry(SeplosTransaction *t, int status)
+{
+    seplosd_bus_t *bus = (seplosd_bus_t *)t->data;
+    seplosd_pack_t *pack = &bus->packs[bus->current];
+    uint64_t started;
+
+    __bus_observe(pack, t, status);
+
+    if (status != NORMAL)
+    {
+        __bus_pack_failed(bus, "telemetry", status, status < 0 ? t->error : EBADMSG, t->failure);
+        return;
+    }
+
+    started = uv_hrtime();
+    if (bus->all_packs)
+    {
+        bus->n_samples = seplos_decode_telemetry_packs(t, bus->samples, SEPLOS_MAX_PACKS);
+    }
+    else
+    {
+        bus->n_samples = seplos_decode_telemetry(t, &bus->samples[0]) < 0 ? -1 : 1;
+    }
+    seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_DECODE], uv_hrtime() - started);
+
+    if (bus->n_samples < 0)
+    {
+        __bus_pack_failed(bus, "telemetry decode", -1, EBADMSG, SEPLOS_FAILURE_MALFORMED);
+        return;
+    }
+
+    pack->stats.failures[SEPLOS_FAILURE_NONE]++;
+    pack->reachable = true;
+    bus->attempt = 0;
+
+    pack->next_telemetry = bus->sweep_at + pack->interval;
+    pack->telemetry_digest = __bus_digest(t);
+    pack->telecommand_due = __bus_telecommand_due(bus, pack);
+
+    __bus_merge(bus, true);
+
+    bus->current++;
+    __bus_next(bus);
+}
+
+/*
+ * A pack that doesn't answer a metadata command, or doesn't know it, isn't
+ * asked again until metadata_ttl has passed, so it costs one timeout per
+ * metadata_ttl at most. The rest of its metadata is still published.
+ */
+static void __bus_on_metadata(SeplosTransaction *t, int status)
+{
+    seplosd_bus_t *bus = (seplosd_bus_t *)t->data;
+    seplosd_pack_t *pack = &bus->packs[bus->current];
+
+    if (seplos_metadata_decode(t, &pack->metadata) < 0)
+    {
+        log_warn("%s: command %02X failed for address %u pack %u, not asking again until metadata_ttl has passed. status=%d %s",
+                 bus->session.device, t->command, pack->address, pack->pack, status,
+                 status < 0 ? strerror(t->error) : "");
+
+        if (status < 0 && seplosd_session_is_io_error(t->error))
+        {
+            __bus_finish(bus, -1, t->error);
+            return;
+        }
+
+        seplos_discard_input(bus->session.fd, bus->session.transport);
+    }
+
+    /* __bus_next() stays on this pack while more of its metadata is due. */
+    __bus_next(bus);
+}
+
+static void __bus_on_poll(uv_poll_t *poll, int status, int events)
+{
+    seplosd_bus_t *bus = (seplosd_bus_t *)poll->data;
+
+    if (status < 0)
+    {
+        log_error("%s: poll error: %s", bus->session.device, uv_strerror(status));
+        seplos_transaction_fail(&bus->transaction, EIO);
+        return;
+    }
+
+    if (events & UV_WRITABLE)
+    {
+        __bus_send(bus);
+    }
+    else if (events & UV_READABLE)
+    {
+        const bool started = bus->transaction.offset > 0;
+
+        /* Once the pack has started to answer, give it the rest of timeout. */
+        if (seplos_transaction_read(&bus->transaction, bus->session.fd) == 1 && !started &&
+            bus->transaction.offset > 0 && bus->timeout > bus->reply_timeout)
+        {
+            uv_timer_start(&bus->deadline, __bus_on_deadline, bus->timeout - bus->reply_timeout, 0);
+        }
+    }
+}
+
+static void __bus_on_deadline(uv_timer_t *timer)
+{
+    seplosd_bus_t *bus = (seplosd_bus_t *)timer->data;
+
+    /* A serial server that never accepted the connection is a device problem, not a silent pack. */
+    if (bus->transaction.state == SEPLOS_TRANSACTION_SENDING)
+    {
+        log_warn("%s: the device did not take the request within %llu ms", bus->session.device,
+                 (unsigned long long)bus->reply_timeout);
+        seplos_transaction_fail(&bus->transaction, EIO);
+        return;
+    }
+
+    if (bus->transaction.offset == 0)
+    {
+        log_warn("%s: bms did not start answering within %llu ms", bus->session.device,
+                 (unsigned long long)bus->reply_timeout);
+    }
+    else
+    {
+        log_warn("%s: bms did not finish answering within %llu ms", bus->session.device,
+                 (unsigned long long)bus->timeout);
+    }
+    seplos_transaction_fail(&bus->transaction, ETIMEDOUT);
+}
+
+int seplosd_bus_init(uv_loop_t *loop, seplosd_bus_t *bus, uint64_t timeout,
+                     uint64_t reply_timeout, uint64_t backoff_min, uint64_t backoff_max,
+                     uint64_t metadata_ttl, unsigned int retries, uint64_t retry_jitter,
+                     seplosd_bus_sample_cb on_sample, void *udata)
+{
+    int r;
+
+    bus->loop = loop;
+    bus->poll = NULL;
+    bus->timeout = timeout;
+    bus->reply_timeout = reply_timeout < timeout ? reply_timeout : timeout;
+    bus->metadata_ttl = metadata_ttl;
+    bus->retries = retries;
+    bus->retry_jitter = retry_jitter;
+    bus->attempt = 0;
+    bus->seed = (unsigned int)uv_hrtime() ^ (unsigned int)(uintptr_t)bus;
+    bus->busy = false;
+    bus->current = 0;
+    bus->reload = NULL;
+    bus->on_sample = on_sample;
+    bus->udata = udata;
+
+    for (size_t i = 0; i < bus->n_packs; i++)
+    {
+        seplos_metadata_init(&bus->packs[i].metadata, bus->packs[i].address, bus->packs[i].pack, metadata_ttl);
+    }
+
+    seplosd_session_init(loop, &bus->session, bus->device, bus->baud, backoff_min, backoff_max);
+
+    if ((r = uv_timer_init(loop, &bus->deadline)) < 0)
+    {
+        log_error("uv timer initialization failed: %s", uv_strerror(r));
+        return -1;
+    }
+
+    bus->deadline.data = bus;
+
+    return 0;
+}
+
+int seplosd_bus_poll(seplosd_bus_t *bus)
+{
+    int fd, r;
+
+    if (bus->busy)
+    {
+        log_warn("%s: previous sweep still in progress, skipping this one", bus->session.device);
+        return -1;
+    }
+
+    if ((fd = seplosd_session_get(&bus->session, uv_now(bus->loop))) < 0)
+    {
+        return -1;
+    }
+
+    if (!bus->poll)
+    {
+        /* The transaction engine needs reads and writes that never wait. */
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        {
+            log_error("%s: cannot make device non-blocking: %s", bus->session.device, strerror(errno));
+            seplosd_session_result(&bus->session, -1, errno, uv_now(bus->loop));
+            return -1;
+        }
+
+        if (!(bus->poll = malloc(sizeof(*bus->poll))))
+        {
+            log_error("out of memory allocating poll handle.");
+            return -1;
+        }
+
+        if ((r = uv_poll_init(bus->loop, bus->poll, fd)) < 0)
+        {
+            log_error("%s: uv poll initialization failed: %s", bus->session.device, uv_strerror(r));
+            free(bus->poll);
+            bus->poll = NULL;
+            return -1;
+        }
+
+        bus->poll->data = bus;
+    }
+
+    bus->busy = true;
+    bus->current = 0;
+    bus->attempt = 0;
+    bus->phase = SEPLOSD_BUS_TELEMETRY;
+    bus->sweep_at = uv_now(bus->loop);
+
+    for (size_t i = 0; i < bus->n_packs; i++)
+    {
+        bus->packs[i].telecommand_due = false;
+        bus->packs[i].pending = false;
+        bus->packs[i].answered = false;
+    }
+
+    /*
+     * Flush once for the whole sweep. After that every request goes out as
+     * soon as the previous reply has been read.
+     */
+    seplos_discard_input(fd, bus->session.transport);
+    __bus_next(bus);
+
+    return 0;
+}
+
+seplosd_pack_t *seplosd_bus_find(const seplosd_bus_t *bus, unsigned int address, unsigned int pack)
+{
+    for (size_t i = 0; i < bus->n_packs; i++)
+    {
+        if (bus->packs[i].address == address && bus->packs[i].pack == pack)
+        {
+            return &bus->packs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void __bus_free_packs(seplosd_pack_t *packs, size_t n_packs)
+{
+    for (size_t i = 0; i < n_packs; i++)
+    {
+        seplos_ring_close(&packs[i].ring);
+        free(packs[i].topic);
+    }
+
+    free(packs);
+}
+
+static void __bus_free(seplosd_bus_t *bus)
+{
+    __bus_free_packs(bus->packs, bus->n_packs);
+    free(bus->device);
+    free(bus);
+}
+
+/* The old pack at address and pack that hasn't been carried over yet, if any. */
+static seplosd_pack_t *__bus_take(seplosd_bus_t *bus, bool *taken, unsigned int address, unsigned int pack)
+{
+    for (size_t i = 0; i < bus->n_packs; i++)
+    {
+        if (!taken[i] && bus->packs[i].address == address && bus->packs[i].pack == pack)
+        {
+            taken[i] = true;
+            return &bus->packs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Moves the packs of from onto the bus, carrying over the state of those it
+ * already had. An old pack that has been carried over is left zeroed, so taken
+ * says which they are rather than the zeroes, which are also a valid pack.
+ */
+static void __bus_apply(seplosd_bus_t *bus, seplosd_bus_t *from)
+{
+    seplosd_pack_t *packs;
+    bool *taken;
+
+    packs = calloc(from->n_packs ? from->n_packs : 1, sizeof(*packs));
+    taken = calloc(bus->n_packs ? bus->n_packs : 1, sizeof(*taken));
+
+    if (!packs || !taken)
+    {
+        log_error("%s: out of memory reloading the packs, keeping the old ones.", bus->device);
+        free(packs);
+        free(taken);
+        __bus_free(from);
+        return;
+    }
+
+    for (size_t i = 0; i < from->n_packs; i++)
+    {
+        seplosd_pack_t *next = &from->packs[i];
+        seplosd_pack_t *kept = __bus_take(bus, taken, next->address, next->pack);
+
+        if (!kept)
+        {
+            log_info("%s: now polling address %u pack %u.  topic=%s", bus->device, next->address, next->pack,
+                     next->topic);
+            packs[i] = *next;
+            seplos_metadata_init(&packs[i].metadata, next->address, next->pack, from->metadata_ttl);
+            memset(next, 0, sizeof(*next));
+            continue;
+        }
+
+        packs[i] = *kept;
+        memset(kept, 0, sizeof(*kept));
+
+        /* Subscribers of a new topic need a whole document and the config to start from. */
+        if (strcmp(packs[i].topic, next->topic))
+        {
+            log_info("%s: address %u pack %u now publishes to %s.", bus->device, next->address, next->pack,
+                     next->topic);
+            packs[i].published.valid = false;
+            packs[i].announced = packs[i].metadata.generation - 1;
+        }
+
+        free(packs[i].topic);
+        packs[i].topic = next->topic;
+        next->topic = NULL;
+        packs[i].interval = next->interval;
+        packs[i].telecommand_interval = next->telecommand_interval;
+        packs[i].metadata.ttl = from->metadata_ttl * 1000000;
+        seplos_ring_close(&next->ring);
+    }
+
+    /* What is left of the old list are the packs that are gone. */
+    for (size_t i = 0; i < bus->n_packs; i++)
+    {
+        if (!taken[i])
+        {
+            log_info("%s: no longer polling address %u pack %u.", bus->device, bus->packs[i].address,
+                     bus->packs[i].pack);
+        }
+    }
+
+    free(taken);
+    __bus_free_packs(bus->packs, bus->n_packs);
+    bus->packs = packs;
+    bus->n_packs = from->n_packs;
+    bus->all_packs = from->all_packs;
+    bus->timeout = from->timeout;
+    bus->reply_timeout = from->reply_timeout < from->timeout ? from->reply_timeout : from->timeout;
+    bus->metadata_ttl = from->metadata_ttl;
+    bus->retries = from->retries;
+    bus->retry_jitter = from->retry_jitter;
+    bus->current = 0;
+
+    if (from->baud != bus->baud)
+    {
+        log_info("%s: reopening at %u baud.", bus->device, from->baud);
+        bus->baud = bus->session.baud = from->baud;
+        __bus_release_poll(bus);
+        seplosd_session_close(&bus->session);
+    }
+
+    __bus_free(from);
+}
+
+void seplosd_bus_reconfigure(seplosd_bus_t *bus, seplosd_bus_t *from)
+{
+    /* Only the latest configuration matters. */
+    if (bus->reload)
+    {
+        __bus_free(bus->reload);
+        bus->reload = NULL;
+    }
+
+    if (bus->busy)
+    {
+        bus->reload = from;
+        return;
+    }
+
+    __bus_apply(bus, from);
+}
+
+void seplosd_bus_close(seplosd_bus_t *bus)
+{
+    if (bus->reload)
+    {
+        __bus_free(bus->reload);
+        bus->reload = NULL;
+    }
+
+    uv_timer_stop(&bus->deadline);
+    __bus_release_poll(bus);
+    seplosd_session_close(&bus->session);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "pack.h"
+#include "seplos.h"
+#include "session.h"
+
+struct seplosd_bus;
+
+enum seplosd_bus_phase {
+    SEPLOSD_BUS_TELEMETRY,
+    SEPLOSD_BUS_TELECOMMAND,
+    SEPLOSD_BUS_METADATA
+};
+
+typedef void (*seplosd_bus_sample_cb)(struct seplosd_bus *bus, seplosd_pack_t *pack);
+
+/*
+ * One serial bus, polled from the uv loop without blocking it.
+ *
+ * A poll sweeps the packs on the bus through a SeplosTransaction: first
+ * TELEMETRY_GET to every pack whose interval has passed, then TELECOMMAND_GET
+ * to those whose telecommand_interval has passed and whose telemetry has
+ * changed since they were last asked, and last the metadata of any pack
+ * whose metadata_ttl has passed or whose switches have changed, one item at
+ * a time. Each request goes out
+ * as soon as the previous reply is in, waiting for the device with a
+ * uv_poll_t and bounding each exchange with a deadline timer. A pack has
+ * reply_timeout to start answering and timeout for the whole exchange, so a
+ * pack that isn't there is given up on quickly. A command whose reply was
+ * damaged, or that a pack which has been answering let time out, is sent
+ * again up to retries times after a random pause of up to retry_jitter, so
+ * that line noise costs a retry rather than the pack's sample. on_sample runs
+ * for every pack that answered.
+ *
+ * With all_packs, each controller address is asked once for SEPLOS_ALL_PACKS
+ * and answers for all of its packs in a single reply.
+ *
+ * Every bus has its own device, session and transaction, so any number of
+ * them can be swept at the same time on one loop, and a bus that is slow or
+ * not answering only holds up its own packs.
+ *
+ * device, baud, packs and all_packs come from the config file. The rest is set up
+ * by seplosd_bus_init(), and can be changed later with seplosd_bus_reconfigure().
+ */
+typedef struct seplosd_bus {
+    char *device;
+    unsigned int baud;
+    seplosd_pack_t *packs;
+    size_t n_packs;
+    bool all_packs;
+    uv_loop_t *loop;
+    seplosd_session_t session;
+    uv_poll_t *poll;
+    uv_timer_t deadline;
+    uint64_t timeout;
+    uint64_t reply_timeout;
+    uint64_t metadata_ttl;
+    unsigned int retries;          /* times a failed command is sent again at once */
+    uint64_t retry_jitter;         /* up to this many ms, at random, before it is */
+    unsigned int attempt;          /* retries of the current command so far */
+    unsigned int seed;
+    bool busy;
+    enum seplosd_bus_phase phase;
+    uint64_t sweep_at;
+    size_t current;
+    SeplosTransaction transaction;
+    SeplosData samples[SEPLOS_MAX_PACKS];
+    int n_samples;
+    seplosd_bus_sample_cb on_sample;
+    void *udata;
+    struct seplosd_bus *reload;    /* a new configuration, waiting for the sweep to end */
+} seplosd_bus_t;
+
+int seplosd_bus_init(uv_loop_t *loop, seplosd_bus_t *bus, uint64_t timeout,
+                     uint64_t reply_timeout, uint64_t backoff_min, uint64_t backoff_max,
+                     uint64_t metadata_ttl, unsigned int retries, uint64_t retry_jitter,
+                     seplosd_bus_sample_cb on_sample, void *udata);
+
+/*
+ * Starts a sweep of the bus. Returns -1 if the device isn't available or the
+ * previous sweep is still running.
+ */
+int seplosd_bus_poll(seplosd_bus_t *bus);
+
+/* Returns the pack with this address and number, or NULL if the bus has none. */
+seplosd_pack_t *seplosd_bus_find(const seplosd_bus_t *bus, unsigned int address, unsigned int pack);
+
+/*
+ * Takes over the configuration of from, the same bus read again from the
+ * config file, along with its timeout, reply_timeout, metadata_ttl and retries. A pack
+ * that was already on the bus keeps its data, schedule, history, metadata and
+ * stats, and only its topic and intervals change. The device is only reopened
+ * if baud changed. If a sweep is running, this waits for it to end. from must
+ * come from malloc(), and the bus frees it along with what it doesn't keep.
+ */
+void seplosd_bus_reconfigure(seplosd_bus_t *bus, seplosd_bus_t *from);
+
+void seplosd_bus_close(seplosd_bus_t *bus);
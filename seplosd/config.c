@@ -1,6 +1,7 @@
 #include "config.h"
 
 #include <libconfig.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -41,6 +42,243 @@ static int __config_fill_u64(config_t *config, const char *key, uint64_t *into)
     return 0;
 }
 
+static int __config_fill_bool(config_t *config, const char *key, bool *into)
+{
+    int value;
+
+    if (config_lookup_bool(config, key, &value))
+    {
+        *into = value;
+    }
+
+    return 0;
+}
+
+/* Accepts integers as well, so "deadband_current = 1;" doesn't have to be 1.0. */
+static int __config_fill_double(config_t *config, const char *key, double *into)
+{
+    long long integer_value;
+    double value;
+
+    if (config_lookup_float(config, key, &value))
+    {
+        *into = value;
+    }
+    else if (config_lookup_int64(config, key, &integer_value))
+    {
+        *into = integer_value;
+    }
+
+    if (*into < 0)
+    {
+        log_fatal("%s must not be negative.", key);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char *__config_pack_topic(const char *topic, unsigned int pack)
+{
+    size_t size;
+    char *into;
+
+    if (!topic)
+    {
+        return NULL;
+    }
+
+    size = strlen(topic) + 12;
+
+    if ((into = malloc(size)))
+    {
+        snprintf(into, size, "%s/%u", topic, pack);
+    }
+
+    return into;
+}
+
+/* Reads a pack's own polling intervals, which default to the top-level ones. */
+static int __config_fill_intervals(config_setting_t *entry, const seplosd_context_t *context,
+                                   seplosd_pack_t *pack)
+{
+    long long value;
+
+    pack->interval = 0;
+    pack->telecommand_interval = context->telecommand_interval;
+
+    if (entry && config_setting_lookup_int64(entry, "interval", &value))
+    {
+        pack->interval = value < 0 ? 0 : value;
+    }
+
+    if (entry && config_setting_lookup_int64(entry, "telecommand_interval", &value))
+    {
+        pack->telecommand_interval = value < 0 ? 0 : value;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the list of packs on a bus:
+ *
+ *   packs = ( { address = 0; pack = 1; topic = "seplos/0"; }, ... );
+ *
+ * A pack without a topic publishes to "<topic>/<pack>". Without a list, the
+ * bus polls pack 1 at address 0 and publishes to topic as it always has.
+ */
+static int __config_fill_packs(config_setting_t *list, const char *topic,
+                               const seplosd_context_t *context, seplosd_bus_t *bus)
+{
+    size_t n_packs = list ? config_setting_length(list) : 1;
+    seplosd_pack_t *packs;
+
+    if (!(packs = calloc(n_packs, sizeof(*packs))))
+    {
+        log_fatal("out of memory reading packs key from config file.");
+        return -1;
+    }
+
+    bus->packs = packs;
+    bus->n_packs = n_packs;
+
+    if (!list)
+    {
+        packs[0].address = 0;
+        packs[0].pack = 1;
+        packs[0].topic = topic ? strdup(topic) : NULL;
+        __config_fill_intervals(NULL, context, &packs[0]);
+    }
+
+    for (size_t i = 0; list && i < n_packs; i++)
+    {
+        config_setting_t *entry = config_setting_get_elem(list, i);
+        const char *pack_topic = NULL;
+        int address = 0, pack = 1;
+
+        config_setting_lookup_int(entry, "address", &address);
+        config_setting_lookup_int(entry, "pack", &pack);
+
+        if (address < 0 || address > 0xff || pack < 0 || pack > 0xff)
+        {
+            log_fatal("packs entry %zu: address and pack must be between 0 and 255.", i);
+            return -1;
+        }
+
+        packs[i].address = address;
+        packs[i].pack = pack;
+        __config_fill_intervals(entry, context, &packs[i]);
+
+        if (config_setting_lookup_string(entry, "topic", &pack_topic))
+        {
+            packs[i].topic = strdup(pack_topic);
+        }
+        else
+        {
+            packs[i].topic = __config_pack_topic(topic, pack);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reads one bus: its device, its speed, its packs and whether to ask for all
+ * packs at once. A topic given for the bus is the default for its packs.
+ */
+static int __config_fill_bus(config_setting_t *setting, const char *device_key,
+                             const char *topic, const seplosd_context_t *context,
+                             seplosd_bus_t *bus)
+{
+    const char *string_value;
+    int all_packs, baud;
+
+    if (config_setting_lookup_string(setting, device_key, &string_value) &&
+        !(bus->device = strdup(string_value)))
+    {
+        log_fatal("out of memory reading %s key from config file.", device_key);
+        return -1;
+    }
+
+    bus->baud = context->baud;
+    if (config_setting_lookup_int(setting, "baud", &baud))
+    {
+        bus->baud = baud;
+    }
+
+    if (config_setting_lookup_bool(setting, "all_packs", &all_packs))
+    {
+        bus->all_packs = all_packs;
+    }
+
+    if (config_setting_lookup_string(setting, "topic", &string_value))
+    {
+        topic = string_value;
+    }
+
+    return __config_fill_packs(config_setting_get_member(setting, "packs"), topic, context, bus);
+}
+
+/*
+ * Reads the list of serial buses:
+ *
+ *   buses = ( { device = "/dev/ttyUSB0"; packs = ( ... ); }, ... );
+ *
+ * Without a list there is one bus, described by bms_device, all_packs and
+ * packs at the top level of the file.
+ */
+static int __config_fill_buses(config_t *config, seplosd_context_t *context)
+{
+    config_setting_t *list = config_lookup(config, "buses");
+    size_t n_buses = list ? config_setting_length(list) : 1;
+    seplosd_bus_t *buses;
+    int r = 0;
+
+    if (!(buses = calloc(n_buses, sizeof(*buses))))
+    {
+        log_fatal("out of memory reading buses key from config file.");
+        return -1;
+    }
+
+    seplosd_config_free_buses(context);
+    context->buses = buses;
+    context->n_buses = n_buses;
+
+    if (!list)
+    {
+        return __config_fill_bus(config_root_setting(config), "bms_device", context->topic, context, &buses[0]);
+    }
+
+    for (size_t i = 0; i < n_buses && r == 0; i++)
+    {
+        r = __config_fill_bus(config_setting_get_elem(list, i), "device", context->topic, context, &buses[i]);
+    }
+
+    return r;
+}
+
+void seplosd_config_free_buses(seplosd_context_t *context)
+{
+    for (size_t i = 0; i < context->n_buses; i++)
+    {
+        seplosd_bus_t *bus = &context->buses[i];
+
+        for (size_t j = 0; j < bus->n_packs; j++)
+        {
+            seplos_ring_close(&bus->packs[j].ring);
+            free(bus->packs[j].topic);
+        }
+
+        free(bus->packs);
+        free(bus->device);
+    }
+
+    free(context->buses);
+    context->buses = NULL;
+    context->n_buses = 0;
+}
+
 int seplosd_config_fill(const char *path, seplosd_context_t *context)
 {
     config_t config;
@@ -59,11 +297,48 @@ int seplosd_config_fill(const char *path, seplosd_context_t *context)
 
     log_trace("using config file at %s", path);
 
-    if (__config_fill_string(&config, "bms_device", &context->bms_device) < 0 ||
-        __config_fill_string(&config, "topic", &context->topic) < 0 ||
+    if (__config_fill_string(&config, "topic", &context->topic) < 0 ||
+        __config_fill_string(&config, "log_level", &context->log_level) < 0 ||
+        __config_fill_bool(&config, "log_async", &context->log_async) < 0 ||
+        __config_fill_u64(&config, "log_buffer", &context->log_buffer) < 0 ||
         __config_fill_string(&config, "mqtt_uri", &context->mqtt_uri) < 0 ||
         __config_fill_string(&config, "mqtt_client_id", &context->mqtt_client_id) < 0 ||
-        __config_fill_u64(&config, "interval", &context->interval) < 0)
+        __config_fill_string(&config, "capture_file", &context->capture_file) < 0 ||
+        __config_fill_string(&config, "ring_directory", &context->ring_directory) < 0 ||
+        __config_fill_u64(&config, "ring_samples", &context->ring_samples) < 0 ||
+        __config_fill_string(&config, "shm_name", &context->shm_name) < 0 ||
+        __config_fill_string(&config, "metrics_listen", &context->metrics_listen) < 0 ||
+        __config_fill_u64(&config, "stats_interval", &context->stats_interval) < 0 ||
+        __config_fill_u64(&config, "cells_interval", &context->cells_interval) < 0 ||
+        __config_fill_string(&config, "spool_file", &context->spool_file) < 0 ||
+        __config_fill_string(&config, "payload_format", &context->payload_format) < 0 ||
+        __config_fill_u64(&config, "metadata_ttl", &context->metadata_ttl) < 0 ||
+        __config_fill_bool(&config, "ha_discovery", &context->ha_discovery) < 0 ||
+        __config_fill_string(&config, "ha_discovery_prefix", &context->ha_discovery_prefix) < 0 ||
+        __config_fill_u64(&config, "spool_messages", &context->spool_messages) < 0 ||
+        __config_fill_u64(&config, "spool_drain_interval", &context->spool_drain_interval) < 0 ||
+        __config_fill_u64(&config, "spool_drain_batch", &context->spool_drain_batch) < 0 ||
+        __config_fill_u64(&config, "mqtt_qos", &context->mqtt_qos) < 0 ||
+        __config_fill_u64(&config, "mqtt_max_inflight", &context->mqtt_max_inflight) < 0 ||
+        __config_fill_u64(&config, "interval", &context->interval) < 0 ||
+        __config_fill_u64(&config, "telecommand_interval", &context->telecommand_interval) < 0 ||
+        __config_fill_u64(&config, "transaction_timeout", &context->transaction_timeout) < 0 ||
+        __config_fill_u64(&config, "reply_timeout", &context->reply_timeout) < 0 ||
+        __config_fill_u64(&config, "retries", &context->retries) < 0 ||
+        __config_fill_u64(&config, "retry_jitter", &context->retry_jitter) < 0 ||
+        __config_fill_u64(&config, "baud", &context->baud) < 0 ||
+        __config_fill_u64(&config, "reconnect_backoff_min", &context->reconnect_backoff_min) < 0 ||
+        __config_fill_u64(&config, "reconnect_backoff_max", &context->reconnect_backoff_max) < 0 ||
+        __config_fill_bool(&config, "publish_changes", &context->publish_changes) < 0 ||
+        __config_fill_u64(&config, "full_refresh_interval", &context->full_refresh_interval) < 0 ||
+        __config_fill_u64(&config, "aggregate_window", &context->aggregate_window) < 0 ||
+        __config_fill_double(&config, "deadband_cell_voltage", &context->deadband.cell_voltage) < 0 ||
+        __config_fill_double(&config, "deadband_voltage", &context->deadband.voltage) < 0 ||
+        __config_fill_double(&config, "deadband_current", &context->deadband.current) < 0 ||
+        __config_fill_double(&config, "deadband_temperature", &context->deadband.temperature) < 0 ||
+        __config_fill_double(&config, "deadband_soc", &context->deadband.soc) < 0 ||
+        __config_fill_double(&config, "deadband_capacity", &context->deadband.capacity) < 0 ||
+        __config_fill_buses(&config, context) < 0)
     {
 
         log_fatal("config file parsing failed.");
@@ -2,4 +2,5 @@
 
 #include "context.h"
 
-int seplosd_config_fill(const char *path, seplosd_context_t *context);
\ No newline at end of file
+int seplosd_config_fill(const char *path, seplosd_context_t *context);
+void seplosd_config_free_buses(seplosd_context_t *context);
\ No newline at end of file
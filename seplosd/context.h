@@ -1,13 +1,65 @@
 #pragma once
 
-#include <MQTTClient.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "bus.h"
+#include "deadband.h"
+#include "metrics.h"
+#include "mqtt.h"
+#include "spool.h"
+#include "window.h"
+
 typedef struct seplosd_context {
-    char *bms_device;
+    const char *config_path;
+    uv_timer_t *timer;             /* starts the sweeps, every interval */
+    uv_timer_t *stats_timer;       /* publishes the stats, every stats_interval */
+    uv_timer_t *cells_timer;       /* publishes and saves the cell statistics, every cells_interval */
+    uv_signal_t *terminate;        /* SIGTERM and SIGINT stop the loop, for an orderly shutdown */
+    uv_signal_t *interrupt;
     char *topic;
+    char *log_level;
+    bool log_async;
+    uint64_t log_buffer;
     char *mqtt_uri;
     char *mqtt_client_id;
+    char *capture_file;
+    char *ring_directory;
+    uint64_t ring_samples;
+    char *shm_name;
+    SeplosLive live;               /* latest samples in shared memory, unmapped without shm_name */
+    bool live_full;                /* a pack found no slot, logged once */
+    char *metrics_listen;
+    uint64_t stats_interval;
+    uint64_t cells_interval;
+    char *spool_file;
+    uint64_t spool_messages;
+    uint64_t spool_drain_interval;
+    uint64_t spool_drain_batch;
+    uint64_t mqtt_qos;
+    uint64_t mqtt_max_inflight;
     uint64_t interval;
-    MQTTClient client;
+    uint64_t telecommand_interval;
+    uint64_t transaction_timeout;
+    uint64_t reply_timeout;
+    uint64_t retries;
+    uint64_t retry_jitter;
+    uint64_t baud;
+    uint64_t reconnect_backoff_min;
+    uint64_t reconnect_backoff_max;
+    bool publish_changes;
+    uint64_t full_refresh_interval;
+    uint64_t aggregate_window;
+    seplosd_deadband_t deadband;
+    char *payload_format;
+    uint64_t metadata_ttl;
+    bool ha_discovery;
+    char *ha_discovery_prefix;
+    bool cbor;                     /* payload_format is "cbor" */
+    char payload[SEPLOSD_WINDOW_JSON_MAX]; /* reused for every message, JSON or CBOR */
+    seplosd_mqtt_t mqtt;
+    seplosd_spool_t spool;
+    seplosd_metrics_t metrics;
+    seplosd_bus_t *buses;
+    size_t n_buses;
 } seplosd_context_t;
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include "deadband.h"
+
+#include <math.h>
+#include <string.h>
+
+/* The single values as seplos_json_format() writes them, indexed by field bit. */
+static void __deadband_values(const SeplosData *data, float *values)
+{
+    const float members[SEPLOS_JSON_SCALARS] = {
+        data->charge_discharge_current,
+        data->total_battery_voltage,
+        data->highest_cell_voltage - data->lowest_cell_voltage,
+        data->charge_discharge_current * data->total_battery_voltage,
+        roundf(data->state_of_charge),
+        roundf(data->state_of_health),
+        roundf(data->battery_capacity),
+        data->number_of_cycles,
+        roundf(data->residual_capacity),
+        roundf(data->rated_capacity),
+        data->equilibrium_state,
+        data->hot,
+        data->cold,
+        data->shutdown,
+        data->standby,
+        data->charge,
+        data->discharge,
+        data->charge_switch,
+        data->discharge_switch,
+        roundf(data->highest_temperature),
+        roundf(data->lowest_temperature),
+        roundf(data->temperature[4]),
+        roundf(data->temperature[5]),
+    };
+
+    for (int i = 0; i < SEPLOS_JSON_SCALARS; i++)
+    {
+        values[i] = members[i];
+    }
+}
+
+/* True if any of the values moved by at least limit. */
+static bool __deadband_moved(const float *published, const float *values, unsigned int n, float limit)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        float delta = fabsf(values[i] - published[i]);
+
+        if (delta > 0 && delta >= limit)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int __deadband_bit(uint32_t field)
+{
+    int bit = 0;
+
+    while (field >>= 1)
+    {
+        bit++;
+    }
+
+    return bit;
+}
+
+uint32_t seplosd_deadband_changes(const seplosd_deadband_t *deadband,
+                                  const seplosd_published_t *published,
+                                  const SeplosData *data)
+{
+    float values[SEPLOS_JSON_SCALARS];
+    float limits[SEPLOS_JSON_SCALARS] = {0};
+    uint32_t changes = 0;
+
+    if (!published->valid)
+    {
+        return SEPLOS_JSON_ALL;
+    }
+
+    limits[__deadband_bit(SEPLOS_JSON_CURRENT)] = deadband->current;
+    limits[__deadband_bit(SEPLOS_JSON_VOLTAGE)] = deadband->voltage;
+    limits[__deadband_bit(SEPLOS_JSON_DELTA_VOLTAGE)] = deadband->cell_voltage;
+    limits[__deadband_bit(SEPLOS_JSON_SOC)] = deadband->soc;
+    limits[__deadband_bit(SEPLOS_JSON_RESIDUAL_CAPACITY)] = deadband->capacity;
+    limits[__deadband_bit(SEPLOS_JSON_MAX_TEMPERATURE)] = deadband->temperature;
+    limits[__deadband_bit(SEPLOS_JSON_MIN_TEMPERATURE)] = deadband->temperature;
+    limits[__deadband_bit(SEPLOS_JSON_ENVIRONMENT_TEMPERATURE)] = deadband->temperature;
+    limits[__deadband_bit(SEPLOS_JSON_BMS_TEMPERATURE)] = deadband->temperature;
+
+    __deadband_values(data, values);
+
+    for (int i = 0; i < SEPLOS_JSON_SCALARS; i++)
+    {
+        float delta = fabsf(values[i] - published->values[i]);
+
+        if (delta > 0 && delta >= limits[i])
+        {
+            changes |= 1u << i;
+        }
+    }
+
+    if (__deadband_moved(published->cell_voltage, data->cell_voltage, SEPLOS_N_CELLS,
+                         deadband->cell_voltage))
+    {
+        changes |= SEPLOS_JSON_CELLS;
+    }
+
+    if (__deadband_moved(published->temperature, data->temperature, SEPLOS_N_TEMPERATURES,
+                         deadband->temperature))
+    {
+        changes |= SEPLOS_JSON_TEMPERATURES;
+    }
+
+    /* Power has no deadband of its own, it follows current and voltage. */
+    if (changes & (SEPLOS_JSON_CURRENT | SEPLOS_JSON_VOLTAGE))
+    {
+        changes |= SEPLOS_JSON_POWER;
+    }
+    else
+    {
+        changes &= ~SEPLOS_JSON_POWER;
+    }
+
+    return changes;
+}
+
+void seplosd_deadband_commit(seplosd_published_t *published, const SeplosData *data,
+                             uint32_t fields)
+{
+    float values[SEPLOS_JSON_SCALARS];
+
+    __deadband_values(data, values);
+
+    for (int i = 0; i < SEPLOS_JSON_SCALARS; i++)
+    {
+        if (fields & (1u << i))
+        {
+            published->values[i] = values[i];
+        }
+    }
+
+    if (fields & SEPLOS_JSON_CELLS)
+    {
+        memcpy(published->cell_voltage, data->cell_voltage, sizeof(published->cell_voltage));
+    }
+
+    if (fields & SEPLOS_JSON_TEMPERATURES)
+    {
+        memcpy(published->temperature, data->temperature, sizeof(published->temperature));
+    }
+
+    if ((fields & SEPLOS_JSON_ALL) == SEPLOS_JSON_ALL)
+    {
+        published->valid = true;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "seplos.h"
+
+/*
+ * How far a value has to move from what was last published before it is
+ * published again. A deadband of 0 publishes every change.
+ */
+typedef struct seplosd_deadband {
+    double cell_voltage; /* V, for "dv" and "cells" */
+    double voltage;      /* V, for "v" */
+    double current;      /* A, for "i" */
+    double temperature;  /* degrees C, for the temperatures and "temps" */
+    double soc;          /* percent, for "soc" */
+    double capacity;     /* Ah, for "cap_residual" */
+} seplosd_deadband_t;
+
+/* The values of a pack as they were last published, one per document member. */
+typedef struct seplosd_published {
+    float values[SEPLOS_JSON_SCALARS];
+    float cell_voltage[SEPLOS_N_CELLS];
+    float temperature[SEPLOS_N_TEMPERATURES];
+    uint64_t at; /* loop time of the last full document, in milliseconds */
+    bool valid;
+} seplosd_published_t;
+
+/* Returns the seplos_json_field mask of members that moved beyond their deadband. */
+uint32_t seplosd_deadband_changes(const seplosd_deadband_t *deadband,
+                                  const seplosd_published_t *published,
+                                  const SeplosData *data);
+
+/* Records the members in fields as published. */
+void seplosd_deadband_commit(seplosd_published_t *published, const SeplosData *data,
+                             uint32_t fields);
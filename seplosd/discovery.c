@@ -0,0 +1,232 @@
+#include "discovery.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+typedef struct seplosd_discovery_sensor {
+    const char *member;
+    const char *name;
+    const char *unit;
+    const char *device_class;
+    const char *state_class;
+} seplosd_discovery_sensor_t;
+
+/* The members of the JSON document that make sense as sensors of their own. */
+static const seplosd_discovery_sensor_t __discovery_sensors[] = {
+    {"soc", "State of charge", "%", "battery", "measurement"},
+    {"soh", "State of health", "%", NULL, "measurement"},
+    {"v", "Voltage", "V", "voltage", "measurement"},
+    {"i", "Current", "A", "current", "measurement"},
+    {"p", "Power", "W", "power", "measurement"},
+    {"dv", "Cell voltage difference", "V", "voltage", "measurement"},
+    {"cap", "Capacity", "Ah", NULL, "measurement"},
+    {"cap_residual", "Residual capacity", "Ah", NULL, "measurement"},
+    {"ncycles", "Cycles", NULL, NULL, "total_increasing"},
+    {"max_temp", "Highest temperature", "°C", "temperature", "measurement"},
+    {"min_temp", "Lowest temperature", "°C", "temperature", "measurement"},
+    {"environment_temp", "Environment temperature", "°C", "temperature", "measurement"},
+    {"bms_temp", "BMS temperature", "°C", "temperature", "measurement"},
+};
+
+/* The metadata strings are printable ASCII, so only quotes and backslashes need escaping. */
+static size_t __discovery_string(char *buf, size_t size, const char *value)
+{
+    size_t n = 0;
+
+    for (; *value; value++)
+    {
+        if (*value == '"' || *value == '\\')
+        {
+            if (n < size)
+            {
+                buf[n] = '\\';
+            }
+            n++;
+        }
+        if (n < size)
+        {
+            buf[n] = *value;
+        }
+        n++;
+    }
+
+    if (size)
+    {
+        buf[n < size ? n : size - 1] = '\0';
+    }
+
+    return n;
+}
+
+/* The MQTT topic levels for the pack: letters, digits and underscores only. */
+static void __discovery_node(char *buf, size_t size, const char *device, const seplosd_pack_t *pack)
+{
+    const char *base = strrchr(device, '/') ? strrchr(device, '/') + 1 : device;
+
+    snprintf(buf, size, "seplos_%s_%u_%u", base, pack->address, pack->pack);
+    for (char *p = buf; *p; p++)
+    {
+        if (!isalnum((unsigned char)*p))
+        {
+            *p = '_';
+        }
+    }
+}
+
+static int __discovery_config(seplosd_mqtt_t *mqtt, const seplosd_pack_t *pack)
+{
+    const SeplosMetadata *m = &pack->metadata;
+    char topic[1024];
+    char payload[2048];
+    char device[32], manufacturer[48];
+    size_t n;
+
+    __discovery_string(device, sizeof(device), m->device_name);
+    __discovery_string(manufacturer, sizeof(manufacturer), m->manufacturer);
+
+    n = snprintf(payload, sizeof(payload), "{\"address\":%u,\"pack\":%u", pack->address, pack->pack);
+
+    if (m->valid & SEPLOS_METADATA_PROTOCOL)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, ",\"protocol\":\"%.1f\"",
+                      m->protocol_version);
+    }
+
+    if (m->valid & SEPLOS_METADATA_VENDOR)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0,
+                      ",\"device\":\"%s\",\"software\":\"%u.%u\",\"manufacturer\":\"%s\"", device,
+                      m->software_version[0], m->software_version[1], manufacturer);
+    }
+
+    if (m->valid & SEPLOS_METADATA_TIME)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, ",\"clock_offset\":%lld",
+                      (long long)m->clock_offset);
+    }
+
+    if (m->valid & SEPLOS_METADATA_TELEREGULATION)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, ",\"parameters\":[");
+        for (unsigned int i = 0; i < m->number_of_parameters; i++)
+        {
+            n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, "%s%u", i ? "," : "",
+                          m->parameters[i]);
+        }
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, "]");
+    }
+
+    n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, "}");
+
+    if (n >= sizeof(payload))
+    {
+        log_error("config for %s does not fit in %zu bytes.", pack->topic, sizeof(payload));
+        return -1;
+    }
+
+    snprintf(topic, sizeof(topic), "%s/config", pack->topic);
+    return seplosd_mqtt_publish(mqtt, topic, payload, n, true);
+}
+
+/*
+ * With publish_changes a document may leave a member out, and the sensor
+ * then keeps the value it had.
+ */
+static int __discovery_sensor(seplosd_mqtt_t *mqtt, const char *prefix, const char *node,
+                              const seplosd_pack_t *pack, const seplosd_discovery_sensor_t *sensor)
+{
+    const SeplosMetadata *m = &pack->metadata;
+    char topic[1024];
+    char payload[2048];
+    char state_topic[1024], device[32], manufacturer[48];
+    size_t n;
+
+    __discovery_string(state_topic, sizeof(state_topic), pack->topic);
+    __discovery_string(device, sizeof(device), m->device_name[0] ? m->device_name : "BMS");
+    __discovery_string(manufacturer, sizeof(manufacturer), m->manufacturer[0] ? m->manufacturer : "SEPLOS");
+
+    n = snprintf(payload, sizeof(payload),
+                 "{\"name\":\"%s\",\"unique_id\":\"%s_%s\",\"state_topic\":\"%s\","
+                 "\"value_template\":\"{{ value_json.%s if '%s' in value_json else this.state }}\"",
+                 sensor->name, node, sensor->member, state_topic, sensor->member, sensor->member);
+
+    if (sensor->unit)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0,
+                      ",\"unit_of_measurement\":\"%s\"", sensor->unit);
+    }
+
+    if (sensor->device_class)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, ",\"device_class\":\"%s\"",
+                      sensor->device_class);
+    }
+
+    n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0,
+                  ",\"state_class\":\"%s\",\"device\":{\"identifiers\":[\"%s\"],"
+                  "\"name\":\"SEPLOS %u/%u\",\"manufacturer\":\"%s\",\"model\":\"%s\"",
+                  sensor->state_class, node, pack->address, pack->pack, manufacturer, device);
+
+    if (m->valid & SEPLOS_METADATA_VENDOR)
+    {
+        n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, ",\"sw_version\":\"%u.%u\"",
+                      m->software_version[0], m->software_version[1]);
+    }
+
+    n += snprintf(payload + n, n < sizeof(payload) ? sizeof(payload) - n : 0, "}}");
+
+    if (n >= sizeof(payload))
+    {
+        log_error("discovery config for %s %s does not fit in %zu bytes.", pack->topic, sensor->member,
+                  sizeof(payload));
+        return -1;
+    }
+
+    snprintf(topic, sizeof(topic), "%s/sensor/%s/%s/config", prefix, node, sensor->member);
+    return seplosd_mqtt_publish(mqtt, topic, payload, n, true);
+}
+
+size_t seplosd_discovery_messages(const char *prefix)
+{
+    return 1 + (prefix ? sizeof(__discovery_sensors) / sizeof(*__discovery_sensors) : 0);
+}
+
+int seplosd_discovery_publish(seplosd_mqtt_t *mqtt, const char *prefix, const char *device,
+                              const seplosd_pack_t *pack)
+{
+    char node[256];
+
+    /*
+     * Wait for room for all of it, rather than have most of it refused, and
+     * logged, each time a sample comes in while the broker is away.
+     */
+    if (seplosd_mqtt_room(mqtt) < seplosd_discovery_messages(prefix))
+    {
+        return -1;
+    }
+
+    /* Each refused publish logs, so the rest isn't tried once one is. */
+    if (__discovery_config(mqtt, pack) < 0)
+    {
+        return -1;
+    }
+
+    if (!prefix)
+    {
+        return 0;
+    }
+
+    __discovery_node(node, sizeof(node), device, pack);
+    for (size_t i = 0; i < sizeof(__discovery_sensors) / sizeof(*__discovery_sensors); i++)
+    {
+        if (__discovery_sensor(mqtt, prefix, node, pack, &__discovery_sensors[i]) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
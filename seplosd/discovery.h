@@ -0,0 +1,19 @@
+#pragma once
+
+#include "mqtt.h"
+#include "pack.h"
+
+/*
+ * Publishes, retained, what a pack says about itself to "<topic>/config",
+ * and with a prefix, the Home Assistant discovery config of each of its
+ * sensors to "<prefix>/sensor/<node>/<member>/config", where node names the
+ * device, address and pack. Called once each time the pack's metadata
+ * changes, not for every sample. Nothing is sent until we are connected with
+ * room in the in-flight window for all of it. Returns -1 if any of it wasn't
+ * queued, to be tried again with a later sample.
+ */
+/* How many messages seplosd_discovery_publish() sends for a pack. */
+size_t seplosd_discovery_messages(const char *prefix);
+
+int seplosd_discovery_publish(seplosd_mqtt_t *mqtt, const char *prefix, const char *device,
+                              const seplosd_pack_t *pack);
@@ -1,9 +0,0 @@
-
-#pragma once
-
-#include <json-c/json.h>
-
-#include "seplos.h"
-
-bool
-seplosd_json_serialize(const SeplosData *const data, json_object *root);
\ No newline at end of file
@@ -22,6 +22,12 @@
 
 #include "log.h"
 
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+
 #define MAX_CALLBACKS 32
 
 typedef struct {
@@ -39,6 +45,35 @@ static struct {
 } L;
 
 
+int log_threshold = LOG_TRACE;
+
+/*
+ * One line on its way to the writer thread. seq is the ring position the
+ * slot is ready to be claimed at, plus one once the line in it is complete,
+ * as in Dmitry Vyukov's bounded queue.
+ */
+typedef struct {
+  size_t seq;
+  int level;
+  const char *file;
+  int line;
+  time_t time;
+  char message[LOG_ASYNC_LINE];
+} Record;
+
+static struct {
+  Record *ring;
+  size_t mask;
+  size_t head;    /* next position to claim, shared by the callers */
+  size_t tail;    /* next position to write, the writer thread's own */
+  size_t dropped;
+  sem_t ready;
+  pthread_t thread;
+  bool running;
+  bool stopping;
+} A;
+
+
 static const char *level_strings[] = {
   "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
 };
@@ -96,6 +131,24 @@ const char* log_level_string(int level) {
 }
 
 
+int log_level_from_string(const char *name) {
+  for (int i = LOG_TRACE; i <= LOG_FATAL; i++) {
+    if (!strcasecmp(name, level_strings[i])) { return i; }
+  }
+  return -1;
+}
+
+
+/* The lowest level anything is written at, for the log_at() macro. */
+static void update_threshold(void) {
+  int threshold = L.quiet ? LOG_FATAL + 1 : L.level;
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].level < threshold) { threshold = L.callbacks[i].level; }
+  }
+  log_threshold = threshold;
+}
+
+
 void log_set_lock(log_LockFn fn, void *udata) {
   L.lock = fn;
   L.udata = udata;
@@ -104,11 +157,13 @@ void log_set_lock(log_LockFn fn, void *udata) {
 
 void log_set_level(int level) {
   L.level = level;
+  update_threshold();
 }
 
 
 void log_set_quiet(bool enable) {
   L.quiet = enable;
+  update_threshold();
 }
 
 
@@ -116,6 +171,7 @@ int log_add_callback(log_LogFn fn, void *udata, int level) {
   for (int i = 0; i < MAX_CALLBACKS; i++) {
     if (!L.callbacks[i].fn) {
       L.callbacks[i] = (Callback) { fn, udata, level };
+      update_threshold();
       return 0;
     }
   }
@@ -137,6 +193,161 @@ static void init_event(log_Event *ev, void *udata) {
 }
 
 
+/* Writes one line to stderr and every callback that wants it. */
+static void dispatch(log_Event *ev, va_list ap) {
+  if (!L.quiet && ev->level >= L.level) {
+    init_event(ev, stderr);
+    va_copy(ev->ap, ap);
+    stdout_callback(ev);
+    va_end(ev->ap);
+  }
+
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    Callback *cb = &L.callbacks[i];
+    if (ev->level >= cb->level) {
+      init_event(ev, cb->udata);
+      va_copy(ev->ap, ap);
+      cb->fn(ev);
+      va_end(ev->ap);
+    }
+  }
+}
+
+
+static void dispatch_formatted(log_Event *ev, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  dispatch(ev, ap);
+  va_end(ap);
+}
+
+
+/* Writes the lines that are complete, in order. Only the writer thread calls this. */
+static void drain(void) {
+  struct tm tm;
+  size_t dropped;
+
+  for (;;) {
+    Record *r = &A.ring[A.tail & A.mask];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != A.tail + 1) { break; }
+
+    log_Event ev = {
+      .fmt   = "%s",
+      .file  = r->file,
+      .line  = r->line,
+      .level = r->level,
+      .time  = localtime_r(&r->time, &tm),
+    };
+    lock();
+    dispatch_formatted(&ev, "%s", r->message);
+    unlock();
+
+    __atomic_store_n(&r->seq, A.tail + A.mask + 1, __ATOMIC_RELEASE);
+    A.tail++;
+  }
+
+  if ((dropped = __atomic_exchange_n(&A.dropped, 0, __ATOMIC_RELAXED))) {
+    time_t t = time(NULL);
+    log_Event ev = {
+      .fmt   = "%zu log lines dropped, the writer couldn't keep up",
+      .file  = __FILE__,
+      .line  = __LINE__,
+      .level = LOG_WARN,
+      .time  = localtime_r(&t, &tm),
+    };
+    lock();
+    dispatch_formatted(&ev, ev.fmt, dropped);
+    unlock();
+  }
+}
+
+
+static void *writer(void *udata) {
+  for (;;) {
+    while (sem_wait(&A.ready) < 0) {}
+    drain();
+    if (__atomic_load_n(&A.stopping, __ATOMIC_ACQUIRE)) { break; }
+  }
+  drain();
+  return NULL;
+}
+
+
+int log_start_async(size_t capacity) {
+  size_t size = 1;
+
+  if (A.running) { return 0; }
+
+  while (size < capacity) { size *= 2; }
+
+  if (!(A.ring = calloc(size, sizeof(*A.ring)))) { return -1; }
+  for (size_t i = 0; i < size; i++) { A.ring[i].seq = i; }
+  A.mask = size - 1;
+  A.head = A.tail = A.dropped = 0;
+  A.stopping = false;
+
+  if (sem_init(&A.ready, 0, 0) < 0) {
+    free(A.ring);
+    return -1;
+  }
+
+  if (pthread_create(&A.thread, NULL, writer, NULL) != 0) {
+    sem_destroy(&A.ready);
+    free(A.ring);
+    return -1;
+  }
+
+  __atomic_store_n(&A.running, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+void log_stop_async(void) {
+  if (!A.running) { return; }
+
+  __atomic_store_n(&A.running, false, __ATOMIC_RELEASE);
+  __atomic_store_n(&A.stopping, true, __ATOMIC_RELEASE);
+  sem_post(&A.ready);
+  pthread_join(A.thread, NULL);
+
+  sem_destroy(&A.ready);
+  free(A.ring);
+  A.ring = NULL;
+}
+
+
+/* Claims a slot and formats the line into it, or counts it as dropped if there is none. */
+static void log_async(int level, const char *file, int line, const char *fmt, va_list ap) {
+  size_t pos = __atomic_load_n(&A.head, __ATOMIC_RELAXED);
+  Record *r;
+
+  for (;;) {
+    r = &A.ring[pos & A.mask];
+    intptr_t diff = (intptr_t)__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&A.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_fetch_add(&A.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&A.head, __ATOMIC_RELAXED);
+    }
+  }
+
+  r->level = level;
+  r->file = file;
+  r->line = line;
+  r->time = time(NULL);
+  vsnprintf(r->message, sizeof(r->message), fmt, ap);
+
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&A.ready);
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
   log_Event ev = {
     .fmt   = fmt,
@@ -144,25 +355,17 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .line  = line,
     .level = level,
   };
+  va_list ap;
 
-  lock();
-
-  if (!L.quiet && level >= L.level) {
-    init_event(&ev, stderr);
-    va_start(ev.ap, fmt);
-    stdout_callback(&ev);
-    va_end(ev.ap);
-  }
+  va_start(ap, fmt);
 
-  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
-    Callback *cb = &L.callbacks[i];
-    if (level >= cb->level) {
-      init_event(&ev, cb->udata);
-      va_start(ev.ap, fmt);
-      cb->fn(&ev);
-      va_end(ev.ap);
-    }
+  if (__atomic_load_n(&A.running, __ATOMIC_ACQUIRE)) {
+    log_async(level, file, line, fmt, ap);
+  } else {
+    lock();
+    dispatch(&ev, ap);
+    unlock();
   }
 
-  unlock();
+  va_end(ap);
 }
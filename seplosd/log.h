@@ -30,20 +30,53 @@ typedef void (*log_LockFn)(bool lock, void *udata);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+/*
+ * Calls below LOG_MIN_LEVEL are compiled out, arguments and all. Build with
+ * -DLOG_MIN_LEVEL=1 to drop log_trace(), and so on up to 5 for LOG_FATAL.
+ * The rest cost a comparison when their level is below every output's, so
+ * their arguments aren't evaluated either.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+extern int log_threshold;
+
+#define log_at(level, ...) \
+  ((level) >= LOG_MIN_LEVEL && (level) >= log_threshold ? log_log(level, __FILE__, __LINE__, __VA_ARGS__) : (void)0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
 
 const char* log_level_string(int level);
+int log_level_from_string(const char *name);
 void log_set_lock(log_LockFn fn, void *udata);
 void log_set_level(int level);
 void log_set_quiet(bool enable);
 int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
+/*
+ * Hands every line from here on to a background thread to write, through a
+ * lock-free ring of capacity lines, so that a slow stderr or log file never
+ * holds up the caller. The message is formatted by the caller, and the time
+ * stamp and the writing are done by the thread. A line that finds the ring
+ * full is dropped and counted, and the count is logged once there is room.
+ * Lines longer than LOG_ASYNC_LINE are cut short.
+ */
+#define LOG_ASYNC_LINE 512
+int log_start_async(size_t capacity);
+
+/*
+ * Writes what is still in the ring and goes back to writing on the caller's
+ * thread. Nothing else may be logging while this runs.
+ */
+void log_stop_async(void);
+
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
 #endif
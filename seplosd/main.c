@@ -3,89 +3,471 @@
 #include <errno.h>
 #include <uv.h>
 #include <string.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
 
 #include "log.h"
 #include "seplos.h"
 #include "context.h"
-#include "json.h"
 #include "config.h"
+#include "bus.h"
+#include "mqtt.h"
+#include "deadband.h"
+#include "discovery.h"
+#include "spool.h"
+#include "stats.h"
+
+/*
+ * Picks the members of the document to publish. With publish_changes, only
+ * those that moved beyond their deadband go out, except for a full document
+ * every full_refresh_interval so that new subscribers catch up.
+ */
+static uint32_t __sample_fields(seplosd_context_t *context, const seplosd_pack_t *pack, uint64_t now)
+{
+  if (!context->publish_changes || !pack->published.valid)
+  {
+    return SEPLOS_JSON_ALL;
+  }
+
+  if (context->full_refresh_interval && now - pack->published.at >= context->full_refresh_interval)
+  {
+    return SEPLOS_JSON_ALL;
+  }
+
+  return seplosd_deadband_changes(&context->deadband, &pack->published, &pack->data);
+}
+
+static uint64_t __wall_clock_ms(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/*
+ * Publishes the window of samples as one document. Everything in it counts as
+ * published, so publish_changes carries on from its latest sample.
+ */
+static void __publish_window(seplosd_context_t *context, seplosd_pack_t *pack, uint64_t now)
+{
+  seplosd_window_t *window = &pack->window;
+  uint64_t started;
+  size_t length;
+  int r;
+
+  started = uv_hrtime();
+  length = seplosd_window_json(context->payload, sizeof(context->payload), window);
+  seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_SERIALIZE], uv_hrtime() - started);
+
+  if (length >= sizeof(context->payload))
+  {
+    log_error("window of %u samples for %s does not fit in %zu bytes.", window->count, pack->topic,
+              sizeof(context->payload));
+    window->count = 0;
+    return;
+  }
+
+  started = uv_hrtime();
+  r = seplosd_spool_publish(&context->spool, pack->topic, context->payload, length, window->sampled_at);
+  seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_PUBLISH], uv_hrtime() - started);
+
+  if (r == 0)
+  {
+    seplosd_deadband_commit(&pack->published, &window->last, SEPLOS_JSON_ALL);
+    pack->published.at = now;
+    log_info("mqtt: window of %u samples queued.  topic=%s", window->count, pack->topic);
+  }
+
+  window->count = 0;
+}
+
+static void __bus_on_sample(seplosd_bus_t *bus, seplosd_pack_t *pack)
+{
+  const SeplosData *data = &pack->data;
+  seplosd_context_t *context = (seplosd_context_t *)bus->udata;
+  uint64_t now = uv_now(bus->loop);
+  uint64_t started;
+  uint32_t fields;
+  size_t length;
+  bool excursion = false;
+  int r;
+
+  pack->sampled_at = __wall_clock_ms();
+  seplosd_metrics_invalidate(&context->metrics);
+
+  /* Every sample goes into the history, whether or not MQTT is up. */
+  if (pack->ring.base)
+  {
+    seplos_ring_append(&pack->ring, data, pack->sampled_at);
+  }
+
+  if (context->cells_interval)
+  {
+    seplos_cells_add(&pack->cells, data, pack->sampled_at);
+  }
+
+  if (context->live.base && seplos_live_publish(&context->live, bus->device, data, pack->sampled_at) < 0 &&
+      !context->live_full)
+  {
+    context->live_full = true;
+    log_warn("%s has no room for %s address %u pack %u until seplosd is restarted.", context->shm_name,
+             bus->device, pack->address, pack->pack);
+  }
+
+  log_info("bms address=%u pack=%u soc=%.2f i=%.2f v=%.2f",
+           pack->address,
+           pack->pack,
+           data->state_of_charge,
+           data->charge_discharge_current,
+           data->total_battery_voltage);
+
+  /* The metadata goes out once per change, when all of it has been read, and again if that failed. */
+  if (pack->metadata.generation != pack->announced && !seplos_metadata_due(&pack->metadata) &&
+      seplosd_discovery_publish(&context->mqtt,
+                                !context->ha_discovery           ? NULL
+                                : context->ha_discovery_prefix ? context->ha_discovery_prefix
+                                                               : "homeassistant",
+                                bus->device,
+                                pack) == 0)
+  {
+    pack->announced = pack->metadata.generation;
+    log_info("mqtt: metadata published.  topic=%s/config", pack->topic);
+  }
+
+  /*
+   * With a window, the samples are only published together once it has
+   * passed, except that an alarm goes out at once, and so does its clearing.
+   */
+  if (context->aggregate_window)
+  {
+    excursion = seplosd_window_excursion(&pack->window, data);
+
+    if (pack->window.count && now - pack->window.started >= context->aggregate_window)
+    {
+      __publish_window(context, pack, now);
+    }
+
+    seplosd_window_add(&pack->window, data, now, pack->sampled_at);
+
+    if (!excursion)
+    {
+      return;
+    }
+
+    log_info("alarm state of %s, publishing the sample now.", pack->topic);
+  }
+  else if (pack->window.count)
+  {
+    /* aggregate_window was turned off by a reload. */
+    __publish_window(context, pack, now);
+  }
+
+  if (!(fields = excursion ? SEPLOS_JSON_ALL : __sample_fields(context, pack, now)))
+  {
+    log_trace("no change beyond the deadbands, nothing to publish.  topic=%s", pack->topic);
+    return;
+  }
+
+  /* The binary document carries its own time, so a held-back one needs nothing added. */
+  started = uv_hrtime();
+  if (context->cbor)
+  {
+    length = seplos_cbor_format(context->payload, sizeof(context->payload), data, fields, pack->sampled_at);
+  }
+  else
+  {
+    length = seplos_json_format(context->payload, sizeof(context->payload), data, fields);
+  }
+  seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_SERIALIZE], uv_hrtime() - started);
+
+  /* This only queues the message, or holds it back until the broker is reachable. */
+  started = uv_hrtime();
+  r = seplosd_spool_publish(&context->spool, pack->topic, context->payload, length, pack->sampled_at);
+  seplosd_histogram_observe(&pack->stats.stages[SEPLOSD_STAGE_PUBLISH], uv_hrtime() - started);
+  if (r < 0)
+  {
+    return;
+  }
+
+  /* Only what was queued counts as published, the rest keeps its old value. */
+  seplosd_deadband_commit(&pack->published, data, fields);
+  if (fields == SEPLOS_JSON_ALL)
+  {
+    pack->published.at = now;
+  }
+
+  log_info("mqtt: message queued.  topic=%s", pack->topic);
+}
 
 static void __timer_on_tick(uv_timer_t *timer)
 {
-  int fd, r;
-  SeplosData data;
   seplosd_context_t *context = (seplosd_context_t *)timer->data;
-  MQTTClient_message message = MQTTClient_message_initializer;
-  MQTTClient_deliveryToken token;
 
   log_trace("timer on tick");
 
-  MQTTClient_yield();
-
-  if ((fd = seplos_open(context->bms_device)) < 0)
+  /*
+   * This only starts the sweeps. The serial exchanges on all buses run on the
+   * loop side by side and __bus_on_sample publishes the results, so a slow
+   * BMS doesn't hold up the timer, the other buses or anything else.
+   */
+  for (size_t i = 0; i < context->n_buses; i++)
   {
-    log_error("cannot open device: %s, will try again next tick", strerror(errno));
-    goto out;
+    if (seplosd_bus_poll(&context->buses[i]) < 0)
+    {
+      log_trace("%s: bms poll not started, will try again next tick", context->buses[i].device);
+    }
   }
 
-  log_trace("bms open. fd=%d", fd);
+  /* The last sweep's timings and failures, even if no pack answered. */
+  seplosd_metrics_invalidate(&context->metrics);
+}
+
+/* Publishes the timings and failure counts of each pack to <topic>/stats. */
+static void __stats_on_tick(uv_timer_t *timer)
+{
+  seplosd_context_t *context = (seplosd_context_t *)timer->data;
+  char topic[1024];
+  char payload[4096];
 
-  if ((r = seplos_data(fd, 0, 1, &data)) < 0)
+  for (size_t i = 0; i < context->n_buses; i++)
   {
-    log_error("bms read failure, will try again next tick");
-    goto out;
+    const seplosd_bus_t *bus = &context->buses[i];
+
+    for (size_t j = 0; j < bus->n_packs; j++)
+    {
+      const seplosd_pack_t *pack = &bus->packs[j];
+      size_t length = seplosd_stats_json(payload, sizeof(payload), &pack->stats, &bus->session.open);
+
+      if (length >= sizeof(payload))
+      {
+        log_error("stats for %s do not fit in %zu bytes.", pack->topic, sizeof(payload));
+        continue;
+      }
+
+      snprintf(topic, sizeof(topic), "%s/stats", pack->topic);
+      seplosd_mqtt_publish(&context->mqtt, topic, payload, length, false);
+    }
   }
+}
 
-  log_info("bms soc=%.2f i=%.2f v=%.2f",
-           data.state_of_charge,
-           data.charge_discharge_current,
-           data.total_battery_voltage);
+/* <ring_directory>/<device>-<address>-<pack>.<suffix>, where each pack keeps what it has on disk. */
+static void __pack_path(char *path, size_t size, const seplosd_context_t *context, const seplosd_bus_t *bus,
+                        const seplosd_pack_t *pack, const char *suffix)
+{
+  const char *device = strrchr(bus->device, '/') ? strrchr(bus->device, '/') + 1 : bus->device;
 
-  json_object *root;
+  snprintf(path, size, "%s/%s-%u-%u.%s", context->ring_directory, device, pack->address, pack->pack, suffix);
+}
+
+/* Each pack keeps its history in a .ring file, and the statistics of its cells in a .cells file. */
+static int __open_ring(const seplosd_context_t *context, const seplosd_bus_t *bus, seplosd_pack_t *pack)
+{
+  char path[4096];
 
-  if (!(root = json_object_new_object()))
+  __pack_path(path, sizeof(path), context, bus, pack, "ring");
+  if (seplos_ring_open(&pack->ring, path, context->ring_samples, pack->address, pack->pack) < 0)
   {
-    log_error("cannot allocate new json object.");
-    goto out;
+    log_fatal("cannot open the history ring %s.", path);
+    return -1;
   }
+  log_trace("history ring %s holds %u samples.", path, (unsigned int)context->ring_samples);
 
-  if (!seplosd_json_serialize(&data, root))
+  __pack_path(path, sizeof(path), context, bus, pack, "cells");
+  if (seplos_cells_load(&pack->cells, path, pack->address, pack->pack) < 0)
   {
-    log_error("cannot serialize bms data into json.");
-    goto json_out;
+    log_warn("cannot read the cell statistics in %s, starting them over.", path);
   }
 
-  message.qos = 0;
-  message.retained = 0;
-  message.payload = (char *)json_object_to_json_string(root);
-  message.payloadlen = (int)strlen(message.payload);
+  return 0;
+}
+
+/* Saves the statistics of the cells of every pack, with ring_directory. */
+static void __save_cells(const seplosd_context_t *context)
+{
+  char path[4096];
 
-  if ((r = MQTTClient_publishMessage(context->client, context->topic, &message, &token)) != MQTTCLIENT_SUCCESS ||
-      (r = MQTTClient_waitForCompletion(context->client, token, 1000)) != MQTTCLIENT_SUCCESS)
+  for (size_t i = 0; context->ring_directory && strcmp(context->ring_directory, "") && i < context->n_buses; i++)
   {
-    log_error("error publishing message to topic. rc=%d %s", r, MQTTClient_strerror(r));
-    goto json_out;
+    const seplosd_bus_t *bus = &context->buses[i];
+
+    for (size_t j = 0; j < bus->n_packs; j++)
+    {
+      if (bus->packs[j].cells.samples == 0)
+      {
+        continue;
+      }
+
+      __pack_path(path, sizeof(path), context, bus, &bus->packs[j], "cells");
+      if (seplos_cells_save(&bus->packs[j].cells, path) < 0)
+      {
+        log_error("cannot save the cell statistics to %s.", path);
+      }
+    }
   }
+}
 
-  log_info("mqtt: message published.  topic=%s", context->topic);
+/*
+ * Publishes the long-run statistics of each pack's cells, retained, to
+ * <topic>/cells, and saves them so that they carry on after a restart.
+ */
+static void __cells_on_tick(uv_timer_t *timer)
+{
+  seplosd_context_t *context = (seplosd_context_t *)timer->data;
+  char topic[1024];
+  char payload[SEPLOS_CELLS_JSON_MAX];
 
-json_out:
-  json_object_put(root);
+  for (size_t i = 0; i < context->n_buses; i++)
+  {
+    const seplosd_bus_t *bus = &context->buses[i];
 
-out:
-  close(fd);
-  log_trace("bms closed. fd=%d", fd);
+    for (size_t j = 0; j < bus->n_packs; j++)
+    {
+      const seplosd_pack_t *pack = &bus->packs[j];
+      size_t length;
+
+      if (pack->cells.samples == 0)
+      {
+        continue;
+      }
+
+      if ((length = seplos_cells_json(payload, sizeof(payload), &pack->cells)) >= sizeof(payload))
+      {
+        log_error("cell statistics for %s do not fit in %zu bytes.", pack->topic, sizeof(payload));
+        continue;
+      }
+
+      snprintf(topic, sizeof(topic), "%s/cells", pack->topic);
+      seplosd_mqtt_publish(&context->mqtt, topic, payload, length, true);
+    }
+  }
+
+  __save_cells(context);
 }
 
-static int __validate_context(seplosd_context_t *context)
+static int __open_rings(seplosd_context_t *context)
+{
+  for (size_t i = 0; i < context->n_buses; i++)
+  {
+    for (size_t j = 0; j < context->buses[i].n_packs; j++)
+    {
+      if (__open_ring(context, &context->buses[i], &context->buses[i].packs[j]) < 0)
+      {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * The shared-memory segment has a slot for each pack, and as many again for
+ * those a reload adds, since it can't grow under its readers.
+ */
+static int __open_live(seplosd_context_t *context)
 {
+  size_t packs = 0;
+
+  for (size_t i = 0; i < context->n_buses; i++)
+  {
+    packs += context->buses[i].n_packs;
+  }
 
-  if (!context->bms_device || !strcmp(context->bms_device, ""))
+  if (seplos_live_open(&context->live, context->shm_name, packs < 8 ? 16 : packs * 2) < 0)
   {
-    log_error("configuration error, bms_device is required.");
+    log_fatal("cannot open the shared-memory segment %s.", context->shm_name);
     return -1;
   }
+  log_trace("shared-memory segment %s holds %u packs.", context->shm_name, seplos_live_capacity(&context->live));
+
+  return 0;
+}
+
+/* The defaults, before the config file is read. */
+static void __context_defaults(seplosd_context_t *context)
+{
+  *context = (seplosd_context_t){
+      .transaction_timeout = 1000,
+      .reply_timeout = 300,
+      .retries = 2,
+      .retry_jitter = 20,
+      .baud = SEPLOS_DEFAULT_BAUD,
+      .reconnect_backoff_min = 1000,
+      .reconnect_backoff_max = 60000,
+      .mqtt_max_inflight = 64,
+      .full_refresh_interval = 300000,
+      .ring_samples = 100000,
+      .stats_interval = 60000,
+      .spool_messages = 1000,
+      .spool_drain_interval = 1000,
+      .spool_drain_batch = 20,
+      .log_buffer = 1024,
+      .metadata_ttl = 86400000,
+      .deadband = {
+          .cell_voltage = 0.005,
+          .voltage = 0.05,
+          .current = 0.1,
+          .temperature = 1,
+          .soc = 1,
+          .capacity = 1,
+      },
+  };
+}
+
+/* Frees what the config file filled in. */
+static void __context_free(seplosd_context_t *context)
+{
+  if (context->topic)
+  {
+    free(context->topic);
+  }
+  if (context->mqtt_uri)
+  {
+    free(context->mqtt_uri);
+  }
+  if (context->mqtt_client_id)
+  {
+    free(context->mqtt_client_id);
+  }
+  if (context->capture_file)
+  {
+    free(context->capture_file);
+  }
+  if (context->ring_directory)
+  {
+    free(context->ring_directory);
+  }
+  if (context->shm_name)
+  {
+    free(context->shm_name);
+  }
+  if (context->metrics_listen)
+  {
+    free(context->metrics_listen);
+  }
+  if (context->spool_file)
+  {
+    free(context->spool_file);
+  }
+  if (context->payload_format)
+  {
+    free(context->payload_format);
+  }
+  if (context->log_level)
+  {
+    free(context->log_level);
+  }
+  if (context->ha_discovery_prefix)
+  {
+    free(context->ha_discovery_prefix);
+  }
+  seplosd_config_free_buses(context);
+}
+
+static int __validate_context(seplosd_context_t *context)
+{
 
   if (!context->mqtt_uri || !strcmp(context->mqtt_uri, ""))
   {
@@ -93,10 +475,25 @@ static int __validate_context(seplosd_context_t *context)
     return -1;
   }
 
-  if (!context->topic || !strcmp(context->topic, ""))
+  for (size_t i = 0; i < context->n_buses; i++)
   {
-    log_error("configuration error, topic is required.");
-    return -1;
+    const seplosd_bus_t *bus = &context->buses[i];
+
+    if (!bus->device || !strcmp(bus->device, ""))
+    {
+      log_error("configuration error, bms_device is required.");
+      return -1;
+    }
+
+    for (size_t j = 0; j < bus->n_packs; j++)
+    {
+      if (!bus->packs[j].topic || !strcmp(bus->packs[j].topic, ""))
+      {
+        log_error("configuration error, topic is required for %s address %u pack %u.",
+                  bus->device, bus->packs[j].address, bus->packs[j].pack);
+        return -1;
+      }
+    }
   }
 
   if (!context->mqtt_client_id || !strcmp(context->mqtt_client_id, ""))
@@ -105,17 +502,353 @@ static int __validate_context(seplosd_context_t *context)
     return -1;
   }
 
+  if (context->mqtt_qos > 2)
+  {
+    log_error("configuration error, mqtt_qos must be 0, 1 or 2.");
+    return -1;
+  }
+
+  if (context->reply_timeout == 0 || context->transaction_timeout == 0)
+  {
+    log_error("configuration error, reply_timeout and transaction_timeout must be at least 1.");
+    return -1;
+  }
+
+  if (context->retries > 10 || context->retry_jitter > 10000)
+  {
+    log_error("configuration error, retries must be at most 10 and retry_jitter at most 10000.");
+    return -1;
+  }
+
+  if (context->ring_samples == 0 || context->ring_samples > 100000000)
+  {
+    log_error("configuration error, ring_samples must be from 1 to 100000000.");
+    return -1;
+  }
+
+  if (context->shm_name && strcmp(context->shm_name, "") &&
+      (context->shm_name[0] != '/' || strchr(context->shm_name + 1, '/') || strlen(context->shm_name) > 255))
+  {
+    log_error("configuration error, shm_name must be a \"/\" followed by a name with no other \"/\".");
+    return -1;
+  }
+
+  if (!context->payload_format || !strcmp(context->payload_format, "") || !strcmp(context->payload_format, "json"))
+  {
+    context->cbor = false;
+  }
+  else if (!strcmp(context->payload_format, "cbor"))
+  {
+    context->cbor = true;
+  }
+  else
+  {
+    log_error("configuration error, payload_format must be \"json\" or \"cbor\".");
+    return -1;
+  }
+
+  if (context->aggregate_window && context->cbor)
+  {
+    log_error("configuration error, aggregate_window needs payload_format \"json\".");
+    return -1;
+  }
+
+  if (context->ha_discovery && context->cbor)
+  {
+    log_error("configuration error, ha_discovery needs payload_format \"json\".");
+    return -1;
+  }
+
+  if (context->ha_discovery_prefix && !strcmp(context->ha_discovery_prefix, ""))
+  {
+    log_error("configuration error, ha_discovery_prefix must not be empty.");
+    return -1;
+  }
+
+  if (context->metadata_ttl < 60000)
+  {
+    log_error("configuration error, metadata_ttl must be at least 60000.");
+    return -1;
+  }
+
+  if (context->log_level && strcmp(context->log_level, "") && log_level_from_string(context->log_level) < 0)
+  {
+    log_error("configuration error, log_level must be trace, debug, info, warn, error or fatal.");
+    return -1;
+  }
+
+  if (context->log_async && context->log_buffer == 0)
+  {
+    log_error("configuration error, log_buffer must be at least 1.");
+    return -1;
+  }
+
+  if (context->spool_messages == 0 || context->spool_drain_interval == 0 || context->spool_drain_batch == 0)
+  {
+    log_error("configuration error, spool_messages, spool_drain_interval and spool_drain_batch must be at least 1.");
+    return -1;
+  }
+
+  if (context->mqtt_max_inflight == 0)
+  {
+    log_error("configuration error, mqtt_max_inflight must be at least 1.");
+    return -1;
+  }
+
+  if (context->ha_discovery && context->mqtt_max_inflight < seplosd_discovery_messages(""))
+  {
+    log_error("configuration error, mqtt_max_inflight must be at least %zu with ha_discovery.",
+              seplosd_discovery_messages(""));
+    return -1;
+  }
+
   return 0;
 }
 
+static bool __differs(const char *a, const char *b)
+{
+  return strcmp(a ? a : "", b ? b : "") != 0;
+}
+
+/* Settings that belong to a session or a file that is kept open. */
+static void __reload_fixed(const char *key, bool changed)
+{
+  if (changed)
+  {
+    log_warn("reload: %s has changed, which takes effect when seplosd is restarted.", key);
+  }
+}
+
+static void __reload_swap(char **live, char **fresh)
+{
+  char *swapped = *live;
+
+  *live = *fresh;
+  *fresh = swapped;
+}
+
+static seplosd_bus_t *__find_bus(const seplosd_context_t *context, const char *device)
+{
+  for (size_t i = 0; i < context->n_buses; i++)
+  {
+    if (context->buses[i].device && !strcmp(context->buses[i].device, device))
+    {
+      return &context->buses[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Hands each bus its new packs, opening the history of those it didn't have.
+ * The buses are polled through uv handles that can't move, so the list of
+ * buses itself only changes on a restart.
+ */
+static void __reload_buses(seplosd_context_t *context, seplosd_context_t *fresh)
+{
+  for (size_t i = 0; i < context->n_buses; i++)
+  {
+    if (!__find_bus(fresh, context->buses[i].device))
+    {
+      log_warn("reload: %s is no longer configured, but is polled until seplosd is restarted.",
+               context->buses[i].device);
+    }
+  }
+
+  for (size_t i = 0; i < fresh->n_buses; i++)
+  {
+    seplosd_bus_t *from = &fresh->buses[i];
+    seplosd_bus_t *bus = __find_bus(context, from->device);
+    seplosd_bus_t *copy;
+
+    if (!bus)
+    {
+      log_warn("reload: %s is new, and is only polled once seplosd is restarted.", from->device);
+      continue;
+    }
+
+    for (size_t j = 0; j < from->n_packs; j++)
+    {
+      seplosd_pack_t *pack = &from->packs[j];
+
+      if (context->ring_directory && strcmp(context->ring_directory, "") &&
+          !seplosd_bus_find(bus, pack->address, pack->pack) && __open_ring(context, bus, pack) < 0)
+      {
+        log_error("reload: %s address %u pack %u keeps no history.", from->device, pack->address, pack->pack);
+      }
+    }
+
+    if (!(copy = malloc(sizeof(*copy))))
+    {
+      log_error("reload: out of memory, %s is left as it was.", from->device);
+      continue;
+    }
+
+    *copy = *from;
+    copy->timeout = fresh->transaction_timeout;
+    copy->reply_timeout = fresh->reply_timeout;
+    copy->metadata_ttl = fresh->metadata_ttl;
+    copy->retries = fresh->retries;
+    copy->retry_jitter = fresh->retry_jitter;
+    from->device = NULL;
+    from->packs = NULL;
+    from->n_packs = 0;
+
+    seplosd_bus_reconfigure(bus, copy);
+  }
+}
+
+/*
+ * Reads the config file again on SIGHUP and applies what has changed. The
+ * MQTT session and the serial devices stay up, and the packs that are still
+ * configured keep their state. A file that can't be read or doesn't validate
+ * leaves everything as it was.
+ */
+static void __reload_on_signal(uv_signal_t *signal, int signum)
+{
+  seplosd_context_t *context = (seplosd_context_t *)signal->data;
+  seplosd_context_t *fresh;
+  bool announce;
+
+  log_info("reload: reading %s.", context->config_path);
+
+  if (!(fresh = malloc(sizeof(*fresh))))
+  {
+    log_error("reload: out of memory, keeping the running configuration.");
+    return;
+  }
+
+  __context_defaults(fresh);
+
+  if (seplosd_config_fill(context->config_path, fresh) < 0 || __validate_context(fresh) < 0)
+  {
+    log_error("reload: %s is not usable, keeping the running configuration.", context->config_path);
+    goto out;
+  }
+
+  __reload_fixed("mqtt_uri", __differs(context->mqtt_uri, fresh->mqtt_uri));
+  __reload_fixed("mqtt_client_id", __differs(context->mqtt_client_id, fresh->mqtt_client_id));
+  __reload_fixed("mqtt_qos", context->mqtt_qos != fresh->mqtt_qos);
+  __reload_fixed("mqtt_max_inflight", context->mqtt_max_inflight != fresh->mqtt_max_inflight);
+  __reload_fixed("reconnect_backoff_min", context->reconnect_backoff_min != fresh->reconnect_backoff_min);
+  __reload_fixed("reconnect_backoff_max", context->reconnect_backoff_max != fresh->reconnect_backoff_max);
+  __reload_fixed("log_async", context->log_async != fresh->log_async);
+  __reload_fixed("log_buffer", context->log_buffer != fresh->log_buffer);
+  __reload_fixed("capture_file", __differs(context->capture_file, fresh->capture_file));
+  __reload_fixed("ring_directory", __differs(context->ring_directory, fresh->ring_directory));
+  __reload_fixed("ring_samples", context->ring_samples != fresh->ring_samples);
+  __reload_fixed("shm_name", __differs(context->shm_name, fresh->shm_name));
+  __reload_fixed("metrics_listen", __differs(context->metrics_listen, fresh->metrics_listen));
+  __reload_fixed("spool_file", __differs(context->spool_file, fresh->spool_file));
+  __reload_fixed("spool_messages", context->spool_messages != fresh->spool_messages);
+  __reload_fixed("spool_drain_interval", context->spool_drain_interval != fresh->spool_drain_interval);
+  __reload_fixed("spool_drain_batch", context->spool_drain_batch != fresh->spool_drain_batch);
+
+  if (fresh->log_level && strcmp(fresh->log_level, ""))
+  {
+    log_set_level(log_level_from_string(fresh->log_level));
+  }
+  else if (__differs(context->log_level, fresh->log_level))
+  {
+    log_set_level(LOG_TRACE);
+  }
+
+  if (fresh->interval != context->interval)
+  {
+    log_info("reload: sweeping every %llu ms.", (unsigned long long)fresh->interval);
+    uv_timer_start(context->timer, __timer_on_tick, fresh->interval, fresh->interval);
+  }
+
+  if (fresh->stats_interval != context->stats_interval)
+  {
+    uv_timer_stop(context->stats_timer);
+    if (fresh->stats_interval)
+    {
+      uv_timer_start(context->stats_timer, __stats_on_tick, fresh->stats_interval, fresh->stats_interval);
+    }
+  }
+
+  if (fresh->cells_interval != context->cells_interval)
+  {
+    uv_timer_stop(context->cells_timer);
+    if (fresh->cells_interval)
+    {
+      uv_timer_start(context->cells_timer, __cells_on_tick, fresh->cells_interval, fresh->cells_interval);
+    }
+  }
+
+  announce = fresh->ha_discovery != context->ha_discovery ||
+             __differs(fresh->ha_discovery_prefix, context->ha_discovery_prefix);
+
+  context->interval = fresh->interval;
+  context->stats_interval = fresh->stats_interval;
+  context->cells_interval = fresh->cells_interval;
+  context->telecommand_interval = fresh->telecommand_interval;
+  context->transaction_timeout = fresh->transaction_timeout;
+  context->reply_timeout = fresh->reply_timeout;
+  context->retries = fresh->retries;
+  context->retry_jitter = fresh->retry_jitter;
+  context->baud = fresh->baud;
+  context->publish_changes = fresh->publish_changes;
+  context->full_refresh_interval = fresh->full_refresh_interval;
+  context->aggregate_window = fresh->aggregate_window;
+  context->deadband = fresh->deadband;
+  context->cbor = fresh->cbor;
+  context->metadata_ttl = fresh->metadata_ttl;
+  context->ha_discovery = fresh->ha_discovery;
+  __reload_swap(&context->topic, &fresh->topic);
+  __reload_swap(&context->log_level, &fresh->log_level);
+  __reload_swap(&context->payload_format, &fresh->payload_format);
+  __reload_swap(&context->ha_discovery_prefix, &fresh->ha_discovery_prefix);
+
+  /* A generation that differs from the current one has the metadata published again. */
+  for (size_t i = 0; announce && i < context->n_buses; i++)
+  {
+    for (size_t j = 0; j < context->buses[i].n_packs; j++)
+    {
+      context->buses[i].packs[j].announced = context->buses[i].packs[j].metadata.generation - 1;
+    }
+  }
+
+  __reload_buses(context, fresh);
+  log_info("reload: done.");
+
+out:
+  __context_free(fresh);
+  free(fresh);
+}
+
+/*
+ * Stops the loop on SIGTERM or SIGINT, so that seplosd shuts down in order:
+ * the held-back messages and the cell statistics are saved, and the log is
+ * written out. The handlers are removed, so a second signal kills it at once.
+ */
+static void __stop_on_signal(uv_signal_t *signal, int signum)
+{
+  seplosd_context_t *context = (seplosd_context_t *)signal->data;
+
+  log_info("%s: shutting down.", strsignal(signum));
+  uv_signal_stop(context->terminate);
+  uv_signal_stop(context->interrupt);
+  uv_stop(signal->loop);
+}
+
 int main(int argc, char **argv)
 {
   uv_loop_t *loop = uv_default_loop();
   uv_timer_t timer = {};
+  uv_timer_t stats_timer = {};
+  uv_timer_t cells_timer = {};
+  uv_signal_t reload = {};
+  uv_signal_t terminate = {};
+  uv_signal_t interrupt = {};
   int r, opt;
   const char *config_path = "/etc/seplosd.conf";
   seplosd_context_t context = {};
 
+  __context_defaults(&context);
+
   while ((opt = getopt(argc, argv, "c:")) != -1)
   {
     switch (opt)
@@ -126,6 +859,13 @@ int main(int argc, char **argv)
     }
   }
 
+  context.config_path = config_path;
+  context.timer = &timer;
+  context.stats_timer = &stats_timer;
+  context.cells_timer = &cells_timer;
+  context.terminate = &terminate;
+  context.interrupt = &interrupt;
+
   if ((r = seplosd_config_fill(config_path, &context)) < 0)
   {
     log_fatal("Cannot read config file. rc=%d", r);
@@ -135,10 +875,40 @@ int main(int argc, char **argv)
   if (__validate_context(&context) < 0)
   {
     log_fatal("configuration validation failed.");
+    r = -1;
     goto out;
   }
 
-  MQTTClient_connectOptions options = MQTTClient_connectOptions_initializer;
+  if (context.log_level && strcmp(context.log_level, ""))
+  {
+    log_set_level(log_level_from_string(context.log_level));
+  }
+
+  if (context.log_async && log_start_async(context.log_buffer) < 0)
+  {
+    log_fatal("cannot start the log writer thread.");
+    r = -1;
+    goto out;
+  }
+
+  if (context.capture_file && strcmp(context.capture_file, "") && seplos_capture_open(context.capture_file) < 0)
+  {
+    log_fatal("cannot open capture_file %s.", context.capture_file);
+    r = -1;
+    goto out;
+  }
+
+  if (context.ring_directory && strcmp(context.ring_directory, "") && __open_rings(&context) < 0)
+  {
+    r = -1;
+    goto out;
+  }
+
+  if (context.shm_name && strcmp(context.shm_name, "") && __open_live(&context) < 0)
+  {
+    r = -1;
+    goto out;
+  }
 
   if ((r = uv_timer_init(loop, &timer)) < 0)
   {
@@ -146,26 +916,61 @@ int main(int argc, char **argv)
     goto out;
   }
 
-  if ((r = MQTTClient_create(&context.client,
-                             context.mqtt_uri,
-                             context.mqtt_client_id,
-                             MQTTCLIENT_PERSISTENCE_NONE,
-                             NULL)) != MQTTCLIENT_SUCCESS)
+  if (seplosd_mqtt_init(loop,
+                        &context.mqtt,
+                        context.mqtt_uri,
+                        context.mqtt_client_id,
+                        context.mqtt_qos,
+                        context.mqtt_max_inflight,
+                        context.reconnect_backoff_min) < 0)
   {
-    log_fatal("cannot create MQTT client. rc=%d", r);
+    log_fatal("mqtt client initialization failed.");
+    r = -1;
     goto out;
   }
 
-  options.keepAliveInterval = 20;
-  options.cleansession = true;
+  if (seplosd_spool_init(loop,
+                         &context.spool,
+                         &context.mqtt,
+                         context.spool_file && strcmp(context.spool_file, "") ? context.spool_file : NULL,
+                         context.spool_messages,
+                         context.spool_drain_interval,
+                         context.spool_drain_batch) < 0)
+  {
+    log_fatal("cannot set up the queue of held back messages.");
+    r = -1;
+    goto mqtt_connect_out;
+  }
+
+  seplosd_mqtt_connect(&context.mqtt);
 
-  if ((r = MQTTClient_connect(context.client, &options)) != MQTTCLIENT_SUCCESS)
+  for (size_t i = 0; i < context.n_buses; i++)
   {
-    log_fatal("mqtt client failed to connect.  rc=%d", r);
-    goto out;
+    if (seplosd_bus_init(loop,
+                         &context.buses[i],
+                         context.transaction_timeout,
+                         context.reply_timeout,
+                         context.reconnect_backoff_min,
+                         context.reconnect_backoff_max,
+                         context.metadata_ttl,
+                         context.retries,
+                         context.retry_jitter,
+                         __bus_on_sample,
+                         &context) < 0)
+    {
+      log_fatal("bms bus initialization failed.");
+      r = -1;
+      goto mqtt_connect_out;
+    }
   }
 
-  log_info("mqtt connected");
+  if (context.metrics_listen && strcmp(context.metrics_listen, "") &&
+      seplosd_metrics_init(loop, &context.metrics, context.metrics_listen, context.buses, context.n_buses) < 0)
+  {
+    log_fatal("metrics endpoint initialization failed.");
+    r = -1;
+    goto mqtt_connect_out;
+  }
 
   timer.data = &context;
 
@@ -175,41 +980,72 @@ int main(int argc, char **argv)
                           context.interval)) < 0)
   {
     log_fatal("uv timer start failure.");
-    goto out;
+    goto mqtt_connect_out;
   }
 
-  uv_run(loop, UV_RUN_DEFAULT);
+  /* Initialised even when unused, so that a reload can start it. */
+  stats_timer.data = &context;
 
-  r = 0;
-  /* fall through */
-mqtt_connect_out:
-  if (MQTTClient_disconnect(context.client, 1000) != MQTTCLIENT_SUCCESS)
+  if ((r = uv_timer_init(loop, &stats_timer)) < 0 ||
+      (context.stats_interval &&
+       (r = uv_timer_start(&stats_timer, __stats_on_tick, context.stats_interval, context.stats_interval)) < 0))
   {
-    log_error("cannot disconnect from mqtt server. we're exiting anyway.");
+    log_fatal("uv stats timer failure: %s", uv_strerror(r));
+    goto mqtt_connect_out;
   }
-mqtt_out:
-  MQTTClient_destroy(context.client);
 
-out:
-  if (context.bms_device)
+  cells_timer.data = &context;
+
+  if ((r = uv_timer_init(loop, &cells_timer)) < 0 ||
+      (context.cells_interval &&
+       (r = uv_timer_start(&cells_timer, __cells_on_tick, context.cells_interval, context.cells_interval)) < 0))
   {
-    free(context.bms_device);
+    log_fatal("uv cell statistics timer failure: %s", uv_strerror(r));
+    goto mqtt_connect_out;
   }
-  if (context.topic)
+
+  reload.data = &context;
+
+  if ((r = uv_signal_init(loop, &reload)) < 0 || (r = uv_signal_start(&reload, __reload_on_signal, SIGHUP)) < 0)
   {
-    free(context.topic);
+    log_fatal("uv signal failure: %s", uv_strerror(r));
+    goto mqtt_connect_out;
   }
-  if (context.mqtt_uri)
+
+  terminate.data = &context;
+  interrupt.data = &context;
+
+  if ((r = uv_signal_init(loop, &terminate)) < 0 || (r = uv_signal_start(&terminate, __stop_on_signal, SIGTERM)) < 0 ||
+      (r = uv_signal_init(loop, &interrupt)) < 0 || (r = uv_signal_start(&interrupt, __stop_on_signal, SIGINT)) < 0)
   {
-    free(context.mqtt_uri);
+    log_fatal("uv signal failure: %s", uv_strerror(r));
+    goto mqtt_connect_out;
   }
-  if (context.mqtt_client_id)
+
+  uv_run(loop, UV_RUN_DEFAULT);
+  __save_cells(&context);
+
+  for (size_t i = 0; i < context.n_buses; i++)
   {
-    free(context.mqtt_client_id);
+    seplosd_bus_close(&context.buses[i]);
   }
 
+  r = 0;
+  /* fall through */
+mqtt_connect_out:
+  seplosd_metrics_close(&context.metrics);
+  /* The MQTT client goes first, so that what it hands back on the way out is spooled too. */
+  seplosd_mqtt_close(&context.mqtt);
+  seplosd_spool_close(&context.spool);
+
+out:
+  __context_free(&context);
+  seplos_capture_close();
+  seplos_live_close(&context.live);
+
 config_out:
   uv_loop_close(loop);
+  log_stop_async();
 
   return r;
 }
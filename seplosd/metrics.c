@@ -0,0 +1,667 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define __METRICS_MAX_CLIENTS 64
+#define __METRICS_CLIENT_TIMEOUT 5000
+
+/*
+ * One scrape. The connection is closed once the response has been written,
+ * so there's no keep-alive to track.
+ */
+typedef struct __metrics_client {
+    uv_tcp_t tcp;
+    uv_timer_t timeout;
+    uv_write_t write;
+    seplosd_metrics_t *metrics;
+    seplosd_metrics_page_t *page;
+    int open_handles;
+    bool responded;
+    size_t received;
+    char request[1024];
+    char header[192];
+} __metrics_client_t;
+
+typedef enum __metrics_type {
+    __METRICS_FLOAT,
+    __METRICS_BOOL,
+    __METRICS_UINT
+} __metrics_type_t;
+
+/* The single-valued gauges, rendered straight out of each pack's SeplosData. */
+static const struct
+{
+    const char *name;
+    const char *help;
+    size_t offset;
+    __metrics_type_t type;
+} __metrics_gauges[] = {
+    {"seplos_current_amperes", "Charge (positive) or discharge (negative) current.",
+     offsetof(SeplosData, charge_discharge_current), __METRICS_FLOAT},
+    {"seplos_voltage_volts", "Total battery voltage.", offsetof(SeplosData, total_battery_voltage), __METRICS_FLOAT},
+    {"seplos_port_voltage_volts", "Port voltage.", offsetof(SeplosData, port_voltage), __METRICS_FLOAT},
+    {"seplos_state_of_charge_percent", "State of charge.", offsetof(SeplosData, state_of_charge), __METRICS_FLOAT},
+    {"seplos_state_of_health_percent", "State of health.", offsetof(SeplosData, state_of_health), __METRICS_FLOAT},
+    {"seplos_residual_capacity_amp_hours", "Charge left in the battery.",
+     offsetof(SeplosData, residual_capacity), __METRICS_FLOAT},
+    {"seplos_capacity_amp_hours", "Battery capacity.", offsetof(SeplosData, battery_capacity), __METRICS_FLOAT},
+    {"seplos_rated_capacity_amp_hours", "Rated capacity.", offsetof(SeplosData, rated_capacity), __METRICS_FLOAT},
+    {"seplos_cycles", "Lifetime charge cycles.", offsetof(SeplosData, number_of_cycles), __METRICS_UINT},
+    {"seplos_cells", "Number of cells.", offsetof(SeplosData, number_of_cells), __METRICS_UINT},
+    {"seplos_charging", "1 while charging.", offsetof(SeplosData, charge), __METRICS_BOOL},
+    {"seplos_discharging", "1 while discharging.", offsetof(SeplosData, discharge), __METRICS_BOOL},
+    {"seplos_floating_charge", "1 while float charging.", offsetof(SeplosData, floating_charge), __METRICS_BOOL},
+    {"seplos_standby", "1 in standby.", offsetof(SeplosData, standby), __METRICS_BOOL},
+    {"seplos_shutdown", "1 when shut down.", offsetof(SeplosData, shutdown), __METRICS_BOOL},
+    {"seplos_charge_switch", "1 when the charge switch is on.", offsetof(SeplosData, charge_switch), __METRICS_BOOL},
+    {"seplos_discharge_switch", "1 when the discharge switch is on.",
+     offsetof(SeplosData, discharge_switch), __METRICS_BOOL},
+    {"seplos_current_limit_switch", "1 when current limiting is on.",
+     offsetof(SeplosData, current_limit_switch), __METRICS_BOOL},
+    {"seplos_heating_switch", "1 when the heater is on.", offsetof(SeplosData, heating_switch), __METRICS_BOOL},
+    {"seplos_alarm", "1 when any alarm is raised.", offsetof(SeplosData, has_alarm), __METRICS_BOOL},
+    {"seplos_hot", "1 when a temperature sensor is too hot.", offsetof(SeplosData, hot), __METRICS_BOOL},
+    {"seplos_cold", "1 when a temperature sensor is too cold.", offsetof(SeplosData, cold), __METRICS_BOOL},
+    {"seplos_depleted", "1 when a cell or the battery voltage is too low.", offsetof(SeplosData, depleted),
+     __METRICS_BOOL},
+    {"seplos_overcharge", "1 when a cell or the battery voltage is too high.", offsetof(SeplosData, overcharge),
+     __METRICS_BOOL},
+};
+
+static const char *__metrics_sensors[SEPLOS_N_TEMPERATURES] = {
+    "cell1", "cell2", "cell3", "cell4", "environment", "power"};
+
+/* The page being rendered. Running out of room is noticed at the end, and the page is rendered again larger. */
+typedef struct __metrics_writer {
+    seplosd_metrics_page_t *page;
+    bool overflow;
+} __metrics_writer_t;
+
+static void __metrics_printf(__metrics_writer_t *w, const char *format, ...)
+{
+    seplosd_metrics_page_t *page = w->page;
+    size_t room = page->size - page->length;
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(page->text + page->length, room, format, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= room)
+    {
+        w->overflow = true;
+        page->length = page->size;
+        return;
+    }
+    page->length += n;
+}
+
+static void __metrics_family_of(__metrics_writer_t *w, const char *type, const char *name, const char *help)
+{
+    __metrics_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void __metrics_family(__metrics_writer_t *w, const char *name, const char *help)
+{
+    __metrics_family_of(w, "gauge", name, help);
+}
+
+/* The buckets of a Prometheus histogram are cumulative, ours aren't. */
+static void __metrics_histogram(__metrics_writer_t *w, const char *name, const char *labels,
+                                const seplosd_histogram_t *histogram)
+{
+    uint64_t count = 0;
+
+    for (unsigned int i = 0; i < SEPLOSD_HISTOGRAM_BOUNDS; i++)
+    {
+        count += histogram->buckets[i];
+        __metrics_printf(w, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, seplosd_histogram_bounds[i],
+                         (unsigned long long)count);
+    }
+    __metrics_printf(w, "%s_bucket{%s,le=\"+Inf\"} %llu\n%s_sum{%s} %.9f\n%s_count{%s} %llu\n",
+                     name, labels, (unsigned long long)histogram->count,
+                     name, labels, histogram->sum / 1e9,
+                     name, labels, (unsigned long long)histogram->count);
+}
+
+/* Label values can't hold a quote, a backslash or a newline unescaped. */
+static void __metrics_escape(char *into, size_t size, const char *value)
+{
+    size_t n = 0;
+
+    for (; *value && n + 2 < size; value++)
+    {
+        if (*value == '"' || *value == '\\' || *value == '\n')
+        {
+            into[n++] = '\\';
+            into[n++] = *value == '\n' ? 'n' : *value;
+        }
+        else
+        {
+            into[n++] = *value;
+        }
+    }
+    into[n] = '\0';
+}
+
+static void __metrics_labels(char *into, size_t size, const seplosd_bus_t *bus, const seplosd_pack_t *pack)
+{
+    char device[128], topic[256];
+
+    __metrics_escape(device, sizeof(device), bus->device);
+    __metrics_escape(topic, sizeof(topic), pack->topic);
+    snprintf(into, size, "device=\"%s\",address=\"%u\",pack=\"%u\",topic=\"%s\"",
+             device, pack->address, pack->pack, topic);
+}
+
+/* Calls body for every pack that has been sampled, with its labels. */
+#define __METRICS_EACH_PACK(metrics, labels, bus, pack, body)                                  \
+    for (size_t __i = 0; __i < (metrics)->n_buses; __i++)                                      \
+    {                                                                                          \
+        const seplosd_bus_t *bus = &(metrics)->buses[__i];                                     \
+        for (size_t __j = 0; __j < bus->n_packs; __j++)                                        \
+        {                                                                                      \
+            const seplosd_pack_t *pack = &bus->packs[__j];                                     \
+            if (!pack->sampled_at)                                                             \
+                continue;                                                                      \
+            __metrics_labels(labels, sizeof(labels), bus, pack);                               \
+            body                                                                               \
+        }                                                                                      \
+    }
+
+/*
+ * How the poll path is doing. Unlike the gauges, these cover the packs that
+ * have never answered too, since those are the ones worth looking at.
+ */
+static void __metrics_render_stats(seplosd_metrics_t *metrics, __metrics_writer_t *w)
+{
+    char labels[512], stage[576], device[128];
+
+    __metrics_family_of(w, "histogram", "seplosd_open_seconds", "Time to open the serial device.");
+    for (size_t i = 0; i < metrics->n_buses; i++)
+    {
+        __metrics_escape(device, sizeof(device), metrics->buses[i].device);
+        snprintf(labels, sizeof(labels), "device=\"%s\"", device);
+        __metrics_histogram(w, "seplosd_open_seconds", labels, &metrics->buses[i].session.open);
+    }
+
+    __metrics_family_of(w, "histogram", "seplosd_stage_seconds",
+                        "Time spent in each stage of polling a pack and publishing its data.");
+    for (size_t i = 0; i < metrics->n_buses; i++)
+    {
+        const seplosd_bus_t *bus = &metrics->buses[i];
+
+        for (size_t j = 0; j < bus->n_packs; j++)
+        {
+            __metrics_labels(labels, sizeof(labels), bus, &bus->packs[j]);
+            for (unsigned int k = 0; k < SEPLOSD_STAGE_COUNT; k++)
+            {
+                snprintf(stage, sizeof(stage), "%s,stage=\"%s\"", labels, seplosd_stage_names[k]);
+                __metrics_histogram(w, "seplosd_stage_seconds", stage, &bus->packs[j].stats.stages[k]);
+            }
+        }
+    }
+
+    __metrics_family_of(w, "counter", "seplosd_exchanges_total",
+                        "Exchanges with a pack by outcome, kind=\"none\" for those that succeeded.");
+    for (size_t i = 0; i < metrics->n_buses; i++)
+    {
+        const seplosd_bus_t *bus = &metrics->buses[i];
+
+        for (size_t j = 0; j < bus->n_packs; j++)
+        {
+            __metrics_labels(labels, sizeof(labels), bus, &bus->packs[j]);
+            for (unsigned int k = 0; k < SEPLOS_FAILURE_COUNT; k++)
+            {
+                __metrics_printf(w, "seplosd_exchanges_total{%s,kind=\"%s\"} %llu\n", labels,
+                                 seplos_failure_names[k], (unsigned long long)bus->packs[j].stats.failures[k]);
+            }
+        }
+    }
+
+    __metrics_family_of(w, "counter", "seplosd_retries_total", "Commands sent to a pack again after a failure.");
+    for (size_t i = 0; i < metrics->n_buses; i++)
+    {
+        const seplosd_bus_t *bus = &metrics->buses[i];
+
+        for (size_t j = 0; j < bus->n_packs; j++)
+        {
+            __metrics_labels(labels, sizeof(labels), bus, &bus->packs[j]);
+            __metrics_printf(w, "seplosd_retries_total{%s} %llu\n", labels,
+                             (unsigned long long)bus->packs[j].stats.retries);
+        }
+    }
+
+    __metrics_family_of(w, "counter", "seplosd_skipped_bytes_total",
+                        "Bytes of line noise dropped to find the start of a reply.");
+    for (size_t i = 0; i < metrics->n_buses; i++)
+    {
+        const seplosd_bus_t *bus = &metrics->buses[i];
+
+        for (size_t j = 0; j < bus->n_packs; j++)
+        {
+            __metrics_labels(labels, sizeof(labels), bus, &bus->packs[j]);
+            __metrics_printf(w, "seplosd_skipped_bytes_total{%s} %llu\n", labels,
+                             (unsigned long long)bus->packs[j].stats.skipped);
+        }
+    }
+}
+
+static void __metrics_render_into(seplosd_metrics_t *metrics, __metrics_writer_t *w)
+{
+    char labels[512];
+
+    for (size_t k = 0; k < sizeof(__metrics_gauges) / sizeof(*__metrics_gauges); k++)
+    {
+        __metrics_family(w, __metrics_gauges[k].name, __metrics_gauges[k].help);
+        __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+            const void *value = (const char *)&pack->data + __metrics_gauges[k].offset;
+
+            switch (__metrics_gauges[k].type)
+            {
+            case __METRICS_FLOAT:
+                __metrics_printf(w, "%s{%s} %.6g\n", __metrics_gauges[k].name, labels, *(const float *)value);
+                break;
+            case __METRICS_BOOL:
+                __metrics_printf(w, "%s{%s} %d\n", __metrics_gauges[k].name, labels, *(const bool *)value);
+                break;
+            case __METRICS_UINT:
+                __metrics_printf(w, "%s{%s} %u\n", __metrics_gauges[k].name, labels, *(const unsigned int *)value);
+                break;
+            }
+        })
+    }
+
+    __metrics_family(w, "seplos_cell_voltage_volts", "Voltage of each cell.");
+    __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+        for (unsigned int c = 0; c < pack->data.number_of_cells && c < SEPLOS_N_CELLS; c++)
+        {
+            __metrics_printf(w, "seplos_cell_voltage_volts{%s,cell=\"%u\"} %.3f\n",
+                             labels, c + 1, pack->data.cell_voltage[c]);
+        }
+    })
+
+    __metrics_family(w, "seplos_cell_alarm", "Cell alarm: 0 normal, 1 low, 2 high, 240 other.");
+    __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+        for (unsigned int c = 0; c < pack->data.number_of_cells && c < SEPLOS_N_CELLS; c++)
+        {
+            __metrics_printf(w, "seplos_cell_alarm{%s,cell=\"%u\"} %u\n", labels, c + 1, pack->data.cell_alarm[c]);
+        }
+    })
+
+    __metrics_family(w, "seplos_temperature_celsius", "Temperature of each sensor.");
+    __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+        for (unsigned int t = 0; t < SEPLOS_N_TEMPERATURES; t++)
+        {
+            __metrics_printf(w, "seplos_temperature_celsius{%s,sensor=\"%s\"} %.1f\n",
+                             labels, __metrics_sensors[t], pack->data.temperature[t]);
+        }
+    })
+
+    __metrics_family(w, "seplos_temperature_alarm", "Temperature alarm: 0 normal, 1 low, 2 high, 240 other.");
+    __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+        for (unsigned int t = 0; t < SEPLOS_N_TEMPERATURES; t++)
+        {
+            __metrics_printf(w, "seplos_temperature_alarm{%s,sensor=\"%s\"} %u\n",
+                             labels, __metrics_sensors[t], pack->data.temperature_alarm[t]);
+        }
+    })
+
+    __metrics_family(w, "seplos_bit_alarm", "The bit alarm words, names in seplos_bit_alarm_names.");
+    __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+        for (unsigned int b = 0; b < sizeof(pack->data.bit_alarm) / sizeof(*pack->data.bit_alarm); b++)
+        {
+            __metrics_printf(w, "seplos_bit_alarm{%s,word=\"%u\"} %u\n", labels, b, pack->data.bit_alarm[b]);
+        }
+    })
+
+    __metrics_family(w, "seplos_sample_timestamp_seconds", "When the pack was last read.");
+    __METRICS_EACH_PACK(metrics, labels, bus, pack, {
+        __metrics_printf(w, "seplos_sample_timestamp_seconds{%s} %.3f\n", labels, pack->sampled_at / 1000.0);
+    })
+
+    __metrics_render_stats(metrics, w);
+}
+
+static void __metrics_page_unref(seplosd_metrics_page_t *page)
+{
+    if (page && --page->refs == 0)
+    {
+        free(page);
+    }
+}
+
+static seplosd_metrics_page_t *__metrics_page_new(size_t size)
+{
+    seplosd_metrics_page_t *page;
+
+    if (!(page = malloc(sizeof(*page) + size)))
+    {
+        return NULL;
+    }
+    page->refs = 1;
+    page->length = 0;
+    page->size = size;
+    return page;
+}
+
+/* Renders the page if there's been a sample since it was last rendered. */
+static seplosd_metrics_page_t *__metrics_render(seplosd_metrics_t *metrics)
+{
+    size_t size = metrics->page ? metrics->page->size : 16384;
+
+    if (metrics->page && !metrics->stale)
+    {
+        return metrics->page;
+    }
+
+    for (;;)
+    {
+        __metrics_writer_t w = {};
+
+        /* A page nobody is writing out can be rendered over. */
+        if (metrics->page && metrics->page->refs == 1 && metrics->page->size >= size)
+        {
+            w.page = metrics->page;
+        }
+        else
+        {
+            if (!(w.page = __metrics_page_new(size)))
+            {
+                log_error("metrics: out of memory rendering %zu bytes.", size);
+                return metrics->page;
+            }
+            __metrics_page_unref(metrics->page);
+            metrics->page = w.page;
+        }
+
+        w.page->length = 0;
+        __metrics_render_into(metrics, &w);
+        if (!w.overflow)
+        {
+            break;
+        }
+        size *= 2;
+    }
+
+    metrics->stale = false;
+    return metrics->page;
+}
+
+static void __metrics_on_client_closed(uv_handle_t *handle)
+{
+    __metrics_client_t *client = (__metrics_client_t *)handle->data;
+
+    if (--client->open_handles == 0)
+    {
+        client->metrics->n_clients--;
+        __metrics_page_unref(client->page);
+        free(client);
+    }
+}
+
+static void __metrics_client_close(__metrics_client_t *client)
+{
+    if (!uv_is_closing((uv_handle_t *)&client->tcp))
+    {
+        uv_timer_stop(&client->timeout);
+        uv_close((uv_handle_t *)&client->tcp, __metrics_on_client_closed);
+        uv_close((uv_handle_t *)&client->timeout, __metrics_on_client_closed);
+    }
+}
+
+static void __metrics_on_written(uv_write_t *write, int status)
+{
+    __metrics_client_close((__metrics_client_t *)write->data);
+}
+
+static void __metrics_respond(__metrics_client_t *client, const char *status, bool head, bool body)
+{
+    seplosd_metrics_page_t *page = NULL;
+    uv_buf_t bufs[2];
+    unsigned int n_bufs = 1;
+    int r;
+
+    client->responded = true;
+    uv_read_stop((uv_stream_t *)&client->tcp);
+
+    if (body)
+    {
+        page = __metrics_render(client->metrics);
+        client->metrics->scrapes++;
+    }
+
+    if (page)
+    {
+        snprintf(client->header, sizeof(client->header),
+                 "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                 status, page->length);
+
+        if (!head)
+        {
+            /* The response points into the shared page, not a copy of it. */
+            page->refs++;
+            client->page = page;
+            bufs[n_bufs++] = uv_buf_init(page->text, page->length);
+        }
+    }
+    else
+    {
+        snprintf(client->header, sizeof(client->header),
+                 "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", body ? "503 Service Unavailable" : status);
+    }
+    bufs[0] = uv_buf_init(client->header, strlen(client->header));
+
+    client->write.data = client;
+    if ((r = uv_write(&client->write, (uv_stream_t *)&client->tcp, bufs, n_bufs, __metrics_on_written)) < 0)
+    {
+        log_debug("metrics: cannot write the response: %s", uv_strerror(r));
+        __metrics_client_close(client);
+    }
+}
+
+/* Only the request line matters. The headers are read and ignored. */
+static void __metrics_on_request(__metrics_client_t *client)
+{
+    char method[8], path[64];
+    char *query;
+
+    if (sscanf(client->request, "%7s %63s HTTP/", method, path) != 2)
+    {
+        __metrics_respond(client, "400 Bad Request", false, false);
+        return;
+    }
+
+    if ((query = strchr(path, '?')))
+    {
+        *query = '\0';
+    }
+
+    if (strcmp(method, "GET") && strcmp(method, "HEAD"))
+    {
+        __metrics_respond(client, "405 Method Not Allowed", false, false);
+    }
+    else if (strcmp(path, "/metrics"))
+    {
+        __metrics_respond(client, "404 Not Found", false, false);
+    }
+    else
+    {
+        __metrics_respond(client, "200 OK", !strcmp(method, "HEAD"), true);
+    }
+}
+
+static void __metrics_on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf)
+{
+    __metrics_client_t *client = (__metrics_client_t *)handle->data;
+
+    /* Keep one byte for the terminator. */
+    *buf = uv_buf_init(client->request + client->received, sizeof(client->request) - client->received - 1);
+}
+
+static void __metrics_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    __metrics_client_t *client = (__metrics_client_t *)stream->data;
+
+    if (nread < 0)
+    {
+        __metrics_client_close(client);
+        return;
+    }
+
+    client->received += nread;
+    client->request[client->received] = '\0';
+
+    if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n"))
+    {
+        __metrics_on_request(client);
+    }
+    else if (client->received == sizeof(client->request) - 1)
+    {
+        __metrics_respond(client, "431 Request Header Fields Too Large", false, false);
+    }
+}
+
+static void __metrics_on_client_timeout(uv_timer_t *timer)
+{
+    __metrics_client_t *client = (__metrics_client_t *)timer->data;
+
+    log_debug("metrics: scraper took too long, closing the connection.");
+    __metrics_client_close(client);
+}
+
+static void __metrics_on_connection(uv_stream_t *server, int status)
+{
+    seplosd_metrics_t *metrics = (seplosd_metrics_t *)server->data;
+    __metrics_client_t *client;
+    int r;
+
+    if (status < 0)
+    {
+        log_error("metrics: accept failed: %s", uv_strerror(status));
+        return;
+    }
+
+    if (!(client = calloc(1, sizeof(*client))))
+    {
+        log_error("metrics: out of memory accepting a scraper.");
+        return;
+    }
+
+    client->metrics = metrics;
+    client->tcp.data = client;
+    client->timeout.data = client;
+    uv_tcp_init(metrics->loop, &client->tcp);
+    uv_timer_init(metrics->loop, &client->timeout);
+    client->open_handles = 2;
+    metrics->n_clients++;
+
+    if ((r = uv_accept(server, (uv_stream_t *)&client->tcp)) < 0)
+    {
+        log_error("metrics: accept failed: %s", uv_strerror(r));
+        __metrics_client_close(client);
+        return;
+    }
+
+    /* Not accepting would leave the connection in the backlog, so take it and drop it. */
+    if (metrics->n_clients > __METRICS_MAX_CLIENTS)
+    {
+        log_debug("metrics: too many scrapers at once, dropping one.");
+        __metrics_client_close(client);
+        return;
+    }
+
+    uv_timer_start(&client->timeout, __metrics_on_client_timeout, __METRICS_CLIENT_TIMEOUT, 0);
+    uv_read_start((uv_stream_t *)&client->tcp, __metrics_on_alloc, __metrics_on_read);
+}
+
+static int __metrics_address(const char *listen, struct sockaddr_storage *address)
+{
+    char host[128];
+    const char *colon;
+    size_t length;
+    int port;
+
+    if (!(colon = strrchr(listen, ':')) || (port = atoi(colon + 1)) <= 0 || port > 65535)
+    {
+        return -1;
+    }
+
+    length = colon - listen;
+    if (length >= 2 && listen[0] == '[' && listen[length - 1] == ']')
+    {
+        listen++;
+        length -= 2;
+    }
+    if (length >= sizeof(host))
+    {
+        return -1;
+    }
+    memcpy(host, listen, length);
+    host[length] = '\0';
+
+    if (uv_ip4_addr(host, port, (struct sockaddr_in *)address) == 0 ||
+        uv_ip6_addr(host, port, (struct sockaddr_in6 *)address) == 0)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+int seplosd_metrics_init(uv_loop_t *loop, seplosd_metrics_t *metrics, const char *listen,
+                         const seplosd_bus_t *buses, size_t n_buses)
+{
+    struct sockaddr_storage address = {};
+    int r;
+
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->loop = loop;
+    metrics->buses = buses;
+    metrics->n_buses = n_buses;
+    metrics->stale = true;
+
+    if (__metrics_address(listen, &address) < 0)
+    {
+        log_error("metrics: %s isn't an address:port to listen on.", listen);
+        return -1;
+    }
+
+    uv_tcp_init(loop, &metrics->server);
+    metrics->server.data = metrics;
+
+    if ((r = uv_tcp_bind(&metrics->server, (const struct sockaddr *)&address, 0)) < 0 ||
+        (r = uv_listen((uv_stream_t *)&metrics->server, 16, __metrics_on_connection)) < 0)
+    {
+        log_error("metrics: cannot listen on %s: %s", listen, uv_strerror(r));
+        uv_close((uv_handle_t *)&metrics->server, NULL);
+        return -1;
+    }
+
+    metrics->listening = true;
+    log_info("metrics: serving /metrics on %s", listen);
+    return 0;
+}
+
+void seplosd_metrics_invalidate(seplosd_metrics_t *metrics)
+{
+    metrics->stale = true;
+}
+
+/* Scrapes in progress finish on their own, and free themselves. */
+void seplosd_metrics_close(seplosd_metrics_t *metrics)
+{
+    if (metrics->listening)
+    {
+        uv_close((uv_handle_t *)&metrics->server, NULL);
+        metrics->listening = false;
+    }
+    __metrics_page_unref(metrics->page);
+    metrics->page = NULL;
+}
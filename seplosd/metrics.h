@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "bus.h"
+
+/*
+ * The rendered /metrics document. Responses being written hold a reference,
+ * so a new sample doesn't disturb a scrape in progress.
+ */
+typedef struct seplosd_metrics_page {
+    unsigned int refs;
+    size_t length;
+    size_t size;
+    char text[];
+} seplosd_metrics_page_t;
+
+/*
+ * A Prometheus /metrics endpoint on the loop, serving the latest sample of
+ * every pack on every bus.
+ *
+ * Scrapes never touch the serial bus. The page is rendered at most once per
+ * new sample, by the first scrape after it, and every scrape until the next
+ * sample writes the same buffer, so many scrapers cost almost nothing.
+ * The timings and failure counts of the poll path are rendered with them.
+ */
+typedef struct seplosd_metrics {
+    uv_loop_t *loop;
+    uv_tcp_t server;
+    const seplosd_bus_t *buses;
+    size_t n_buses;
+    bool listening;
+    bool stale;
+    seplosd_metrics_page_t *page;
+    unsigned int n_clients;
+    uint64_t scrapes;
+} seplosd_metrics_t;
+
+/* listen is "address:port", with IPv6 addresses in brackets, e.g. "[::]:9101". */
+int seplosd_metrics_init(uv_loop_t *loop, seplosd_metrics_t *metrics, const char *listen,
+                         const seplosd_bus_t *buses, size_t n_buses);
+
+/* Called when a pack has a new sample or a sweep has run, so that the next scrape renders it. */
+void seplosd_metrics_invalidate(seplosd_metrics_t *metrics);
+
+void seplosd_metrics_close(seplosd_metrics_t *metrics);
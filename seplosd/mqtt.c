@@ -0,0 +1,359 @@
+#include "mqtt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/* Paho thread callbacks. These must not log or touch the loop. */
+
+static void __mqtt_on_connect(void *udata, MQTTAsync_successData *response)
+{
+    seplosd_mqtt_t *mqtt = (seplosd_mqtt_t *)udata;
+
+    pthread_mutex_lock(&mqtt->lock);
+    mqtt->connected = true;
+    mqtt->connect_changed = true;
+    pthread_mutex_unlock(&mqtt->lock);
+    uv_async_send(&mqtt->async);
+}
+
+static void __mqtt_on_connect_failure(void *udata, MQTTAsync_failureData *response)
+{
+    seplosd_mqtt_t *mqtt = (seplosd_mqtt_t *)udata;
+
+    pthread_mutex_lock(&mqtt->lock);
+    mqtt->connected = false;
+    mqtt->connect_failed = true;
+    mqtt->last_failure = response ? response->code : MQTTASYNC_FAILURE;
+    pthread_mutex_unlock(&mqtt->lock);
+    uv_async_send(&mqtt->async);
+}
+
+static void __mqtt_on_connected(void *udata, char *cause)
+{
+    __mqtt_on_connect(udata, NULL);
+}
+
+static void __mqtt_on_connection_lost(void *udata, char *cause)
+{
+    seplosd_mqtt_t *mqtt = (seplosd_mqtt_t *)udata;
+
+    pthread_mutex_lock(&mqtt->lock);
+    mqtt->connected = false;
+    mqtt->connection_lost = true;
+    pthread_mutex_unlock(&mqtt->lock);
+    uv_async_send(&mqtt->async);
+}
+
+static int __mqtt_on_message(void *udata, char *topic, int topic_length, MQTTAsync_message *message)
+{
+    /* we don't subscribe to anything. */
+    MQTTAsync_freeMessage(&message);
+    MQTTAsync_free(topic);
+    return 1;
+}
+
+static void __mqtt_on_publish(void *udata, MQTTAsync_successData *response)
+{
+    seplosd_mqtt_t *mqtt = (seplosd_mqtt_t *)udata;
+
+    pthread_mutex_lock(&mqtt->lock);
+    mqtt->in_flight--;
+    mqtt->published++;
+    pthread_mutex_unlock(&mqtt->lock);
+}
+
+static void __mqtt_on_publish_failure(void *udata, MQTTAsync_failureData *response)
+{
+    seplosd_mqtt_t *mqtt = (seplosd_mqtt_t *)udata;
+
+    pthread_mutex_lock(&mqtt->lock);
+    mqtt->in_flight--;
+    mqtt->failed++;
+    mqtt->new_failures++;
+    mqtt->last_failure = response ? response->code : MQTTASYNC_FAILURE;
+    pthread_mutex_unlock(&mqtt->lock);
+    uv_async_send(&mqtt->async);
+}
+
+static void __mqtt_on_kept_publish(void *udata, MQTTAsync_successData *response)
+{
+    seplosd_mqtt_kept_t *kept = (seplosd_mqtt_kept_t *)udata;
+
+    __mqtt_on_publish(kept->mqtt, response);
+    free(kept->topic);
+    free(kept);
+}
+
+/* The copy can't go back to its owner from here, so it waits on a list for the loop. */
+static void __mqtt_on_kept_publish_failure(void *udata, MQTTAsync_failureData *response)
+{
+    seplosd_mqtt_kept_t *kept = (seplosd_mqtt_kept_t *)udata;
+    seplosd_mqtt_t *mqtt = kept->mqtt;
+
+    kept->next = NULL;
+    pthread_mutex_lock(&mqtt->lock);
+    *mqtt->returned_tail = kept;
+    mqtt->returned_tail = &kept->next;
+    pthread_mutex_unlock(&mqtt->lock);
+    __mqtt_on_publish_failure(mqtt, response);
+}
+
+/* Loop side. */
+
+static void __mqtt_hand_back(seplosd_mqtt_t *mqtt)
+{
+    seplosd_mqtt_kept_t *kept;
+
+    pthread_mutex_lock(&mqtt->lock);
+    kept = mqtt->returned;
+    mqtt->returned = NULL;
+    mqtt->returned_tail = &mqtt->returned;
+    pthread_mutex_unlock(&mqtt->lock);
+
+    while (kept)
+    {
+        seplosd_mqtt_kept_t *next = kept->next;
+
+        if (mqtt->returned_cb)
+        {
+            mqtt->returned_cb(mqtt->returned_data, kept);
+        }
+        else
+        {
+            free(kept->topic);
+            free(kept);
+        }
+        kept = next;
+    }
+}
+
+static void __mqtt_on_retry(uv_timer_t *timer)
+{
+    seplosd_mqtt_connect((seplosd_mqtt_t *)timer->data);
+}
+
+static void __mqtt_on_async(uv_async_t *async)
+{
+    seplosd_mqtt_t *mqtt = (seplosd_mqtt_t *)async->data;
+    bool connected, connect_failed, connection_lost, connect_changed;
+    unsigned int new_failures;
+    int last_failure;
+
+    pthread_mutex_lock(&mqtt->lock);
+    connected = mqtt->connected;
+    connect_failed = mqtt->connect_failed;
+    connection_lost = mqtt->connection_lost;
+    connect_changed = mqtt->connect_changed;
+    new_failures = mqtt->new_failures;
+    last_failure = mqtt->last_failure;
+    mqtt->connect_failed = mqtt->connection_lost = mqtt->connect_changed = false;
+    mqtt->new_failures = 0;
+    pthread_mutex_unlock(&mqtt->lock);
+
+    if (connection_lost)
+    {
+        log_warn("mqtt connection lost, reconnecting.");
+    }
+
+    if (connect_changed && connected)
+    {
+        log_info("mqtt connected");
+    }
+
+    if (connect_failed)
+    {
+        log_error("mqtt client failed to connect.  rc=%d %s, retrying in %llu ms",
+                  last_failure, MQTTAsync_strerror(last_failure),
+                  (unsigned long long)mqtt->retry_interval);
+        uv_timer_start(&mqtt->retry, __mqtt_on_retry, mqtt->retry_interval, 0);
+    }
+
+    if (new_failures)
+    {
+        log_error("error publishing %u message(s). rc=%d %s", new_failures, last_failure,
+                  MQTTAsync_strerror(last_failure));
+    }
+
+    __mqtt_hand_back(mqtt);
+}
+
+int seplosd_mqtt_init(uv_loop_t *loop, seplosd_mqtt_t *mqtt, const char *uri, const char *client_id,
+                      int qos, unsigned int max_in_flight, uint64_t retry_interval)
+{
+    MQTTAsync_createOptions options = MQTTAsync_createOptions_initializer;
+    int r;
+
+    mqtt->loop = loop;
+    mqtt->qos = qos;
+    mqtt->max_in_flight = max_in_flight;
+    mqtt->retry_interval = retry_interval;
+    mqtt->returned = NULL;
+    mqtt->returned_tail = &mqtt->returned;
+
+    pthread_mutex_init(&mqtt->lock, NULL);
+
+    if ((r = uv_async_init(loop, &mqtt->async, __mqtt_on_async)) < 0 ||
+        (r = uv_timer_init(loop, &mqtt->retry)) < 0)
+    {
+        log_fatal("uv initialization failed: %s", uv_strerror(r));
+        return -1;
+    }
+
+    mqtt->async.data = mqtt;
+    mqtt->retry.data = mqtt;
+
+    options.maxBufferedMessages = max_in_flight;
+
+    if ((r = MQTTAsync_createWithOptions(&mqtt->client,
+                                         uri,
+                                         client_id,
+                                         MQTTCLIENT_PERSISTENCE_NONE,
+                                         NULL,
+                                         &options)) != MQTTASYNC_SUCCESS)
+    {
+        log_fatal("cannot create MQTT client. rc=%d %s", r, MQTTAsync_strerror(r));
+        return -1;
+    }
+
+    if ((r = MQTTAsync_setCallbacks(mqtt->client, mqtt, __mqtt_on_connection_lost,
+                                    __mqtt_on_message, NULL)) != MQTTASYNC_SUCCESS ||
+        (r = MQTTAsync_setConnected(mqtt->client, mqtt, __mqtt_on_connected)) != MQTTASYNC_SUCCESS)
+    {
+        log_fatal("cannot set MQTT callbacks. rc=%d %s", r, MQTTAsync_strerror(r));
+        return -1;
+    }
+
+    return 0;
+}
+
+int seplosd_mqtt_connect(seplosd_mqtt_t *mqtt)
+{
+    MQTTAsync_connectOptions options = MQTTAsync_connectOptions_initializer;
+    int r;
+
+    options.keepAliveInterval = 20;
+    options.cleansession = true;
+    options.maxInflight = mqtt->max_in_flight;
+    options.automaticReconnect = true;
+    options.onSuccess = __mqtt_on_connect;
+    options.onFailure = __mqtt_on_connect_failure;
+    options.context = mqtt;
+
+    if ((r = MQTTAsync_connect(mqtt->client, &options)) != MQTTASYNC_SUCCESS)
+    {
+        log_error("mqtt client failed to start connecting.  rc=%d %s", r, MQTTAsync_strerror(r));
+        uv_timer_start(&mqtt->retry, __mqtt_on_retry, mqtt->retry_interval, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int __mqtt_send(seplosd_mqtt_t *mqtt, const char *topic, const void *payload, size_t length,
+                       bool retained, seplosd_mqtt_kept_t *kept)
+{
+    MQTTAsync_responseOptions options = MQTTAsync_responseOptions_initializer;
+    bool connected;
+    int r;
+
+    pthread_mutex_lock(&mqtt->lock);
+    connected = mqtt->connected;
+    if (connected && mqtt->in_flight < mqtt->max_in_flight)
+    {
+        mqtt->in_flight++;
+    }
+    else
+    {
+        mqtt->failed++;
+        connected = false;
+        r = mqtt->connected ? MQTTASYNC_MAX_BUFFERED_MESSAGES : MQTTASYNC_DISCONNECTED;
+    }
+    pthread_mutex_unlock(&mqtt->lock);
+
+    if (!connected)
+    {
+        log_error("error publishing message to topic %s. rc=%d %s", topic, r, MQTTAsync_strerror(r));
+        return -1;
+    }
+
+    if (kept)
+    {
+        kept->mqtt = mqtt;
+        options.onSuccess = __mqtt_on_kept_publish;
+        options.onFailure = __mqtt_on_kept_publish_failure;
+        options.context = kept;
+    }
+    else
+    {
+        options.onSuccess = __mqtt_on_publish;
+        options.onFailure = __mqtt_on_publish_failure;
+        options.context = mqtt;
+    }
+
+    if ((r = MQTTAsync_send(mqtt->client, topic, (int)length, payload, mqtt->qos, retained, &options)) != MQTTASYNC_SUCCESS)
+    {
+        pthread_mutex_lock(&mqtt->lock);
+        mqtt->in_flight--;
+        mqtt->failed++;
+        pthread_mutex_unlock(&mqtt->lock);
+
+        log_error("error publishing message to topic %s. rc=%d %s", topic, r, MQTTAsync_strerror(r));
+        return -1;
+    }
+
+    return 0;
+}
+
+int seplosd_mqtt_publish(seplosd_mqtt_t *mqtt, const char *topic, const void *payload, size_t length,
+                         bool retained)
+{
+    return __mqtt_send(mqtt, topic, payload, length, retained, NULL);
+}
+
+int seplosd_mqtt_publish_kept(seplosd_mqtt_t *mqtt, const char *topic, const void *payload, size_t length,
+                              seplosd_mqtt_kept_t *kept)
+{
+    return __mqtt_send(mqtt, topic, payload, length, false, kept);
+}
+
+void seplosd_mqtt_on_returned(seplosd_mqtt_t *mqtt, seplosd_mqtt_returned_cb cb, void *data)
+{
+    mqtt->returned_cb = cb;
+    mqtt->returned_data = data;
+}
+
+unsigned int seplosd_mqtt_room(seplosd_mqtt_t *mqtt)
+{
+    unsigned int room = 0;
+
+    pthread_mutex_lock(&mqtt->lock);
+    if (mqtt->connected && mqtt->in_flight < mqtt->max_in_flight)
+    {
+        room = mqtt->max_in_flight - mqtt->in_flight;
+    }
+    pthread_mutex_unlock(&mqtt->lock);
+
+    return room;
+}
+
+void seplosd_mqtt_close(seplosd_mqtt_t *mqtt)
+{
+    MQTTAsync_disconnectOptions options = MQTTAsync_disconnectOptions_initializer;
+
+    uv_timer_stop(&mqtt->retry);
+    uv_close((uv_handle_t *)&mqtt->retry, NULL);
+    uv_close((uv_handle_t *)&mqtt->async, NULL);
+
+    options.timeout = 1000;
+
+    if (MQTTAsync_disconnect(mqtt->client, &options) != MQTTASYNC_SUCCESS)
+    {
+        log_error("cannot disconnect from mqtt server. we're exiting anyway.");
+    }
+
+    MQTTAsync_destroy(&mqtt->client);
+    __mqtt_hand_back(mqtt);
+    pthread_mutex_destroy(&mqtt->lock);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <MQTTAsync.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * A copy of a message, kept until the broker has it, so that a publish that
+ * fails after Paho took it can be handed back instead of lost. topic is one
+ * malloc()ed block that also holds payload.
+ */
+typedef struct seplosd_mqtt_kept {
+    struct seplosd_mqtt_kept *next;
+    struct seplosd_mqtt *mqtt;
+    char *topic;
+    char *payload;
+    size_t length;
+} seplosd_mqtt_kept_t;
+
+/* Called on the loop with each kept message whose publish failed. It takes kept over. */
+typedef void (*seplosd_mqtt_returned_cb)(void *data, seplosd_mqtt_kept_t *kept);
+
+/*
+ * The MQTT connection, driven asynchronously.
+ *
+ * Publishing hands the message to Paho and returns at once, so the loop is
+ * never held up waiting for the broker, and up to max_in_flight publishes can
+ * be outstanding at the same time. Paho reports completions on its own
+ * threads; those only update counters under the lock and wake the loop with
+ * a uv_async_t, and everything else, logging included, happens on the loop.
+ */
+typedef struct seplosd_mqtt {
+    MQTTAsync client;
+    uv_loop_t *loop;
+    uv_async_t async;
+    uv_timer_t retry;
+    uint64_t retry_interval;
+    int qos;
+    unsigned int max_in_flight;
+    seplosd_mqtt_returned_cb returned_cb;
+    void *returned_data;
+
+    pthread_mutex_t lock;
+    /* Everything below is shared with Paho's threads. */
+    unsigned int in_flight;
+    uint64_t published;
+    uint64_t failed;
+    unsigned int new_failures;
+    seplosd_mqtt_kept_t *returned; /* failed kept messages, oldest first */
+    seplosd_mqtt_kept_t **returned_tail;
+    int last_failure;
+    bool connected;
+    bool connect_failed;
+    bool connection_lost;
+    bool connect_changed;
+} seplosd_mqtt_t;
+
+int seplosd_mqtt_init(uv_loop_t *loop, seplosd_mqtt_t *mqtt, const char *uri, const char *client_id,
+                      int qos, unsigned int max_in_flight, uint64_t retry_interval);
+
+/*
+ * Starts connecting to the broker. A failed connection is retried every
+ * retry_interval ms, and a lost one is re-established by Paho.
+ */
+int seplosd_mqtt_connect(seplosd_mqtt_t *mqtt);
+
+/*
+ * Queues a message for publishing. The payload is copied. Returns -1 if it
+ * couldn't be queued, for instance because we aren't connected or too many
+ * publishes are in flight already.
+ */
+int seplosd_mqtt_publish(seplosd_mqtt_t *mqtt, const char *topic, const void *payload, size_t length,
+                         bool retained);
+
+/*
+ * Like seplosd_mqtt_publish(), but not retained, and if it is queued, kept is
+ * held on to until the broker acknowledges the message, then freed with its
+ * topic. If the publish fails after all, kept goes to the callback set with
+ * seplosd_mqtt_on_returned(). If this returns -1, the caller still owns kept.
+ */
+int seplosd_mqtt_publish_kept(seplosd_mqtt_t *mqtt, const char *topic, const void *payload, size_t length,
+                              seplosd_mqtt_kept_t *kept);
+
+/* Sets where kept messages whose publish failed are handed back. */
+void seplosd_mqtt_on_returned(seplosd_mqtt_t *mqtt, seplosd_mqtt_returned_cb cb, void *data);
+
+/* How many more publishes can go out now, 0 while we aren't connected. */
+unsigned int seplosd_mqtt_room(seplosd_mqtt_t *mqtt);
+
+/* Kept messages that failed by the time the client is gone are handed back before this returns. */
+void seplosd_mqtt_close(seplosd_mqtt_t *mqtt);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "deadband.h"
+#include "seplos.h"
+#include "stats.h"
+#include "window.h"
+
+/*
+ * One battery pack on a bus, as listed in the config file, along with the
+ * most recent data read from it, when it is next due to be asked, and what
+ * was last published for it.
+ *
+ * With all_packs, the scheduling of the first pack at an address applies to
+ * all of the packs at that address, and the exchanges are timed and counted
+ * in its stats.
+ */
+typedef struct seplosd_pack {
+    unsigned int address;
+    unsigned int pack;
+    char *topic;
+    uint64_t interval;             /* ms between telemetry, 0 for every sweep */
+    uint64_t telecommand_interval; /* ms between telecommands, 0 for every sweep */
+    uint64_t next_telemetry;
+    uint64_t next_telecommand;
+    uint32_t telemetry_digest;     /* of the latest telemetry reply */
+    uint32_t telecommand_digest;   /* of the telemetry when the alarms were last read */
+    bool telecommand_due;
+    bool pending;                  /* telemetry not yet published, waiting for alarms */
+    bool answered;                 /* its telemetry came in this sweep */
+    bool reachable;                /* its last command was answered, so a timeout is worth a retry */
+    SeplosData data;
+    uint64_t sampled_at;           /* wall-clock ms of data, 0 before the first sample */
+    seplosd_published_t published;
+    seplosd_window_t window;       /* the samples not yet published, with aggregate_window */
+    SeplosRing ring;               /* history on disk, unmapped without ring_directory */
+    SeplosCells cells;             /* long-run statistics of each cell, with cells_interval */
+    SeplosMetadata metadata;       /* what the pack says about itself, read now and then */
+    unsigned int announced;        /* the metadata generation last published, 0 for none */
+    seplosd_stats_t stats;
+} seplosd_pack_t;
@@ -0,0 +1,202 @@
+#include "session.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "log.h"
+
+static void __session_resolve(seplosd_session_t *session);
+
+static bool __session_is_tcp(const seplosd_session_t *session)
+{
+    return !strncmp(session->device, SEPLOS_TCP_PREFIX, strlen(SEPLOS_TCP_PREFIX));
+}
+
+void seplosd_session_init(uv_loop_t *loop, seplosd_session_t *session, const char *device, unsigned int baud,
+                          uint64_t backoff_min, uint64_t backoff_max)
+{
+    session->device = device;
+    session->baud = baud;
+    session->fd = -1;
+    session->transport = __session_is_tcp(session) ? SEPLOS_TRANSPORT_TCP : SEPLOS_TRANSPORT_SERIAL;
+    session->loop = loop;
+    session->resolving = false;
+    session->address_length = 0;
+    session->backoff_min = backoff_min;
+    session->backoff_max = backoff_max > backoff_min ? backoff_max : backoff_min;
+    session->backoff = 0;
+    session->retry_at = 0;
+    memset(&session->open, 0, sizeof(session->open));
+
+    if (__session_is_tcp(session))
+    {
+        __session_resolve(session);
+    }
+}
+
+static void __session_backoff(seplosd_session_t *session, uint64_t now)
+{
+    if (session->backoff == 0)
+    {
+        session->backoff = session->backoff_min;
+    }
+    else if ((session->backoff *= 2) > session->backoff_max)
+    {
+        session->backoff = session->backoff_max;
+    }
+
+    session->retry_at = now + session->backoff;
+    log_warn("%s: will reopen in %llu ms", session->device, (unsigned long long)session->backoff);
+}
+
+static void __session_on_resolved(uv_getaddrinfo_t *resolver, int status, struct addrinfo *addresses)
+{
+    seplosd_session_t *session = (seplosd_session_t *)resolver->data;
+
+    session->resolving = false;
+
+    if (status == UV_ECANCELED)
+    {
+        return;
+    }
+
+    if (status < 0)
+    {
+        log_error("cannot resolve device %s: %s", session->device, uv_strerror(status));
+        __session_backoff(session, uv_now(session->loop));
+        return;
+    }
+
+    /* Only the first address is tried, as the connection is made in the background. */
+    memcpy(&session->address, addresses->ai_addr, addresses->ai_addrlen);
+    session->address_length = addresses->ai_addrlen;
+    uv_freeaddrinfo(addresses);
+}
+
+/* The lookup runs on the uv thread pool, because the resolver can take seconds to give up. */
+static void __session_resolve(seplosd_session_t *session)
+{
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    char host[256];
+    const char *port;
+    int r;
+
+    session->address_length = 0;
+
+    if (seplos_parse_tcp(session->device + strlen(SEPLOS_TCP_PREFIX), host, sizeof(host), &port) < 0)
+    {
+        __session_backoff(session, uv_now(session->loop));
+        return;
+    }
+
+    session->resolver.data = session;
+    if ((r = uv_getaddrinfo(session->loop, &session->resolver, __session_on_resolved, host, port, &hints)) < 0)
+    {
+        log_error("cannot resolve device %s: %s", session->device, uv_strerror(r));
+        __session_backoff(session, uv_now(session->loop));
+        return;
+    }
+
+    session->resolving = true;
+}
+
+/* A serial server may have moved, so its name is looked up again while the backoff runs. */
+static void __session_failed(seplosd_session_t *session, uint64_t now)
+{
+    __session_backoff(session, now);
+
+    if (__session_is_tcp(session))
+    {
+        __session_resolve(session);
+    }
+}
+
+seplos_device seplosd_session_get(seplosd_session_t *session, uint64_t now)
+{
+    uint64_t started;
+
+    if (session->fd >= 0)
+    {
+        return session->fd;
+    }
+
+    if (now < session->retry_at || session->resolving)
+    {
+        return -1;
+    }
+
+    if (__session_is_tcp(session) && session->address_length == 0)
+    {
+        __session_resolve(session);
+        return -1;
+    }
+
+    /* A serial server is connected to in the background, so the loop never waits for it. */
+    started = uv_hrtime();
+    if (__session_is_tcp(session))
+    {
+        session->fd = seplos_connect_tcp((const struct sockaddr *)&session->address, session->address_length, 0);
+    }
+    else
+    {
+        session->fd = seplos_open_serial(session->device, session->baud, SEPLOS_DEFAULT_BYTE_TIMEOUT);
+    }
+    seplosd_histogram_observe(&session->open, uv_hrtime() - started);
+
+    if (session->fd < 0)
+    {
+        log_error("cannot open device %s: %s", session->device, strerror(errno));
+        __session_failed(session, now);
+        return -1;
+    }
+
+    log_info("bms open. device=%s baud=%u fd=%d", session->device, session->baud, session->fd);
+    session->backoff = 0;
+
+    return session->fd;
+}
+
+void seplosd_session_result(seplosd_session_t *session, int r, int error, uint64_t now)
+{
+    if (r >= 0 || session->fd < 0)
+    {
+        return;
+    }
+
+    if (!seplosd_session_is_io_error(error))
+    {
+        return;
+    }
+
+    log_error("%s: i/o error: %s, closing device", session->device, strerror(error));
+    seplosd_session_close(session);
+    __session_failed(session, now);
+}
+
+bool seplosd_session_is_io_error(int error)
+{
+    /*
+     * A garbled frame or a pack that didn't answer says nothing about the
+     * adapter, so keep the line up for those.
+     */
+    return error != EBADMSG && error != ETIMEDOUT;
+}
+
+void seplosd_session_close(seplosd_session_t *session)
+{
+    if (session->resolving)
+    {
+        uv_cancel((uv_req_t *)&session->resolver);
+    }
+
+    if (session->fd < 0)
+    {
+        return;
+    }
+
+    close(session->fd);
+    log_trace("bms closed. fd=%d", session->fd);
+    session->fd = -1;
+}
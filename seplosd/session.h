@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <uv.h>
+
+#include "seplos.h"
+#include "stats.h"
+
+/*
+ * A long-lived connection to one BMS serial device.
+ *
+ * The device is opened on first use and the same descriptor is handed out on
+ * every poll. It is only closed when the caller reports an I/O failure, after
+ * which reopening is delayed by an exponential backoff so an unplugged adapter
+ * doesn't get hammered with open() calls.
+ *
+ * The name of a serial server is looked up with uv_getaddrinfo(), off the
+ * loop, when the session is set up and again each time the connection is
+ * lost, so that the address is ready by the time the backoff has passed.
+ */
+typedef struct seplosd_session {
+    const char *device;
+    unsigned int baud;
+    seplos_device fd;
+    int transport; /* SEPLOS_TRANSPORT_*, known from the device name */
+    uv_loop_t *loop;
+    uv_getaddrinfo_t resolver;
+    bool resolving;
+    struct sockaddr_storage address; /* of a serial server, once its name has been looked up */
+    socklen_t address_length;        /* 0 until then */
+    uint64_t backoff_min;
+    uint64_t backoff_max;
+    uint64_t backoff;
+    uint64_t retry_at;
+    seplosd_histogram_t open; /* how long each attempt to open the device took */
+} seplosd_session_t;
+
+void seplosd_session_init(uv_loop_t *loop, seplosd_session_t *session, const char *device, unsigned int baud,
+                          uint64_t backoff_min, uint64_t backoff_max);
+
+/*
+ * Returns the open device, opening it if needed. Returns -1 if the device
+ * cannot be opened, the session is still backing off, or the name of the
+ * serial server is still being looked up. `now` is in ms.
+ */
+seplos_device seplosd_session_get(seplosd_session_t *session, uint64_t now);
+
+/*
+ * Reports the result of a transaction on the session's device. Protocol-level
+ * failures keep the device open; anything else closes it and arms the backoff.
+ */
+void seplosd_session_result(seplosd_session_t *session, int r, int error, uint64_t now);
+
+/*
+ * True if a transaction error means the device itself is in trouble, as
+ * opposed to a garbled frame or a pack that didn't answer.
+ */
+bool seplosd_session_is_io_error(int error);
+
+/* Closes the device, and gives up on a lookup in progress. */
+void seplosd_session_close(seplosd_session_t *session);
@@ -0,0 +1,535 @@
+#include "spool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*
+ * The spill file is this magic and the little-endian offset of the next
+ * message to send, then the messages one after the other, each a 2-byte
+ * topic length, a 4-byte payload length, the topic and the payload.
+ */
+static const char __spool_magic[8] = {'S', 'E', 'P', 'L', 'S', 'P', 'L', 1};
+#define __SPOOL_HEADER 16
+#define __SPOOL_RECORD 6
+
+static void __spool_put64(uint8_t *into, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        into[i] = value >> (i * 8);
+    }
+}
+
+static uint64_t __spool_get64(const uint8_t *from)
+{
+    uint64_t value = 0;
+
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | from[i];
+    }
+
+    return value;
+}
+
+static int __spool_write_header(seplosd_spool_t *spool)
+{
+    uint8_t header[__SPOOL_HEADER];
+
+    memcpy(header, __spool_magic, sizeof(__spool_magic));
+    __spool_put64(header + 8, spool->read_offset);
+
+    if (pwrite(spool->fd, header, sizeof(header), 0) != sizeof(header))
+    {
+        log_error("%s: cannot write: %s", spool->path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int __spool_open_file(seplosd_spool_t *spool)
+{
+    uint8_t header[__SPOOL_HEADER];
+    struct stat s;
+
+    if ((spool->fd = open(spool->path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(spool->fd, &s) < 0)
+    {
+        log_error("%s: %s", spool->path, strerror(errno));
+        return -1;
+    }
+
+    if (s.st_size == 0)
+    {
+        spool->read_offset = spool->write_offset = __SPOOL_HEADER;
+        return __spool_write_header(spool);
+    }
+
+    if (s.st_size < __SPOOL_HEADER || pread(spool->fd, header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header, __spool_magic, sizeof(__spool_magic)) != 0)
+    {
+        log_error("%s: not a spill file.", spool->path);
+        return -1;
+    }
+
+    spool->read_offset = __spool_get64(header + 8);
+    spool->write_offset = s.st_size;
+
+    if (spool->read_offset < __SPOOL_HEADER || spool->read_offset > spool->write_offset)
+    {
+        log_error("%s: the offset in the header is past the end of the file.", spool->path);
+        return -1;
+    }
+
+    if (spool->read_offset < spool->write_offset)
+    {
+        log_info("%s: %llu bytes of messages left from before, sending them.", spool->path,
+                 (unsigned long long)(spool->write_offset - spool->read_offset));
+    }
+
+    return 0;
+}
+
+static bool __spool_file_pending(const seplosd_spool_t *spool)
+{
+    return spool->fd >= 0 && spool->read_offset < spool->write_offset;
+}
+
+/* Makes a message to hold back, with the "time" member added to the document. */
+static seplosd_spool_message_t __spool_message(const char *topic, const char *payload, size_t length,
+                                               uint64_t time)
+{
+    seplosd_spool_message_t m = {0};
+    const size_t topic_length = strlen(topic);
+    char stamp[40];
+    int n = 0;
+
+    if (length > 1 && payload[0] == '{')
+    {
+        n = snprintf(stamp, sizeof(stamp), "{\"time\":%llu%s", (unsigned long long)time,
+                     payload[1] == '}' ? "" : ",");
+        payload++;
+        length--;
+    }
+
+    if (!(m.topic = malloc(topic_length + 1 + n + length)))
+    {
+        log_error("out of memory holding back a message for %s.", topic);
+        return m;
+    }
+
+    memcpy(m.topic, topic, topic_length + 1);
+    m.payload = m.topic + topic_length + 1;
+    memcpy(m.payload, stamp, n);
+    memcpy(m.payload + n, payload, length);
+    m.length = n + length;
+
+    return m;
+}
+
+static int __spool_append(seplosd_spool_t *spool, const seplosd_spool_message_t *m)
+{
+    const size_t topic_length = strlen(m->topic);
+    uint8_t record[__SPOOL_RECORD];
+    struct iovec v[3] = {
+        {record, sizeof(record)},
+        {m->topic, topic_length},
+        {m->payload, m->length},
+    };
+    const ssize_t size = sizeof(record) + topic_length + m->length;
+
+    record[0] = topic_length;
+    record[1] = topic_length >> 8;
+    for (int i = 0; i < 4; i++)
+    {
+        record[2 + i] = m->length >> (i * 8);
+    }
+
+    if (pwritev(spool->fd, v, 3, spool->write_offset) != size)
+    {
+        log_error("%s: cannot write: %s", spool->path, strerror(errno));
+        return -1;
+    }
+
+    spool->write_offset += size;
+    spool->spilled++;
+
+    return 0;
+}
+
+static void __spool_push(seplosd_spool_t *spool, seplosd_spool_message_t m)
+{
+    spool->queue[(spool->head + spool->count) % spool->capacity] = m;
+    spool->count++;
+}
+
+static void __spool_pop(seplosd_spool_t *spool)
+{
+    free(spool->queue[spool->head].topic);
+    spool->head = (spool->head + 1) % spool->capacity;
+    spool->count--;
+}
+
+/*
+ * Publishes topic and payload, and has MQTT keep m until the broker has it, so
+ * that it comes back to __spool_on_returned() if the publish fails later.
+ * On success, m belongs to MQTT.
+ */
+static int __spool_send(seplosd_spool_t *spool, const char *topic, const char *payload, size_t length,
+                        seplosd_spool_message_t m)
+{
+    seplosd_mqtt_kept_t *kept;
+
+    if (!(kept = malloc(sizeof(*kept))))
+    {
+        log_error("out of memory keeping a message for %s.", topic);
+        return -1;
+    }
+
+    kept->topic = m.topic;
+    kept->payload = m.payload;
+    kept->length = m.length;
+
+    if (seplosd_mqtt_publish_kept(spool->mqtt, topic, payload, length, kept) < 0)
+    {
+        free(kept);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Reads messages from the spill file into the queue until it is full. */
+static void __spool_refill(seplosd_spool_t *spool)
+{
+    while (spool->count < spool->capacity && __spool_file_pending(spool))
+    {
+        uint8_t record[__SPOOL_RECORD];
+        seplosd_spool_message_t m;
+        size_t topic_length;
+
+        if (pread(spool->fd, record, sizeof(record), spool->read_offset) != sizeof(record))
+        {
+            break;
+        }
+
+        topic_length = record[0] | (record[1] << 8);
+        m.length = record[2] | (record[3] << 8) | (record[4] << 16) | ((size_t)record[5] << 24);
+
+        if (spool->read_offset + sizeof(record) + topic_length + m.length > spool->write_offset)
+        {
+            break;
+        }
+
+        if (!(m.topic = malloc(topic_length + 1 + m.length)))
+        {
+            log_error("out of memory reading %s.", spool->path);
+            return;
+        }
+        m.payload = m.topic + topic_length + 1;
+
+        if (pread(spool->fd, m.topic, topic_length, spool->read_offset + sizeof(record)) != (ssize_t)topic_length ||
+            pread(spool->fd, m.payload, m.length, spool->read_offset + sizeof(record) + topic_length) != (ssize_t)m.length)
+        {
+            free(m.topic);
+            break;
+        }
+        m.topic[topic_length] = '\0';
+
+        spool->read_offset += sizeof(record) + topic_length + m.length;
+        __spool_push(spool, m);
+    }
+
+    if (__spool_file_pending(spool) && spool->count < spool->capacity)
+    {
+        /* What's left can't be read, most likely a message cut short by a crash. */
+        log_warn("%s: dropping %llu bytes at the end that aren't a whole message.", spool->path,
+                 (unsigned long long)(spool->write_offset - spool->read_offset));
+        spool->read_offset = spool->write_offset;
+    }
+
+    /* Once it has all been read, the file starts over so it doesn't grow forever. */
+    if (spool->fd >= 0 && spool->read_offset == spool->write_offset && spool->write_offset > __SPOOL_HEADER)
+    {
+        spool->read_offset = spool->write_offset = __SPOOL_HEADER;
+        if (ftruncate(spool->fd, __SPOOL_HEADER) < 0)
+        {
+            log_error("%s: cannot truncate: %s", spool->path, strerror(errno));
+        }
+    }
+
+    if (spool->fd >= 0)
+    {
+        __spool_write_header(spool);
+    }
+}
+
+static void __spool_on_drain(uv_timer_t *timer)
+{
+    seplosd_spool_t *spool = (seplosd_spool_t *)timer->data;
+    const uint64_t drained = spool->drained;
+
+    for (size_t n = 0; n < spool->batch; n++)
+    {
+        seplosd_spool_message_t *m;
+
+        if (spool->count == 0 && __spool_file_pending(spool))
+        {
+            __spool_refill(spool);
+        }
+
+        if (spool->count == 0 || seplosd_mqtt_room(spool->mqtt) <= spool->mqtt->max_in_flight / 2)
+        {
+            break;
+        }
+
+        m = &spool->queue[spool->head];
+        if (__spool_send(spool, m->topic, m->payload, m->length, *m) < 0)
+        {
+            break;
+        }
+
+        m->topic = NULL;
+        __spool_pop(spool);
+        spool->drained++;
+        spool->dropping = false;
+    }
+
+    if (spool->drained != drained && spool->count == 0 && !__spool_file_pending(spool))
+    {
+        log_info("mqtt: backlog sent, %llu messages in all.", (unsigned long long)spool->drained);
+    }
+}
+
+/* Holds a message back, in the file when there is one and there's no room in the queue. Takes m over. */
+static int __spool_hold(seplosd_spool_t *spool, seplosd_spool_message_t m)
+{
+    /* Once anything is in the file, the rest follows it there, to stay in order. */
+    if (spool->fd >= 0 && (spool->count == spool->capacity || __spool_file_pending(spool)))
+    {
+        const int r = __spool_append(spool, &m);
+
+        free(m.topic);
+        return r;
+    }
+
+    if (spool->count == spool->capacity)
+    {
+        if (!spool->dropping)
+        {
+            log_warn("mqtt: %zu messages held back, dropping the oldest.", spool->capacity);
+            spool->dropping = true;
+        }
+        __spool_pop(spool);
+        spool->dropped++;
+    }
+
+    __spool_push(spool, m);
+
+    return 0;
+}
+
+/*
+ * A message MQTT took, but that never got to the broker. It goes behind what
+ * is held back already; its "time" member still tells when it was made.
+ */
+static void __spool_on_returned(void *data, seplosd_mqtt_kept_t *kept)
+{
+    seplosd_spool_t *spool = (seplosd_spool_t *)data;
+    const seplosd_spool_message_t m = {kept->topic, kept->payload, kept->length};
+
+    free(kept);
+    __spool_hold(spool, m);
+}
+
+int seplosd_spool_init(uv_loop_t *loop, seplosd_spool_t *spool, seplosd_mqtt_t *mqtt, const char *path,
+                       size_t capacity, uint64_t interval, size_t batch)
+{
+    int r;
+
+    memset(spool, 0, sizeof(*spool));
+    spool->mqtt = mqtt;
+    spool->capacity = capacity;
+    spool->batch = batch;
+    spool->path = path;
+    spool->fd = -1;
+
+    if (!(spool->queue = calloc(capacity, sizeof(*spool->queue))))
+    {
+        log_fatal("out of memory allocating a queue of %zu messages.", capacity);
+        return -1;
+    }
+
+    if (path && __spool_open_file(spool) < 0)
+    {
+        goto fail;
+    }
+
+    if ((r = uv_timer_init(loop, &spool->drain)) < 0)
+    {
+        log_fatal("uv timer initialization failed: %s", uv_strerror(r));
+        goto fail;
+    }
+
+    spool->drain.data = spool;
+    uv_timer_start(&spool->drain, __spool_on_drain, interval, interval);
+    seplosd_mqtt_on_returned(mqtt, __spool_on_returned, spool);
+
+    return 0;
+
+fail:
+    if (spool->fd >= 0)
+    {
+        close(spool->fd);
+    }
+    free(spool->queue);
+    spool->queue = NULL;
+    return -1;
+}
+
+int seplosd_spool_publish(seplosd_spool_t *spool, const char *topic, const char *payload, size_t length,
+                          uint64_t time)
+{
+    seplosd_spool_message_t m;
+
+    /* Made first: if the publish fails, even after MQTT has taken it, this copy is what's held back. */
+    if (!(m = __spool_message(topic, payload, length, time)).topic)
+    {
+        return -1;
+    }
+
+    if (seplosd_mqtt_room(spool->mqtt) > 0 && __spool_send(spool, topic, payload, length, m) == 0)
+    {
+        return 0;
+    }
+
+    return __spool_hold(spool, m);
+}
+
+/*
+ * Rewrites the spill file as the queue followed by what is still unread in it,
+ * since the queue holds the older messages. The new file replaces the old one
+ * only once it is whole, so a crash part way through loses nothing.
+ */
+static int __spool_rewrite(seplosd_spool_t *spool)
+{
+    const int fd = spool->fd;
+    const uint64_t read_offset = spool->read_offset;
+    const uint64_t write_offset = spool->write_offset;
+    uint8_t buffer[65536];
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s.new", spool->path);
+    if ((spool->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        log_error("%s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    spool->read_offset = spool->write_offset = __SPOOL_HEADER;
+    if (__spool_write_header(spool) < 0)
+    {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < spool->count; i++)
+    {
+        if (__spool_append(spool, &spool->queue[(spool->head + i) % spool->capacity]) < 0)
+        {
+            goto fail;
+        }
+    }
+
+    for (uint64_t from = read_offset; from < write_offset;)
+    {
+        const size_t want = write_offset - from < sizeof(buffer) ? write_offset - from : sizeof(buffer);
+        const ssize_t n = pread(fd, buffer, want, from);
+
+        if (n <= 0 || pwrite(spool->fd, buffer, n, spool->write_offset) != n)
+        {
+            log_error("%s: cannot copy the messages from %s: %s", path, spool->path,
+                      n < 0 ? strerror(errno) : "short read");
+            goto fail;
+        }
+        from += n;
+        spool->write_offset += n;
+    }
+
+    if (rename(path, spool->path) < 0)
+    {
+        log_error("%s: cannot replace %s: %s", path, spool->path, strerror(errno));
+        goto fail;
+    }
+
+    close(fd);
+    return 0;
+
+fail:
+    if (spool->fd >= 0)
+    {
+        close(spool->fd);
+        unlink(path);
+    }
+    spool->fd = fd;
+    spool->read_offset = read_offset;
+    spool->write_offset = write_offset;
+    return -1;
+}
+
+void seplosd_spool_close(seplosd_spool_t *spool)
+{
+    if (!spool->queue)
+    {
+        return;
+    }
+
+    uv_timer_stop(&spool->drain);
+    uv_close((uv_handle_t *)&spool->drain, NULL);
+
+    if (spool->count && spool->fd >= 0)
+    {
+        log_info("%s: keeping %zu queued messages for next time.", spool->path, spool->count);
+    }
+    else if (spool->count)
+    {
+        log_warn("mqtt: %zu queued messages are lost.", spool->count);
+    }
+
+    /* Behind the file, the queue can be appended; otherwise it has to go in front. */
+    if (spool->count && __spool_file_pending(spool) && __spool_rewrite(spool) == 0)
+    {
+        while (spool->count)
+        {
+            __spool_pop(spool);
+        }
+    }
+    else if (spool->count && __spool_file_pending(spool))
+    {
+        log_warn("%s: appending the queued messages instead, so they are sent after newer ones.", spool->path);
+    }
+
+    while (spool->count)
+    {
+        if (spool->fd >= 0)
+        {
+            __spool_append(spool, &spool->queue[spool->head]);
+        }
+        __spool_pop(spool);
+    }
+
+    if (spool->fd >= 0)
+    {
+        close(spool->fd);
+    }
+
+    free(spool->queue);
+    spool->queue = NULL;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "mqtt.h"
+
+/* A message held back because it couldn't be published when it was made. */
+typedef struct seplosd_spool_message {
+    char *topic;
+    char *payload; /* in the same allocation as topic */
+    size_t length;
+} seplosd_spool_message_t;
+
+/*
+ * Store and forward for the samples, so that an outage of the broker or the
+ * network doesn't lose them.
+ *
+ * A sample that can't be published right away, or whose publish fails after
+ * MQTT took it, is held in a queue of capacity messages, and once that is
+ * full, appended to the spill file.
+ * The file starts with where reading has got to, so whatever is in it is
+ * still sent after a restart. Live samples always go first; the backlog is
+ * drained by at most batch messages every interval ms, and only while half
+ * of the MQTT in-flight window is free, so it never holds up the live data.
+ *
+ * Without a spill file, the oldest message is dropped when the queue is full.
+ */
+typedef struct seplosd_spool {
+    seplosd_mqtt_t *mqtt;
+    uv_timer_t drain;
+    seplosd_spool_message_t *queue;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t batch;
+    const char *path;
+    int fd;
+    uint64_t read_offset;  /* of the next message in the file */
+    uint64_t write_offset; /* the end of the file */
+    uint64_t spilled;
+    uint64_t drained;
+    uint64_t dropped;
+    bool dropping;
+} seplosd_spool_t;
+
+/* path is the spill file, or NULL for none. */
+int seplosd_spool_init(uv_loop_t *loop, seplosd_spool_t *spool, seplosd_mqtt_t *mqtt, const char *path,
+                       size_t capacity, uint64_t interval, size_t batch);
+
+/*
+ * Publishes a document about time, in wall-clock ms, or holds it back if it
+ * can't be published now. A held-back JSON document gets a "time" member
+ * with time, so a late one can be told from a live one; anything else is
+ * kept as it is. Returns -1 only if it could be neither published nor kept.
+ */
+int seplosd_spool_publish(seplosd_spool_t *spool, const char *topic, const char *payload, size_t length,
+                          uint64_t time);
+
+/* Writes what is still queued to the spill file, so it is sent after a restart. */
+void seplosd_spool_close(seplosd_spool_t *spool);
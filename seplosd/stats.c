@@ -0,0 +1,94 @@
+#include "stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+const double seplosd_histogram_bounds[SEPLOSD_HISTOGRAM_BOUNDS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5};
+
+const char *const seplosd_stage_names[SEPLOSD_STAGE_COUNT] = {
+    "write", "first_byte", "frame", "decode", "serialize", "publish"};
+
+void seplosd_histogram_observe(seplosd_histogram_t *histogram, uint64_t ns)
+{
+    unsigned int i = 0;
+
+    while (i < SEPLOSD_HISTOGRAM_BOUNDS && ns > seplosd_histogram_bounds[i] * 1e9)
+    {
+        i++;
+    }
+
+    histogram->buckets[i]++;
+    histogram->count++;
+    histogram->sum += ns;
+}
+
+typedef struct __stats_writer {
+    char *buffer;
+    size_t size;
+    size_t length;
+} __stats_writer_t;
+
+/* Keeps count of the whole length when the buffer is too small, as snprintf does. */
+static void __stats_printf(__stats_writer_t *w, const char *format, ...)
+{
+    size_t room = w->length < w->size ? w->size - w->length : 0;
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(room ? w->buffer + w->length : NULL, room, format, args);
+    va_end(args);
+
+    if (n > 0)
+    {
+        w->length += n;
+    }
+}
+
+static void __stats_histogram(__stats_writer_t *w, const char *name, const seplosd_histogram_t *histogram)
+{
+    __stats_printf(w, "\"%s\":{\"count\":%llu,\"sum\":%.6f,\"buckets\":[", name,
+                   (unsigned long long)histogram->count, histogram->sum / 1e9);
+
+    for (unsigned int i = 0; i <= SEPLOSD_HISTOGRAM_BOUNDS; i++)
+    {
+        __stats_printf(w, "%s%llu", i ? "," : "", (unsigned long long)histogram->buckets[i]);
+    }
+
+    __stats_printf(w, "]}");
+}
+
+size_t seplosd_stats_json(char *buffer, size_t size, const seplosd_stats_t *stats,
+                          const seplosd_histogram_t *open)
+{
+    __stats_writer_t w = {buffer, size, 0};
+
+    __stats_printf(&w, "{\"le\":[");
+    for (unsigned int i = 0; i < SEPLOSD_HISTOGRAM_BOUNDS; i++)
+    {
+        __stats_printf(&w, "%s%g", i ? "," : "", seplosd_histogram_bounds[i]);
+    }
+
+    __stats_printf(&w, "],\"answered\":%llu,\"failures\":{",
+                   (unsigned long long)stats->failures[SEPLOS_FAILURE_NONE]);
+    for (unsigned int i = SEPLOS_FAILURE_NONE + 1; i < SEPLOS_FAILURE_COUNT; i++)
+    {
+        __stats_printf(&w, "%s\"%s\":%llu", i > SEPLOS_FAILURE_NONE + 1 ? "," : "",
+                       seplos_failure_names[i], (unsigned long long)stats->failures[i]);
+    }
+
+    __stats_printf(&w, "},\"retries\":%llu,\"skipped\":%llu,", (unsigned long long)stats->retries,
+                   (unsigned long long)stats->skipped);
+    __stats_histogram(&w, "open", open);
+    for (unsigned int i = 0; i < SEPLOSD_STAGE_COUNT; i++)
+    {
+        __stats_printf(&w, ",");
+        __stats_histogram(&w, seplosd_stage_names[i], &stats->stages[i]);
+    }
+
+    __stats_printf(&w, "}");
+
+    return w.length;
+}
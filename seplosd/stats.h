@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seplos.h"
+
+/* Upper bounds of the histogram buckets in seconds. A last bucket takes the rest. */
+#define SEPLOSD_HISTOGRAM_BOUNDS 14
+extern const double seplosd_histogram_bounds[SEPLOSD_HISTOGRAM_BOUNDS];
+
+/*
+ * How long something took, in fixed buckets so that observing is a handful of
+ * comparisons and an increment, and nothing is ever allocated.
+ */
+typedef struct seplosd_histogram {
+    uint64_t buckets[SEPLOSD_HISTOGRAM_BOUNDS + 1]; /* not cumulative */
+    uint64_t count;
+    uint64_t sum; /* ns */
+} seplosd_histogram_t;
+
+/* The stages of the poll path that are timed for each pack. */
+enum seplosd_stage {
+    SEPLOSD_STAGE_WRITE,      /* sending the request */
+    SEPLOSD_STAGE_FIRST_BYTE, /* from then until the pack starts to answer */
+    SEPLOSD_STAGE_FRAME,      /* from then until the whole reply is in */
+    SEPLOSD_STAGE_DECODE,
+    SEPLOSD_STAGE_SERIALIZE,  /* formatting the JSON or CBOR payload */
+    SEPLOSD_STAGE_PUBLISH,    /* queueing the message for MQTT */
+    SEPLOSD_STAGE_COUNT
+};
+
+extern const char *const seplosd_stage_names[SEPLOSD_STAGE_COUNT];
+
+typedef struct seplosd_stats {
+    seplosd_histogram_t stages[SEPLOSD_STAGE_COUNT];
+    uint64_t failures[SEPLOS_FAILURE_COUNT]; /* by _seplos_failure, [SEPLOS_FAILURE_NONE] counts successes */
+    uint64_t retries;                        /* commands sent again after a failure */
+    uint64_t skipped;                        /* bytes of noise dropped to find the start of a reply */
+} seplosd_stats_t;
+
+void seplosd_histogram_observe(seplosd_histogram_t *histogram, uint64_t ns);
+
+/*
+ * Formats the stats as a JSON document, with the open histogram of the bus
+ * the pack is on. Returns the length, like seplos_json_format().
+ */
+size_t seplosd_stats_json(char *buffer, size_t size, const seplosd_stats_t *stats,
+                          const seplosd_histogram_t *open);
@@ -0,0 +1,171 @@
+#include "window.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef struct seplosd_window_member {
+    const char *name;
+    int decimals;
+} seplosd_window_member_t;
+
+/* In the order of the document, with its decimals. */
+static const seplosd_window_member_t __window_members[SEPLOSD_WINDOW_SCALARS] = {
+    {"i", 2},
+    {"v", 2},
+    {"dv", 3},
+    {"p", 2},
+    {"soc", 0},
+    {"soh", 0},
+    {"cap_residual", 0},
+    {"max_temp", 0},
+    {"min_temp", 0},
+    {"environment_temp", 0},
+    {"bms_temp", 0},
+};
+
+enum seplosd_window_which {
+    SEPLOSD_WINDOW_MIN,
+    SEPLOSD_WINDOW_MAX,
+    SEPLOSD_WINDOW_MEAN
+};
+
+static void __window_values(const SeplosData *data, float *values)
+{
+    values[0] = data->charge_discharge_current;
+    values[1] = data->total_battery_voltage;
+    values[2] = data->highest_cell_voltage - data->lowest_cell_voltage;
+    values[3] = data->charge_discharge_current * data->total_battery_voltage;
+    values[4] = data->state_of_charge;
+    values[5] = data->state_of_health;
+    values[6] = data->residual_capacity;
+    values[7] = data->highest_temperature;
+    values[8] = data->lowest_temperature;
+    values[9] = data->temperature[4];
+    values[10] = data->temperature[5];
+}
+
+static void __window_fold(seplosd_window_stat_t *stats, const float *values, unsigned int n, bool first)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (first)
+        {
+            stats[i].min = stats[i].max = values[i];
+            stats[i].sum = values[i];
+            continue;
+        }
+
+        stats[i].min = values[i] < stats[i].min ? values[i] : stats[i].min;
+        stats[i].max = values[i] > stats[i].max ? values[i] : stats[i].max;
+        stats[i].sum += values[i];
+    }
+}
+
+void seplosd_window_add(seplosd_window_t *window, const SeplosData *data, uint64_t now, uint64_t sampled_at)
+{
+    float values[SEPLOSD_WINDOW_SCALARS];
+    const bool first = window->count == 0;
+
+    if (first)
+    {
+        window->started = now;
+    }
+
+    __window_values(data, values);
+    __window_fold(window->scalars, values, SEPLOSD_WINDOW_SCALARS, first);
+    __window_fold(window->cells, data->cell_voltage, SEPLOS_N_CELLS, first);
+    __window_fold(window->temperatures, data->temperature, SEPLOS_N_TEMPERATURES, first);
+
+    window->count++;
+    window->sampled_at = sampled_at;
+    window->alarm = data->has_alarm;
+    window->last = *data;
+}
+
+bool seplosd_window_excursion(const seplosd_window_t *window, const SeplosData *data)
+{
+    return data->has_alarm || window->alarm;
+}
+
+/* Appends to the buffer and counts past its end, like snprintf(). */
+static void __window_put(char *buffer, size_t size, size_t *n, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    *n += vsnprintf(buffer + *n, *n < size ? size - *n : 0, format, args);
+    va_end(args);
+}
+
+static void __window_number(char *buffer, size_t size, size_t *n, const seplosd_window_stat_t *stat,
+                            enum seplosd_window_which which, uint32_t count, int decimals)
+{
+    const double value = which == SEPLOSD_WINDOW_MIN   ? stat->min
+                         : which == SEPLOSD_WINDOW_MAX ? stat->max
+                                                       : stat->sum / count;
+
+    if (!isfinite(value))
+    {
+        __window_put(buffer, size, n, "null");
+        return;
+    }
+
+    __window_put(buffer, size, n, "%.*f", decimals, value);
+}
+
+static void __window_array(char *buffer, size_t size, size_t *n, const char *name,
+                           const seplosd_window_stat_t *stats, unsigned int length,
+                           enum seplosd_window_which which, uint32_t count, int decimals)
+{
+    __window_put(buffer, size, n, ",\"%s\":[", name);
+    for (unsigned int i = 0; i < length; i++)
+    {
+        __window_put(buffer, size, n, i ? "," : "");
+        __window_number(buffer, size, n, &stats[i], which, count, decimals);
+    }
+    __window_put(buffer, size, n, "]");
+}
+
+static void __window_object(char *buffer, size_t size, size_t *n, const seplosd_window_t *window,
+                            const char *name, enum seplosd_window_which which)
+{
+    unsigned int cells = window->last.number_of_cells;
+
+    if (cells > SEPLOS_N_CELLS)
+    {
+        cells = SEPLOS_N_CELLS;
+    }
+
+    __window_put(buffer, size, n, ",\"%s\":{", name);
+    for (int i = 0; i < SEPLOSD_WINDOW_SCALARS; i++)
+    {
+        __window_put(buffer, size, n, "%s\"%s\":", i ? "," : "", __window_members[i].name);
+        __window_number(buffer, size, n, &window->scalars[i], which, window->count,
+                        __window_members[i].decimals);
+    }
+    __window_array(buffer, size, n, "cells", window->cells, cells, which, window->count, 3);
+    __window_array(buffer, size, n, "temps", window->temperatures, SEPLOS_N_TEMPERATURES, which,
+                   window->count, 1);
+    __window_put(buffer, size, n, "}");
+}
+
+size_t seplosd_window_json(char *buffer, size_t size, const seplosd_window_t *window)
+{
+    size_t n = seplos_json_format(buffer, size, &window->last, SEPLOS_JSON_ALL);
+
+    if (n >= size || n < 2)
+    {
+        return n;
+    }
+
+    /* Carry on from before the closing brace of the sample's document. */
+    n--;
+    __window_put(buffer, size, &n, ",\"n\":%u", window->count);
+    __window_object(buffer, size, &n, window, "min", SEPLOSD_WINDOW_MIN);
+    __window_object(buffer, size, &n, window, "max", SEPLOSD_WINDOW_MAX);
+    __window_object(buffer, size, &n, window, "mean", SEPLOSD_WINDOW_MEAN);
+    __window_put(buffer, size, &n, "}");
+
+    return n;
+}
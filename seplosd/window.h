@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seplos.h"
+
+/* The numbers of the document that are aggregated, besides "cells" and "temps". */
+#define SEPLOSD_WINDOW_SCALARS 11
+
+/* A buffer of this size holds any document seplosd_window_json() writes. */
+#define SEPLOSD_WINDOW_JSON_MAX 4096
+
+typedef struct seplosd_window_stat {
+    float min;
+    float max;
+    double sum;
+} seplosd_window_stat_t;
+
+/*
+ * The samples of a pack over one aggregate_window: the minimum, maximum and
+ * mean of every number in the document, and the latest sample. Adding a
+ * sample takes the same time however many the window holds. A count of 0 is
+ * an empty window, and the next sample starts a new one.
+ */
+typedef struct seplosd_window {
+    uint32_t count;
+    uint64_t started;    /* loop time of the first sample, in milliseconds */
+    uint64_t sampled_at; /* wall-clock ms of the latest */
+    bool alarm;          /* the latest sample had an alarm, kept across windows */
+    SeplosData last;
+    seplosd_window_stat_t scalars[SEPLOSD_WINDOW_SCALARS];
+    seplosd_window_stat_t cells[SEPLOS_N_CELLS];
+    seplosd_window_stat_t temperatures[SEPLOS_N_TEMPERATURES];
+} seplosd_window_t;
+
+void seplosd_window_add(seplosd_window_t *window, const SeplosData *data, uint64_t now, uint64_t sampled_at);
+
+/*
+ * True if data can't wait for the end of the window: the BMS reports an
+ * alarm, or an alarm has just cleared.
+ */
+bool seplosd_window_excursion(const seplosd_window_t *window, const SeplosData *data);
+
+/*
+ * Writes the document of the latest sample, with "n", the number of samples,
+ * and "min", "max" and "mean" objects holding the same numeric members over
+ * the window. Returns the length it needed, like snprintf().
+ */
+size_t seplosd_window_json(char *buffer, size_t size, const seplosd_window_t *window);